@@ -0,0 +1,1047 @@
+#include "bvh.hpp"
+#include "compactmesh.hpp"
+#include "depthraster.hpp"
+#include "depthsort.hpp"
+#include "dirtytiles.hpp"
+#include "engine.hpp"
+#include "input.hpp"
+#include "pointcloud.hpp"
+#include "rasterpipeline.hpp"
+#include "scenegraph.hpp"
+#include "shmring.hpp"
+#include "skinning.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <thread>
+
+// Renders `frames` headless frames and returns the mean time per frame.
+static float frameMs(olcEngine3D &engine, Keyboard *keyboard, int frames) {
+  engine.OnUserUpdate(1.0f / 60.0f, keyboard);
+  Timer timer;
+  for (int i = 0; i < frames; i++)
+    engine.OnUserUpdate(1.0f / 60.0f, keyboard);
+  return timer.elapsedMs() / frames;
+}
+
+// Calls `run(setting)`, which returns a time in ms, for each of `settings`
+// in turn, once to warm up and then 9 times, and returns the median for
+// each. Taking turns spreads drift in the machine's speed over all of them.
+template <typename Run>
+static std::vector<float> medianMs(int settings, Run run) {
+  std::vector<std::vector<float>> times(settings);
+  for (int i = -1; i < 9; i++)
+    for (int setting = 0; setting < settings; setting++) {
+      float ms = run(setting);
+      if (i >= 0)
+        times[setting].push_back(ms);
+    }
+  std::vector<float> medians;
+  for (std::vector<float> &t : times) {
+    std::nth_element(t.begin(), t.begin() + 4, t.end());
+    medians.push_back(t[4]);
+  }
+  return medians;
+}
+
+static void benchFrame(Keyboard *keyboard) {
+  olcEngine3D engine(1280, 720, true);
+  engine.sMeshFile = "res/teapot.obj";
+  engine.OnUserCreate();
+  if (!engine.WaitForAssets()) {
+    fail("Could not load res/teapot.obj");
+  }
+
+  std::cout << "teapot 1280x720" << std::endl;
+
+  engine.bMsaa = false;
+  float noAa = frameMs(engine, keyboard, 100);
+  std::cout << "  no AA:   " << noAa << " ms/frame" << std::endl;
+
+  engine.bMsaa = true;
+  float msaa = frameMs(engine, keyboard, 100);
+  std::cout << "  4x MSAA: " << msaa << " ms/frame (" << msaa / noAa
+            << "x, " << engine.msaa.edgePixels << " edge pixels)" << std::endl;
+
+  engine.bMsaa = false;
+  engine.bGouraud = true;
+  float gouraud = frameMs(engine, keyboard, 100);
+  std::cout << "  Gouraud: " << gouraud << " ms/frame (" << gouraud / noAa
+            << "x)" << std::endl;
+
+  // Two directional and two point lights.
+  Light point;
+  point.type = Light::POINT;
+  point.v = {2.0f, 2.0f, 3.0f};
+  point.falloff = 0.1f;
+  engine.lighting.lights.push_back(point);
+  point.v = {-2.0f, 0.0f, 3.0f};
+  engine.lighting.lights.push_back(point);
+  Light side;
+  side.v = {0.6f, 0.0f, -0.8f};
+  engine.lighting.lights.push_back(side);
+  float lights = frameMs(engine, keyboard, 100);
+  std::cout << "  Gouraud, 4 lights: " << lights << " ms/frame ("
+            << lights / noAa << "x)" << std::endl;
+}
+
+static void benchDepthPrepass(Keyboard *keyboard) {
+  olcEngine3D engine(1280, 720, true);
+  engine.sMeshFile = "res/teapot.obj";
+  engine.OnUserCreate();
+  if (!engine.WaitForAssets()) {
+    fail("Could not load res/teapot.obj");
+  }
+  // Close enough to fill most of the screen.
+  engine.SetCamera({0.0f, -1.0f, 1.5f}, 0.0f);
+
+  std::cout << "depth prepass, teapot 1280x720 (median of 9 runs)"
+            << std::endl;
+  for (bool gouraud : {false, true}) {
+    engine.bGouraud = gouraud;
+    std::vector<float> ms = medianMs(2, [&](int prepass) {
+      engine.bDepthPrepass = prepass;
+      return frameMs(engine, keyboard, 20);
+    });
+    for (int prepass : {0, 1})
+      std::cout << "  " << (gouraud ? "Gouraud" : "flat") << ", "
+                << (prepass ? "prepass:    " : "no prepass: ") << ms[prepass]
+                << " ms/frame" << std::endl;
+  }
+
+  engine.bDepthPrepass = false;
+  engine.bGouraud = false;
+  Light sun;
+  float length = sqrtf(0.6f * 0.6f + 0.5f * 0.5f + 0.6f * 0.6f);
+  sun.v = {-0.6f / length, -0.5f / length, -0.6f / length};
+  engine.lighting.lights = {sun};
+  // With nothing moving the map is drawn once; turning the light a little
+  // every frame has it redrawn each time. The light turns the same way
+  // without shadows, for the cost to compare against.
+  int frame = 0;
+  auto frames = [&](bool moving) {
+    engine.OnUserUpdate(1.0f / 60.0f, keyboard);
+    Timer timer;
+    for (int i = 0; i < 20; i++) {
+      if (moving) {
+        float angle = 0.002f * (++frame % 200);
+        vec3d v = sun.v;
+        engine.lighting.lights[0].v = {v.x * cosf(angle) - v.z * sinf(angle),
+                                       v.y,
+                                       v.x * sinf(angle) + v.z * cosf(angle)};
+      }
+      engine.OnUserUpdate(1.0f / 60.0f, keyboard);
+    }
+    return timer.elapsedMs() / 20;
+  };
+  const int sizes[] = {0, 1024, 2048};
+  for (bool moving : {false, true}) {
+    engine.lighting.lights[0].v = sun.v;
+    std::vector<float> ms = medianMs(3, [&](int setting) {
+      engine.bShadows = sizes[setting] != 0;
+      if (engine.bShadows)
+        engine.nShadowMapSize = sizes[setting];
+      return frames(moving);
+    });
+    std::cout << "  no shadows, " << (moving ? "light turning: " : "still: ")
+              << ms[0] << " ms/frame" << std::endl;
+    for (int setting : {1, 2})
+      std::cout << "  shadows, " << sizes[setting] << "x" << sizes[setting]
+                << " map, " << (moving ? "light turning: " : "still: ")
+                << ms[setting] << " ms/frame (" << ms[setting] - ms[0]
+                << " ms more)" << std::endl;
+  }
+  engine.bShadows = false;
+}
+
+static void benchViews(Keyboard *keyboard) {
+  // One to four 640x360 views of the teapot, split-screen in one engine,
+  // against as many separate 640x360 renders from the same cameras, each of
+  // which repeats the world-space pass. Once lit by the default light and
+  // once Gouraud shaded by four, which makes that pass dearer. Medians of
+  // interleaved runs are kept, as timings here are noisy. The views' own
+  // stage times are those of the last frame, averaged over the views.
+  const int frames = 20;
+  std::cout << "multiple views, teapot 640x360 each, "
+            << std::thread::hardware_concurrency() << " hardware threads"
+            << std::endl;
+  for (bool lit : {false, true}) {
+    std::vector<Light> lights = {Light()};
+    if (lit) {
+      Light point;
+      point.type = Light::POINT;
+      point.v = {2.0f, 2.0f, 3.0f};
+      point.falloff = 0.1f;
+      lights.push_back(point);
+      point.v = {-2.0f, 0.0f, 7.0f};
+      lights.push_back(point);
+      Light side;
+      side.v = {0.6f, 0.0f, -0.8f};
+      lights.push_back(side);
+    }
+    std::cout << (lit ? "  Gouraud, 4 lights" : "  flat, 1 light") << std::endl;
+    float previous = 0.0f;
+    for (int n = 1; n <= 4; n++) {
+      std::vector<Viewport> views = splitScreen(n, {0.0f, 0.0f, 5.0f}, 5.0f);
+      std::vector<std::unique_ptr<olcEngine3D>> engines;
+      engines.emplace_back(new olcEngine3D(n == 1 ? 640 : 1280,
+                                           n <= 2 ? 360 : 720, true));
+      engines[0]->vecViews = views;
+      for (Viewport &view : views) {
+        engines.emplace_back(new olcEngine3D(640, 360, true));
+        engines.back()->SetCamera(view.camera, view.yaw);
+      }
+      for (auto &engine : engines) {
+        engine->sMeshFile = "res/teapot.obj";
+        engine->bGouraud = lit;
+        engine->lighting.lights = lights;
+        engine->OnUserCreate();
+        if (!engine->WaitForAssets()) {
+          fail("Could not load res/teapot.obj");
+        }
+      }
+      std::vector<float> medians = medianMs(2, [&](int separate) {
+        if (!separate)
+          return frameMs(*engines[0], keyboard, frames);
+        float sum = 0.0f;
+        for (int v = 1; v <= n; v++)
+          sum += frameMs(*engines[v], keyboard, frames);
+        return sum;
+      });
+      float ms = medians[0], separateMs = medians[1];
+      float stage[3] = {0.0f, 0.0f, 0.0f};
+      for (Viewport &view : engines[0]->vecViews) {
+        stage[0] += view.projectMs / n;
+        stage[1] += view.sortMs / n;
+        stage[2] += view.rasterMs / n;
+      }
+      std::cout << "    " << n << (n == 1 ? " view:  " : " views: ") << ms
+                << " ms/frame";
+      if (n > 1)
+        std::cout << " (+" << ms - previous << ")";
+      std::cout << ", shared pass " << engines[0]->fProjectMs
+                << " ms, each view " << stage[0] << " + " << stage[1]
+                << " + " << stage[2] << " (project, sort, raster); "
+                << separateMs << " rendered separately ("
+                << separateMs / ms << "x)" << std::endl;
+      previous = ms;
+    }
+  }
+}
+
+// Flies low over a 16k x 16k procedural terrain with chunks streaming in
+// behind the frame, as in a window, and reports how steady the frame time
+// is. The same view with every chunk at full detail is for comparison.
+static void benchTerrain(Keyboard *keyboard) {
+  const int size = 16385, frames = 900;
+  const float speed = 2.0f;
+  olcEngine3D engine(1280, 720, true);
+  engine.bWaitForStreaming = false;
+  Timer open;
+  if (!engine.GenerateTerrain(size, 64ull << 20)) {
+    fail("Could not generate the terrain");
+  }
+  float openMs = open.elapsedMs();
+  Light sun;
+  float length = sqrtf(0.3f * 0.3f + 0.8f * 0.8f + 0.5f * 0.5f);
+  sun.v = {0.3f / length, -0.8f / length, -0.5f / length};
+  engine.lighting.lights = {sun};
+  engine.OnUserCreate();
+  Terrain &terrain = *engine.pTerrain;
+
+  // Diagonally across the map, keeping 40 units above the ground.
+  float x = size * 0.25f, z = size * 0.25f, yaw = -(float)M_PI / 4.0f;
+  std::vector<float> times;
+  size_t triangles = 0;
+  int maxPending = 0;
+  for (int i = 0; i < frames; i++) {
+    x += speed * sinf(-yaw);
+    z += speed * cosf(yaw);
+    engine.SetCamera({x, -terrain.groundAt(x, z) - 40.0f, z}, yaw);
+    Timer timer;
+    engine.OnUserUpdate(1.0f / 60.0f, keyboard);
+    times.push_back(timer.elapsedMs());
+    triangles += engine.nTrianglesSubmitted;
+    maxPending = std::max(maxPending, terrain.pending);
+  }
+  // The first frames fill the view from nothing.
+  std::vector<float> steady(times.begin() + 60, times.end());
+  std::sort(steady.begin(), steady.end());
+  float mean = 0.0f;
+  for (float t : steady)
+    mean += t / steady.size();
+
+  std::cout << "terrain, " << size << "x" << size << " procedural, 1280x720, "
+            << frames << " frames at " << speed << " units/frame"
+            << std::endl;
+  std::cout << "  opened in " << openMs << " ms; first frame "
+            << times[0] << " ms; then " << mean << " ms mean, "
+            << steady[steady.size() * 99 / 100] << " p99, " << steady.back()
+            << " max; " << triangles / frames << " triangles/frame"
+            << std::endl;
+  std::cout << "  " << terrain.generated << " chunks generated, "
+            << terrain.evictions << " evicted, at most " << maxPending
+            << " pending, " << (terrain.residentBytes() >> 20) << "/"
+            << (terrain.budgetBytes >> 20) << " MB resident" << std::endl;
+
+  // Everything at level 0, once it has all been generated.
+  terrain.lodDistance = 1e9f;
+  terrain.triangleBudget = 0;
+  engine.bWaitForStreaming = true;
+  engine.OnUserUpdate(1.0f / 60.0f, keyboard);
+  Timer full;
+  engine.OnUserUpdate(1.0f / 60.0f, keyboard);
+  std::cout << "  without levels of detail: " << full.elapsedMs() << " ms, "
+            << engine.nTrianglesSubmitted << " triangles" << std::endl;
+}
+
+static void benchCompactMesh(Keyboard *keyboard) {
+  mesh teapot;
+  if (!teapot.LoadFromObjectFile("res/teapot.obj")) {
+    fail("Could not load res/teapot.obj");
+  }
+  teapot.ComputeBounds();
+  CompactMesh compact;
+  compact.Build(teapot);
+  size_t soupBytes = sizeof(teapot) + teapot.tris.capacity() * sizeof(triangle);
+
+  std::cout << "compact vertex format, teapot" << std::endl;
+  std::cout << "  triangle soup: " << soupBytes << " bytes ("
+            << (float)soupBytes / teapot.tris.size() << " per tri)"
+            << std::endl;
+  std::cout << "  compact:       " << compact.memoryBytes() << " bytes ("
+            << (float)compact.memoryBytes() / compact.triangleCount
+            << " per tri, " << compact.vertexCount << " verts, "
+            << (compact.indices16.empty() ? 32 : 16) << "-bit indices)"
+            << std::endl;
+
+  std::vector<vec3d> out;
+  mat4x4 identity;
+  for (int i = 0; i < 4; i++)
+    identity.m[i][i] = 1.0f;
+  Timer decode;
+  for (int r = 0; r < 1000; r++) {
+    compact.TransformPositions(identity, out);
+    compact.DecodeNormals(out);
+  }
+  std::cout << "  decode positions + normals: " << decode.elapsedMs()
+            << " us/mesh" << std::endl;
+
+  for (bool useCompact : {false, true}) {
+    olcEngine3D engine(1280, 720, true);
+    engine.sMeshFile = "res/teapot.obj";
+    engine.bCompact = useCompact;
+    engine.OnUserCreate();
+    if (!engine.WaitForAssets()) {
+      fail("Could not load res/teapot.obj");
+    }
+    std::cout << (useCompact ? "  compact frame: " : "  soup frame:    ")
+              << frameMs(engine, keyboard, 100) << " ms/frame" << std::endl;
+  }
+}
+
+static void benchBvh(Keyboard *keyboard) {
+  mesh teapot;
+  if (!teapot.LoadFromObjectFile("res/teapot.obj")) {
+    fail("Could not load res/teapot.obj");
+  }
+  teapot.ComputeBounds();
+  Bvh bvh;
+  Timer build;
+  bvh.Build(teapot);
+  float buildMs = build.elapsedMs();
+
+  // Rays from a box around the mesh towards random points inside it.
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<float> unit(-0.5f, 0.5f);
+  vec3d lo = teapot.boundsMin, hi = teapot.boundsMax;
+  auto around = [&](float scale) {
+    return vec3d((lo.x + hi.x) * 0.5f + (hi.x - lo.x) * scale * unit(rng),
+                 (lo.y + hi.y) * 0.5f + (hi.y - lo.y) * scale * unit(rng),
+                 (lo.z + hi.z) * 0.5f + (hi.z - lo.z) * scale * unit(rng));
+  };
+  const int rays = 100000;
+  std::vector<vec3d> origins, targets;
+  for (int i = 0; i < rays; i++) {
+    origins.push_back(around(3.0f));
+    targets.push_back(around(1.0f));
+  }
+  int hits = 0;
+  Timer query;
+  for (int i = 0; i < rays; i++) {
+    BvhHit hit;
+    vec3d dir = {targets[i].x - origins[i].x, targets[i].y - origins[i].y,
+                 targets[i].z - origins[i].z};
+    hits += bvh.Intersect(origins[i], dir, hit);
+  }
+  float queryMs = query.elapsedMs();
+
+  olcEngine3D engine(1280, 720, true);
+  engine.sMeshFile = "res/teapot.obj";
+  engine.OnUserCreate();
+  if (!engine.WaitForAssets()) {
+    fail("Could not load res/teapot.obj");
+  }
+  engine.OnUserUpdate(1.0f / 60.0f, keyboard);
+  BvhHit hit;
+  engine.Pick(640, 360, hit); // Builds the engine's BVH.
+  int picked = 0;
+  Timer pick;
+  for (int y = 0; y < 720; y += 8)
+    for (int x = 0; x < 1280; x += 8)
+      picked += engine.Pick(x + 0.5f, y + 0.5f, hit);
+  float pickMs = pick.elapsedMs();
+
+  std::cout << "bvh, teapot" << std::endl;
+  std::cout << "  build: " << buildMs << " ms, " << bvh.nodeCount()
+            << " nodes, " << bvh.memoryBytes() << " bytes" << std::endl;
+  std::cout << "  rays:  " << rays / queryMs / 1000.0f << " M rays/s ("
+            << hits << "/" << rays << " hit)" << std::endl;
+  std::cout << "  picks: " << pickMs * 1000.0f / (160 * 90)
+            << " us each through the engine (" << picked << "/" << 160 * 90
+            << " hit)" << std::endl;
+}
+
+// A flat grid of 2 x side x side triangles, row by row.
+static mesh gridMesh(int side) {
+  mesh grid;
+  for (int z = 0; z < side; z++)
+    for (int x = 0; x < side; x++) {
+      vec3d a(x, 0, z), b(x + 1, 0, z), c(x, 0, z + 1), d(x + 1, 0, z + 1);
+      grid.tris.push_back({{a, c, b}});
+      grid.tris.push_back({{b, c, d}});
+    }
+  return grid;
+}
+
+static void benchMeshEdits() {
+  const int side = 512, repeats = 20;
+  mesh grid = gridMesh(side);
+  grid.ComputeNormals();
+  grid.ComputeBounds();
+  Bvh bvh;
+  bvh.Build(grid);
+
+  std::cout << "mesh edits, " << grid.tris.size() << " triangle grid"
+            << std::endl;
+  // The first edit also sums up the vertex normals.
+  Timer prepare;
+  grid.UpdateTriangles(0, grid.tris.data(), 1);
+  std::cout << "  first edit: " << prepare.elapsedMs() << " ms" << std::endl;
+
+  std::mt19937 rng(5);
+  for (size_t count : {16, 256, 4096}) {
+    // Raises a run of triangles by a different amount each time.
+    auto raised = [&](size_t first, float height) {
+      std::vector<triangle> tris(grid.tris.begin() + first,
+                                 grid.tris.begin() + first + count);
+      for (triangle &tri : tris)
+        for (vec3d &p : tri.p)
+          p.y = -height * sinf(p.x * 0.1f) * sinf(p.z * 0.1f);
+      return tris;
+    };
+    Timer edit;
+    for (int r = 0; r < repeats; r++) {
+      size_t first = rng() % (grid.tris.size() - count);
+      std::vector<triangle> tris = raised(first, 1.0f + r);
+      grid.UpdateTriangles(first, tris.data(), tris.size());
+      grid.UpdateBounds();
+      bvh.Update(grid);
+    }
+    float editMs = edit.elapsedMs() / repeats;
+
+    // The same kind of change made to tris directly, redoing everything.
+    Timer rebuild;
+    for (int r = 0; r < 3; r++) {
+      size_t first = rng() % (grid.tris.size() - count);
+      std::vector<triangle> tris = raised(first, 1.0f + r);
+      std::copy(tris.begin(), tris.end(), grid.tris.begin() + first);
+      grid.ComputeNormals();
+      grid.ComputeBounds();
+      bvh.Build(grid);
+    }
+    float rebuildMs = rebuild.elapsedMs() / 3;
+    // Sums the vertex normals again, outside the next timing.
+    grid.UpdateTriangles(0, grid.tris.data(), 1);
+
+    std::cout << "  " << count << " triangles: " << editMs
+              << " ms incremental (normals, bounds, bvh), " << rebuildMs
+              << " ms rebuilt" << std::endl;
+  }
+
+  Timer remove;
+  for (int r = 0; r < repeats; r++) {
+    grid.RemoveTriangles(rng() % (grid.tris.size() - 256), 256);
+    grid.UpdateBounds();
+    bvh.Update(grid);
+  }
+  std::cout << "  removing 256 triangles: " << remove.elapsedMs() / repeats
+            << " ms" << std::endl;
+}
+
+// Adds `levels` more levels of `fanout` children under `node`, depth first,
+// and collects the leaves.
+static void addSubtree(SceneGraph &scene, int node, int fanout, int levels,
+                       std::vector<int> &leaves) {
+  if (levels == 0)
+    leaves.push_back(node);
+  for (int i = 0; levels > 0 && i < fanout; i++)
+    addSubtree(scene, scene.add(node), fanout, levels - 1, leaves);
+}
+
+static void benchSceneGraph() {
+  const int frames = 200;
+  SceneGraph scene;
+  std::vector<int> leaves;
+  addSubtree(scene, scene.add(), 10, 5, leaves);
+  scene.update();
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> angle(0.0f, 6.28f);
+  auto turn = [&](int node) {
+    float a = angle(rng);
+    mat4x4 m = scene.localTransform(node);
+    m.m[0][0] = m.m[2][2] = cosf(a);
+    m.m[0][2] = sinf(a);
+    m.m[2][0] = -sinf(a);
+    scene.setLocal(node, m);
+  };
+
+  std::cout << "scene graph, " << scene.size() << " nodes, 10 children each"
+            << std::endl;
+  Timer full;
+  for (int f = 0; f < frames; f++) {
+    scene.invalidate();
+    scene.update();
+  }
+  std::cout << "  everything: " << full.elapsedMs() / frames << " ms"
+            << std::endl;
+  // Node 1 heads a tenth of the tree.
+  for (int moving : {1, 10, 100}) {
+    size_t redone = 0;
+    Timer timer;
+    for (int f = 0; f < frames; f++) {
+      for (int i = 0; i < moving; i++)
+        turn(leaves[rng() % leaves.size()]);
+      redone += scene.update();
+    }
+    std::cout << "  " << moving << (moving == 1 ? " leaf" : " leaves")
+              << " moving: "
+              << timer.elapsedMs() * 1000.0f / frames << " us, "
+              << redone / frames << " nodes redone" << std::endl;
+  }
+  Timer branch;
+  for (int f = 0; f < frames; f++) {
+    turn(1);
+    scene.update();
+  }
+  std::cout << "  one branch moving: " << branch.elapsedMs() / frames
+            << " ms" << std::endl;
+  Timer still;
+  for (int f = 0; f < frames; f++)
+    scene.update();
+  std::cout << "  nothing moving: " << still.elapsedMs() * 1000.0f / frames
+            << " us" << std::endl;
+}
+
+// The comparator sort the engine used before DepthSorter, for reference.
+static void sortByComparator(std::vector<triangle> &tris) {
+  std::sort(tris.begin(), tris.end(), [](triangle &t1, triangle &t2) {
+    float z1 = (t1.p[0].z + t1.p[1].z + t1.p[2].z) / 3.0f;
+    float z2 = (t2.p[0].z + t2.p[1].z + t2.p[2].z) / 3.0f;
+    return z1 > z2;
+  });
+}
+
+static void benchDepthSort() {
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> z(0.0f, 1.0f);
+  DepthSorter sorter;
+  std::vector<Uint32> order;
+
+  std::cout << "back-to-front sort" << std::endl;
+  for (int n : {10000, 100000, 1000000}) {
+    std::vector<triangle> tris(n);
+    for (auto &t : tris)
+      for (auto &p : t.p)
+        p.z = z(rng);
+
+    int runs = 10000000 / n;
+    float comparatorMs = 0.0f;
+    for (int r = 0; r < runs; r++) {
+      std::vector<triangle> copy = tris;
+      Timer timer;
+      sortByComparator(copy);
+      comparatorMs += timer.elapsedMs();
+    }
+    Timer timer;
+    for (int r = 0; r < runs; r++)
+      sorter.sortBackToFront(tris, order);
+    float radixMs = timer.elapsedMs();
+
+    std::cout << "  " << n << " tris: std::sort " << comparatorMs / runs
+              << " ms, radix " << radixMs / runs << " ms ("
+              << comparatorMs / radixMs << "x)" << std::endl;
+  }
+}
+
+static void benchRasterPipeline() {
+  std::mt19937 rng(2);
+  std::uniform_real_distribution<float> px(0.0f, 1240.0f), py(0.0f, 680.0f);
+  std::uniform_real_distribution<float> offset(0.0f, 40.0f), unit(0.0f, 1.0f);
+  std::vector<RasterVertex> verts;
+  for (int i = 0; i < 20000; i++) {
+    float x = px(rng), y = py(rng);
+    for (int k = 0; k < 3; k++)
+      verts.push_back({x + offset(rng), y + offset(rng), unit(rng), unit(rng)});
+  }
+
+  Framebuffer fb(1280, 720);
+  const char *names[] = {"depth", "depth+gouraud", "depth+blend+gouraud",
+                         "wireframe"};
+  RasterFlags configs[4];
+  configs[1].gouraud = true;
+  configs[2].blend = configs[2].gouraud = true;
+  configs[3].wireframe = true;
+
+  std::cout << "raster pipeline, 20000 tris of ~20px" << std::endl;
+  for (int c = 0; c < 4; c++) {
+    // Read back through a volatile so the generic loop cannot be
+    // specialised by the compiler behind our back.
+    volatile bool blend = configs[c].blend;
+    RasterFlags flags = configs[c];
+    flags.blend = blend;
+    RasterFunction specialised = selectRaster(configs[c]);
+
+    float specialisedMs = 0.0f, genericMs = 0.0f;
+    for (int run = 0; run < 10; run++) {
+      fb.clear();
+      fb.clearDepth();
+      Timer a;
+      for (size_t i = 0; i < verts.size(); i += 3)
+        specialised(fb, verts[i], verts[i + 1], verts[i + 2], 0xffffffc0);
+      specialisedMs += a.elapsedMs();
+
+      fb.clear();
+      fb.clearDepth();
+      Timer b;
+      for (size_t i = 0; i < verts.size(); i += 3)
+        rasterTriangleGeneric(fb, verts[i], verts[i + 1], verts[i + 2],
+                              0xffffffc0, flags);
+      genericMs += b.elapsedMs();
+    }
+    std::cout << "  " << names[c] << ": specialised " << specialisedMs / 10
+              << " ms, generic " << genericMs / 10 << " ms ("
+              << genericMs / specialisedMs << "x)" << std::endl;
+  }
+
+  // The depth-only kernel against the flat one it matches, and the colour
+  // pass that tests for equal depth after it.
+  RasterFlags equalFlags;
+  equalFlags.depthEqual = true;
+  RasterFunction flat = selectRaster(RasterFlags());
+  RasterFunction equal = selectRaster(equalFlags);
+  float flatMs = 0.0f, depthMs = 0.0f, equalMs = 0.0f;
+  for (int run = 0; run < 10; run++) {
+    fb.clearDepth();
+    Timer a;
+    for (size_t i = 0; i < verts.size(); i += 3)
+      flat(fb, verts[i], verts[i + 1], verts[i + 2], 0xffffffff);
+    flatMs += a.elapsedMs();
+
+    fb.clearDepth();
+    Timer b;
+    for (size_t i = 0; i < verts.size(); i += 3)
+      rasterDepth(fb, verts[i], verts[i + 1], verts[i + 2]);
+    depthMs += b.elapsedMs();
+    Timer c;
+    for (size_t i = 0; i < verts.size(); i += 3)
+      equal(fb, verts[i], verts[i + 1], verts[i + 2], 0xffffffff);
+    equalMs += c.elapsedMs();
+  }
+  std::cout << "  depth only: " << depthMs / 10 << " ms (flat colour "
+            << flatMs / 10 << " ms, " << flatMs / depthMs
+            << "x); equal-depth colour pass after it " << equalMs / 10
+            << " ms" << std::endl;
+}
+
+static void benchObjLoad() {
+  // A 1000 x 500 vertex grid, written with relative face indices.
+  const char *path = "build/bench-grid.obj";
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    std::cout << "obj load: could not write " << path << ", skipped"
+              << std::endl;
+    return;
+  }
+  const int columns = 1000, rows = 500;
+  for (int y = 0; y < rows; y++) {
+    for (int x = 0; x < columns; x++)
+      fprintf(out, "v %f %f %f\n", x * 0.01f, y * 0.01f,
+              sinf(x * 0.1f) * cosf(y * 0.1f));
+    // Quads between this row and the one before, just after it is written.
+    for (int x = 1; y > 0 && x < columns; x++) {
+      int a = -(columns - x + 1) - columns, b = a + 1;
+      int c = -(columns - x + 1), d = c + 1;
+      fprintf(out, "f %d %d %d\nf %d %d %d\n", a, c, b, b, c, d);
+    }
+  }
+  long bytes = ftell(out);
+  fclose(out);
+
+  std::cout << "obj load, " << bytes / 1000000 << " MB grid" << std::endl;
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  float oneThread = 0.0f;
+  for (int threads = 1;; threads = std::min(threads * 2, cores)) {
+    float best = 1e9f;
+    size_t triangles = 0;
+    for (int run = 0; run < 3; run++) {
+      mesh grid;
+      Timer timer;
+      if (!grid.LoadFromObjectFile(path, threads)) {
+        fail("Could not load the generated grid");
+      }
+      best = std::min(best, timer.elapsedMs());
+      triangles = grid.tris.size();
+    }
+    if (threads == 1)
+      oneThread = best;
+    std::cout << "  " << threads << " thread" << (threads > 1 ? "s: " : ":  ")
+              << best << " ms (" << oneThread / best << "x, " << triangles
+              << " tris)" << std::endl;
+    if (threads == cores)
+      break;
+  }
+  remove(path);
+}
+
+static void benchDirtyTiles() {
+  // One triangle moving over the clear colour, then over a background of
+  // small triangles that is redrawn unchanged every frame. The first case
+  // is settled by the rasterizer's tile flags alone; in the second every
+  // tile is flagged and has to be compared.
+  std::mt19937 rng(4);
+  std::uniform_real_distribution<float> px(0.0f, 1240.0f), py(0.0f, 680.0f);
+  std::uniform_real_distribution<float> offset(0.0f, 40.0f);
+  std::vector<RasterVertex> background;
+  for (int i = 0; i < 2000; i++) {
+    float x = px(rng), y = py(rng);
+    for (int k = 0; k < 3; k++)
+      background.push_back({x + offset(rng), y + offset(rng), 0.5f, 1.0f});
+  }
+
+  Framebuffer fb(1280, 720);
+  std::vector<Uint32> texture(fb.color.size());
+  RasterFunction raster = selectRaster(RasterFlags());
+  const int frames = 200;
+  std::cout << "dirty tiles, 1280x720, one triangle moving" << std::endl;
+  for (int withBackground = 0; withBackground < 2; withBackground++) {
+    DirtyTiles dirty;
+    float trackMs = 0.0f, uploadMs = 0.0f, fullMs = 0.0f;
+    size_t dirtyPixels = 0;
+    for (int f = 0; f < frames; f++) {
+      fb.clear();
+      fb.clearDepth();
+      for (size_t i = 0; withBackground && i < background.size(); i += 3)
+        raster(fb, background[i], background[i + 1], background[i + 2],
+               0x808080ff);
+      float x = 100.0f + f * 5.0f;
+      raster(fb, {x, 300.0f, 0.25f, 1.0f}, {x + 60.0f, 320.0f, 0.25f, 1.0f},
+             {x + 20.0f, 380.0f, 0.25f, 1.0f}, 0xff0000ff);
+
+      // Copies into `texture` stand in for SDL_UpdateTexture.
+      Timer track;
+      dirty.update(fb, fb.color.data(), fb.width, fb.height);
+      trackMs += track.elapsedMs();
+      Timer upload;
+      for (SDL_Rect &r : dirty.rects)
+        for (int y = r.y; y < r.y + r.h; y++)
+          memcpy(&texture[(size_t)y * fb.width + r.x],
+                 &fb.color[(size_t)y * fb.width + r.x], r.w * sizeof(Uint32));
+      uploadMs += upload.elapsedMs();
+      Timer full;
+      memcpy(texture.data(), fb.color.data(),
+             fb.color.size() * sizeof(Uint32));
+      fullMs += full.elapsedMs();
+      if (f > 0)
+        dirtyPixels += dirty.dirtyPixels;
+    }
+    std::cout << (withBackground ? "  over a redrawn background: "
+                                 : "  over the clear colour:     ")
+              << 100.0 * dirtyPixels / ((frames - 1) * fb.color.size())
+              << "% of the screen uploaded; tracking " << trackMs / frames
+              << " ms + upload " << uploadMs / frames << " ms vs full upload "
+              << fullMs / frames << " ms" << std::endl;
+  }
+}
+
+// The loop a plain per-point draw would be: one matrix-vector product and
+// one depth-tested write per point, no tile flags.
+static void drawPointsNaively(Framebuffer &fb, const PointCloud &cloud,
+                              const mat4x4 &mvp) {
+  for (size_t i = 0; i < cloud.size(); i++) {
+    vec3d v = {cloud.x[i], cloud.y[i], cloud.z[i]};
+    float c[4];
+    for (int k = 0; k < 4; k++)
+      c[k] = v.x * mvp.m[0][k] + v.y * mvp.m[1][k] + v.z * mvp.m[2][k] +
+             mvp.m[3][k];
+    if (c[3] < 0.1f)
+      continue;
+    int sx = (int)((c[0] / c[3] + 1.0f) * 0.5f * fb.width);
+    int sy = (int)((c[1] / c[3] + 1.0f) * 0.5f * fb.height);
+    float depth = c[2] / c[3];
+    if (sx < 0 || sx >= fb.width || sy < 0 || sy >= fb.height ||
+        depth < 0.0f || depth >= 1.0f)
+      continue;
+    size_t at = (size_t)sy * fb.width + sx;
+    if (depth < fb.depth[at]) {
+      fb.depth[at] = depth;
+      fb.color[at] = cloud.color[i];
+    }
+  }
+}
+
+static void benchPointCloud() {
+  // A 10M point height field seen from above at an angle. Scans store
+  // neighbouring points together, so it is timed in that order and again
+  // shuffled, where nearly every write misses the cache.
+  const int side = 3163;
+  PointCloud scan;
+  for (int row = 0; row < side; row++) {
+    for (int column = 0; column < side; column++) {
+      float x = column * 6.0f / side - 3.0f, z = row * 6.0f / side - 3.0f;
+      scan.add(x, 0.3f * sinf(x * 3.0f) * cosf(z * 2.0f), z,
+               (Uint32)(row * 255 / side) << 24 | 0x8080ff);
+    }
+  }
+  std::vector<size_t> order(scan.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::shuffle(order.begin(), order.end(), std::mt19937(5));
+  PointCloud shuffled;
+  for (size_t i : order)
+    shuffled.add(scan.x[i], scan.y[i], scan.z[i], scan.color[i]);
+
+  Framebuffer fb(1280, 720);
+  mat4x4 proj;
+  proj.m[0][0] = 720.0f / 1280.0f;
+  proj.m[1][1] = 1.0f;
+  proj.m[2][2] = 1000.0f / (1000.0f - 0.1f);
+  proj.m[3][2] = -1000.0f * 0.1f / (1000.0f - 0.1f);
+  proj.m[2][3] = 1.0f;
+  // Tilted by 0.6 rad and pushed 5 units away.
+  mat4x4 view;
+  view.m[0][0] = 1.0f;
+  view.m[1][1] = cosf(0.6f);
+  view.m[1][2] = sinf(0.6f);
+  view.m[2][1] = -sinf(0.6f);
+  view.m[2][2] = cosf(0.6f);
+  view.m[3][2] = 5.0f;
+  view.m[3][3] = 1.0f;
+  mat4x4 mvp;
+  for (int r = 0; r < 4; r++)
+    for (int c = 0; c < 4; c++)
+      for (int k = 0; k < 4; k++)
+        mvp.m[r][c] += view.m[r][k] * proj.m[k][c];
+
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  std::cout << "point cloud, " << scan.size() / 1000000 << "M points, 1280x720"
+            << std::endl;
+  for (PointCloud *cloud : {&scan, &shuffled}) {
+    std::cout << (cloud == &scan ? "  scan order" : "  shuffled") << std::endl;
+    float naiveMs = 1e9f;
+    for (int run = 0; run < 3; run++) {
+      fb.clear();
+      fb.clearDepth();
+      Timer timer;
+      drawPointsNaively(fb, *cloud, mvp);
+      naiveMs = std::min(naiveMs, timer.elapsedMs());
+    }
+    std::cout << "    per-point loop: " << cloud->size() / (naiveMs * 1000.0f)
+              << " M points/s" << std::endl;
+    for (int threads = 1;; threads = std::min(threads * 2, cores)) {
+      ThreadPool pool(threads);
+      for (int size : {1, 3}) {
+        float best = 1e9f;
+        for (int run = 0; run < 3; run++) {
+          fb.clear();
+          fb.clearDepth();
+          Timer timer;
+          cloud->Render(fb, mvp, 0.1f, size, &pool);
+          best = std::min(best, timer.elapsedMs());
+        }
+        std::cout << "    " << threads << " thread"
+                  << (threads > 1 ? "s" : "") << ", " << size
+                  << "px splats: " << cloud->size() / (best * 1000.0f)
+                  << " M points/s (" << naiveMs / best << "x)" << std::endl;
+      }
+      if (threads == cores)
+        break;
+    }
+  }
+}
+
+// Skinning as an array-of-structures loop would do it: each vertex's
+// matrix blended and applied one component at a time, morphs first.
+static void skinNaively(const SkinnedMesh &mesh,
+                        const std::vector<mat4x4> &palette,
+                        const std::vector<float> &morphWeights,
+                        std::vector<vec3d> &positions,
+                        std::vector<vec3d> &normals) {
+  positions.resize(mesh.vertexCount());
+  normals.resize(mesh.vertexCount());
+  for (size_t i = 0; i < mesh.vertexCount(); i++) {
+    vec3d p = {mesh.bind.x[i], mesh.bind.y[i], mesh.bind.z[i]};
+    vec3d n = {mesh.bind.nx[i], mesh.bind.ny[i], mesh.bind.nz[i], 0.0f};
+    for (size_t t = 0; t < mesh.morphs.size(); t++) {
+      const VertexStreams &d = mesh.morphs[t].delta;
+      p = {p.x + d.x[i] * morphWeights[t], p.y + d.y[i] * morphWeights[t],
+           p.z + d.z[i] * morphWeights[t]};
+    }
+    mat4x4 m;
+    for (int k = 0; k < SkinnedMesh::MAX_INFLUENCES; k++)
+      for (int r = 0; r < 4; r++)
+        for (int c = 0; c < 4; c++)
+          m.m[r][c] += mesh.weights[k][i] * palette[mesh.joints[k][i]].m[r][c];
+    positions[i] = {p.x * m.m[0][0] + p.y * m.m[1][0] + p.z * m.m[2][0] +
+                        m.m[3][0],
+                    p.x * m.m[0][1] + p.y * m.m[1][1] + p.z * m.m[2][1] +
+                        m.m[3][1],
+                    p.x * m.m[0][2] + p.y * m.m[1][2] + p.z * m.m[2][2] +
+                        m.m[3][2]};
+    vec3d o = {n.x * m.m[0][0] + n.y * m.m[1][0] + n.z * m.m[2][0],
+               n.x * m.m[0][1] + n.y * m.m[1][1] + n.z * m.m[2][1],
+               n.x * m.m[0][2] + n.y * m.m[1][2] + n.z * m.m[2][2]};
+    float length = sqrtf(o.x * o.x + o.y * o.y + o.z * o.z);
+    normals[i] = {o.x / length, o.y / length, o.z / length, 0.0f};
+  }
+}
+
+static void benchSkinning() {
+  // The demo's tube, about 4700 vertices on 8 joints, and a crowd of 64 of
+  // them posed at different times, skinned one character after another as
+  // the engine would.
+  SkinnedMesh character;
+  buildSkinnedTube(character, 96, 48, 8, 4.0f, 0.5f);
+  const int crowd = 64;
+  std::vector<std::vector<mat4x4>> palettes(crowd);
+  std::vector<std::vector<float>> morphWeights(crowd);
+  mat4x4 root;
+  for (int d = 0; d < 4; d++)
+    root.m[d][d] = 1.0f;
+  for (int c = 0; c < crowd; c++) {
+    std::vector<mat4x4> local;
+    poseSkinnedTube(character, c * 0.1f, local, morphWeights[c]);
+    character.skeleton.Pose(local, root, palettes[c]);
+  }
+  size_t vertices = character.vertexCount() * crowd;
+
+  std::cout << "skinning, " << crowd << " characters of "
+            << character.vertexCount() << " vertices, 4 weights, 1 morph"
+            << std::endl;
+  std::vector<vec3d> positions, normals;
+  float naiveMs = 1e9f;
+  for (int run = 0; run < 3; run++) {
+    Timer timer;
+    for (int c = 0; c < crowd; c++)
+      skinNaively(character, palettes[c], morphWeights[c], positions, normals);
+    naiveMs = std::min(naiveMs, timer.elapsedMs());
+  }
+  std::cout << "  per-vertex loop: " << vertices / naiveMs << " vertices/ms"
+            << std::endl;
+  VertexStreams out;
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  for (int threads = 1;; threads = std::min(threads * 2, cores)) {
+    ThreadPool pool(threads);
+    float best = 1e9f;
+    for (int run = 0; run < 3; run++) {
+      Timer timer;
+      for (int c = 0; c < crowd; c++)
+        character.Deform(palettes[c], morphWeights[c], out, &pool);
+      best = std::min(best, timer.elapsedMs());
+    }
+    // How many such characters fit in 2 ms of a frame.
+    int perFrame = (int)(2.0f * vertices / best / character.vertexCount());
+    std::cout << "  " << threads << " thread" << (threads > 1 ? "s" : "")
+              << ": " << vertices / best << " vertices/ms (" << naiveMs / best
+              << "x), " << perFrame << " characters in 2 ms" << std::endl;
+    if (threads == cores)
+      break;
+  }
+}
+
+static void benchShmRing() {
+  const int w = 1280, h = 720, frames = 600;
+  std::string name = "/tar-bench-" + std::to_string(getpid());
+  ShmRingWriter writer(name, w, h, 3);
+  ShmRingReader reader;
+  if (writer.failed || !reader.open(name)) {
+    std::cout << "shm ring: shared memory unavailable, skipped" << std::endl;
+    return;
+  }
+
+  // The consumer reads every pixel in place, as an analysis process would,
+  // and checks it against what frame n was filled with below.
+  std::atomic<bool> done(false);
+  int received = 0, torn = 0, wrong = 0;
+  std::thread consumer([&] {
+    ShmRingReader::Frame frame;
+    while (frame.sequence < (Uint64)frames) {
+      if (!reader.wait(frame.sequence, 100, frame)) {
+        if (done)
+          break;
+        continue;
+      }
+      Uint64 sum = 0;
+      for (int i = 0; i < frame.width * frame.height; i++)
+        sum += frame.pixels[i] >> 24;
+      if (reader.valid(frame)) {
+        Uint32 fill = 0x10203040u * (Uint32)(frame.sequence - 1);
+        wrong += sum != (Uint64)(fill >> 24) * w;
+        received++;
+      } else {
+        torn++;
+      }
+    }
+  });
+
+  std::vector<Uint32> pixels((size_t)w * h);
+  Timer timer;
+  for (int i = 0; i < frames; i++) {
+    std::fill(pixels.begin(), pixels.begin() + w, 0x10203040u * i);
+    writer.publish(pixels.data(), w, h);
+  }
+  float publishMs = timer.elapsedMs();
+  done = true;
+  consumer.join();
+
+  std::cout << "shm ring, 1280x720, 3 slots" << std::endl;
+  std::cout << "  publish: " << frames * 1000.0f / publishMs << " frames/s, "
+            << (double)frames * w * h * 4 / publishMs / 1e6 << " GB/s"
+            << std::endl;
+  std::cout << "  consumer: " << received << "/" << frames
+            << " frames read in place, " << torn << " torn and dropped, "
+            << wrong << " wrong" << std::endl;
+}
+
+int main() {
+  Keyboard *keyboard = initKeyboard();
+
+  benchFrame(keyboard);
+  benchDepthPrepass(keyboard);
+  benchViews(keyboard);
+  benchTerrain(keyboard);
+  benchCompactMesh(keyboard);
+  benchBvh(keyboard);
+  benchMeshEdits();
+  benchSceneGraph();
+  benchDepthSort();
+  benchRasterPipeline();
+  benchObjLoad();
+  benchDirtyTiles();
+  benchShmRing();
+  benchPointCloud();
+  benchSkinning();
+
+  return 0;
+}
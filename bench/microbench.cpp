@@ -0,0 +1,436 @@
+#include "depthsort.hpp"
+#include "engine.hpp"
+#include "framebuffer.hpp"
+#include "hud.hpp"
+#include "lighting.hpp"
+#include "mesh.hpp"
+#include "rasterpipeline.hpp"
+#include "timer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Per-kernel timings with regression checking.
+//
+// Each benchmark is an operation run `iterations` times per call. The
+// iteration count is calibrated during warm-up so one repetition takes about
+// 10 ms; the reported figures are per operation, over all repetitions.
+// Results can be saved as a JSON baseline and later runs compared against
+// it, with medians that got slower by more than the threshold flagged.
+
+#define USAGE                                                                  \
+  "Usage: microbench [--reps n] [--warmup-ms ms] [--filter substring]\n"       \
+  "                  [--save baseline.json] [--compare baseline.json]\n"       \
+  "                  [--threshold percent]"
+
+// Results are written here so the compiler cannot drop the work.
+static volatile float sink;
+
+struct Result {
+  std::string name;
+  double minNs;
+  double medianNs;
+  double meanNs;
+  double stddevNs;
+  int reps;
+  long long iterations;
+};
+
+struct Options {
+  int reps = 15;
+  float warmupMs = 50.0f;
+  float repMs = 10.0f;
+  std::string filter;
+};
+
+static Result measure(const Options &options, const std::string &name,
+                      const std::function<void(long long)> &op) {
+  // Warm caches and branch predictors while growing the batch until one
+  // repetition is long enough to time reliably.
+  long long iterations = 1;
+  Timer warmup;
+  while (true) {
+    Timer batch;
+    op(iterations);
+    float ms = batch.elapsedMs();
+    if (ms < options.repMs / 2 && iterations < (1LL << 40)) {
+      iterations *= 2;
+      continue;
+    }
+    if (ms > 0.0f)
+      iterations = std::max(1LL, (long long)(iterations * options.repMs / ms));
+    if (warmup.elapsedMs() >= options.warmupMs)
+      break;
+  }
+
+  std::vector<double> samples;
+  for (int r = 0; r < options.reps; r++) {
+    Timer timer;
+    op(iterations);
+    samples.push_back(timer.elapsedMs() * 1e6 / iterations);
+  }
+  std::sort(samples.begin(), samples.end());
+
+  Result result;
+  result.name = name;
+  result.reps = options.reps;
+  result.iterations = iterations;
+  result.minNs = samples.front();
+  size_t mid = samples.size() / 2;
+  result.medianNs = samples.size() % 2
+                        ? samples[mid]
+                        : (samples[mid - 1] + samples[mid]) / 2.0;
+  double sum = 0.0;
+  for (double s : samples)
+    sum += s;
+  result.meanNs = sum / samples.size();
+  double variance = 0.0;
+  for (double s : samples)
+    variance += (s - result.meanNs) * (s - result.meanNs);
+  result.stddevNs =
+      samples.size() > 1 ? sqrt(variance / (samples.size() - 1)) : 0.0;
+  return result;
+}
+
+static bool saveBaseline(const std::string &path,
+                         const std::vector<Result> &results) {
+  std::ofstream f(path);
+  if (!f.is_open())
+    return false;
+  f << "{\n  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    f << "    {\"name\": \"" << r.name << "\", \"median_ns\": " << r.medianNs
+      << ", \"mean_ns\": " << r.meanNs << ", \"min_ns\": " << r.minNs
+      << ", \"stddev_ns\": " << r.stddevNs << ", \"reps\": " << r.reps
+      << ", \"iterations\": " << r.iterations << "}"
+      << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  f << "  ]\n}\n";
+  return f.good();
+}
+
+// Reads the medians back from a file written by saveBaseline(). This only
+// understands that layout: each object's "name" followed by its
+// "median_ns".
+static bool loadBaseline(const std::string &path,
+                         std::map<std::string, double> &medians) {
+  std::ifstream f(path);
+  if (!f.is_open())
+    return false;
+  std::stringstream buffer;
+  buffer << f.rdbuf();
+  std::string text = buffer.str();
+
+  size_t at = 0;
+  while ((at = text.find("\"name\"", at)) != std::string::npos) {
+    size_t open = text.find('"', text.find(':', at));
+    size_t close = text.find('"', open + 1);
+    size_t median = text.find("\"median_ns\"", close);
+    if (open == std::string::npos || close == std::string::npos ||
+        median == std::string::npos)
+      return false;
+    size_t colon = text.find(':', median);
+    medians[text.substr(open + 1, close - open - 1)] =
+        strtod(text.c_str() + colon + 1, nullptr);
+    at = colon;
+  }
+  return true;
+}
+
+// `count` triangles of about `size` pixels at random places on a
+// width x height screen; a size of 0 gives ones covering the whole screen.
+static std::vector<vec3d> screenTriangles(int count, float size, int width,
+                                          int height) {
+  std::mt19937 rng(4);
+  std::uniform_real_distribution<float> x(0.0f, width - size - 1.0f);
+  std::uniform_real_distribution<float> y(0.0f, height - size - 1.0f);
+  std::uniform_real_distribution<float> z(0.0f, 1.0f);
+  std::vector<vec3d> verts;
+  for (int i = 0; i < count; i++) {
+    if (size == 0.0f) {
+      verts.push_back({0.0f, 0.0f, z(rng)});
+      verts.push_back({2.0f * width, 0.0f, z(rng)});
+      verts.push_back({0.0f, 2.0f * height, z(rng)});
+      continue;
+    }
+    float ox = x(rng), oy = y(rng);
+    verts.push_back({ox, oy, z(rng)});
+    verts.push_back({ox + size, oy + size * 0.5f, z(rng)});
+    verts.push_back({ox + size * 0.25f, oy + size, z(rng)});
+  }
+  return verts;
+}
+
+int main(int argc, char **argv) {
+  Options options;
+  std::string savePath;
+  std::string comparePath;
+  float threshold = 10.0f;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+      options.reps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--warmup-ms") == 0 && i + 1 < argc) {
+      options.warmupMs = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+      savePath = argv[++i];
+    } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+      comparePath = argv[++i];
+    } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+      threshold = atof(argv[++i]);
+    } else {
+      std::cerr << "Unknown argument: " << argv[i] << std::endl;
+      fail(USAGE);
+    }
+  }
+  if (options.reps < 1 || threshold <= 0.0f) {
+    fail("--reps and --threshold must be positive");
+  }
+
+  std::map<std::string, double> baseline;
+  if (!comparePath.empty() && !loadBaseline(comparePath, baseline)) {
+    fail("Could not read the baseline");
+  }
+
+  std::vector<Result> results;
+  int regressions = 0;
+  printf("%-34s %12s %12s %8s %12s\n", "benchmark", "median ns", "mean ns",
+         "stddev", "min ns");
+  auto run = [&](const std::string &name,
+                 const std::function<void(long long)> &op) {
+    if (name.find(options.filter) == std::string::npos)
+      return;
+    Result r = measure(options, name, op);
+    results.push_back(r);
+    printf("%-34s %12.2f %12.2f %7.1f%% %12.2f", name.c_str(), r.medianNs,
+           r.meanNs, 100.0 * r.stddevNs / r.meanNs, r.minNs);
+    auto base = baseline.find(name);
+    if (base != baseline.end() && base->second > 0.0) {
+      double change = 100.0 * (r.medianNs / base->second - 1.0);
+      printf("  %+6.1f%%", change);
+      if (change > threshold) {
+        printf("  REGRESSION");
+        regressions++;
+      }
+    }
+    printf("\n");
+    fflush(stdout);
+  };
+
+  // Maths.
+  olcEngine3D engine(64, 64, true);
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+  std::vector<vec3d> points(256);
+  for (auto &p : points)
+    p = {unit(rng), unit(rng), unit(rng)};
+  mat4x4 matrix, other;
+  for (int r = 0; r < 4; r++)
+    for (int c = 0; c < 4; c++) {
+      matrix.m[r][c] = unit(rng);
+      other.m[r][c] = unit(rng);
+    }
+
+  run("math/Matrix_MultiplyVector", [&](long long n) {
+    float sum = 0.0f;
+    for (long long i = 0; i < n; i++)
+      sum += engine.Matrix_MultiplyVector(matrix, points[i & 255]).x;
+    sink = sum;
+  });
+  run("math/Matrix_MultiplyMatrix", [&](long long n) {
+    mat4x4 m = matrix;
+    for (long long i = 0; i < n; i++) {
+      m = engine.Matrix_MultiplyMatrix(m, other);
+      m.m[0][0] = 0.5f; // Keeps the chain from overflowing.
+    }
+    sink = m.m[1][1];
+  });
+
+  // Lighting, per surface, one at a time and in batches.
+  LightingInputs surfaces;
+  for (int i = 0; i < 1024; i++) {
+    vec3d n = {unit(rng), unit(rng), unit(rng)};
+    float l = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+    surfaces.add({n.x / l, n.y / l, n.z / l}, {unit(rng), unit(rng), 5.0f});
+  }
+  std::vector<float> lit(surfaces.size());
+  LightingStage lighting;
+  for (int count : {1, 4}) {
+    if (count == 4) {
+      Light point;
+      point.type = Light::POINT;
+      point.v = {2.0f, 2.0f, 3.0f};
+      point.falloff = 0.1f;
+      lighting.lights.push_back(point);
+      point.v = {-2.0f, 0.0f, 3.0f};
+      lighting.lights.push_back(point);
+      Light side;
+      side.v = {0.6f, 0.0f, -0.8f};
+      lighting.lights.push_back(side);
+    }
+    std::string lights = std::to_string(count) + " light" +
+                         (count > 1 ? "s" : "");
+    run("light/shadeOne " + lights, [&](long long n) {
+      float sum = 0.0f;
+      for (long long i = 0; i < n; i++) {
+        size_t k = i & 1023;
+        sum += lighting.shadeOne(
+            {surfaces.nx[k], surfaces.ny[k], surfaces.nz[k]},
+            {surfaces.px[k], surfaces.py[k], surfaces.pz[k]});
+      }
+      sink = sum;
+    });
+    // Per surface, over batches of 1024.
+    run("light/shade " + lights, [&](long long n) {
+      for (long long i = 0; i < n; i += 1024)
+        lighting.shade(surfaces, lit.data());
+      sink = lit[0];
+    });
+  }
+
+  // Clipping against z = 0.1 with all, one and two vertices in front.
+  const char *clipNames[] = {"clip/Triangle_ClipAgainstPlane 3in",
+                             "clip/Triangle_ClipAgainstPlane 1in",
+                             "clip/Triangle_ClipAgainstPlane 2in"};
+  float clipZ[3][3] = {{1.0f, 2.0f, 3.0f},
+                       {1.0f, -1.0f, -2.0f},
+                       {1.0f, 2.0f, -1.0f}};
+  for (int c = 0; c < 3; c++) {
+    triangle tri;
+    for (int v = 0; v < 3; v++)
+      tri.p[v] = {unit(rng), unit(rng), clipZ[c][v]};
+    run(clipNames[c], [&](long long n) {
+      triangle out1, out2;
+      int total = 0;
+      for (long long i = 0; i < n; i++)
+        total += engine.Triangle_ClipAgainstPlane(
+            {0.0f, 0.0f, 0.1f}, {0.0f, 0.0f, 1.0f}, tri, out1, out2);
+      sink = total + out1.p[1].z;
+    });
+  }
+
+  // Lines and triangles at 1, 10, 100 pixels and full screen.
+  Framebuffer fb(1280, 720);
+  const float sizes[] = {1.0f, 10.0f, 100.0f, 0.0f};
+  const char *sizeNames[] = {"1px", "10px", "100px", "fullscreen"};
+  for (int s = 0; s < 4; s++) {
+    std::vector<vec3d> tris = screenTriangles(64, sizes[s], fb.width,
+                                              fb.height);
+    // Lines run along the first edge; a full-screen one is the diagonal.
+    std::vector<vec3d> lines;
+    for (int i = 0; i < 64; i++) {
+      vec3d a = tris[i * 3];
+      if (sizes[s] == 0.0f) {
+        lines.push_back({0.0f, 0.0f, 0.0f});
+        lines.push_back({fb.width - 1.0f, fb.height - 1.0f, 0.0f});
+      } else {
+        lines.push_back(a);
+        lines.push_back({a.x + sizes[s], a.y, 0.0f});
+      }
+    }
+    run(std::string("raster/line ") + sizeNames[s], [&](long long n) {
+      for (long long i = 0; i < n; i++) {
+        size_t l = (i & 63) * 2;
+        fb.line(lines[l].x, lines[l].y, lines[l + 1].x, lines[l + 1].y,
+                0xffffffff);
+      }
+      sink = fb.color[0];
+    });
+    run(std::string("raster/fillTriangle ") + sizeNames[s],
+        [&](long long n) {
+          for (long long i = 0; i < n; i++) {
+            size_t t = (i & 63) * 3;
+            fb.fillTriangle(tris[t], tris[t + 1], tris[t + 2], 0xffffffff);
+          }
+          sink = fb.color[0];
+        });
+    // Without the depth test, so every repetition does the same work.
+    RasterFlags flags;
+    flags.depthTest = false;
+    RasterFunction raster = selectRaster(flags);
+    run(std::string("raster/rasterTriangle ") + sizeNames[s],
+        [&](long long n) {
+          for (long long i = 0; i < n; i++) {
+            size_t t = (i & 63) * 3;
+            raster(fb, {tris[t].x, tris[t].y, tris[t].z, 1.0f},
+                   {tris[t + 1].x, tris[t + 1].y, tris[t + 1].z, 1.0f},
+                   {tris[t + 2].x, tris[t + 2].y, tris[t + 2].z, 1.0f},
+                   0xffffffff);
+          }
+          sink = fb.color[0];
+        });
+  }
+
+  // OBJ parsing, per file.
+  for (const char *file : {"res/VideoShip.obj", "res/teapot.obj"}) {
+    run(std::string("obj/") + file, [&](long long n) {
+      size_t total = 0;
+      for (long long i = 0; i < n; i++) {
+        mesh m;
+        if (!m.LoadFromObjectFile(file)) {
+          fail("Could not load a mesh under res/");
+        }
+        total += m.tris.size();
+      }
+      sink = total;
+    });
+  }
+
+  // Depth sorting, per call.
+  for (int count : {10000, 100000}) {
+    std::vector<triangle> tris(count);
+    std::uniform_real_distribution<float> z(0.0f, 1.0f);
+    for (auto &t : tris)
+      for (auto &p : t.p)
+        p.z = z(rng);
+    DepthSorter sorter;
+    std::vector<Uint32> order;
+    run("sort/DepthSorter " + std::to_string(count), [&](long long n) {
+      for (long long i = 0; i < n; i++)
+        sorter.sortBackToFront(tris, order);
+      sink = order[0];
+    });
+  }
+
+  // The overlay as main draws it, six lines and the graph, per frame. Its
+  // budget is 0.1 ms.
+  Hud hud;
+  for (int i = 0; i < Hud::HISTORY; i++)
+    hud.addFrame(10.0f + 10.0f * unit(rng));
+  run("hud/draw", [&](long long n) {
+    for (long long i = 0; i < n; i++) {
+      hud.begin(fb);
+      hud.text("FRAME %.2f MS %.0f FPS", 16.67f, 60.0f);
+      hud.text("SCENE %.2f MS AT %d%%", 4.25f, 100);
+      hud.text("PROJECT %.2f SORT %.2f", 1.5f, 0.25f);
+      hud.text("RASTER %.2f", 2.5f);
+      hud.text("TRIS %zu / %zu", (size_t)3120, (size_t)6320);
+      hud.text("MEM %llu MB HUD %.3f MS", 123ULL, 0.02f);
+      hud.graph(1000.0f / 60.0f);
+    }
+    sink = (float)fb.color[0];
+  });
+
+  if (!savePath.empty()) {
+    if (!saveBaseline(savePath, results)) {
+      fail("Could not write the baseline");
+    }
+    std::cout << "saved " << results.size() << " results to " << savePath
+              << std::endl;
+  }
+  if (!comparePath.empty()) {
+    std::cout << regressions << " regression(s) beyond " << threshold
+              << "% against " << comparePath << std::endl;
+  }
+  return regressions > 0 ? 1 : 0;
+}
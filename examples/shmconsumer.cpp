@@ -0,0 +1,98 @@
+// Sample consumer for the shared memory output (main --shm /name). Reads
+// each frame in place and prints once a second how many frames arrived,
+// how many it skipped, and the average brightness of the newest one.
+#include "shmring.hpp"
+#include "timer.hpp"
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cerr << "Usage: shmconsumer /name [--frames n] [--snapshot out.ppm]"
+              << std::endl;
+    return 1;
+  }
+  long limit = -1;
+  const char *snapshot = nullptr;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      limit = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+      snapshot = argv[++i];
+    } else {
+      std::cerr << "Unknown argument: " << argv[i] << std::endl;
+      return 1;
+    }
+  }
+
+  ShmRingReader reader;
+  if (!reader.open(argv[1])) {
+    std::cerr << "Could not open " << argv[1] << std::endl;
+    return 1;
+  }
+
+  ShmRingReader::Frame frame;
+  long received = 0, skipped = 0, torn = 0, second = 0;
+  double brightness = 0.0;
+  Timer report;
+  while (limit < 0 || received < limit) {
+    Uint64 previous = frame.sequence;
+    if (!reader.wait(previous, 2000, frame)) {
+      std::cerr << "no frame for 2 s, stopping" << std::endl;
+      break;
+    }
+    if (previous)
+      skipped += frame.sequence - previous - 1;
+
+    Uint64 sum = 0;
+    size_t pixels = (size_t)frame.width * frame.height;
+    for (size_t i = 0; i < pixels; i++) {
+      Uint32 c = frame.pixels[i];
+      sum += (c >> 24) + (c >> 16 & 0xff) + (c >> 8 & 0xff);
+    }
+    // The producer may have lapped us while we were reading.
+    if (!reader.valid(frame)) {
+      torn++;
+      continue;
+    }
+    received++;
+    second++;
+    brightness = pixels ? sum / (3.0 * pixels) : 0.0;
+
+    if (report.elapsedMs() >= 1000.0f) {
+      std::cout << "frame " << frame.sequence << " (" << frame.width << "x"
+                << frame.height << "): " << second << " frames/s, "
+                << skipped << " skipped, " << torn
+                << " torn, brightness " << brightness << std::endl;
+      second = 0;
+      report.reset();
+    }
+  }
+
+  if (snapshot && received) {
+    // Copied out first, so a frame overwritten mid-write is retried.
+    std::vector<Uint32> copy;
+    do {
+      reader.wait(frame.sequence - 1, 2000, frame);
+      copy.assign(frame.pixels,
+                  frame.pixels + (size_t)frame.width * frame.height);
+    } while (!reader.valid(frame));
+    FILE *out = fopen(snapshot, "wb");
+    if (!out) {
+      std::cerr << "Could not open " << snapshot << std::endl;
+      return 1;
+    }
+    fprintf(out, "P6\n%d %d\n255\n", frame.width, frame.height);
+    for (Uint32 c : copy) {
+      Uint8 rgb[3] = {(Uint8)(c >> 24), (Uint8)(c >> 16), (Uint8)(c >> 8)};
+      fwrite(rgb, 1, 3, out);
+    }
+    fclose(out);
+  }
+
+  std::cout << received << " frames read, " << skipped << " skipped, "
+            << torn << " torn" << std::endl;
+  return 0;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "compactmesh.hpp"
+#include "mesh.hpp"
+#include "threadpool.hpp"
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+
+typedef int MeshHandle;
+
+// Loads and prepares meshes on background threads so the first frame does
+// not wait for them.
+//
+// load() returns a handle straight away. A worker parses the file, computes
+// its bounds, and flips the entry's state with a release store; publish(),
+// called once per frame on the main thread, picks finished entries up with
+// acquire loads. Nothing on the render path takes a lock, and get() keeps
+// returning null until the frame in which the mesh was published.
+class AssetManager {
+  enum State { LOADING, LOADED, FAILED };
+
+  struct Entry {
+    std::string path;
+    // Written by the worker before state; only one of them is set.
+    std::shared_ptr<const mesh> loaded;
+    std::shared_ptr<const CompactMesh> compacted;
+    std::atomic<int> state{LOADING};
+    // Main thread only.
+    const mesh *published = nullptr;
+    const CompactMesh *publishedCompact = nullptr;
+    bool reported = false;
+
+    Entry(const std::string &path) : path(path) {}
+  };
+
+  // A deque never moves its elements, so workers can hold on to an Entry
+  // while the main thread appends more.
+  std::deque<Entry> entries;
+  std::unique_ptr<ThreadPool> pool;
+  int pending = 0;
+
+public:
+  int threads;
+  // Keep meshes loaded from now on only in CompactMesh form; the triangle
+  // soup is dropped once converted.
+  bool compact = false;
+
+  AssetManager(int threads = 0) { this->threads = threads; }
+
+  MeshHandle load(const std::string &path) {
+    // Started lazily so engines that never stream assets own no threads.
+    if (!this->pool)
+      this->pool = std::make_unique<ThreadPool>(this->threads);
+
+    this->entries.emplace_back(path);
+    Entry *entry = &this->entries.back();
+    this->pending++;
+    bool compact = this->compact;
+    this->pool->submit([entry, compact](int) {
+      auto loaded = std::make_shared<mesh>();
+      if (loaded->LoadFromObjectFile(entry->path)) {
+        loaded->ComputeBounds();
+        if (compact) {
+          auto compacted = std::make_shared<CompactMesh>();
+          compacted->Build(*loaded);
+          entry->compacted = compacted;
+        } else {
+          entry->loaded = loaded;
+        }
+        entry->state.store(LOADED, std::memory_order_release);
+      } else {
+        entry->state.store(FAILED, std::memory_order_release);
+      }
+    });
+    return (MeshHandle)this->entries.size() - 1;
+  }
+
+  // Makes meshes that finished since the last call visible to get().
+  // Returns how many were published.
+  int publish() {
+    int published = 0;
+    for (auto &entry : this->entries) {
+      if (entry.published != nullptr || entry.publishedCompact != nullptr ||
+          entry.reported)
+        continue;
+      int state = entry.state.load(std::memory_order_acquire);
+      if (state == LOADED) {
+        entry.published = entry.loaded.get();
+        entry.publishedCompact = entry.compacted.get();
+        published++;
+        this->pending--;
+      } else if (state == FAILED) {
+        std::cerr << "Could not load " << entry.path << std::endl;
+        entry.reported = true;
+        this->pending--;
+      }
+    }
+    return published;
+  }
+
+  // Null until the mesh is loaded and published, and forever if it failed.
+  const mesh *get(MeshHandle handle) {
+    if (handle < 0 || handle >= (int)this->entries.size())
+      return nullptr;
+    return this->entries[handle].published;
+  }
+
+  // As get(), for meshes loaded while `compact` was set.
+  const CompactMesh *getCompact(MeshHandle handle) {
+    if (handle < 0 || handle >= (int)this->entries.size())
+      return nullptr;
+    return this->entries[handle].publishedCompact;
+  }
+
+  // True once every requested asset has been published or has failed.
+  bool settled() { return this->pending == 0; }
+
+  // Blocks until everything requested so far is loaded, then publishes it.
+  void waitAll() {
+    if (this->pool)
+      this->pool->wait();
+    this->publish();
+  }
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "engine.hpp"
+#include "image.hpp"
+#include "input.hpp"
+#include "meshcache.hpp"
+#include "threadpool.hpp"
+#include "timer.hpp"
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// One thumbnail to render. Manifest lines look like
+//
+//   mesh.obj out.ppm 256x256 camX camY camZ yaw
+//
+// with blank lines and lines starting with '#' ignored.
+struct BatchJob {
+  std::string meshFile;
+  std::string outputFile;
+  int width;
+  int height;
+  vec3d camera;
+  float yaw;
+
+  int line;
+  std::string error;
+};
+
+// Parses the manifest. Malformed lines become jobs that already carry an
+// error, so they are reported with the rest instead of stopping the batch.
+inline bool parseBatchManifest(const std::string &path,
+                               std::vector<BatchJob> &jobs) {
+  std::ifstream f(path);
+  if (!f.is_open())
+    return false;
+
+  std::string text;
+  int lineNumber = 0;
+  while (std::getline(f, text)) {
+    lineNumber++;
+    size_t start = text.find_first_not_of(" \t\r");
+    if (start == std::string::npos || text[start] == '#')
+      continue;
+
+    std::stringstream s(text);
+    BatchJob job;
+    std::string size;
+    job.line = lineNumber;
+    s >> job.meshFile >> job.outputFile >> size >> job.camera.x >>
+        job.camera.y >> job.camera.z >> job.yaw;
+    if (s.fail()) {
+      job.error = "malformed manifest line";
+    } else if (sscanf(size.c_str(), "%dx%d", &job.width, &job.height) != 2 ||
+               job.width < 1 || job.height < 1 || job.width > 16384 ||
+               job.height > 16384) {
+      job.error = "bad resolution '" + size + "'";
+    }
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+// Renders every job on a pool of worker threads. Each worker keeps its own
+// headless engine (and so its own framebuffer), recreated only when the
+// resolution changes; meshes are shared between workers through a cache.
+// Returns the number of failed jobs.
+inline int runBatch(std::vector<BatchJob> &jobs, int threads, bool msaa) {
+  ThreadPool pool(threads);
+  MeshCache cache;
+  std::vector<std::unique_ptr<olcEngine3D>> engines(pool.size());
+  std::vector<std::vector<Uint8>> scratch(pool.size());
+  Keyboard *keyboard = initKeyboard();
+
+  Timer timer;
+  for (auto &job : jobs) {
+    if (!job.error.empty())
+      continue;
+    pool.submit([&, keyboard](int worker) {
+      std::shared_ptr<const mesh> model = cache.get(job.meshFile);
+      if (!model) {
+        job.error = "could not load " + job.meshFile;
+        return;
+      }
+
+      std::unique_ptr<olcEngine3D> &engine = engines[worker];
+      if (!engine || engine->windowWidth != job.width ||
+          engine->windowHeight != job.height) {
+        engine = std::make_unique<olcEngine3D>(job.width, job.height, true);
+        engine->bMsaa = msaa;
+      }
+      engine->pSharedMesh = model;
+      engine->OnUserCreate();
+      engine->SetCamera(job.camera, job.yaw);
+      engine->OnUserUpdate(0.0f, keyboard);
+      if (!writePpm(job.outputFile.c_str(), engine->color.data(),
+                    engine->width, engine->height, scratch[worker])) {
+        job.error = "could not write " + job.outputFile;
+      }
+      engine->pSharedMesh = nullptr;
+    });
+  }
+  pool.wait();
+  float elapsedMs = timer.elapsedMs();
+  free(keyboard);
+
+  int failed = 0;
+  for (auto &job : jobs) {
+    if (!job.error.empty()) {
+      std::cerr << "line " << job.line << ": " << job.error << std::endl;
+      failed++;
+    }
+  }
+  int rendered = (int)jobs.size() - failed;
+  std::cout << "rendered " << rendered << "/" << jobs.size() << " jobs on "
+            << pool.size() << " threads in " << elapsedMs << " ms ("
+            << rendered * 1000.0f / elapsedMs << " jobs/s, " << cache.loads
+            << " meshes loaded, " << cache.hits << " cache hits)"
+            << std::endl;
+  return failed;
+}
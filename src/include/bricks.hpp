@@ -0,0 +1,440 @@
+#pragma once
+
+#include "matrix.hpp"
+#include "vec3d.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// On-disk layout for meshes too large to hold in memory ("brick files"):
+//
+//   BrickFileHeader
+//   BrickRecord[brickCount]
+//   payloads, each starting on a BRICK_ALIGN boundary
+//
+// A payload is `triangles` records of nine floats, the xyz of each vertex.
+// Bricks are the occupied cells of a uniform grid over the mesh bounds, so
+// each one holds a spatially compact set of triangles; its record carries
+// their tight bounds. Aligning payloads to pages lets a brick be paged in
+// and dropped on its own.
+static const Uint64 BRICK_ALIGN = 4096;
+static const char BRICK_MAGIC[8] = {'T', 'A', 'R', 'B', 'R', 'K', '0', '1'};
+
+struct BrickFileHeader {
+  char magic[8];
+  Uint32 brickCount;
+  Uint32 reserved;
+};
+
+struct BrickRecord {
+  float boundsMin[3];
+  float boundsMax[3];
+  Uint64 offset;
+  Uint64 triangles;
+};
+
+// Calls vertex(x, y, z) and face(a, b, c) for every line of an OBJ file,
+// with the same rules as loadObjFile() except that relative (negative) face
+// indices are not supported; face indices are passed through 1-based and
+// unchecked. Streams the file instead of holding it, so it suits inputs
+// larger than memory. Returns false if the file cannot be read, has an
+// overlong line, or face() returns false.
+template <typename Vertex, typename Face>
+bool scanObjFile(const std::string &path, Vertex vertex, Face face) {
+  std::ifstream f(path);
+  if (!f.is_open())
+    return false;
+
+  while (!f.eof()) {
+    char line[128];
+    f.getline(line, 128);
+    if (f.fail() && !f.eof())
+      return false;
+
+    if (line[0] == 'v' && line[1] == ' ') {
+      float x = 0.0f, y = 0.0f, z = 0.0f;
+      sscanf(line + 2, "%f %f %f", &x, &y, &z);
+      vertex(x, y, z);
+    }
+    if (line[0] == 'f' && line[1] == ' ') {
+      int a, b, c;
+      if (sscanf(line + 2, "%d %d %d", &a, &b, &c) != 3 || !face(a, b, c))
+        return false;
+    }
+  }
+  return true;
+}
+
+// Converts an OBJ file into a brick file of about `trianglesPerBrick`
+// triangles per brick. Only the vertex positions (12 bytes a vertex) are
+// held in memory: the OBJ is read three times, for the bounds, the cell
+// counts, and finally to write each triangle straight into its slot in the
+// mapped output.
+inline bool buildBrickFile(const std::string &objPath,
+                           const std::string &brickPath,
+                           int trianglesPerBrick) {
+  std::vector<float> positions;
+  float lo[3] = {std::numeric_limits<float>::max(),
+                 std::numeric_limits<float>::max(),
+                 std::numeric_limits<float>::max()};
+  float hi[3] = {-lo[0], -lo[1], -lo[2]};
+  Uint64 triangles = 0;
+  bool ok = scanObjFile(
+      objPath,
+      [&](float x, float y, float z) {
+        float v[3] = {x, y, z};
+        for (int i = 0; i < 3; i++) {
+          positions.push_back(v[i]);
+          lo[i] = std::min(lo[i], v[i]);
+          hi[i] = std::max(hi[i], v[i]);
+        }
+      },
+      [&](int, int, int) {
+        triangles++;
+        return true;
+      });
+  if (!ok || triangles == 0 || trianglesPerBrick < 1)
+    return false;
+
+  // Split the longest cell edge until there are enough cells; this copes
+  // with flat meshes where a volume-based cell size would not.
+  Uint64 targetCells = std::max<Uint64>(1, triangles / trianglesPerBrick);
+  int dims[3] = {1, 1, 1};
+  while ((Uint64)dims[0] * dims[1] * dims[2] < targetCells) {
+    int axis = 0;
+    for (int i = 1; i < 3; i++)
+      if ((hi[i] - lo[i]) / dims[i] > (hi[axis] - lo[axis]) / dims[axis])
+        axis = i;
+    dims[axis] *= 2;
+  }
+  size_t cells = (size_t)dims[0] * dims[1] * dims[2];
+  Uint64 vertexCount = positions.size() / 3;
+
+  auto cellOf = [&](int a, int b, int c) {
+    size_t cell = 0;
+    for (int i = 0; i < 3; i++) {
+      float centroid = (positions[(size_t)(a - 1) * 3 + i] +
+                        positions[(size_t)(b - 1) * 3 + i] +
+                        positions[(size_t)(c - 1) * 3 + i]) /
+                       3.0f;
+      float extent = hi[i] - lo[i];
+      int d = extent > 0.0f ? (int)((centroid - lo[i]) / extent * dims[i]) : 0;
+      cell = cell * dims[i] + std::clamp(d, 0, dims[i] - 1);
+    }
+    return cell;
+  };
+  auto valid = [&](int a, int b, int c) {
+    return a >= 1 && b >= 1 && c >= 1 && (Uint64)a <= vertexCount &&
+           (Uint64)b <= vertexCount && (Uint64)c <= vertexCount;
+  };
+
+  std::vector<Uint64> counts(cells, 0);
+  ok = scanObjFile(
+      objPath, [](float, float, float) {},
+      [&](int a, int b, int c) {
+        if (!valid(a, b, c))
+          return false;
+        counts[cellOf(a, b, c)]++;
+        return true;
+      });
+  if (!ok)
+    return false;
+
+  // Occupied cells become bricks; counts is reused as the brick index.
+  std::vector<BrickRecord> records;
+  Uint64 offset = sizeof(BrickFileHeader);
+  for (size_t cell = 0; cell < cells; cell++) {
+    if (counts[cell] == 0)
+      continue;
+    BrickRecord record = {};
+    record.triangles = counts[cell];
+    counts[cell] = records.size();
+    records.push_back(record);
+  }
+  offset += records.size() * sizeof(BrickRecord);
+  for (auto &record : records) {
+    offset = (offset + BRICK_ALIGN - 1) / BRICK_ALIGN * BRICK_ALIGN;
+    record.offset = offset;
+    offset += record.triangles * 9 * sizeof(float);
+    for (int i = 0; i < 3; i++) {
+      record.boundsMin[i] = std::numeric_limits<float>::max();
+      record.boundsMax[i] = -std::numeric_limits<float>::max();
+    }
+  }
+
+  int fd = open(brickPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  if (ftruncate(fd, (off_t)offset) != 0) {
+    close(fd);
+    return false;
+  }
+  void *mapped =
+      mmap(nullptr, offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return false;
+  Uint8 *base = (Uint8 *)mapped;
+
+  std::vector<Uint64> written(records.size(), 0);
+  ok = scanObjFile(
+      objPath, [](float, float, float) {},
+      [&](int a, int b, int c) {
+        BrickRecord &record = records[counts[cellOf(a, b, c)]];
+        size_t n = &record - records.data();
+        float *out = (float *)(base + record.offset) + written[n]++ * 9;
+        int index[3] = {a, b, c};
+        for (int v = 0; v < 3; v++) {
+          for (int i = 0; i < 3; i++) {
+            float p = positions[(size_t)(index[v] - 1) * 3 + i];
+            out[v * 3 + i] = p;
+            record.boundsMin[i] = std::min(record.boundsMin[i], p);
+            record.boundsMax[i] = std::max(record.boundsMax[i], p);
+          }
+        }
+        return true;
+      });
+
+  BrickFileHeader header = {};
+  memcpy(header.magic, BRICK_MAGIC, sizeof(header.magic));
+  header.brickCount = ok ? (Uint32)records.size() : 0;
+  memcpy(base, &header, sizeof(header));
+  memcpy(base + sizeof(header), records.data(),
+         records.size() * sizeof(BrickRecord));
+  munmap(mapped, offset);
+  return ok;
+}
+
+// Pages the bricks of a brick file in and out under a fixed memory budget.
+//
+// The file is mapped read-only and the mapping itself is the cache: paging a
+// brick in asks the kernel to read it ahead (MADV_WILLNEED) and it becomes
+// drawable once mincore() reports all of its pages in memory, so the render
+// loop never blocks on disk. Each frame the bricks whose bounding sphere
+// meets the view frustum are ranked by distance from the camera and the
+// nearest are paged in first; when the budget is full the least recently
+// visible brick is dropped (MADV_DONTNEED). Bricks seen this frame are never
+// evicted for farther ones.
+class BrickStreamer {
+  enum State { ON_DISK, LOADING, RESIDENT };
+
+  struct Brick {
+    vec3d center;
+    float radius;
+    Uint64 offset;
+    Uint64 bytes;
+    Uint64 triangles;
+    State state = ON_DISK;
+    Uint64 lastUsed = 0;
+    std::list<int>::iterator lru;
+  };
+
+  Uint8 *base = nullptr;
+  size_t mappedBytes = 0;
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  std::vector<Brick> bricks;
+  std::list<int> lru; // Paged-in bricks, most recently visible first.
+  std::vector<std::pair<float, int>> candidates;
+  std::vector<unsigned char> pageBits;
+  Uint64 frame = 0;
+
+  void evict(int n) {
+    Brick &brick = this->bricks[n];
+    // Only whole pages inside the brick can be dropped.
+    size_t start = (brick.offset + this->pageSize - 1) / this->pageSize *
+                   this->pageSize;
+    size_t end = (brick.offset + brick.bytes) / this->pageSize * this->pageSize;
+    if (end > start)
+      madvise(this->base + start, end - start, MADV_DONTNEED);
+    brick.state = ON_DISK;
+    this->lru.erase(brick.lru);
+    this->residentBytes -= brick.bytes;
+    this->evictions++;
+  }
+
+  bool makeRoom(Uint64 bytes) {
+    while (this->residentBytes + bytes > this->budgetBytes) {
+      if (this->lru.empty() ||
+          this->bricks[this->lru.back()].lastUsed == this->frame)
+        return false;
+      this->evict(this->lru.back());
+    }
+    return true;
+  }
+
+  bool inMemory(const Brick &brick) {
+    size_t start = brick.offset / this->pageSize * this->pageSize;
+    size_t end = brick.offset + brick.bytes;
+    size_t pages = (end - start + this->pageSize - 1) / this->pageSize;
+    this->pageBits.resize(pages);
+    if (mincore(this->base + start, end - start, this->pageBits.data()) != 0)
+      return false;
+    for (unsigned char bits : this->pageBits)
+      if (!(bits & 1))
+        return false;
+    return true;
+  }
+
+public:
+  Uint64 budgetBytes;
+  // Bounds the read-ahead issued per frame so a sudden turn does not queue
+  // the whole budget at once.
+  Uint64 pageInBytesPerFrame = 32 << 20;
+
+  // Bricks to draw this frame, nearest first.
+  std::vector<int> drawable;
+  int visibleBricks = 0;
+  Uint64 residentBytes = 0;
+  Uint64 peakResidentBytes = 0;
+  Uint64 pageIns = 0;
+  Uint64 evictions = 0;
+
+  BrickStreamer(Uint64 budgetBytes) { this->budgetBytes = budgetBytes; }
+  BrickStreamer(const BrickStreamer &) = delete;
+  BrickStreamer &operator=(const BrickStreamer &) = delete;
+  ~BrickStreamer() {
+    if (this->base)
+      munmap(this->base, this->mappedBytes);
+  }
+
+  bool open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 ||
+        (size_t)info.st_size < sizeof(BrickFileHeader)) {
+      close(fd);
+      return false;
+    }
+    void *mapped =
+        mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+      return false;
+    this->base = (Uint8 *)mapped;
+    this->mappedBytes = info.st_size;
+    // Paging is driven by visibility, not by access order.
+    madvise(this->base, this->mappedBytes, MADV_RANDOM);
+
+    BrickFileHeader header;
+    memcpy(&header, this->base, sizeof(header));
+    size_t tableEnd =
+        sizeof(header) + (size_t)header.brickCount * sizeof(BrickRecord);
+    if (memcmp(header.magic, BRICK_MAGIC, sizeof(header.magic)) != 0 ||
+        header.brickCount == 0 || tableEnd > this->mappedBytes)
+      return false;
+
+    this->bricks.resize(header.brickCount);
+    for (Uint32 n = 0; n < header.brickCount; n++) {
+      BrickRecord record;
+      memcpy(&record, this->base + sizeof(header) + n * sizeof(record),
+             sizeof(record));
+      Brick &brick = this->bricks[n];
+      brick.offset = record.offset;
+      brick.triangles = record.triangles;
+      brick.bytes = record.triangles * 9 * sizeof(float);
+      if (record.offset % BRICK_ALIGN != 0 || record.offset < tableEnd ||
+          record.triangles > this->mappedBytes ||
+          brick.offset + brick.bytes > this->mappedBytes)
+        return false;
+      float r2 = 0.0f;
+      float c[3];
+      for (int i = 0; i < 3; i++) {
+        c[i] = (record.boundsMin[i] + record.boundsMax[i]) * 0.5f;
+        float h = (record.boundsMax[i] - record.boundsMin[i]) * 0.5f;
+        r2 += h * h;
+      }
+      brick.center = {c[0], c[1], c[2]};
+      brick.radius = sqrtf(r2);
+    }
+    return true;
+  }
+
+  int brickCount() { return (int)this->bricks.size(); }
+  Uint64 triangleCount(int n) { return this->bricks[n].triangles; }
+  const float *triangles(int n) {
+    return (const float *)(this->base + this->bricks[n].offset);
+  }
+
+  // Culls and ranks the bricks for one frame and pages them accordingly.
+  // `modelView` takes model space to view space, where the camera sits at
+  // the origin looking down +z; `proj` is the engine's projection. With
+  // `blocking` the visible bricks are read in before returning, ignoring
+  // pageInBytesPerFrame, for offline rendering.
+  void update(const mat4x4 &modelView, const mat4x4 &proj, float fNear,
+              bool blocking) {
+    this->frame++;
+    this->drawable.clear();
+    this->candidates.clear();
+
+    const float px = proj.m[0][0], py = proj.m[1][1];
+    const float kx = sqrtf(px * px + 1.0f), ky = sqrtf(py * py + 1.0f);
+    const mat4x4 &m = modelView;
+    for (int n = 0; n < (int)this->bricks.size(); n++) {
+      const vec3d &c = this->bricks[n].center;
+      float r = this->bricks[n].radius;
+      float x = c.x * m.m[0][0] + c.y * m.m[1][0] + c.z * m.m[2][0] + m.m[3][0];
+      float y = c.x * m.m[0][1] + c.y * m.m[1][1] + c.z * m.m[2][1] + m.m[3][1];
+      float z = c.x * m.m[0][2] + c.y * m.m[1][2] + c.z * m.m[2][2] + m.m[3][2];
+      // Sphere against the near plane and the four side planes, whose
+      // normals are (+-px, 0, -1) and (0, +-py, -1) before normalising.
+      if (z + r <= fNear || px * x - z > r * kx || -px * x - z > r * kx ||
+          py * y - z > r * ky || -py * y - z > r * ky)
+        continue;
+      this->candidates.push_back({x * x + y * y + z * z, n});
+    }
+    std::sort(this->candidates.begin(), this->candidates.end());
+    this->visibleBricks = (int)this->candidates.size();
+
+    Uint64 requested = 0;
+    for (auto &candidate : this->candidates) {
+      int n = candidate.second;
+      Brick &brick = this->bricks[n];
+      if (brick.state == ON_DISK) {
+        if (!blocking && requested > 0 &&
+            requested + brick.bytes > this->pageInBytesPerFrame)
+          continue;
+        if (!this->makeRoom(brick.bytes))
+          continue;
+        size_t start = brick.offset / this->pageSize * this->pageSize;
+        madvise(this->base + start, brick.offset + brick.bytes - start,
+                MADV_WILLNEED);
+        brick.state = LOADING;
+        this->lru.push_front(n);
+        brick.lru = this->lru.begin();
+        this->residentBytes += brick.bytes;
+        this->pageIns++;
+        requested += brick.bytes;
+        if (blocking) {
+          Uint8 sum = 0;
+          for (size_t p = start; p < brick.offset + brick.bytes;
+               p += this->pageSize)
+            sum += *(volatile const Uint8 *)(this->base + p);
+          (void)sum;
+          brick.state = RESIDENT;
+        }
+      }
+      if (brick.state == LOADING && this->inMemory(brick))
+        brick.state = RESIDENT;
+
+      brick.lastUsed = this->frame;
+      this->lru.splice(this->lru.begin(), this->lru, brick.lru);
+      if (brick.state == RESIDENT)
+        this->drawable.push_back(n);
+    }
+    this->peakResidentBytes =
+        std::max(this->peakResidentBytes, this->residentBytes);
+  }
+};
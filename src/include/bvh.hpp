@@ -0,0 +1,682 @@
+#pragma once
+
+#include "mesh.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+struct BvhHit {
+  // Distance along the ray, in multiples of its direction vector.
+  float t;
+  // Barycentric weights of the triangle's second and third vertices.
+  float u, v;
+  // Index of the triangle in the mesh the BVH was built from.
+  Uint32 triangle;
+};
+
+// Bounding volume hierarchy over a mesh's triangles for ray queries.
+//
+// The tree is built as a binary tree with binned surface area heuristic
+// splits, then collapsed into 4-wide nodes stored in one flat array in
+// depth-first order. A node keeps its children's bounds as structure of
+// arrays, so a ray is tested against all four boxes at once with SSE2.
+// Triangles are copied into leaf order as a vertex plus two edges, so a
+// leaf's triangles are contiguous and ready for the intersection test.
+//
+// Update() follows edits to the mesh without a rebuild. Moved triangles
+// are rewritten in place and the boxes above them refitted, bottom up;
+// removed ones are emptied. Added triangles go to a short list after the
+// leaves that every query tests in full, until there are enough of them,
+// or of removed ones, to be worth a rebuild.
+class Bvh {
+  static constexpr Uint32 EMPTY = 0xffffffff;
+  static const int BINS = 16;
+  static const int MAX_LEAF = 4;
+  // Deeper than this the build falls back to median splits, so the binary
+  // tree is at most MAX_DEPTH + 32 levels and a traversal pushes fewer
+  // than three entries per level.
+  static const int MAX_DEPTH = 40;
+  static const int STACK_SIZE = 256;
+  // Update() rebuilds once triangles added or removed since the last build
+  // reach 1/REBUILD_SHARE of it, plus REBUILD_SLACK.
+  static const Uint32 REBUILD_SHARE = 8;
+  static const Uint32 REBUILD_SLACK = 64;
+
+  struct Node {
+    float minX[4], minY[4], minZ[4];
+    float maxX[4], maxY[4], maxZ[4];
+    // A node index, or the first triangle of a leaf when count > 0.
+    Uint32 child[4];
+    Uint32 count[4];
+  };
+
+  struct Box {
+    float lo[3] = {std::numeric_limits<float>::max(),
+                   std::numeric_limits<float>::max(),
+                   std::numeric_limits<float>::max()};
+    float hi[3] = {-std::numeric_limits<float>::max(),
+                   -std::numeric_limits<float>::max(),
+                   -std::numeric_limits<float>::max()};
+
+    void grow(const float *p) {
+      for (int i = 0; i < 3; i++) {
+        lo[i] = std::min(lo[i], p[i]);
+        hi[i] = std::max(hi[i], p[i]);
+      }
+    }
+    void grow(const Box &b) {
+      for (int i = 0; i < 3; i++) {
+        lo[i] = std::min(lo[i], b.lo[i]);
+        hi[i] = std::max(hi[i], b.hi[i]);
+      }
+    }
+    float area() const {
+      float d[3];
+      for (int i = 0; i < 3; i++)
+        d[i] = std::max(hi[i] - lo[i], 0.0f);
+      return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+    }
+  };
+
+  struct BuildNode {
+    Box box;
+    int left = -1, right = -1;
+    Uint32 first = 0, count = 0;
+  };
+
+  std::vector<Node> nodes;
+  // Per triangle in leaf order: v0, v1 - v0, v2 - v0. Those from
+  // leafCount on were added since the build and are in no leaf; empty
+  // entries, removed from the mesh, have zero edges and id EMPTY.
+  std::vector<float> tris;
+  std::vector<Uint32> ids;
+  Uint32 leafCount = 0;
+
+  // For Update(): each node's parent, the node holding each leaf entry and
+  // each triangle's entry.
+  std::vector<Uint32> parents;
+  std::vector<Uint32> leafNodes;
+  std::vector<Uint32> entryOf;
+  Uint32 removedCount = 0;
+  Uint64 revision = 0;
+  std::vector<Uint8> queued;
+  std::vector<Uint32> refitQueue;
+
+  // Scratch for the build.
+  std::vector<BuildNode> buildNodes;
+  std::vector<Box> triBoxes;
+  std::vector<float> centroids;
+
+  int buildRecursive(Uint32 first, Uint32 count, int depth) {
+    int index = (int)this->buildNodes.size();
+    this->buildNodes.emplace_back();
+    Box box, centroidBox;
+    for (Uint32 i = first; i < first + count; i++) {
+      box.grow(this->triBoxes[this->ids[i]]);
+      centroidBox.grow(&this->centroids[this->ids[i] * 3]);
+    }
+    this->buildNodes[index].box = box;
+
+    auto makeLeaf = [&]() {
+      this->buildNodes[index].first = first;
+      this->buildNodes[index].count = count;
+      return index;
+    };
+    if (count <= (Uint32)MAX_LEAF)
+      return makeLeaf();
+
+    // Cost in units of one intersection test, with a traversal step
+    // counted the same; areas are relative to this node's.
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1, bestSplit = 0;
+    float invArea = 1.0f / std::max(box.area(), 1e-30f);
+    for (int axis = 0; axis < 3 && depth < MAX_DEPTH; axis++) {
+      float lo = centroidBox.lo[axis], hi = centroidBox.hi[axis];
+      if (!(hi > lo))
+        continue;
+      Box bins[BINS];
+      Uint32 binCount[BINS] = {};
+      float scale = BINS / (hi - lo);
+      for (Uint32 i = first; i < first + count; i++) {
+        Uint32 id = this->ids[i];
+        int b = std::min(BINS - 1,
+                         (int)((this->centroids[id * 3 + axis] - lo) * scale));
+        bins[b].grow(this->triBoxes[id]);
+        binCount[b]++;
+      }
+      // Sweep from the right, then from the left.
+      float rightArea[BINS];
+      Uint32 rightCount[BINS];
+      Box acc;
+      Uint32 n = 0;
+      for (int b = BINS - 1; b > 0; b--) {
+        acc.grow(bins[b]);
+        n += binCount[b];
+        rightArea[b] = n ? acc.area() : 0.0f;
+        rightCount[b] = n;
+      }
+      acc = Box();
+      n = 0;
+      for (int b = 0; b < BINS - 1; b++) {
+        acc.grow(bins[b]);
+        n += binCount[b];
+        if (n == 0 || rightCount[b + 1] == 0)
+          continue;
+        float cost = 1.0f + (acc.area() * n +
+                             rightArea[b + 1] * rightCount[b + 1]) *
+                                invArea;
+        if (cost < bestCost) {
+          bestCost = cost;
+          bestAxis = axis;
+          bestSplit = b + 1;
+        }
+      }
+    }
+
+    Uint32 mid;
+    if (bestAxis >= 0) {
+      if (bestCost >= (float)count && count <= (Uint32)(4 * MAX_LEAF))
+        return makeLeaf();
+      float lo = centroidBox.lo[bestAxis];
+      float scale = BINS / (centroidBox.hi[bestAxis] - lo);
+      Uint32 *split = std::partition(
+          &this->ids[first], &this->ids[first] + count, [&](Uint32 id) {
+            int b = std::min(
+                BINS - 1,
+                (int)((this->centroids[id * 3 + bestAxis] - lo) * scale));
+            return b < bestSplit;
+          });
+      mid = (Uint32)(split - &this->ids[0]);
+    } else {
+      // All centroids coincide, or the tree is too deep: halve the range
+      // along the widest axis.
+      int axis = 0;
+      for (int i = 1; i < 3; i++)
+        if (centroidBox.hi[i] - centroidBox.lo[i] >
+            centroidBox.hi[axis] - centroidBox.lo[axis])
+          axis = i;
+      mid = first + count / 2;
+      std::nth_element(&this->ids[first], &this->ids[mid],
+                       &this->ids[first] + count, [&](Uint32 a, Uint32 b) {
+                         return this->centroids[a * 3 + axis] <
+                                this->centroids[b * 3 + axis];
+                       });
+    }
+
+    int left = this->buildRecursive(first, mid - first, depth + 1);
+    int right = this->buildRecursive(mid, first + count - mid, depth + 1);
+    this->buildNodes[index].left = left;
+    this->buildNodes[index].right = right;
+    return index;
+  }
+
+  // Turns the binary subtree at `b` into 4-wide nodes by repeatedly opening
+  // the inner child with the largest surface area.
+  Uint32 collapse(int b, Uint32 parent) {
+    int children[4] = {this->buildNodes[b].left, this->buildNodes[b].right};
+    int n = 2;
+    while (n < 4) {
+      int open = -1;
+      float openArea = -1.0f;
+      for (int i = 0; i < n; i++) {
+        const BuildNode &c = this->buildNodes[children[i]];
+        if (c.count == 0 && c.box.area() > openArea) {
+          open = i;
+          openArea = c.box.area();
+        }
+      }
+      if (open < 0)
+        break;
+      int opened = children[open];
+      children[open] = this->buildNodes[opened].left;
+      children[n++] = this->buildNodes[opened].right;
+    }
+
+    Uint32 index = (Uint32)this->nodes.size();
+    this->nodes.emplace_back();
+    this->parents.push_back(parent);
+    for (int i = 0; i < 4; i++) {
+      Uint32 child = EMPTY, count = 0;
+      Box box;
+      if (i < n) {
+        const BuildNode &c = this->buildNodes[children[i]];
+        box = c.box;
+        if (c.count > 0) {
+          child = c.first;
+          count = c.count;
+          std::fill(this->leafNodes.begin() + c.first,
+                    this->leafNodes.begin() + c.first + c.count, index);
+        } else {
+          child = this->collapse(children[i], index);
+        }
+      } else {
+        box.lo[0] = box.lo[1] = box.lo[2] = 0.0f;
+        box.hi[0] = box.hi[1] = box.hi[2] = 0.0f;
+      }
+      Node &node = this->nodes[index];
+      node.minX[i] = box.lo[0];
+      node.minY[i] = box.lo[1];
+      node.minZ[i] = box.lo[2];
+      node.maxX[i] = box.hi[0];
+      node.maxY[i] = box.hi[1];
+      node.maxZ[i] = box.hi[2];
+      node.child[i] = child;
+      node.count[i] = count;
+    }
+    return index;
+  }
+
+  void setBox(Node &node, int c, const Box &box) {
+    node.minX[c] = box.lo[0];
+    node.minY[c] = box.lo[1];
+    node.minZ[c] = box.lo[2];
+    node.maxX[c] = box.hi[0];
+    node.maxY[c] = box.hi[1];
+    node.maxZ[c] = box.hi[2];
+  }
+
+  // Recomputes the boxes of a node's children from its leaves' triangles
+  // and its inner children's boxes, which must be up to date. A child left
+  // with no triangles is dropped; removed triangles never come back.
+  void refitNode(Uint32 index) {
+    Node &node = this->nodes[index];
+    for (int c = 0; c < 4; c++) {
+      if (node.child[c] == EMPTY)
+        continue;
+      Box box;
+      if (node.count[c] > 0) {
+        for (Uint32 i = node.child[c]; i < node.child[c] + node.count[c];
+             i++) {
+          if (this->ids[i] == EMPTY)
+            continue;
+          const float *t = &this->tris[(size_t)i * 9];
+          float v1[3] = {t[0] + t[3], t[1] + t[4], t[2] + t[5]};
+          float v2[3] = {t[0] + t[6], t[1] + t[7], t[2] + t[8]};
+          box.grow(t);
+          box.grow(v1);
+          box.grow(v2);
+        }
+      } else {
+        const Node &inner = this->nodes[node.child[c]];
+        for (int k = 0; k < 4; k++) {
+          if (inner.child[k] == EMPTY)
+            continue;
+          float lo[3] = {inner.minX[k], inner.minY[k], inner.minZ[k]};
+          float hi[3] = {inner.maxX[k], inner.maxY[k], inner.maxZ[k]};
+          box.grow(lo);
+          box.grow(hi);
+        }
+      }
+      if (box.lo[0] > box.hi[0])
+        node.child[c] = EMPTY;
+      else
+        this->setBox(node, c, box);
+    }
+  }
+
+  // Copies triangle `id` of `source` into entry i, or empties the entry if
+  // the triangle is gone.
+  void writeEntry(Uint32 i, const mesh &source, Uint32 id) {
+    float *out = &this->tris[(size_t)i * 9];
+    this->ids[i] = id;
+    if (id == EMPTY) {
+      std::fill(out + 3, out + 9, 0.0f);
+      return;
+    }
+    const triangle &tri = source.tris[id];
+    for (int v = 0; v < 3; v++) {
+      const vec3d &p = tri.p[v];
+      float xyz[3] = {p.x, p.y, p.z};
+      for (int a = 0; a < 3; a++)
+        out[v * 3 + a] = v == 0 ? xyz[a] : xyz[a] - out[a];
+    }
+  }
+
+  // Möller-Trumbore against triangle i (leaf order); updates `hit` and
+  // returns true if it is hit nearer than tMax.
+  bool intersectTriangle(Uint32 i, const float *o, const float *d,
+                         float tMax, BvhHit &hit) const {
+    const float *v0 = &this->tris[(size_t)i * 9];
+    const float *e1 = v0 + 3;
+    const float *e2 = v0 + 6;
+    float p[3] = {d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2],
+                  d[0] * e2[1] - d[1] * e2[0]};
+    float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    if (fabsf(det) < 1e-12f)
+      return false;
+    float inv = 1.0f / det;
+    float s[3] = {o[0] - v0[0], o[1] - v0[1], o[2] - v0[2]};
+    float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv;
+    if (u < 0.0f || u > 1.0f)
+      return false;
+    float q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2],
+                  s[0] * e1[1] - s[1] * e1[0]};
+    float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv;
+    if (v < 0.0f || u + v > 1.0f)
+      return false;
+    float t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv;
+    if (t < 0.0f || t >= tMax)
+      return false;
+    hit.t = t;
+    hit.u = u;
+    hit.v = v;
+    hit.triangle = this->ids[i];
+    return true;
+  }
+
+  template <bool AnyHit>
+  bool traverse(const vec3d &origin, const vec3d &dir, float tMax,
+                BvhHit &hit) const {
+    const float o[3] = {origin.x, origin.y, origin.z};
+    const float d[3] = {dir.x, dir.y, dir.z};
+    bool found = false;
+    for (Uint32 i = this->leafCount; i < (Uint32)this->ids.size(); i++) {
+      if (this->intersectTriangle(i, o, d, tMax, hit)) {
+        found = true;
+        tMax = hit.t;
+        if (AnyHit)
+          return true;
+      }
+    }
+    if (this->nodes.empty())
+      return found;
+    // Zero components are nudged off zero so the slab test never computes
+    // 0 * inf for a ray lying in a box face.
+    float inv[3];
+    for (int a = 0; a < 3; a++)
+      inv[a] = 1.0f / (fabsf(d[a]) > 1e-20f ? d[a] : copysignf(1e-20f, d[a]));
+
+    struct Entry {
+      Uint32 node;
+      float t;
+    } stack[STACK_SIZE];
+    int top = 0;
+    stack[top++] = {0, 0.0f};
+
+#if defined(__SSE2__)
+    const __m128 ox = _mm_set1_ps(o[0]), oy = _mm_set1_ps(o[1]),
+                 oz = _mm_set1_ps(o[2]);
+    const __m128 ix = _mm_set1_ps(inv[0]), iy = _mm_set1_ps(inv[1]),
+                 iz = _mm_set1_ps(inv[2]);
+#endif
+
+    while (top > 0) {
+      Entry entry = stack[--top];
+      if (entry.t > tMax)
+        continue;
+      const Node &node = this->nodes[entry.node];
+
+      // Slab test against the four child boxes.
+      float tNear[4];
+      int mask = 0;
+#if defined(__SSE2__)
+      __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minX), ox), ix);
+      __m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxX), ox), ix);
+      __m128 lo = _mm_max_ps(_mm_min_ps(t1, t2), _mm_setzero_ps());
+      __m128 hi = _mm_min_ps(_mm_max_ps(t1, t2), _mm_set1_ps(tMax));
+      t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minY), oy), iy);
+      t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxY), oy), iy);
+      lo = _mm_max_ps(_mm_min_ps(t1, t2), lo);
+      hi = _mm_min_ps(_mm_max_ps(t1, t2), hi);
+      t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.minZ), oz), iz);
+      t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.maxZ), oz), iz);
+      lo = _mm_max_ps(_mm_min_ps(t1, t2), lo);
+      hi = _mm_min_ps(_mm_max_ps(t1, t2), hi);
+      mask = _mm_movemask_ps(_mm_cmple_ps(lo, hi));
+      _mm_storeu_ps(tNear, lo);
+#else
+      const float *mins[3] = {node.minX, node.minY, node.minZ};
+      const float *maxs[3] = {node.maxX, node.maxY, node.maxZ};
+      for (int c = 0; c < 4; c++) {
+        float lo = 0.0f, hi = tMax;
+        for (int a = 0; a < 3; a++) {
+          float t1 = (mins[a][c] - o[a]) * inv[a];
+          float t2 = (maxs[a][c] - o[a]) * inv[a];
+          float n = std::min(t1, t2), f = std::max(t1, t2);
+          lo = n > lo ? n : lo;
+          hi = f < hi ? f : hi;
+        }
+        tNear[c] = lo;
+        if (lo <= hi)
+          mask |= 1 << c;
+      }
+#endif
+
+      // Leaves are tested now; inner children are pushed farthest first so
+      // the nearest is visited next.
+      int inner[4];
+      int innerCount = 0;
+      for (int c = 0; c < 4; c++) {
+        if (!(mask & (1 << c)) || node.child[c] == EMPTY)
+          continue;
+        if (node.count[c] == 0) {
+          inner[innerCount++] = c;
+          continue;
+        }
+        for (Uint32 i = node.child[c]; i < node.child[c] + node.count[c];
+             i++) {
+          if (this->intersectTriangle(i, o, d, tMax, hit)) {
+            found = true;
+            tMax = hit.t;
+            if (AnyHit)
+              return true;
+          }
+        }
+      }
+      for (int k = 1; k < innerCount; k++)
+        for (int j = k; j > 0 && tNear[inner[j]] > tNear[inner[j - 1]]; j--)
+          std::swap(inner[j], inner[j - 1]);
+      for (int k = 0; k < innerCount && top < STACK_SIZE; k++)
+        stack[top++] = {node.child[inner[k]], tNear[inner[k]]};
+    }
+    return found;
+  }
+
+public:
+  // Builds over `count` triangles given as nine floats each (three xyz
+  // vertices).
+  void Build(const float *triangles, size_t count) {
+    this->nodes.clear();
+    this->parents.clear();
+    this->leafNodes.assign(count, 0);
+    this->buildNodes.clear();
+    this->ids.resize(count);
+    this->triBoxes.resize(count);
+    this->centroids.resize(count * 3);
+    for (size_t i = 0; i < count; i++) {
+      const float *t = triangles + i * 9;
+      Box box;
+      for (int v = 0; v < 3; v++)
+        box.grow(t + v * 3);
+      this->triBoxes[i] = box;
+      for (int a = 0; a < 3; a++)
+        this->centroids[i * 3 + a] = (t[a] + t[3 + a] + t[6 + a]) / 3.0f;
+      this->ids[i] = (Uint32)i;
+    }
+
+    if (count > 0) {
+      int root = this->buildRecursive(0, (Uint32)count, 0);
+      if (this->buildNodes[root].count > 0) {
+        // A single leaf still needs a node to hold it.
+        BuildNode &leaf = this->buildNodes[root];
+        Node node = {};
+        node.minX[0] = leaf.box.lo[0];
+        node.minY[0] = leaf.box.lo[1];
+        node.minZ[0] = leaf.box.lo[2];
+        node.maxX[0] = leaf.box.hi[0];
+        node.maxY[0] = leaf.box.hi[1];
+        node.maxZ[0] = leaf.box.hi[2];
+        node.child[0] = leaf.first;
+        node.count[0] = leaf.count;
+        for (int i = 1; i < 4; i++)
+          node.child[i] = EMPTY;
+        this->nodes.push_back(node);
+        this->parents.push_back(EMPTY);
+      } else {
+        this->collapse(root, EMPTY);
+      }
+    }
+
+    this->tris.resize(count * 9);
+    for (size_t i = 0; i < count; i++) {
+      const float *t = triangles + (size_t)this->ids[i] * 9;
+      float *out = &this->tris[i * 9];
+      for (int a = 0; a < 3; a++) {
+        out[a] = t[a];
+        out[3 + a] = t[3 + a] - t[a];
+        out[6 + a] = t[6 + a] - t[a];
+      }
+    }
+
+    this->buildNodes = std::vector<BuildNode>();
+    this->triBoxes = std::vector<Box>();
+    this->centroids = std::vector<float>();
+
+    this->leafCount = (Uint32)count;
+    this->removedCount = 0;
+    this->entryOf.resize(count);
+    for (size_t i = 0; i < count; i++)
+      this->entryOf[this->ids[i]] = (Uint32)i;
+    this->queued.assign(this->nodes.size(), 0);
+  }
+
+  void Build(const mesh &source) {
+    std::vector<float> triangles;
+    triangles.reserve(source.tris.size() * 9);
+    for (auto &tri : source.tris)
+      for (auto &p : tri.p) {
+        triangles.push_back(p.x);
+        triangles.push_back(p.y);
+        triangles.push_back(p.z);
+      }
+    this->Build(triangles.data(), source.tris.size());
+    this->revision = source.revision;
+  }
+
+  // Catches up with the edits made to `source`, the mesh this was built
+  // from, since the build or the last Update(), in time proportional to
+  // the edits (see mesh::Edit). Rebuilds instead when the mesh no longer
+  // keeps them all, or once enough triangles have been added or removed.
+  void Update(const mesh &source) {
+    if (source.revision == this->revision)
+      return;
+    Uint32 size = (Uint32)source.tris.size();
+    auto refit = [&](Uint32 i) {
+      if (i < this->leafCount && !this->queued[this->leafNodes[i]]) {
+        this->queued[this->leafNodes[i]] = 1;
+        this->refitQueue.push_back(this->leafNodes[i]);
+      }
+    };
+    auto remove = [&](Uint32 i) {
+      this->writeEntry(i, source, EMPTY);
+      this->removedCount += i < this->leafCount;
+      refit(i);
+    };
+    // Entries are written from the mesh as it is now, whatever the edit.
+    auto write = [&](Uint32 id, Uint32 i) {
+      if (i == EMPTY) {
+        // A triangle new to the tree.
+        i = (Uint32)this->ids.size();
+        this->ids.push_back(id);
+        this->tris.resize(this->tris.size() + 9);
+      }
+      this->entryOf[id] = i;
+      this->writeEntry(i, source, id);
+      refit(i);
+    };
+    bool kept = source.EditsSince(this->revision, [&](const mesh::Edit &edit) {
+      if (edit.kind == mesh::Edit::VERTICES)
+        return;
+      if (this->entryOf.size() < edit.end)
+        this->entryOf.resize(edit.end, EMPTY);
+      for (Uint32 id = edit.first; id < edit.end; id++) {
+        Uint32 i = this->entryOf[id];
+        if (edit.kind == mesh::Edit::MOVED) {
+          // The moved triangle keeps its entry, and so its place in the
+          // tree; the removed one's entry is emptied.
+          if (i != EMPTY && this->ids[i] == id)
+            remove(i);
+          Uint32 from = edit.from + (id - edit.first);
+          i = from < this->entryOf.size() ? this->entryOf[from] : EMPTY;
+          if (i != EMPTY && this->ids[i] != from)
+            i = EMPTY;
+        } else if (i != EMPTY && this->ids[i] != id) {
+          i = EMPTY;
+        }
+        // Triangles that are gone by now are dealt with below.
+        if (id < size)
+          write(id, i);
+      }
+    });
+    // Triangles past the new end were removed, or moved into the places of
+    // removed ones, which took their entries with them.
+    for (Uint32 id = size; id < (Uint32)this->entryOf.size(); id++) {
+      Uint32 i = this->entryOf[id];
+      if (i != EMPTY && this->ids[i] == id)
+        remove(i);
+    }
+    this->entryOf.resize(size, EMPTY);
+    Uint32 grown = (Uint32)this->ids.size() - this->leafCount;
+    if (!kept || (grown + this->removedCount) * REBUILD_SHARE >
+                     this->leafCount + REBUILD_SHARE * REBUILD_SLACK) {
+      std::fill(this->queued.begin(), this->queued.end(), 0);
+      this->refitQueue.clear();
+      this->Build(source);
+      return;
+    }
+
+    // Children come after their parents in the node array, so refitting
+    // from the highest index down finishes every node's children before
+    // the node itself.
+    std::make_heap(this->refitQueue.begin(), this->refitQueue.end());
+    while (!this->refitQueue.empty()) {
+      std::pop_heap(this->refitQueue.begin(), this->refitQueue.end());
+      Uint32 index = this->refitQueue.back();
+      this->refitQueue.pop_back();
+      this->queued[index] = 0;
+      this->refitNode(index);
+      Uint32 parent = this->parents[index];
+      if (parent != EMPTY && !this->queued[parent]) {
+        this->queued[parent] = 1;
+        this->refitQueue.push_back(parent);
+        std::push_heap(this->refitQueue.begin(), this->refitQueue.end());
+      }
+    }
+    this->revision = source.revision;
+  }
+
+  // Nearest hit along origin + t * dir for 0 <= t < tMax.
+  bool Intersect(const vec3d &origin, const vec3d &dir, BvhHit &hit,
+                 float tMax = std::numeric_limits<float>::max()) const {
+    return this->traverse<false>(origin, dir, tMax, hit);
+  }
+
+  // Nearest hit on the segment from a to b; hit.t runs from 0 at a to 1
+  // at b.
+  bool IntersectSegment(const vec3d &a, const vec3d &b, BvhHit &hit) const {
+    vec3d dir = {b.x - a.x, b.y - a.y, b.z - a.z};
+    return this->traverse<false>(a, dir, 1.0f, hit);
+  }
+
+  // True if anything lies on the segment from a to b; stops at the first
+  // hit found, so it is cheaper than IntersectSegment() for collision and
+  // visibility tests.
+  bool SegmentBlocked(const vec3d &a, const vec3d &b) const {
+    vec3d dir = {b.x - a.x, b.y - a.y, b.z - a.z};
+    BvhHit hit;
+    return this->traverse<true>(a, dir, 1.0f, hit);
+  }
+
+  size_t nodeCount() const { return this->nodes.size(); }
+  size_t memoryBytes() const {
+    return this->nodes.capacity() * sizeof(Node) +
+           this->tris.capacity() * sizeof(float) +
+           this->ids.capacity() * sizeof(Uint32);
+  }
+};
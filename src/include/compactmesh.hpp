@@ -0,0 +1,253 @@
+#pragma once
+
+#include "matrix.hpp"
+#include "mesh.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Octahedral normal encoding: the unit sphere is projected onto the
+// octahedron |x| + |y| + |z| = 1, the lower half folded over the upper, and
+// the resulting square stored as two signed 16-bit values.
+inline void octEncode(vec3d n, Sint16 &u, Sint16 &v) {
+  float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+  float x = l1 > 0.0f ? n.x / l1 : 0.0f;
+  float y = l1 > 0.0f ? n.y / l1 : 0.0f;
+  if (n.z < 0.0f) {
+    float fx = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+    float fy = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    x = fx;
+    y = fy;
+  }
+  u = (Sint16)lroundf(std::clamp(x, -1.0f, 1.0f) * 32767.0f);
+  v = (Sint16)lroundf(std::clamp(y, -1.0f, 1.0f) * 32767.0f);
+}
+
+inline vec3d octDecode(Sint16 u, Sint16 v) {
+  float x = u / 32767.0f;
+  float y = v / 32767.0f;
+  float z = 1.0f - fabsf(x) - fabsf(y);
+  float t = std::max(-z, 0.0f);
+  x += x >= 0.0f ? -t : t;
+  y += y >= 0.0f ? -t : t;
+  float l = sqrtf(x * x + y * y + z * z);
+  return {x / l, y / l, z / l};
+}
+
+// Indexed mesh in a compressed vertex format, about a quarter of the size
+// of the triangle soup in `mesh`:
+//
+//   positions  3 x 16-bit, quantised against the mesh bounds (6 bytes)
+//   normals    2 x 16-bit, octahedral (4 bytes)
+//   indices    16-bit when there are at most 65536 vertices, else 32-bit
+//
+// Vertex data is stored one component per array and padded to a multiple
+// of 8 so the decoders below work on eight vertices at a time with no tail.
+// Vertices are decoded on the fly each frame, straight into the transform.
+struct CompactMesh {
+  // Position i is quantMin + q * quantScale per axis.
+  vec3d quantMin;
+  vec3d quantScale;
+  std::vector<Uint16> px, py, pz;
+  std::vector<Sint16> nu, nv;
+  std::vector<Uint16> indices16;
+  std::vector<Uint32> indices32;
+  size_t vertexCount = 0;
+  size_t triangleCount = 0;
+
+  // Welds identical positions, gives each vertex the area-weighted average
+  // normal of its faces, and quantises the result. `source` must have
+  // valid bounds (see mesh::ComputeBounds()).
+  void Build(const mesh &source) {
+    struct Key {
+      float x, y, z;
+      bool operator==(const Key &o) const {
+        return x == o.x && y == o.y && z == o.z;
+      }
+    };
+    struct KeyHash {
+      size_t operator()(const Key &k) const {
+        Uint32 b[3];
+        memcpy(b, &k, sizeof(b));
+        return (size_t)b[0] * 73856093u ^ (size_t)b[1] * 19349663u ^
+               (size_t)b[2] * 83492791u;
+      }
+    };
+
+    std::unordered_map<Key, Uint32, KeyHash> welded;
+    std::vector<vec3d> positions;
+    std::vector<vec3d> normals;
+    std::vector<Uint32> indices;
+    indices.reserve(source.tris.size() * 3);
+    for (auto &tri : source.tris) {
+      const vec3d &a = tri.p[0], &b = tri.p[1], &c = tri.p[2];
+      // Unnormalised, so larger faces weigh more.
+      vec3d face = {(b.y - a.y) * (c.z - a.z) - (b.z - a.z) * (c.y - a.y),
+                    (b.z - a.z) * (c.x - a.x) - (b.x - a.x) * (c.z - a.z),
+                    (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x)};
+      for (auto &p : tri.p) {
+        auto inserted =
+            welded.insert({{p.x, p.y, p.z}, (Uint32)positions.size()});
+        if (inserted.second) {
+          positions.push_back(p);
+          normals.push_back({0.0f, 0.0f, 0.0f});
+        }
+        Uint32 index = inserted.first->second;
+        normals[index].x += face.x;
+        normals[index].y += face.y;
+        normals[index].z += face.z;
+        indices.push_back(index);
+      }
+    }
+
+    this->vertexCount = positions.size();
+    this->triangleCount = source.tris.size();
+    size_t padded = (this->vertexCount + 7) & ~(size_t)7;
+    this->px.assign(padded, 0);
+    this->py.assign(padded, 0);
+    this->pz.assign(padded, 0);
+    this->nu.assign(padded, 0);
+    this->nv.assign(padded, 0);
+
+    this->quantMin = source.boundsMin;
+    float extent[3] = {source.boundsMax.x - source.boundsMin.x,
+                       source.boundsMax.y - source.boundsMin.y,
+                       source.boundsMax.z - source.boundsMin.z};
+    this->quantScale = {extent[0] / 65535.0f, extent[1] / 65535.0f,
+                        extent[2] / 65535.0f};
+    auto quantise = [](float p, float lo, float extent) {
+      if (extent <= 0.0f)
+        return (Uint16)0;
+      return (Uint16)std::clamp(lroundf((p - lo) / extent * 65535.0f), 0L,
+                                65535L);
+    };
+    for (size_t i = 0; i < this->vertexCount; i++) {
+      this->px[i] = quantise(positions[i].x, this->quantMin.x, extent[0]);
+      this->py[i] = quantise(positions[i].y, this->quantMin.y, extent[1]);
+      this->pz[i] = quantise(positions[i].z, this->quantMin.z, extent[2]);
+      octEncode(normals[i], this->nu[i], this->nv[i]);
+    }
+
+    this->indices16.clear();
+    this->indices32.clear();
+    if (this->vertexCount <= 65536)
+      this->indices16.assign(indices.begin(), indices.end());
+    else
+      this->indices32.swap(indices);
+  }
+
+  size_t memoryBytes() const {
+    return sizeof(*this) +
+           (this->px.capacity() + this->py.capacity() + this->pz.capacity() +
+            this->indices16.capacity()) *
+               sizeof(Uint16) +
+           (this->nu.capacity() + this->nv.capacity()) * sizeof(Sint16) +
+           this->indices32.capacity() * sizeof(Uint32);
+  }
+
+  // Dequantises every position and transforms it by `m` as
+  // Matrix_MultiplyVector would, writing out[i] for vertex i. The
+  // dequantisation is folded into the matrix, so each vertex costs one
+  // integer-to-float conversion per axis and a 3x4 multiply.
+  void TransformPositions(const mat4x4 &m, std::vector<vec3d> &out) const {
+    out.resize(this->px.size());
+    const float s[3] = {this->quantScale.x, this->quantScale.y,
+                        this->quantScale.z};
+    const float o[3] = {this->quantMin.x, this->quantMin.y, this->quantMin.z};
+    float q[4][4];
+    for (int c = 0; c < 4; c++) {
+      for (int r = 0; r < 3; r++)
+        q[r][c] = s[r] * m.m[r][c];
+      q[3][c] = o[0] * m.m[0][c] + o[1] * m.m[1][c] + o[2] * m.m[2][c] +
+                m.m[3][c];
+    }
+
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128 q0[4], q1[4], q2[4], q3[4];
+    for (int c = 0; c < 4; c++) {
+      q0[c] = _mm_set1_ps(q[0][c]);
+      q1[c] = _mm_set1_ps(q[1][c]);
+      q2[c] = _mm_set1_ps(q[2][c]);
+      q3[c] = _mm_set1_ps(q[3][c]);
+    }
+    for (; i < this->px.size(); i += 8) {
+      __m128i x16 = _mm_loadu_si128((const __m128i *)&this->px[i]);
+      __m128i y16 = _mm_loadu_si128((const __m128i *)&this->py[i]);
+      __m128i z16 = _mm_loadu_si128((const __m128i *)&this->pz[i]);
+      for (int h = 0; h < 2; h++) {
+        __m128 x = _mm_cvtepi32_ps(h ? _mm_unpackhi_epi16(x16, zero)
+                                     : _mm_unpacklo_epi16(x16, zero));
+        __m128 y = _mm_cvtepi32_ps(h ? _mm_unpackhi_epi16(y16, zero)
+                                     : _mm_unpacklo_epi16(y16, zero));
+        __m128 z = _mm_cvtepi32_ps(h ? _mm_unpackhi_epi16(z16, zero)
+                                     : _mm_unpacklo_epi16(z16, zero));
+        __m128 r[4];
+        for (int c = 0; c < 4; c++)
+          r[c] = _mm_add_ps(
+              _mm_add_ps(_mm_mul_ps(x, q0[c]), _mm_mul_ps(y, q1[c])),
+              _mm_add_ps(_mm_mul_ps(z, q2[c]), q3[c]));
+        // Four x, four y, ... to four vec3d.
+        _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+        for (int k = 0; k < 4; k++)
+          _mm_storeu_ps(&out[i + h * 4 + k].x, r[k]);
+      }
+    }
+#endif
+    for (; i < this->px.size(); i++) {
+      float x = this->px[i], y = this->py[i], z = this->pz[i];
+      float r[4];
+      for (int c = 0; c < 4; c++)
+        r[c] = x * q[0][c] + y * q[1][c] + z * q[2][c] + q[3][c];
+      out[i] = {r[0], r[1], r[2], r[3]};
+    }
+  }
+
+  // Decodes every normal to a unit vector, writing out[i] for vertex i.
+  void DecodeNormals(std::vector<vec3d> &out) const {
+    out.resize(this->nu.size());
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 inv = _mm_set1_ps(1.0f / 32767.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    const __m128 zerof = _mm_setzero_ps();
+    for (; i < this->nu.size(); i += 8) {
+      __m128i u16 = _mm_loadu_si128((const __m128i *)&this->nu[i]);
+      __m128i v16 = _mm_loadu_si128((const __m128i *)&this->nv[i]);
+      for (int h = 0; h < 2; h++) {
+        // Sign-extend by placing each value in the top half of a lane.
+        __m128i u32 = h ? _mm_unpackhi_epi16(u16, u16)
+                        : _mm_unpacklo_epi16(u16, u16);
+        __m128i v32 = h ? _mm_unpackhi_epi16(v16, v16)
+                        : _mm_unpacklo_epi16(v16, v16);
+        __m128 x = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(u32, 16)), inv);
+        __m128 y = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(v32, 16)), inv);
+        __m128 z = _mm_sub_ps(
+            _mm_sub_ps(one, _mm_andnot_ps(sign, x)), _mm_andnot_ps(sign, y));
+        // x -= copysign(max(-z, 0), x), and the same for y.
+        __m128 t = _mm_max_ps(_mm_sub_ps(zerof, z), zerof);
+        x = _mm_sub_ps(x, _mm_or_ps(t, _mm_and_ps(sign, x)));
+        y = _mm_sub_ps(y, _mm_or_ps(t, _mm_and_ps(sign, y)));
+        __m128 l = _mm_sqrt_ps(_mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+        __m128 r[4] = {_mm_div_ps(x, l), _mm_div_ps(y, l), _mm_div_ps(z, l),
+                       one};
+        _MM_TRANSPOSE4_PS(r[0], r[1], r[2], r[3]);
+        for (int k = 0; k < 4; k++)
+          _mm_storeu_ps(&out[i + h * 4 + k].x, r[k]);
+      }
+    }
+#endif
+    for (; i < this->nu.size(); i++)
+      out[i] = octDecode(this->nu[i], this->nv[i]);
+  }
+};
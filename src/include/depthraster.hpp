@@ -0,0 +1,131 @@
+#pragma once
+
+#include "framebuffer.hpp"
+#include "rasterpipeline.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Depth-only rasterization, for a Z-prepass and for shadow maps: the
+// coverage and depths of rasterTriangle() with nothing but the depth test
+// and write, so no colour, attributes or tile flags.
+//
+// The setup and the depth steps are rasterTriangle()'s, operation for
+// operation, so every pixel gets the depth the colour kernel computes for
+// it and a colour pass testing for equal depth afterwards draws exactly
+// where each triangle ended up nearest. Four pixels go at a time as SSE2
+// registers: the edge functions as 32-bit integers and the nearer of the
+// old and new depths kept with a min under the coverage mask. Only the
+// depths themselves are still stepped one pixel after another, as the
+// colour kernel steps them.
+inline void rasterDepth(float *depth, int width, int height,
+                        const RasterVertex &p1, const RasterVertex &p2,
+                        const RasterVertex &p3) {
+  RasterVertex v[3] = {p1, p2, p3};
+  int X[3], Y[3];
+  for (int i = 0; i < 3; i++) {
+    X[i] = (int)lroundf(v[i].x * 16.0f);
+    Y[i] = (int)lroundf(v[i].y * 16.0f);
+  }
+  long long area = (long long)(X[1] - X[0]) * (Y[2] - Y[0]) -
+                   (long long)(Y[1] - Y[0]) * (X[2] - X[0]);
+  if (area == 0)
+    return;
+  if (area < 0) {
+    std::swap(X[1], X[2]);
+    std::swap(Y[1], Y[2]);
+    std::swap(v[1], v[2]);
+  }
+
+  int minX = std::max(std::min({X[0], X[1], X[2]}) >> 4, 0);
+  int maxX = std::min(std::max({X[0], X[1], X[2]}) >> 4, width - 1);
+  int minY = std::max(std::min({Y[0], Y[1], Y[2]}) >> 4, 0);
+  int maxY = std::min(std::max({Y[0], Y[1], Y[2]}) >> 4, height - 1);
+  if (minX > maxX || minY > maxY)
+    return;
+
+  float fx[3], fy[3];
+  for (int i = 0; i < 3; i++) {
+    fx[i] = X[i] / 16.0f;
+    fy[i] = Y[i] / 16.0f;
+  }
+  float det =
+      (fx[1] - fx[0]) * (fy[2] - fy[0]) - (fx[2] - fx[0]) * (fy[1] - fy[0]);
+  float dzdx = ((v[1].z - v[0].z) * (fy[2] - fy[0]) -
+                (v[2].z - v[0].z) * (fy[1] - fy[0])) /
+               det;
+  float dzdy = ((v[2].z - v[0].z) * (fx[1] - fx[0]) -
+                (v[1].z - v[0].z) * (fx[2] - fx[0])) /
+               det;
+
+  int edgeA[3], step[3], rowE[3];
+  for (int e = 0; e < 3; e++) {
+    int a = e;
+    int b = (e + 1) % 3;
+    edgeA[e] = X[b] - X[a];
+    int edgeB = Y[b] - Y[a];
+    bool topLeft = edgeB < 0 || (edgeB == 0 && edgeA[e] > 0);
+    rowE[e] = edgeA[e] * (minY * 16 + 8 - Y[a]) -
+              edgeB * (minX * 16 + 8 - X[a]) - (topLeft ? 0 : 1);
+    step[e] = edgeB * 16;
+  }
+#if defined(__SSE2__)
+  const __m128i outside = _mm_set1_epi32(-1);
+  __m128i laneStep[3];
+  for (int e = 0; e < 3; e++)
+    laneStep[e] = _mm_set_epi32(3 * step[e], 2 * step[e], step[e], 0);
+#endif
+
+  float rowZ = v[0].z + dzdx * (minX + 0.5f - fx[0]) +
+               dzdy * (minY + 0.5f - fy[0]);
+
+  for (int y = minY; y <= maxY; y++) {
+    float *depthRow = &depth[(size_t)y * width];
+    int e0 = rowE[0], e1 = rowE[1], e2 = rowE[2];
+    float z = rowZ;
+    int x = minX;
+
+#if defined(__SSE2__)
+    for (; x + 3 <= maxX;
+         x += 4, e0 -= 4 * step[0], e1 -= 4 * step[1], e2 -= 4 * step[2]) {
+      float z1 = z + dzdx, z2 = z1 + dzdx, z3 = z2 + dzdx;
+      __m128 zs = _mm_set_ps(z3, z2, z1, z);
+      z = z3 + dzdx;
+      __m128i edges = _mm_or_si128(
+          _mm_or_si128(_mm_sub_epi32(_mm_set1_epi32(e0), laneStep[0]),
+                       _mm_sub_epi32(_mm_set1_epi32(e1), laneStep[1])),
+          _mm_sub_epi32(_mm_set1_epi32(e2), laneStep[2]));
+      __m128 covered = _mm_castsi128_ps(_mm_cmpgt_epi32(edges, outside));
+      if (_mm_movemask_ps(covered) == 0)
+        continue;
+      __m128 old = _mm_loadu_ps(depthRow + x);
+      __m128 nearest = _mm_min_ps(zs, old);
+      _mm_storeu_ps(depthRow + x,
+                    _mm_or_ps(_mm_and_ps(covered, nearest),
+                              _mm_andnot_ps(covered, old)));
+    }
+#endif
+    for (; x <= maxX;
+         x++, e0 -= step[0], e1 -= step[1], e2 -= step[2], z += dzdx) {
+      if ((e0 | e1 | e2) < 0)
+        continue;
+      if (z < depthRow[x])
+        depthRow[x] = z;
+    }
+
+    for (int e = 0; e < 3; e++)
+      rowE[e] += edgeA[e] * 16;
+    rowZ += dzdy;
+  }
+}
+
+// Into fb.depth.
+inline void rasterDepth(Framebuffer &fb, const RasterVertex &p1,
+                        const RasterVertex &p2, const RasterVertex &p3) {
+  rasterDepth(fb.depth.data(), fb.width, fb.height, p1, p2, p3);
+}
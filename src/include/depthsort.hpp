@@ -0,0 +1,79 @@
+#pragma once
+
+#include "mesh.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// Back-to-front ordering for the painter's / translucent pass.
+//
+// Each triangle gets one depth key, computed once: the sum of its vertex z
+// (the same order as the average) quantised to 24 bits between the nearest
+// and farthest triangle. (key, index) pairs are then sorted with a stable
+// LSD radix sort, one 8-bit digit per pass, so the triangles themselves
+// never move and equal depths keep their mesh order.
+class DepthSorter {
+  static const int KEY_BITS = 24;
+
+  std::vector<float> depth;
+  std::vector<Uint64> pairs;
+  std::vector<Uint64> scratch;
+
+public:
+  // Fills `order` with indices into `tris`, farthest triangle first.
+  void sortBackToFront(const std::vector<triangle> &tris,
+                       std::vector<Uint32> &order) {
+    size_t n = tris.size();
+    order.resize(n);
+    if (n == 0)
+      return;
+
+    this->depth.resize(n);
+    float nearest = tris[0].p[0].z + tris[0].p[1].z + tris[0].p[2].z;
+    float farthest = nearest;
+    for (size_t i = 0; i < n; i++) {
+      float z = tris[i].p[0].z + tris[i].p[1].z + tris[i].p[2].z;
+      this->depth[i] = z;
+      nearest = std::min(nearest, z);
+      farthest = std::max(farthest, z);
+    }
+
+    // Keys grow towards the camera so an ascending sort is back to front.
+    const float maxKey = (float)((1 << KEY_BITS) - 1);
+    float scale = farthest > nearest ? maxKey / (farthest - nearest) : 0.0f;
+    this->pairs.resize(n);
+    this->scratch.resize(n);
+    Uint32 histogram[KEY_BITS / 8][256];
+    memset(histogram, 0, sizeof(histogram));
+    for (size_t i = 0; i < n; i++) {
+      Uint32 key =
+          (Uint32)std::min((farthest - this->depth[i]) * scale, maxKey);
+      this->pairs[i] = (Uint64)key << 32 | (Uint32)i;
+      for (int d = 0; d < KEY_BITS / 8; d++)
+        histogram[d][(key >> (d * 8)) & 0xff]++;
+    }
+
+    for (int d = 0; d < KEY_BITS / 8; d++) {
+      // A digit shared by every key would be a no-op pass.
+      Uint32 *count = histogram[d];
+      if (count[(this->pairs[0] >> (32 + d * 8)) & 0xff] == n)
+        continue;
+
+      Uint32 offset = 0;
+      for (int b = 0; b < 256; b++) {
+        Uint32 c = count[b];
+        count[b] = offset;
+        offset += c;
+      }
+      for (size_t i = 0; i < n; i++) {
+        Uint64 pair = this->pairs[i];
+        this->scratch[count[(pair >> (32 + d * 8)) & 0xff]++] = pair;
+      }
+      this->pairs.swap(this->scratch);
+    }
+
+    for (size_t i = 0; i < n; i++)
+      order[i] = (Uint32)this->pairs[i];
+  }
+};
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "framebuffer.hpp"
+#include <SDL2/SDL_rect.h>
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// True when the w x h blocks at `a` and `b`, both with row pitch `stride`,
+// hold the same pixels.
+inline bool samePixels(const Uint32 *a, const Uint32 *b, int stride, int w,
+                       int h) {
+  for (int y = 0; y < h; y++, a += stride, b += stride)
+    if (memcmp(a, b, w * sizeof(Uint32)) != 0)
+      return false;
+  return true;
+}
+
+// Works out which parts of the window changed since the last presented
+// frame, so only those are uploaded.
+//
+// Candidates are the framebuffer tiles flagged in this frame or the one
+// before (see Framebuffer). The matching tiles of the final, upscaled image
+// are then compared with a copy of what was last uploaded, which also drops
+// tiles that were redrawn with the same pixels. A plain compare costs about
+// as much as hashing the tile would and cannot miss a change. Tiles here are
+// TILE_SIZE window pixels square; at a reduced render scale one framebuffer
+// tile maps to several of them, widened by a pixel for bilinear filtering.
+class DirtyTiles {
+  static constexpr int TILE_SHIFT = Framebuffer::TILE_SHIFT;
+  static constexpr int TILE_SIZE = Framebuffer::TILE_SIZE;
+
+  std::vector<Uint8> previousTouched;
+  std::vector<Uint8> candidate;
+  std::vector<Uint8> changed;
+  // The window image as of the last update().
+  std::vector<Uint32> shown;
+  Uint32 generation = 0;
+  int renderWidth = 0;
+  int renderHeight = 0;
+  int windowWidth = 0;
+  int windowHeight = 0;
+  int tilesX = 0;
+  int tilesY = 0;
+  bool valid = false;
+
+public:
+  // Window regions that changed in the last update(), merged along rows.
+  std::vector<SDL_Rect> rects;
+  size_t dirtyTiles = 0;
+  size_t dirtyPixels = 0;
+
+  // Forces the next update() to report the whole window, e.g. after the
+  // window contents were lost.
+  void invalidate() { this->valid = false; }
+
+  // `image` is the windowWidth x windowHeight picture about to be shown,
+  // upscaled from `fb` if their sizes differ.
+  void update(const Framebuffer &fb, const Uint32 *image, int windowWidth,
+              int windowHeight) {
+    bool full = !this->valid || fb.tileGeneration != this->generation ||
+                fb.width != this->renderWidth ||
+                fb.height != this->renderHeight ||
+                windowWidth != this->windowWidth ||
+                windowHeight != this->windowHeight;
+    if (windowWidth != this->windowWidth ||
+        windowHeight != this->windowHeight) {
+      this->windowWidth = windowWidth;
+      this->windowHeight = windowHeight;
+      this->tilesX = (windowWidth + TILE_SIZE - 1) >> TILE_SHIFT;
+      this->tilesY = (windowHeight + TILE_SIZE - 1) >> TILE_SHIFT;
+      this->shown.assign((size_t)windowWidth * windowHeight, 0);
+    }
+    size_t tiles = (size_t)this->tilesX * this->tilesY;
+    this->candidate.assign(tiles, full);
+    this->changed.assign(tiles, 0);
+
+    if (!full) {
+      bool scaled = fb.width != windowWidth || fb.height != windowHeight;
+      for (int ty = 0; ty < fb.tilesY; ty++) {
+        for (int tx = 0; tx < fb.tilesX; tx++) {
+          size_t i = (size_t)ty * fb.tilesX + tx;
+          if (!fb.tileTouched[i] && !this->previousTouched[i])
+            continue;
+          if (!scaled) {
+            this->candidate[(size_t)ty * this->tilesX + tx] = 1;
+            continue;
+          }
+          int x0 = ((tx << TILE_SHIFT) - 1) * windowWidth / fb.width - 1;
+          int x1 = (((tx + 1) << TILE_SHIFT) + 1) * windowWidth / fb.width + 1;
+          int y0 = ((ty << TILE_SHIFT) - 1) * windowHeight / fb.height - 1;
+          int y1 =
+              (((ty + 1) << TILE_SHIFT) + 1) * windowHeight / fb.height + 1;
+          x0 = std::max(x0, 0) >> TILE_SHIFT;
+          y0 = std::max(y0, 0) >> TILE_SHIFT;
+          x1 = std::min(x1, windowWidth - 1) >> TILE_SHIFT;
+          y1 = std::min(y1, windowHeight - 1) >> TILE_SHIFT;
+          for (int y = y0; y <= y1; y++)
+            std::fill(&this->candidate[(size_t)y * this->tilesX + x0],
+                      &this->candidate[(size_t)y * this->tilesX + x1] + 1, 1);
+        }
+      }
+    }
+
+    this->rects.clear();
+    this->dirtyTiles = 0;
+    this->dirtyPixels = 0;
+    for (int ty = 0; ty < this->tilesY; ty++) {
+      int y = ty << TILE_SHIFT;
+      int h = std::min(TILE_SIZE, windowHeight - y);
+      for (int tx = 0; tx < this->tilesX; tx++) {
+        size_t i = (size_t)ty * this->tilesX + tx;
+        if (!this->candidate[i])
+          continue;
+        int x = tx << TILE_SHIFT;
+        int w = std::min(TILE_SIZE, windowWidth - x);
+        const Uint32 *src = image + (size_t)y * windowWidth + x;
+        Uint32 *dst = &this->shown[(size_t)y * windowWidth + x];
+        if (full || !samePixels(src, dst, windowWidth, w, h)) {
+          for (int r = 0; r < h; r++)
+            memcpy(dst + (size_t)r * windowWidth, src + (size_t)r * windowWidth,
+                   w * sizeof(Uint32));
+          this->changed[i] = 1;
+        }
+      }
+      // One rectangle per run of changed tiles.
+      for (int tx = 0; tx < this->tilesX; tx++) {
+        if (!this->changed[(size_t)ty * this->tilesX + tx])
+          continue;
+        int end = tx;
+        while (end + 1 < this->tilesX &&
+               this->changed[(size_t)ty * this->tilesX + end + 1])
+          end++;
+        int x = tx << TILE_SHIFT;
+        int w = std::min((end + 1) << TILE_SHIFT, windowWidth) - x;
+        this->rects.push_back({x, y, w, h});
+        this->dirtyTiles += end - tx + 1;
+        this->dirtyPixels += (size_t)w * h;
+        tx = end;
+      }
+    }
+
+    this->previousTouched = fb.tileTouched;
+    this->generation = fb.tileGeneration;
+    this->renderWidth = fb.width;
+    this->renderHeight = fb.height;
+    this->valid = true;
+  }
+};
@@ -0,0 +1,1429 @@
+#pragma once
+
+#include "assets.hpp"
+#include "bricks.hpp"
+#include "bvh.hpp"
+#include "depthraster.hpp"
+#include "depthsort.hpp"
+#include "display.hpp"
+#include "failure.hpp"
+#include "lighting.hpp"
+#include "matrix.hpp"
+#include "mesh.hpp"
+#include "msaa.hpp"
+#include "pointcloud.hpp"
+#include "rasterpipeline.hpp"
+#include "scenegraph.hpp"
+#include "shadowmap.hpp"
+#include "skinning.hpp"
+#include "terrain.hpp"
+#include "threadpool.hpp"
+#include "timer.hpp"
+#include "vec3d.hpp"
+#include "viewport.hpp"
+#include <algorithm>
+#include <cmath>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+class olcEngine3D : public Display {
+public:
+  olcEngine3D() {}
+  olcEngine3D(int width, int height, bool headless)
+      : Display(width, height, headless) {}
+
+  std::string sMeshFile = "res/axis.obj";
+  // Rotation of the model about its own Y axis, used for turntables.
+  float fSpin = 0;
+  // Mesh to draw instead of loading sMeshFile, e.g. one shared through a
+  // MeshCache between several engines.
+  std::shared_ptr<const mesh> pSharedMesh;
+  bool bMsaa = false;
+  MsaaBuffer msaa;
+  // Opacity of the mesh. Below 1 the triangles are blended in back-to-front
+  // order; the MSAA path ignores it and draws them opaque.
+  float fAlpha = 1.0f;
+  bool bDepthTest = true;
+  bool bWireframe = false;
+  // Keep the mesh as a quantised CompactMesh instead of a triangle soup;
+  // read when the mesh is first loaded.
+  bool bCompact = false;
+  // Out-of-core mesh, drawn instead of sMeshFile when set by LoadBricks().
+  std::unique_ptr<BrickStreamer> pBricks;
+  // Heightmap terrain in world space, drawn instead of sMeshFile when set by
+  // GenerateTerrain() or LoadTerrain(). Lit flat.
+  std::unique_ptr<Terrain> pTerrain;
+  // Headless frames wait for the bricks or terrain chunks they need, so
+  // offline renders come out complete. Clear it to stream as a window does.
+  bool bWaitForStreaming = true;
+  // Drawn instead of any mesh when set by LoadPoints(), as squares of
+  // nPointSize pixels.
+  std::unique_ptr<PointCloud> pPoints;
+  int nPointSize = 1;
+  // Lights for the mesh. The default is a single directional light from
+  // behind the camera.
+  LightingStage lighting;
+  // Light each vertex from its normal and interpolate across the triangle
+  // instead of lighting triangles flat. Brick-streamed meshes and the MSAA
+  // path are always lit flat.
+  bool bGouraud = false;
+  // Skinned mesh drawn instead of any other when set, posed every frame
+  // from vecJointPose (each joint's transform relative to its parent) and
+  // the weights of its morph targets in vecMorphWeights. Skinning runs on
+  // the worker threads.
+  std::shared_ptr<const SkinnedMesh> pSkinned;
+  std::vector<mat4x4> vecJointPose;
+  std::vector<float> vecMorphWeights;
+  // Vertices skinned and the time spent on it, summed over frames.
+  Uint64 nSkinnedVertices = 0;
+  float fSkinningMs = 0.0f;
+  // Where the last frame's time went, in ms: culling, lighting and
+  // projection (skinning included), depth sorting and rasterization
+  // (points and the MSAA resolve included).
+  float fProjectMs = 0.0f;
+  float fSortMs = 0.0f;
+  float fRasterMs = 0.0f;
+  // Triangles of the last frame given to projection, and the triangles
+  // left for the rasterizer after culling and near clipping.
+  size_t nTrianglesSubmitted = 0;
+  size_t nTrianglesDrawn = 0;
+  // Cameras to draw the scene from instead of the engine's own, each into
+  // its part of the framebuffer (see Viewport). The mesh is transformed to
+  // world space, culled against all of them and lit once per frame; only
+  // the view transform, culling, projection and rasterization are done per
+  // view, the views in parallel on the worker threads. Applies to meshes
+  // with normals, loaded, compact or skinned; bricks, terrain, point clouds
+  // and meshes built without normals are drawn from the engine's camera. Views
+  // are drawn without MSAA.
+  // fProjectMs is then the shared pass, fRasterMs the views from start to
+  // finish, and each view keeps its own times. Pick() still uses the
+  // engine's camera.
+  std::vector<Viewport> vecViews;
+  // Lay down the depth of every triangle with rasterDepth() first, then
+  // draw colour only where each one ended up nearest: every pixel is
+  // shaded once and no back-to-front sort is needed. Applies to opaque,
+  // filled, depth-tested drawing from the engine's camera without MSAA.
+  // Off by default: every triangle is clipped and rasterized twice, which
+  // only pays off when many triangles overlap and shading dominates. It
+  // makes the teapot about a third slower.
+  bool bDepthPrepass = false;
+  // Shadows from the first light, when it is directional, through a
+  // shadow map of nShadowMapSize texels a side drawn around the mesh
+  // whenever it or the light moves. Applies to meshes with normals, loaded,
+  // compact or skinned. The map is looked up once per lit surface, so
+  // shadows are per triangle, or per vertex with Gouraud shading.
+  bool bShadows = false;
+  int nShadowMapSize = 1024;
+  ShadowMap shadowMap;
+
+private:
+  mesh meshCube;
+  mat4x4 matProj;
+  // As used for the last frame; Pick() maps through them.
+  mat4x4 matWorld;
+  mat4x4 matView;
+
+  // Built on the first Pick() against each mesh.
+  Bvh bvh;
+  const void *pBvhSource = nullptr;
+
+  AssetManager assets;
+  MeshHandle hMesh = -1;
+
+  // Splats point clouds and skins; made on first use.
+  std::unique_ptr<ThreadPool> pWorkers;
+
+  DepthSorter depthSorter;
+  std::vector<Uint32> vecRasterOrder;
+  std::vector<vec3d> vecWorldVerts;
+
+  // Normals of the mesh being drawn in world space, redone only when the
+  // mesh or matWorld changes, and only in part when the mesh was edited
+  // (see mesh::Edit). Compact meshes store only vertex normals, so their
+  // face normals are worked out once from the decoded positions.
+  const void *pNormalSource = nullptr;
+  mat4x4 matNormalWorld;
+  Uint64 nNormalRevision = 0;
+  const CompactMesh *pCompactNormals = nullptr;
+  std::vector<vec3d> vecCompactFaceNormals;
+  std::vector<vec3d> vecCompactVertexNormals;
+  std::vector<vec3d> vecWorldFaceNormals;
+  std::vector<vec3d> vecWorldVertexNormals;
+  bool bWorldVertexNormals = false;
+  // Visible world-space triangles waiting for the lighting stage, and when
+  // drawing several views, their normals for each view's culling.
+  std::vector<triangle> vecLitTriangles;
+  std::vector<vec3d> vecLitNormals;
+  bool bSharedPass = false;
+  std::vector<std::pair<int, int>> vecViewSpans;
+  LightingInputs lightingInputs;
+  std::vector<float> vecLight;
+  // Three intensities per entry of the frame's vecTrianglesToRaster.
+  std::vector<float> vecVertexLight;
+  std::vector<mat4x4> vecSkinPalette;
+  VertexStreams skinnedVertices;
+  // The mesh in world space while it is drawn with shadows.
+  std::vector<triangle> vecShadowCasters;
+  // The light the shadow map was last drawn for.
+  vec3d vShadowLight = {NAN, NAN, NAN};
+  // Screen-clipped pieces of the frame's triangles after a depth prepass,
+  // and the triangle each came from.
+  std::vector<triangle> vecPrepassPieces;
+  std::vector<Uint32> vecPrepassSource;
+
+  vec3d vCamera;
+  vec3d vLookDir;
+
+  float fTheta = 0;
+  float fYaw = 0;
+
+  // The model turns under a stage that sets it out in front of the camera.
+  // Both the model and the camera keep their inverses, for the view and
+  // for Pick().
+  SceneGraph scene;
+  int nStageNode = scene.add();
+  int nModelNode = scene.add(nStageNode, true);
+  int nCameraNode = scene.add(-1, true);
+  // What the model and camera nodes were last set from.
+  float fNodeTheta = NAN;
+  float fNodeSpin = NAN;
+  float fNodeYaw = NAN;
+  vec3d vNodeCamera;
+
+public:
+  // The maths helpers are public so the microbenchmarks can time them.
+  vec3d Matrix_MultiplyVector(mat4x4 &m, vec3d &i) {
+    vec3d v;
+    v.x = i.x * m.m[0][0] + i.y * m.m[1][0] + i.z * m.m[2][0] + i.w * m.m[3][0];
+    v.y = i.x * m.m[0][1] + i.y * m.m[1][1] + i.z * m.m[2][1] + i.w * m.m[3][1];
+    v.z = i.x * m.m[0][2] + i.y * m.m[1][2] + i.z * m.m[2][2] + i.w * m.m[3][2];
+    v.w = i.x * m.m[0][3] + i.y * m.m[1][3] + i.z * m.m[2][3] + i.w * m.m[3][3];
+    return v;
+  }
+
+  mat4x4 Matrix_PointAt(vec3d &pos, vec3d &target, vec3d &up) {
+    vec3d newForward = Vector_Sub(target, pos);
+    newForward = Vector_Normalise(newForward);
+
+    vec3d a = Vector_Mul(newForward, Vector_DotProduct(up, newForward));
+    vec3d newUp = Vector_Sub(up, a);
+    newUp = Vector_Normalise(newUp);
+
+    vec3d newRight = Vector_CrossProduct(newUp, newForward);
+
+    mat4x4 matrix;
+    matrix.m[0][0] = newRight.x;
+    matrix.m[0][1] = newRight.y;
+    matrix.m[0][2] = newRight.z;
+    matrix.m[0][3] = 0.0f;
+    matrix.m[1][0] = newUp.x;
+    matrix.m[1][1] = newUp.y;
+    matrix.m[1][2] = newUp.z;
+    matrix.m[1][3] = 0.0f;
+    matrix.m[2][0] = newForward.x;
+    matrix.m[2][1] = newForward.y;
+    matrix.m[2][2] = newForward.z;
+    matrix.m[2][3] = 0.0f;
+    matrix.m[3][0] = pos.x;
+    matrix.m[3][1] = pos.y;
+    matrix.m[3][2] = pos.z;
+    matrix.m[3][3] = 1.0f;
+    return matrix;
+  }
+
+  mat4x4 Matrix_MakeIdentity() {
+    mat4x4 matrix;
+    matrix.m[0][0] = 1.0f;
+    matrix.m[1][1] = 1.0f;
+    matrix.m[2][2] = 1.0f;
+    matrix.m[3][3] = 1.0f;
+    return matrix;
+  }
+
+  mat4x4 Matrix_MakeRotationX(float fAngleRad) {
+    mat4x4 matrix;
+    matrix.m[0][0] = 1.0f;
+    matrix.m[1][1] = cosf(fAngleRad);
+    matrix.m[1][2] = sinf(fAngleRad);
+    matrix.m[2][1] = -sinf(fAngleRad);
+    matrix.m[2][2] = cosf(fAngleRad);
+    matrix.m[3][3] = 1.0f;
+    return matrix;
+  }
+
+  mat4x4 Matrix_MakeRotationY(float fAngleRad) {
+    mat4x4 matrix;
+    matrix.m[0][0] = cosf(fAngleRad);
+    matrix.m[0][2] = sinf(fAngleRad);
+    matrix.m[2][0] = -sinf(fAngleRad);
+    matrix.m[1][1] = 1.0f;
+    matrix.m[2][2] = cosf(fAngleRad);
+    matrix.m[3][3] = 1.0f;
+    return matrix;
+  }
+
+  mat4x4 Matrix_MakeRotationZ(float fAngleRad) {
+    mat4x4 matrix;
+    matrix.m[0][0] = cosf(fAngleRad);
+    matrix.m[0][1] = sinf(fAngleRad);
+    matrix.m[1][0] = -sinf(fAngleRad);
+    matrix.m[1][1] = cosf(fAngleRad);
+    matrix.m[2][2] = 1.0f;
+    matrix.m[3][3] = 1.0f;
+    return matrix;
+  }
+
+  mat4x4 Matrix_MakeTranslation(float x, float y, float z) {
+    mat4x4 matrix;
+    matrix.m[0][0] = 1.0f;
+    matrix.m[1][1] = 1.0f;
+    matrix.m[2][2] = 1.0f;
+    matrix.m[3][3] = 1.0f;
+    matrix.m[3][0] = x;
+    matrix.m[3][1] = y;
+    matrix.m[3][2] = z;
+    return matrix;
+  }
+
+  mat4x4 Matrix_MakeProjection(float fFovDegrees, float fAspectRatio,
+                               float fNear, float fFar) {
+    float fFovRad = 1.0f / tanf(fFovDegrees * 0.5f / 180.0f * 3.14159f);
+    mat4x4 matrix;
+    matrix.m[0][0] = fAspectRatio * fFovRad;
+    matrix.m[1][1] = fFovRad;
+    matrix.m[2][2] = fFar / (fFar - fNear);
+    matrix.m[3][2] = (-fFar * fNear) / (fFar - fNear);
+    matrix.m[2][3] = 1.0f;
+    matrix.m[3][3] = 0.0f;
+    return matrix;
+  }
+
+  mat4x4 Matrix_MultiplyMatrix(mat4x4 &m1, mat4x4 &m2) {
+    mat4x4 matrix;
+    for (int c = 0; c < 4; c++)
+      for (int r = 0; r < 4; r++)
+        matrix.m[r][c] = m1.m[r][0] * m2.m[0][c] + m1.m[r][1] * m2.m[1][c] +
+                         m1.m[r][2] * m2.m[2][c] + m1.m[r][3] * m2.m[3][c];
+    return matrix;
+  }
+
+  mat4x4
+  Matrix_QuickInverse(mat4x4 &m) // Only for Rotation/Translation Matrices
+  {
+    mat4x4 matrix;
+    matrix.m[0][0] = m.m[0][0];
+    matrix.m[0][1] = m.m[1][0];
+    matrix.m[0][2] = m.m[2][0];
+    matrix.m[0][3] = 0.0f;
+    matrix.m[1][0] = m.m[0][1];
+    matrix.m[1][1] = m.m[1][1];
+    matrix.m[1][2] = m.m[2][1];
+    matrix.m[1][3] = 0.0f;
+    matrix.m[2][0] = m.m[0][2];
+    matrix.m[2][1] = m.m[1][2];
+    matrix.m[2][2] = m.m[2][2];
+    matrix.m[2][3] = 0.0f;
+    matrix.m[3][0] = -(m.m[3][0] * matrix.m[0][0] + m.m[3][1] * matrix.m[1][0] +
+                       m.m[3][2] * matrix.m[2][0]);
+    matrix.m[3][1] = -(m.m[3][0] * matrix.m[0][1] + m.m[3][1] * matrix.m[1][1] +
+                       m.m[3][2] * matrix.m[2][1]);
+    matrix.m[3][2] = -(m.m[3][0] * matrix.m[0][2] + m.m[3][1] * matrix.m[1][2] +
+                       m.m[3][2] * matrix.m[2][2]);
+    matrix.m[3][3] = 1.0f;
+    return matrix;
+  }
+
+  vec3d Vector_Add(vec3d &v1, vec3d &v2) {
+    return {v1.x + v2.x, v1.y + v2.y, v1.z + v2.z};
+  }
+
+  vec3d Vector_Sub(vec3d &v1, vec3d &v2) {
+    return {v1.x - v2.x, v1.y - v2.y, v1.z - v2.z};
+  }
+
+  vec3d Vector_Mul(vec3d &v1, float k) {
+    return {v1.x * k, v1.y * k, v1.z * k};
+  }
+
+  vec3d Vector_Div(vec3d &v1, float k) {
+    return {v1.x / k, v1.y / k, v1.z / k};
+  }
+
+  float Vector_DotProduct(vec3d &v1, vec3d &v2) {
+    return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
+  }
+
+  float Vector_Length(vec3d &v) { return sqrtf(Vector_DotProduct(v, v)); }
+
+  vec3d Vector_Normalise(vec3d &v) {
+    float l = Vector_Length(v);
+    return {v.x / l, v.y / l, v.z / l};
+  }
+
+  vec3d Vector_CrossProduct(vec3d &v1, vec3d &v2) {
+    vec3d v;
+    v.x = v1.y * v2.z - v1.z * v2.y;
+    v.y = v1.z * v2.x - v1.x * v2.z;
+    v.z = v1.x * v2.y - v1.y * v2.x;
+    return v;
+  }
+
+  vec3d Vector_IntersectPlane(vec3d &plane_p, vec3d &plane_n, vec3d &lineStart,
+                              vec3d &lineEnd) {
+    plane_n = Vector_Normalise(plane_n);
+    float plane_d = -Vector_DotProduct(plane_n, plane_p);
+    float ad = Vector_DotProduct(lineStart, plane_n);
+    float bd = Vector_DotProduct(lineEnd, plane_n);
+    float t = (-plane_d - ad) / (bd - ad);
+    vec3d lineStartToEnd = Vector_Sub(lineEnd, lineStart);
+    vec3d lineToIntersect = Vector_Mul(lineStartToEnd, t);
+    return Vector_Add(lineStart, lineToIntersect);
+  }
+
+  int Triangle_ClipAgainstPlane(vec3d plane_p, vec3d plane_n, triangle &in_tri,
+                                triangle &out_tri1, triangle &out_tri2) {
+    plane_n = Vector_Normalise(plane_n);
+
+    auto dist = [&](vec3d &p) {
+      vec3d n = Vector_Normalise(p);
+      (void)n;
+      return (plane_n.x * p.x + plane_n.y * p.y + plane_n.z * p.z -
+              Vector_DotProduct(plane_n, plane_p));
+    };
+
+    vec3d *inside_points[3];
+    int nInsidePointCount = 0;
+    vec3d *outside_points[3];
+    int nOutsidePointCount = 0;
+
+    float d0 = dist(in_tri.p[0]);
+    float d1 = dist(in_tri.p[1]);
+    float d2 = dist(in_tri.p[2]);
+
+    if (d0 >= 0) {
+      inside_points[nInsidePointCount++] = &in_tri.p[0];
+    } else {
+      outside_points[nOutsidePointCount++] = &in_tri.p[0];
+    }
+    if (d1 >= 0) {
+      inside_points[nInsidePointCount++] = &in_tri.p[1];
+    } else {
+      outside_points[nOutsidePointCount++] = &in_tri.p[1];
+    }
+    if (d2 >= 0) {
+      inside_points[nInsidePointCount++] = &in_tri.p[2];
+    } else {
+      outside_points[nOutsidePointCount++] = &in_tri.p[2];
+    }
+
+    if (nInsidePointCount == 0) {
+      return 0;
+    }
+    if (nInsidePointCount == 3) {
+      out_tri1 = in_tri;
+      return 1;
+    }
+    if (nInsidePointCount == 1 && nOutsidePointCount == 2) {
+      out_tri1.illumination = in_tri.illumination;
+
+      out_tri1.p[0] = *inside_points[0];
+
+      out_tri1.p[1] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0],
+                                            *outside_points[0]);
+      out_tri1.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0],
+                                            *outside_points[1]);
+      return 1;
+    }
+
+    if (nInsidePointCount == 2 && nOutsidePointCount == 1) {
+      out_tri1.illumination = in_tri.illumination;
+      out_tri2.illumination = in_tri.illumination;
+
+      out_tri1.p[0] = *inside_points[0];
+      out_tri1.p[1] = *inside_points[1];
+      out_tri1.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0],
+                                            *outside_points[0]);
+
+      out_tri2.p[0] = *inside_points[1];
+      out_tri2.p[1] = out_tri1.p[2];
+      out_tri2.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[1],
+                                            *outside_points[0]);
+
+      return 2;
+    }
+    return 0;
+  }
+
+private:
+  // World-space culling, lighting, view transform, near clipping and
+  // projection of one model-space triangle; survivors are appended to
+  // vecTrianglesToRaster in screen space.
+  void ProjectTriangle(triangle &tri,
+                       std::vector<triangle> &vecTrianglesToRaster) {
+    triangle triTransformed;
+
+    triTransformed.p[0] = Matrix_MultiplyVector(matWorld, tri.p[0]);
+    triTransformed.p[1] = Matrix_MultiplyVector(matWorld, tri.p[1]);
+    triTransformed.p[2] = Matrix_MultiplyVector(matWorld, tri.p[2]);
+
+    ProjectWorldTriangle(triTransformed, vecTrianglesToRaster);
+  }
+
+  // ProjectTriangle() for a triangle already in world space.
+  void ProjectWorldTriangle(triangle &triTransformed,
+                            std::vector<triangle> &vecTrianglesToRaster) {
+    nTrianglesSubmitted++;
+    vec3d normal, line1, line2;
+
+    line1 = Vector_Sub(triTransformed.p[1], triTransformed.p[0]);
+    line2 = Vector_Sub(triTransformed.p[2], triTransformed.p[0]);
+
+    normal = Vector_CrossProduct(line1, line2);
+
+    normal = Vector_Normalise(normal);
+
+    vec3d vCameraRay = Vector_Sub(triTransformed.p[0], vCamera);
+
+    if (Vector_DotProduct(normal, vCameraRay) < 0.0f) {
+      float fLight = lighting.shadeOne(normal, TriangleCentre(triTransformed));
+      float fLights[3] = {fLight, fLight, fLight};
+      ProjectLitTriangle(triTransformed, fLights, vecTrianglesToRaster);
+    }
+  }
+
+  vec3d TriangleCentre(const triangle &tri) {
+    return {(tri.p[0].x + tri.p[1].x + tri.p[2].x) / 3.0f,
+            (tri.p[0].y + tri.p[1].y + tri.p[2].y) / 3.0f,
+            (tri.p[0].z + tri.p[1].z + tri.p[2].z) / 3.0f};
+  }
+
+  // View transform, near clipping and projection of a visible world-space
+  // triangle lit with fLights at its three corners.
+  void ProjectLitTriangle(triangle &triTransformed, const float *fLights,
+                          std::vector<triangle> &vecTrianglesToRaster) {
+    ProjectLitTriangle(triTransformed, fLights, matView, matProj,
+                       (float)this->width, (float)this->height,
+                       vecTrianglesToRaster, vecVertexLight);
+  }
+
+  // The same through any camera onto a fWidth x fHeight target, appending
+  // the three lights of each piece to vecPieceLight. It touches nothing but
+  // its arguments, so the views can call it in parallel.
+  void ProjectLitTriangle(triangle &triTransformed, const float *fLights,
+                          mat4x4 &matCameraView, mat4x4 &matCameraProj,
+                          float fWidth, float fHeight,
+                          std::vector<triangle> &vecTrianglesToRaster,
+                          std::vector<float> &vecPieceLight) {
+    triangle triProjected, triViewed;
+
+    triViewed.p[0] = Matrix_MultiplyVector(matCameraView, triTransformed.p[0]);
+    triViewed.p[1] = Matrix_MultiplyVector(matCameraView, triTransformed.p[1]);
+    triViewed.p[2] = Matrix_MultiplyVector(matCameraView, triTransformed.p[2]);
+
+    int nClippedTriangles = 0;
+    triangle clipped[2];
+    nClippedTriangles =
+        Triangle_ClipAgainstPlane({0.0f, 0.0f, 0.1f}, {0.0f, 0.0f, 1.0f},
+                                  triViewed, clipped[0], clipped[1]);
+
+    for (int n = 0; n < nClippedTriangles; n++) {
+      triProjected.p[0] = Matrix_MultiplyVector(matCameraProj, clipped[n].p[0]);
+      triProjected.p[1] = Matrix_MultiplyVector(matCameraProj, clipped[n].p[1]);
+      triProjected.p[2] = Matrix_MultiplyVector(matCameraProj, clipped[n].p[2]);
+
+      triProjected.p[0] = Vector_Div(triProjected.p[0], triProjected.p[0].w);
+      triProjected.p[1] = Vector_Div(triProjected.p[1], triProjected.p[1].w);
+      triProjected.p[2] = Vector_Div(triProjected.p[2], triProjected.p[2].w);
+
+      vec3d vOffsetView = {1, 1, 0};
+      triProjected.p[0] = Vector_Add(triProjected.p[0], vOffsetView);
+      triProjected.p[1] = Vector_Add(triProjected.p[1], vOffsetView);
+      triProjected.p[2] = Vector_Add(triProjected.p[2], vOffsetView);
+      triProjected.p[0].x *= 0.5f * fWidth;
+      triProjected.p[0].y *= 0.5f * fHeight;
+      triProjected.p[1].x *= 0.5f * fWidth;
+      triProjected.p[1].y *= 0.5f * fHeight;
+      triProjected.p[2].x *= 0.5f * fWidth;
+      triProjected.p[2].y *= 0.5f * fHeight;
+
+      // Flat shading, and MSAA, take the first corner's light.
+      triProjected.illumination = fLights[0];
+      vecTrianglesToRaster.push_back(triProjected);
+      vecPieceLight.insert(vecPieceLight.end(), fLights, fLights + 3);
+    }
+  }
+
+  // Brings the world-space normal caches up to date for the given
+  // model-space normals, which belong to pEdited if it is an editable mesh.
+  void UpdateWorldNormals(const void *pSource,
+                          const std::vector<vec3d> &vecFaceNormals,
+                          const std::vector<vec3d> &vecVertexNormals,
+                          const mesh *pEdited = nullptr) {
+    bool bCurrent = pSource == pNormalSource &&
+                    memcmp(&matNormalWorld, &matWorld, sizeof(mat4x4)) == 0;
+    // Rotations keep normals unit length; anything else is renormalised.
+    bool bRigid = true;
+    for (int r = 0; r < 3; r++) {
+      float fLength = matWorld.m[r][0] * matWorld.m[r][0] +
+                      matWorld.m[r][1] * matWorld.m[r][1] +
+                      matWorld.m[r][2] * matWorld.m[r][2];
+      bRigid = bRigid && fabsf(fLength - 1.0f) < 1e-5f;
+    }
+    auto transformRange = [&](const std::vector<vec3d> &in,
+                              std::vector<vec3d> &out, size_t nFirst,
+                              size_t nEnd) {
+      for (size_t i = nFirst; i < nEnd; i++) {
+        vec3d n = in[i];
+        n.w = 0.0f;
+        out[i] = Matrix_MultiplyVector(matWorld, n);
+        if (!bRigid && (out[i].x != 0 || out[i].y != 0 || out[i].z != 0))
+          out[i] = Vector_Normalise(out[i]);
+      }
+    };
+    auto transform = [&](const std::vector<vec3d> &in,
+                         std::vector<vec3d> &out) {
+      out.resize(in.size());
+      transformRange(in, out, 0, in.size());
+    };
+    if (bCurrent && pEdited && pEdited->revision != nNormalRevision) {
+      // Only the edited normals, as long as the mesh still has the list.
+      vecWorldFaceNormals.resize(vecFaceNormals.size());
+      if (bWorldVertexNormals)
+        vecWorldVertexNormals.resize(vecVertexNormals.size());
+      auto vertices = [&](size_t nFirst, size_t nEnd) {
+        if (!bWorldVertexNormals)
+          return;
+        for (size_t i = nFirst * 3; i < nEnd * 3; i++) {
+          size_t v = pEdited->normalIndices[i];
+          transformRange(vecVertexNormals, vecWorldVertexNormals, v, v + 1);
+        }
+      };
+      bCurrent = pEdited->EditsSince(nNormalRevision, [&](const mesh::Edit &e) {
+        size_t nEnd = std::min<size_t>(e.end, vecFaceNormals.size());
+        if (e.kind == mesh::Edit::VERTICES) {
+          if (bWorldVertexNormals)
+            transformRange(vecVertexNormals, vecWorldVertexNormals, e.first,
+                           std::min<size_t>(e.end, vecVertexNormals.size()));
+        } else if (e.first < nEnd) {
+          transformRange(vecFaceNormals, vecWorldFaceNormals, e.first, nEnd);
+          vertices(e.first, nEnd);
+        }
+      });
+    }
+    if (pEdited)
+      nNormalRevision = pEdited->revision;
+    // Vertex normals are only needed for Gouraud shading.
+    bool bVertices = bGouraud && (!bCurrent || !bWorldVertexNormals);
+    if (bCurrent && !bVertices)
+      return;
+    if (!bCurrent) {
+      transform(vecFaceNormals, vecWorldFaceNormals);
+      pNormalSource = pSource;
+      matNormalWorld = matWorld;
+      bWorldVertexNormals = false;
+    }
+    if (bVertices) {
+      transform(vecVertexNormals, vecWorldVertexNormals);
+      bWorldVertexNormals = true;
+    }
+  }
+
+  void DeriveCompactNormals(const CompactMesh &compact) {
+    pCompactNormals = &compact;
+    compact.DecodeNormals(vecCompactVertexNormals);
+    std::vector<vec3d> vecModelVerts;
+    compact.TransformPositions(Matrix_MakeIdentity(), vecModelVerts);
+    vecCompactFaceNormals.resize(compact.triangleCount);
+    for (size_t i = 0; i < compact.triangleCount; i++) {
+      Uint32 a, b, c;
+      if (compact.indices16.empty()) {
+        a = compact.indices32[i * 3];
+        b = compact.indices32[i * 3 + 1];
+        c = compact.indices32[i * 3 + 2];
+      } else {
+        a = compact.indices16[i * 3];
+        b = compact.indices16[i * 3 + 1];
+        c = compact.indices16[i * 3 + 2];
+      }
+      vec3d line1 = Vector_Sub(vecModelVerts[b], vecModelVerts[a]);
+      vec3d line2 = Vector_Sub(vecModelVerts[c], vecModelVerts[a]);
+      vec3d normal = Vector_CrossProduct(line1, line2);
+      vecCompactFaceNormals[i] = Vector_Normalise(normal);
+    }
+  }
+
+  // The light at screen point p of a piece clipped from `tri`, interpolated
+  // from fLights at its corners.
+  float LightAt(const triangle &tri, const float *fLights, const vec3d &p) {
+    for (int k = 0; k < 3; k++)
+      if (p.x == tri.p[k].x && p.y == tri.p[k].y)
+        return fLights[k];
+    const vec3d &a = tri.p[0], &b = tri.p[1], &c = tri.p[2];
+    float fDet = (b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y);
+    if (fDet == 0.0f)
+      return fLights[0];
+    float fB = ((p.x - a.x) * (c.y - a.y) - (c.x - a.x) * (p.y - a.y)) / fDet;
+    float fC = ((b.x - a.x) * (p.y - a.y) - (p.x - a.x) * (b.y - a.y)) / fDet;
+    return fLights[0] + fB * (fLights[1] - fLights[0]) +
+           fC * (fLights[2] - fLights[0]);
+  }
+
+  // True if the side of a world-space triangle with this normal, through
+  // point p, faces the camera at vFrom. Degenerate triangles, whose normal
+  // is NaN, count as facing it.
+  bool FacesCamera(vec3d &normal, vec3d &p, vec3d &vFrom) {
+    vec3d vCameraRay = Vector_Sub(p, vFrom);
+    return !(Vector_DotProduct(normal, vCameraRay) >= 0.0f);
+  }
+
+  // Clips a screen-space triangle to the edges of a fWidth x fHeight
+  // target and appends the pieces to listTriangles.
+  void ClipToScreen(triangle &tri, float fWidth, float fHeight,
+                    std::list<triangle> &listTriangles) {
+    triangle clipped[2];
+    listTriangles.push_back(tri);
+    int nNewTriangles = 1;
+
+    for (int p = 0; p < 4; p++) {
+      int nTrisToAdd = 0;
+      while (nNewTriangles > 0) {
+        triangle test = listTriangles.front();
+        listTriangles.pop_front();
+        nNewTriangles--;
+
+        switch (p) {
+        case 0:
+          nTrisToAdd = Triangle_ClipAgainstPlane({0.0f, 0.0f, 0.0f},
+                                                 {0.0f, 1.0f, 0.0f}, test,
+                                                 clipped[0], clipped[1]);
+          break;
+        case 1:
+          nTrisToAdd = Triangle_ClipAgainstPlane(
+              {0.0f, fHeight - 1, 0.0f}, {0.0f, -1.0f, 0.0f}, test,
+              clipped[0], clipped[1]);
+          break;
+        case 2:
+          nTrisToAdd = Triangle_ClipAgainstPlane({0.0f, 0.0f, 0.0f},
+                                                 {1.0f, 0.0f, 0.0f}, test,
+                                                 clipped[0], clipped[1]);
+          break;
+        case 3:
+          nTrisToAdd = Triangle_ClipAgainstPlane(
+              {fWidth - 1, 0.0f, 0.0f}, {-1.0f, 0.0f, 0.0f}, test,
+              clipped[0], clipped[1]);
+          break;
+        }
+
+        for (int w = 0; w < nTrisToAdd; w++) {
+          listTriangles.push_back(clipped[w]);
+        }
+      }
+      nNewTriangles = listTriangles.size();
+    }
+  }
+
+  // Rasterizes piece t, clipped from triToRaster, into `target`, lit flat or
+  // from fLights at the corners of triToRaster.
+  void RasterLitPiece(Framebuffer &target, RasterFunction raster,
+                      const triangle &triToRaster, const float *fLights,
+                      const triangle &t) {
+    if (bGouraud) {
+      raster(target,
+             {t.p[0].x, t.p[0].y, t.p[0].z,
+              LightAt(triToRaster, fLights, t.p[0])},
+             {t.p[1].x, t.p[1].y, t.p[1].z,
+              LightAt(triToRaster, fLights, t.p[1])},
+             {t.p[2].x, t.p[2].y, t.p[2].z,
+              LightAt(triToRaster, fLights, t.p[2])},
+             0xffffff00 | static_cast<Uint32>(0xff * fAlpha));
+    } else {
+      raster(target, {t.p[0].x, t.p[0].y, t.p[0].z, t.illumination},
+             {t.p[1].x, t.p[1].y, t.p[1].z, t.illumination},
+             {t.p[2].x, t.p[2].y, t.p[2].z, t.illumination},
+             0xffffff00 | static_cast<Uint32>(0xff * fAlpha));
+    }
+  }
+
+  // Rasterizes the frame's triangles into the depth buffer, then draws
+  // their colour with `raster`, which tests for equal depth. Each is clipped
+  // to the screen once and both passes draw the same pieces.
+  void DrawWithPrepass(RasterFunction raster,
+                       std::vector<triangle> &vecTrianglesToRaster) {
+    vecPrepassPieces.clear();
+    vecPrepassSource.clear();
+    for (Uint32 nTriangle = 0; nTriangle < vecTrianglesToRaster.size();
+         nTriangle++) {
+      std::list<triangle> listTriangles;
+      ClipToScreen(vecTrianglesToRaster[nTriangle], (float)this->width,
+                   (float)this->height, listTriangles);
+      for (auto &t : listTriangles) {
+        rasterDepth(*this, {t.p[0].x, t.p[0].y, t.p[0].z, 0.0f},
+                    {t.p[1].x, t.p[1].y, t.p[1].z, 0.0f},
+                    {t.p[2].x, t.p[2].y, t.p[2].z, 0.0f});
+        vecPrepassPieces.push_back(t);
+        vecPrepassSource.push_back(nTriangle);
+      }
+    }
+    for (size_t i = 0; i < vecPrepassPieces.size(); i++) {
+      Uint32 nTriangle = vecPrepassSource[i];
+      RasterLitPiece(*this, raster, vecTrianglesToRaster[nTriangle],
+                     &vecVertexLight[(size_t)nTriangle * 3],
+                     vecPrepassPieces[i]);
+    }
+  }
+
+  // The lights at the corners of lit triangle i of the frame; fFlat holds
+  // them when the triangle is lit flat.
+  const float *LitTriangleLights(size_t i, float *fFlat) {
+    if (bGouraud)
+      return &vecLight[i * 3];
+    fFlat[0] = fFlat[1] = fFlat[2] = vecLight[i];
+    return fFlat;
+  }
+
+  // Culls, projects, depth sorts and rasterizes the lit triangles of the
+  // shared pass for one view, into its target.
+  void DrawView(Viewport &view, RasterFunction raster) {
+    Timer timer;
+    Framebuffer &target = view.target;
+    // Only the tiles the view drew into last frame.
+    target.clearTouched(0x000000ff);
+
+    vec3d vUp = {0, 1, 0};
+    vec3d vTarget = {0, 0, 1};
+    mat4x4 matCameraRot = Matrix_MakeRotationY(view.yaw);
+    vec3d vViewDir = Matrix_MultiplyVector(matCameraRot, vTarget);
+    vTarget = Vector_Add(view.camera, vViewDir);
+    mat4x4 matCamera = Matrix_PointAt(view.camera, vTarget, vUp);
+    mat4x4 matCameraView = Matrix_QuickInverse(matCamera);
+    mat4x4 matCameraProj = Matrix_MakeProjection(
+        90.0f, (float)target.height / (float)target.width, 0.1f, 1000.0f);
+
+    view.triangles.clear();
+    view.light.clear();
+    for (size_t i = 0; i < vecLitTriangles.size(); i++) {
+      triangle &tri = vecLitTriangles[i];
+      if (!FacesCamera(vecLitNormals[i], tri.p[0], view.camera))
+        continue;
+      float fFlat[3];
+      ProjectLitTriangle(tri, LitTriangleLights(i, fFlat), matCameraView,
+                         matCameraProj, (float)target.width,
+                         (float)target.height, view.triangles, view.light);
+    }
+    view.trianglesDrawn = view.triangles.size();
+    view.projectMs = timer.elapsedMs();
+    timer.reset();
+
+    view.sorter.sortBackToFront(view.triangles, view.order);
+    view.sortMs = timer.elapsedMs();
+    timer.reset();
+
+    for (Uint32 nTriangle : view.order) {
+      triangle &triToRaster = view.triangles[nTriangle];
+      const float *fLights = &view.light[(size_t)nTriangle * 3];
+      std::list<triangle> listTriangles;
+      ClipToScreen(triToRaster, (float)target.width, (float)target.height,
+                   listTriangles);
+      for (auto &t : listTriangles)
+        RasterLitPiece(target, raster, triToRaster, fLights, t);
+    }
+    view.rasterMs = timer.elapsedMs();
+  }
+
+  // Fills the pixels no view covers with the clear colour, row by row, and
+  // resets the tile flags; copying the views in flags their tiles again.
+  void ClearAroundViews() {
+    for (int y = 0; y < this->height; y++) {
+      vecViewSpans.clear();
+      for (Viewport &view : vecViews) {
+        int left, top, right, bottom;
+        view.area(this->width, this->height, left, top, right, bottom);
+        if (y >= top && y < bottom && left < right)
+          vecViewSpans.push_back({left, right});
+      }
+      std::sort(vecViewSpans.begin(), vecViewSpans.end());
+      Uint32 *row = &this->color[(size_t)y * this->width];
+      int x = 0;
+      for (auto &span : vecViewSpans) {
+        if (span.first > x)
+          std::fill(row + x, row + span.first, this->clearColor);
+        x = std::max(x, span.second);
+      }
+      std::fill(row + x, row + this->width, this->clearColor);
+    }
+    std::fill(this->tileTouched.begin(), this->tileTouched.end(), 0);
+  }
+
+  // Draws every view of vecViews on the workers and copies them into place,
+  // clearing whatever they leave uncovered meanwhile. The framebuffer's own
+  // depth is not used.
+  void DrawViews(RasterFunction raster) {
+    if (!pWorkers)
+      pWorkers = std::make_unique<ThreadPool>();
+    for (Viewport &view : vecViews) {
+      int left, top, right, bottom;
+      view.area(this->width, this->height, left, top, right, bottom);
+      if (right - left != view.target.width ||
+          bottom - top != view.target.height)
+        view.target.resize(right - left, bottom - top);
+      if (right == left || bottom == top) {
+        view.trianglesDrawn = 0;
+        continue;
+      }
+      pWorkers->submit(
+          [this, &view, raster](int) { DrawView(view, raster); });
+    }
+    ClearAroundViews();
+    pWorkers->wait();
+    nTrianglesDrawn = 0;
+    for (Viewport &view : vecViews) {
+      view.present(*this);
+      nTrianglesDrawn += view.trianglesDrawn;
+    }
+  }
+
+  // Culls the triangles of a mesh with cached normals against the camera,
+  // lights the visible ones as one batch and projects them. triangleAt(i)
+  // gives triangle i in world space and corner(i, k) the index of its k-th
+  // vertex normal. In the shared pass for several views, a triangle is kept
+  // if any view could see it, and projection is left to DrawView().
+  template <typename TriangleFn, typename CornerFn>
+  void ProjectMesh(size_t nTriangles, TriangleFn triangleAt, CornerFn corner,
+                   std::vector<triangle> &vecTrianglesToRaster) {
+    nTrianglesSubmitted += nTriangles;
+    vecLitTriangles.clear();
+    vecLitNormals.clear();
+    lightingInputs.clear();
+    bool bShadowed = bShadows && !lighting.lights.empty() &&
+                     lighting.lights[0].type == Light::DIRECTIONAL;
+    if (bShadowed)
+      DrawShadowMap(nTriangles, triangleAt);
+    for (size_t i = 0; i < nTriangles; i++) {
+      triangle tri = bShadowed ? vecShadowCasters[i] : triangleAt(i);
+      vec3d &normal = vecWorldFaceNormals[i];
+      bool bVisible = false;
+      if (bSharedPass) {
+        for (size_t v = 0; v < vecViews.size() && !bVisible; v++)
+          bVisible = FacesCamera(normal, tri.p[0], vecViews[v].camera);
+      } else {
+        bVisible = FacesCamera(normal, tri.p[0], vCamera);
+      }
+      if (!bVisible)
+        continue;
+      vecLitTriangles.push_back(tri);
+      if (bSharedPass)
+        vecLitNormals.push_back(normal);
+      if (bGouraud) {
+        for (int k = 0; k < 3; k++) {
+          vec3d &n = vecWorldVertexNormals[corner(i, k)];
+          lightingInputs.add(n, tri.p[k]);
+          if (bShadowed)
+            lightingInputs.shadow.push_back(shadowMap.lit(tri.p[k], n));
+        }
+      } else {
+        vec3d vCentre = TriangleCentre(tri);
+        lightingInputs.add(normal, vCentre);
+        if (bShadowed)
+          lightingInputs.shadow.push_back(shadowMap.lit(vCentre, normal));
+      }
+    }
+
+    vecLight.resize(lightingInputs.size());
+    lighting.shade(lightingInputs, vecLight.data());
+    if (bSharedPass)
+      return;
+    for (size_t i = 0; i < vecLitTriangles.size(); i++) {
+      float fFlat[3];
+      ProjectLitTriangle(vecLitTriangles[i], LitTriangleLights(i, fFlat),
+                         vecTrianglesToRaster);
+    }
+  }
+
+  // Draws the nTriangles world-space triangles given by triangleAt(i) into
+  // the shadow map, fitted around them, and keeps them in vecShadowCasters.
+  // The map is only redrawn when the casters, the light or the map size
+  // changed since the last frame.
+  template <typename TriangleFn>
+  void DrawShadowMap(size_t nTriangles, TriangleFn triangleAt) {
+    const vec3d &vLight = lighting.lights[0].v;
+    bool bSame = vecShadowCasters.size() == nTriangles &&
+                 shadowMap.size == nShadowMapSize &&
+                 vLight.x == vShadowLight.x && vLight.y == vShadowLight.y &&
+                 vLight.z == vShadowLight.z;
+    vecShadowCasters.resize(nTriangles);
+    vec3d vMin = {INFINITY, INFINITY, INFINITY};
+    vec3d vMax = {-INFINITY, -INFINITY, -INFINITY};
+    for (size_t i = 0; i < nTriangles; i++) {
+      triangle tri = triangleAt(i);
+      for (int k = 0; k < 3 && bSame; k++)
+        bSame = tri.p[k].x == vecShadowCasters[i].p[k].x &&
+                tri.p[k].y == vecShadowCasters[i].p[k].y &&
+                tri.p[k].z == vecShadowCasters[i].p[k].z;
+      vecShadowCasters[i] = tri;
+      for (vec3d &p : vecShadowCasters[i].p) {
+        vMin = {std::min(vMin.x, p.x), std::min(vMin.y, p.y),
+                std::min(vMin.z, p.z)};
+        vMax = {std::max(vMax.x, p.x), std::max(vMax.y, p.y),
+                std::max(vMax.z, p.z)};
+      }
+    }
+    vec3d vCentre = {(vMin.x + vMax.x) * 0.5f, (vMin.y + vMax.y) * 0.5f,
+                     (vMin.z + vMax.z) * 0.5f};
+    if (bSame)
+      return;
+    vShadowLight = vLight;
+    vec3d vExtent = Vector_Sub(vMax, vCentre);
+    shadowMap.resize(nShadowMapSize);
+    shadowMap.aim(vLight, vCentre,
+                  nTriangles ? Vector_Length(vExtent) : 1.0f);
+    for (const triangle &tri : vecShadowCasters)
+      shadowMap.add(tri);
+  }
+
+  void DrawPoints() {
+    vec3d vMin = pPoints->boundsMin, vMax = pPoints->boundsMax;
+    float fExtent = std::max({vMax.x - vMin.x, vMax.y - vMin.y,
+                              vMax.z - vMin.z, 1e-6f});
+    float fScale = 2.0f / fExtent;
+    mat4x4 matFit = Matrix_MakeTranslation(-0.5f * (vMin.x + vMax.x),
+                                           -0.5f * (vMin.y + vMax.y),
+                                           -0.5f * (vMin.z + vMax.z));
+    mat4x4 matScale = Matrix_MakeIdentity();
+    matScale.m[0][0] = matScale.m[1][1] = matScale.m[2][2] = fScale;
+    matFit = Matrix_MultiplyMatrix(matFit, matScale);
+    mat4x4 matModel = Matrix_MultiplyMatrix(matFit, matWorld);
+    mat4x4 matModelView = Matrix_MultiplyMatrix(matModel, matView);
+    mat4x4 matMvp = Matrix_MultiplyMatrix(matModelView, matProj);
+    if (!pWorkers)
+      pWorkers = std::make_unique<ThreadPool>();
+    pPoints->Render(*this, matMvp, 0.1f, std::max(nPointSize, 1),
+                    pWorkers.get());
+  }
+
+  // Skins pSkinned into world space and projects it. Its normals change
+  // every frame, so they replace whatever the normal caches held.
+  void ProjectSkinned(std::vector<triangle> &vecTrianglesToRaster) {
+    const SkinnedMesh &skinned = *pSkinned;
+    if (!pWorkers)
+      pWorkers = std::make_unique<ThreadPool>();
+    Timer timer;
+    // matWorld follows the roots, so the vertices come out in world space.
+    skinned.skeleton.Pose(vecJointPose, matWorld, vecSkinPalette);
+    skinned.Deform(vecSkinPalette, vecMorphWeights, skinnedVertices,
+                   pWorkers.get());
+    fSkinningMs += timer.elapsedMs();
+    nSkinnedVertices += skinned.vertexCount();
+
+    const VertexStreams &v = skinnedVertices;
+    vecWorldVerts.resize(v.size());
+    for (size_t i = 0; i < v.size(); i++)
+      vecWorldVerts[i] = {v.x[i], v.y[i], v.z[i]};
+    if (bGouraud) {
+      vecWorldVertexNormals.resize(v.size());
+      for (size_t i = 0; i < v.size(); i++)
+        vecWorldVertexNormals[i] = {v.nx[i], v.ny[i], v.nz[i], 0.0f};
+    }
+    pNormalSource = nullptr;
+    const Uint32 *indices = skinned.indices.data();
+    vecWorldFaceNormals.resize(skinned.triangleCount());
+    for (size_t i = 0; i < skinned.triangleCount(); i++) {
+      vec3d &a = vecWorldVerts[indices[i * 3]];
+      vec3d line1 = Vector_Sub(vecWorldVerts[indices[i * 3 + 1]], a);
+      vec3d line2 = Vector_Sub(vecWorldVerts[indices[i * 3 + 2]], a);
+      vec3d normal = Vector_CrossProduct(line1, line2);
+      vecWorldFaceNormals[i] = Vector_Normalise(normal);
+    }
+    ProjectMesh(
+        skinned.triangleCount(),
+        [&](size_t i) {
+          const Uint32 *t = indices + i * 3;
+          return triangle{
+              {vecWorldVerts[t[0]], vecWorldVerts[t[1]], vecWorldVerts[t[2]]}};
+        },
+        [&](size_t i, int k) { return indices[i * 3 + k]; },
+        vecTrianglesToRaster);
+  }
+
+public:
+  void SetCamera(vec3d position, float yaw) {
+    vCamera = position;
+    fYaw = yaw;
+  }
+
+  // Streams the mesh from a brick file, keeping at most nResidentBytes of
+  // it in memory. Call before OnUserCreate().
+  bool LoadBricks(const std::string &sBrickFile, Uint64 nResidentBytes) {
+    pBricks = std::make_unique<BrickStreamer>(nResidentBytes);
+    if (!pBricks->open(sBrickFile)) {
+      pBricks = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  // Draws a procedural terrain of nSize x nSize heights, keeping the full
+  // heights of at most nResidentBytes of it in memory. Call before
+  // OnUserCreate().
+  bool GenerateTerrain(int nSize, Uint64 nResidentBytes) {
+    pTerrain = std::make_unique<Terrain>(nResidentBytes);
+    if (!pTerrain->generate(nSize)) {
+      pTerrain = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  // The same from a raw 16-bit heightmap file (see Heightmap).
+  bool LoadTerrain(const std::string &sHeightFile, Uint64 nResidentBytes) {
+    pTerrain = std::make_unique<Terrain>(nResidentBytes);
+    if (!pTerrain->load(sHeightFile)) {
+      pTerrain = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  // Loads a point cloud (.ply or .xyz) to draw in place of the mesh. It is
+  // centred on the model origin and scaled to fit the default view.
+  bool LoadPoints(const std::string &sPointFile) {
+    pPoints = std::make_unique<PointCloud>();
+    if (!pPoints->LoadFromFile(sPointFile)) {
+      pPoints = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  // True once the mesh is ready to draw (or has failed to load).
+  bool AssetsSettled() {
+    return pSharedMesh || pBricks || pTerrain || pPoints || pSkinned ||
+           assets.settled();
+  }
+
+  // Blocks until the mesh has loaded; for offline rendering. Returns false if
+  // it could not be loaded.
+  bool WaitForAssets() {
+    assets.waitAll();
+    return pSharedMesh || pBricks || pTerrain || pPoints || pSkinned ||
+           assets.get(hMesh) != nullptr || assets.getCompact(hMesh) != nullptr;
+  }
+
+  // Finds the triangle of the mesh under window pixel (x, y), as drawn in
+  // the last frame. hit.t is the distance from the camera in world units
+  // and hit.triangle indexes the mesh's triangles. The mesh's BVH is built
+  // on first use. Brick-streamed and skinned meshes, terrain and point
+  // clouds cannot be picked.
+  bool Pick(float x, float y, BvhHit &hit) {
+    const mesh *pMesh = pSharedMesh ? pSharedMesh.get() : assets.get(hMesh);
+    const CompactMesh *pCompact =
+        pSharedMesh ? nullptr : assets.getCompact(hMesh);
+    if (pBricks || pTerrain || pSkinned || (!pMesh && !pCompact))
+      return false;
+
+    const void *pSource = pMesh ? (const void *)pMesh : (const void *)pCompact;
+    if (pBvhSource == pSource && pMesh) {
+      bvh.Update(*pMesh);
+    } else if (pBvhSource != pSource) {
+      if (pMesh) {
+        bvh.Build(*pMesh);
+      } else {
+        // Built from the decoded positions, so hits match what is drawn.
+        std::vector<vec3d> verts;
+        std::vector<float> tris;
+        pCompact->TransformPositions(Matrix_MakeIdentity(), verts);
+        for (size_t i = 0; i < pCompact->triangleCount * 3; i++) {
+          Uint32 v = pCompact->indices16.empty() ? pCompact->indices32[i]
+                                                 : pCompact->indices16[i];
+          tris.insert(tris.end(), {verts[v].x, verts[v].y, verts[v].z});
+        }
+        bvh.Build(tris.data(), pCompact->triangleCount);
+      }
+      pBvhSource = pSource;
+    }
+
+    // Undo the projection at z = 1 in view space, then take the ray back
+    // through the camera and world transforms, which are rigid.
+    float fNdcX = 2.0f * x / (float)this->windowWidth - 1.0f;
+    float fNdcY = 2.0f * y / (float)this->windowHeight - 1.0f;
+    vec3d vOrigin = {0.0f, 0.0f, 0.0f, 1.0f};
+    vec3d vDir = {fNdcX / matProj.m[0][0], fNdcY / matProj.m[1][1], 1.0f,
+                  0.0f};
+    mat4x4 matCamera = scene.worldTransform(nCameraNode);
+    mat4x4 matModel = scene.inverseWorld(nModelNode);
+    mat4x4 matViewToModel = Matrix_MultiplyMatrix(matCamera, matModel);
+    vOrigin = Matrix_MultiplyVector(matViewToModel, vOrigin);
+    vDir = Matrix_MultiplyVector(matViewToModel, vDir);
+    vDir = Vector_Normalise(vDir);
+    return bvh.Intersect(vOrigin, vDir, hit);
+  }
+
+  bool OnUserCreate() {
+    meshCube.tris = {
+        // SOUTH
+        {{{0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}, {1.0f, 1.0f, 0.0f}}},
+        {{{0.0f, 0.0f, 0.0f}, {1.0f, 1.0f, 0.0f}, {1.0f, 0.0f, 0.0f}}},
+
+        // EAST
+        {{{1.0f, 0.0f, 0.0f}, {1.0f, 1.0f, 0.0f}, {1.0f, 1.0f, 1.0f}}},
+        {{{1.0f, 0.0f, 0.0f}, {1.0f, 1.0f, 1.0f}, {1.0f, 0.0f, 1.0f}}},
+
+        // NORTH
+        {{{1.0f, 0.0f, 1.0f}, {1.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 1.0f}}},
+        {{{1.0f, 0.0f, 1.0f}, {0.0f, 1.0f, 1.0f}, {0.0f, 0.0f, 1.0f}}},
+
+        // WEST
+        {{{0.0f, 0.0f, 1.0f}, {0.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}}},
+        {{{0.0f, 0.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 0.0f}}},
+
+        // TOP
+        {{{0.0f, 1.0f, 0.0f}, {0.0f, 1.0f, 1.0f}, {1.0f, 1.0f, 1.0f}}},
+        {{{0.0f, 1.0f, 0.0f}, {1.0f, 1.0f, 1.0f}, {1.0f, 1.0f, 0.0f}}},
+
+        // BOTTOM
+        {{{1.0f, 0.0f, 1.0f}, {0.0f, 0.0f, 1.0f}, {0.0f, 0.0f, 0.0f}}},
+        {{{1.0f, 0.0f, 1.0f}, {0.0f, 0.0f, 0.0f}, {1.0f, 0.0f, 0.0f}}},
+    };
+    meshCube.ComputeNormals();
+
+    // The cube stands in, as a wireframe, until the mesh has streamed in.
+    if (!pSharedMesh && !pBricks && !pTerrain && !pPoints && !pSkinned &&
+        hMesh < 0) {
+      assets.compact = bCompact;
+      hMesh = assets.load(sMeshFile);
+    }
+
+    matProj = Matrix_MakeProjection(
+        90.0f, (float)this->windowHeight / (float)this->windowWidth, 0.1f,
+        1000.0f);
+    scene.setLocal(nStageNode, Matrix_MakeTranslation(0.0f, 0.0f, 5.0f));
+
+    return true;
+  }
+
+  bool OnUserUpdate(float fElapsedTime, Keyboard *keyboard) {
+    if (keyboard->ARROW_UP)
+      vCamera.y -= 8.0f * fElapsedTime;
+    if (keyboard->ARROW_DOWN)
+      vCamera.y += 8.0f * fElapsedTime;
+    if (keyboard->ARROW_LEFT)
+      vCamera.x -= 8.0f * fElapsedTime;
+    if (keyboard->ARROW_RIGHT)
+      vCamera.x += 8.0f * fElapsedTime;
+
+    vec3d vForward = Vector_Mul(vLookDir, 8.0f * fElapsedTime);
+
+    if (keyboard->W)
+      vCamera = Vector_Add(vCamera, vForward);
+    if (keyboard->S)
+      vCamera = Vector_Sub(vCamera, vForward);
+    if (keyboard->A)
+      fYaw -= 2.0f * fElapsedTime;
+    if (keyboard->D)
+      fYaw += 2.0f * fElapsedTime;
+
+    // fTheta += 1.0f * fElapsedTime;
+
+    // The transforms are only rebuilt for what moved.
+    if (fTheta != fNodeTheta || fSpin != fNodeSpin) {
+      mat4x4 matRotZ = Matrix_MakeRotationZ(fTheta * 0.5f);
+      mat4x4 matRotX = Matrix_MakeRotationX(fTheta);
+      mat4x4 matSpin = Matrix_MakeRotationY(fSpin);
+      mat4x4 matRotation = Matrix_MultiplyMatrix(matRotZ, matRotX);
+      scene.setLocal(nModelNode, Matrix_MultiplyMatrix(matRotation, matSpin));
+      fNodeTheta = fTheta;
+      fNodeSpin = fSpin;
+    }
+
+    if (fYaw != fNodeYaw) {
+      vec3d vForward = {0, 0, 1};
+      mat4x4 matCameraRot = Matrix_MakeRotationY(fYaw);
+      vLookDir = Matrix_MultiplyVector(matCameraRot, vForward);
+    }
+    if (fYaw != fNodeYaw || vCamera.x != vNodeCamera.x ||
+        vCamera.y != vNodeCamera.y || vCamera.z != vNodeCamera.z) {
+      vec3d vUp = {0, 1, 0};
+      vec3d vTarget = Vector_Add(vCamera, vLookDir);
+      scene.setLocal(nCameraNode, Matrix_PointAt(vCamera, vTarget, vUp));
+      fNodeYaw = fYaw;
+      vNodeCamera = vCamera;
+    }
+
+    scene.update();
+    matWorld = scene.worldTransform(nModelNode);
+    matView = scene.inverseWorld(nCameraNode);
+
+    Timer timer;
+    fProjectMs = fSortMs = fRasterMs = 0.0f;
+    nTrianglesSubmitted = nTrianglesDrawn = 0;
+    if (pPoints) {
+      this->clear();
+      DrawPoints();
+      fRasterMs = timer.elapsedMs();
+      return true;
+    }
+
+    std::vector<triangle> vecTrianglesToRaster;
+    vecVertexLight.clear();
+
+    assets.publish();
+    const mesh *pMesh = pSharedMesh ? pSharedMesh.get() : assets.get(hMesh);
+    const CompactMesh *pCompact =
+        pSharedMesh ? nullptr : assets.getCompact(hMesh);
+    bool bPlaceholder = pMesh == nullptr && pCompact == nullptr && !pBricks &&
+                        !pTerrain && !pSkinned;
+    // Null for bricks, terrain, skinned and compact meshes, which draw from
+    // their own data, so only the plain-mesh paths below dereference it.
+    const mesh *pMeshToDraw = bPlaceholder ? &meshCube : pMesh;
+    bSharedPass =
+        !vecViews.empty() && !pBricks && !pTerrain &&
+        (pSkinned || pCompact ||
+         (pMeshToDraw &&
+          pMeshToDraw->faceNormals.size() == pMeshToDraw->tris.size()));
+
+    // The views clear around themselves.
+    if (!bSharedPass)
+      this->clear();
+
+    if (pBricks) {
+      mat4x4 matModelView = Matrix_MultiplyMatrix(matWorld, matView);
+      pBricks->update(matModelView, matProj, 0.1f,
+                      this->headless && bWaitForStreaming);
+      for (int nBrick : pBricks->drawable) {
+        const float *f = pBricks->triangles(nBrick);
+        Uint64 nTriangles = pBricks->triangleCount(nBrick);
+        for (Uint64 i = 0; i < nTriangles; i++, f += 9) {
+          triangle tri = {{{f[0], f[1], f[2]}, {f[3], f[4], f[5]},
+                           {f[6], f[7], f[8]}}};
+          ProjectTriangle(tri, vecTrianglesToRaster);
+        }
+      }
+    } else if (pTerrain) {
+      pTerrain->update(vCamera, matView, matProj, 0.1f,
+                       this->headless && bWaitForStreaming);
+      for (const Terrain::DrawChunk &chunk : pTerrain->drawable)
+        pTerrain->triangles(chunk, [&](triangle tri) {
+          ProjectWorldTriangle(tri, vecTrianglesToRaster);
+        });
+    } else if (pSkinned) {
+      ProjectSkinned(vecTrianglesToRaster);
+    } else if (pCompact) {
+      if (pCompactNormals != pCompact)
+        DeriveCompactNormals(*pCompact);
+      UpdateWorldNormals(pCompact, vecCompactFaceNormals,
+                         vecCompactVertexNormals);
+      // Each shared vertex is decoded and transformed once, not once per
+      // triangle that uses it.
+      pCompact->TransformPositions(matWorld, vecWorldVerts);
+      auto project = [&](const auto *indices) {
+        ProjectMesh(
+            pCompact->triangleCount,
+            [&](size_t i) {
+              const auto *t = indices + i * 3;
+              return triangle{{vecWorldVerts[t[0]], vecWorldVerts[t[1]],
+                               vecWorldVerts[t[2]]}};
+            },
+            [&](size_t i, int k) { return indices[i * 3 + k]; },
+            vecTrianglesToRaster);
+      };
+      if (pCompact->indices16.empty())
+        project(pCompact->indices32.data());
+      else
+        project(pCompact->indices16.data());
+    } else if (pMeshToDraw->faceNormals.size() == pMeshToDraw->tris.size()) {
+      const mesh &meshToDraw = *pMeshToDraw;
+      UpdateWorldNormals(&meshToDraw, meshToDraw.faceNormals,
+                         meshToDraw.vertexNormals, &meshToDraw);
+      ProjectMesh(
+          meshToDraw.tris.size(),
+          [&](size_t i) {
+            triangle tri = meshToDraw.tris[i];
+            triangle triTransformed;
+            for (int k = 0; k < 3; k++)
+              triTransformed.p[k] = Matrix_MultiplyVector(matWorld, tri.p[k]);
+            return triTransformed;
+          },
+          [&](size_t i, int k) { return meshToDraw.normalIndices[i * 3 + k]; },
+          vecTrianglesToRaster);
+    } else {
+      // Built by hand without ComputeNormals().
+      for (auto tri : pMeshToDraw->tris)
+        ProjectTriangle(tri, vecTrianglesToRaster);
+    }
+
+    nTrianglesDrawn = vecTrianglesToRaster.size();
+    fProjectMs = timer.elapsedMs();
+    timer.reset();
+
+    if (bSharedPass) {
+      RasterFlags viewFlags;
+      viewFlags.depthTest = bDepthTest;
+      viewFlags.blend = fAlpha < 1.0f;
+      viewFlags.wireframe = bWireframe || bPlaceholder;
+      viewFlags.gouraud = bGouraud;
+      DrawViews(selectRaster(viewFlags));
+      fRasterMs = timer.elapsedMs();
+      bSharedPass = false;
+      return true;
+    }
+
+    bool bPrepass = bDepthPrepass && bDepthTest && !bMsaa && !bWireframe &&
+                    !bPlaceholder && fAlpha >= 1.0f;
+    if (bPrepass) {
+      // The depth test alone decides what is visible; no order needed.
+      vecRasterOrder.resize(vecTrianglesToRaster.size());
+      for (size_t i = 0; i < vecRasterOrder.size(); i++)
+        vecRasterOrder[i] = (Uint32)i;
+    } else {
+      depthSorter.sortBackToFront(vecTrianglesToRaster, vecRasterOrder);
+    }
+    fSortMs = timer.elapsedMs();
+    timer.reset();
+
+    if (bMsaa) {
+      msaa.resize(this->width, this->height);
+      msaa.clear();
+    }
+
+    // The whole mesh is one draw batch, so the specialised raster kernel is
+    // chosen once here rather than per triangle or per pixel.
+    RasterFlags rasterFlags;
+    rasterFlags.depthTest = bDepthTest;
+    rasterFlags.blend = fAlpha < 1.0f;
+    rasterFlags.wireframe = bWireframe || bPlaceholder;
+    rasterFlags.gouraud = bGouraud;
+    rasterFlags.depthEqual = bPrepass;
+    RasterFunction raster = selectRaster(rasterFlags);
+
+    if (bPrepass) {
+      DrawWithPrepass(raster, vecTrianglesToRaster);
+    } else {
+      for (Uint32 nTriangle : vecRasterOrder) {
+        triangle &triToRaster = vecTrianglesToRaster[nTriangle];
+        const float *fLights = &vecVertexLight[(size_t)nTriangle * 3];
+        std::list<triangle> listTriangles;
+        ClipToScreen(triToRaster, (float)this->width, (float)this->height,
+                     listTriangles);
+
+        for (auto &t : listTriangles) {
+          if (bMsaa && !bPlaceholder) {
+            Uint32 col = (static_cast<Uint32>(0xff * t.illumination) << 24) |
+                         (static_cast<Uint32>(0xff * t.illumination) << 16) |
+                         (static_cast<Uint32>(0xff * t.illumination) << 8) |
+                         0xff;
+            msaa.fillTriangle(*this, t.p[0], t.p[1], t.p[2], col);
+          } else {
+            RasterLitPiece(*this, raster, triToRaster, fLights, t);
+          }
+        }
+      }
+    }
+
+    if (bMsaa)
+      msaa.resolve(*this);
+    fRasterMs = timer.elapsedMs();
+
+    return true;
+  }
+};
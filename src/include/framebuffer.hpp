@@ -0,0 +1,481 @@
+#pragma once
+
+#include "vec3d.hpp"
+#include <SDL2/SDL_rect.h>
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Colours are packed 0xRRGGBBAA, matching SDL_PIXELFORMAT_RGBA8888. Depth
+// holds post-projection z in [0, 1], nearer is smaller.
+//
+// The image is also divided into TILE_SIZE square tiles, each with a flag
+// set by every write path and reset by clear(). A tile that is unflagged in
+// two consecutive frames holds only the clear colour in both, which lets the
+// presenter skip it without looking at its pixels.
+class Framebuffer {
+public:
+  static constexpr int TILE_SHIFT = 5;
+  static constexpr int TILE_SIZE = 1 << TILE_SHIFT;
+
+  int width = 0;
+  int height = 0;
+  std::vector<Uint32> color;
+  std::vector<float> depth;
+  int tilesX = 0;
+  int tilesY = 0;
+  std::vector<Uint8> tileTouched;
+  Uint32 clearColor = 0x000000ff;
+  // Changes whenever the tile flags no longer describe the previous frame
+  // (resize, or a new clear colour), so every tile has to be assumed changed.
+  Uint32 tileGeneration = 0;
+
+  Framebuffer() {}
+  Framebuffer(int width, int height) { this->resize(width, height); }
+
+  // Shrinking keeps the allocation, so the resolution controller can move
+  // the render size around every frame without touching the heap.
+  void resize(int width, int height) {
+    this->width = width;
+    this->height = height;
+    this->color.resize((size_t)width * height);
+    this->depth.resize((size_t)width * height);
+    this->tilesX = (width + TILE_SIZE - 1) >> TILE_SHIFT;
+    this->tilesY = (height + TILE_SIZE - 1) >> TILE_SHIFT;
+    this->tileTouched.assign((size_t)this->tilesX * this->tilesY, 1);
+    this->tileGeneration++;
+  }
+
+  void clear(Uint32 col = 0x000000ff) {
+    std::fill(this->color.begin(), this->color.end(), col);
+    std::fill(this->tileTouched.begin(), this->tileTouched.end(), 0);
+    if (col != this->clearColor) {
+      this->clearColor = col;
+      this->tileGeneration++;
+    }
+  }
+
+  // Flags the tiles overlapping the pixel rectangle [x0, x1] x [y0, y1],
+  // which must lie inside the framebuffer.
+  void touch(int x0, int y0, int x1, int y1) {
+    for (int ty = y0 >> TILE_SHIFT; ty <= y1 >> TILE_SHIFT; ty++) {
+      Uint8 *row = &this->tileTouched[(size_t)ty * this->tilesX];
+      std::fill(row + (x0 >> TILE_SHIFT), row + (x1 >> TILE_SHIFT) + 1, 1);
+    }
+  }
+
+  void clearDepth(float z = 1.0f) {
+    std::fill(this->depth.begin(), this->depth.end(), z);
+  }
+
+  // clear(col) and clearDepth(), but only in the flagged tiles, the others
+  // still holding col and the far depth from the last clear. Only for a
+  // framebuffer cleared this way every frame and drawn only through paths
+  // that flag what they write, which rasterDepth() does not.
+  void clearTouched(Uint32 col = 0x000000ff) {
+    if (col != this->clearColor) {
+      this->clear(col);
+      this->clearDepth();
+      return;
+    }
+    for (int ty = 0; ty < this->tilesY; ty++) {
+      Uint8 *flags = &this->tileTouched[(size_t)ty * this->tilesX];
+      int y0 = ty << TILE_SHIFT;
+      int y1 = std::min(y0 + TILE_SIZE, this->height);
+      for (int tx = 0; tx < this->tilesX;) {
+        if (!flags[tx]) {
+          tx++;
+          continue;
+        }
+        // A run of flagged tiles is cleared a pixel row at a time.
+        int run = tx;
+        while (run < this->tilesX && flags[run])
+          flags[run++] = 0;
+        int x0 = tx << TILE_SHIFT;
+        int x1 = std::min(run << TILE_SHIFT, this->width);
+        for (int y = y0; y < y1; y++) {
+          size_t row = (size_t)y * this->width;
+          std::fill(&this->color[row + x0], &this->color[row + x1], col);
+          std::fill(&this->depth[row + x0], &this->depth[row + x1], 1.0f);
+        }
+        tx = run;
+      }
+    }
+  }
+
+  void pixel(SDL_FPoint point, Uint32 color) {
+    this->pixel((int)point.x, (int)point.y, color);
+  }
+  void pixel(float x, float y, Uint32 color) {
+    this->pixel((int)x, (int)y, color);
+  }
+  void pixel(int x, int y, Uint32 color) {
+    if (x < 0 || x >= this->width || y < 0 || y >= this->height)
+      return;
+    this->color[(size_t)y * this->width + x] = color;
+    this->tileTouched[(size_t)(y >> TILE_SHIFT) * this->tilesX +
+                      (x >> TILE_SHIFT)] = 1;
+  }
+
+  // Writes a clipped horizontal run [sx, ex] on row y. Colours with an alpha
+  // below 0xff are blended over what is already there.
+  void span(int sx, int ex, int y, Uint32 color) {
+    if (y < 0 || y >= this->height)
+      return;
+    if (sx < 0)
+      sx = 0;
+    if (ex >= this->width)
+      ex = this->width - 1;
+    if (sx > ex)
+      return;
+    this->touch(sx, y, ex, y);
+    Uint32 *row = &this->color[(size_t)y * this->width];
+    if ((color & 0xff) == 0xff)
+      std::fill(row + sx, row + ex + 1, color);
+    else
+      blendSpan(row + sx, ex - sx + 1, color);
+  }
+
+  // The 0..255 alpha of a colour as the 0..256 weight blendPixel() takes.
+  static int blendWeight(Uint32 color) {
+    int alpha = color & 0xff;
+    return alpha + (alpha >> 7);
+  }
+
+  // dst + (src - dst) * alpha / 256 per colour channel, keeping the
+  // destination's own alpha.
+  static Uint32 blendPixel(Uint32 d, Uint32 color, int alpha) {
+    Uint32 out = d & 0xff;
+    for (int c = 8; c < 32; c += 8) {
+      int dc = (d >> c) & 0xff;
+      int sc = (color >> c) & 0xff;
+      out |= (Uint32)(dc + ((sc * alpha) >> 8) - ((dc * alpha) >> 8)) << c;
+    }
+    return out;
+  }
+
+  // blendPixel() over n pixels.
+  static void blendSpan(Uint32 *dst, int n, Uint32 color) {
+    int alpha = blendWeight(color);
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i weight = _mm_set1_epi16((short)alpha);
+    // (src - dst) * alpha is done as src * alpha - dst * alpha so every
+    // product stays within unsigned 16 bits.
+    __m128i src = _mm_srli_epi16(
+        _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_set1_epi32((int)color), zero),
+                        weight),
+        8);
+    __m128i keepAlpha = _mm_set1_epi32(0xff);
+    for (; i + 4 <= n; i += 4) {
+      __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+      __m128i lo = _mm_unpacklo_epi8(d, zero);
+      __m128i hi = _mm_unpackhi_epi8(d, zero);
+      lo = _mm_sub_epi16(_mm_add_epi16(lo, src),
+                         _mm_srli_epi16(_mm_mullo_epi16(lo, weight), 8));
+      hi = _mm_sub_epi16(_mm_add_epi16(hi, src),
+                         _mm_srli_epi16(_mm_mullo_epi16(hi, weight), 8));
+      __m128i out = _mm_packus_epi16(lo, hi);
+      out = _mm_or_si128(_mm_andnot_si128(keepAlpha, out),
+                         _mm_and_si128(keepAlpha, d));
+      _mm_storeu_si128((__m128i *)(dst + i), out);
+    }
+#endif
+    for (; i < n; i++)
+      dst[i] = blendPixel(dst[i], color, alpha);
+  }
+
+  void line(float x1, float y1, float x2, float y2, Uint32 color) {
+    int x, y, dx, dy, dx1, dy1, px, py, xe, ye, i;
+    dx = x2 - x1;
+    dy = y2 - y1;
+    dx1 = abs(dx);
+    dy1 = abs(dy);
+    px = 2 * dy1 - dx1;
+    py = 2 * dx1 - dy1;
+    if (dy1 <= dx1) {
+      if (dx >= 0) {
+        x = x1;
+        y = y1;
+        xe = x2;
+      } else {
+        x = x2;
+        y = y2;
+        xe = x1;
+      }
+
+      this->pixel(x, y, color);
+
+      for (i = 0; x < xe; i++) {
+        x = x + 1;
+        if (px < 0)
+          px = px + 2 * dy1;
+        else {
+          if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0))
+            y = y + 1;
+          else
+            y = y - 1;
+          px = px + 2 * (dy1 - dx1);
+        }
+        this->pixel(x, y, color);
+      }
+    } else {
+      if (dy >= 0) {
+        x = x1;
+        y = y1;
+        ye = y2;
+      } else {
+        x = x2;
+        y = y2;
+        ye = y1;
+      }
+
+      this->pixel(x, y, color);
+
+      for (i = 0; y < ye; i++) {
+        y = y + 1;
+        if (py <= 0)
+          py = py + 2 * dx1;
+        else {
+          if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0))
+            x = x + 1;
+          else
+            x = x - 1;
+          py = py + 2 * (dx1 - dy1);
+        }
+        this->pixel(x, y, color);
+      }
+    }
+    (void)i;
+  }
+  void addTriangle(vec3d p1, vec3d p2, vec3d p3, Uint32 color) {
+    this->line(p1.x, p1.y, p2.x, p2.y, color);
+    this->line(p2.x, p2.y, p3.x, p3.y, color);
+    this->line(p3.x, p3.y, p1.x, p1.y, color);
+  }
+  void fillTriangle(vec3d p1, vec3d p2, vec3d p3, Uint32 color) {
+    int x1 = p1.x;
+    int x2 = p2.x;
+    int x3 = p3.x;
+    int y1 = p1.y;
+    int y2 = p2.y;
+    int y3 = p3.y;
+
+    auto SWAP = [](int &x, int &y) {
+      int t = x;
+      x = y;
+      y = t;
+    };
+    auto drawline = [&](int sx, int ex, int ny) {
+      this->span(sx, ex, ny, color);
+    };
+
+    int t1x, t2x, y, minx, maxx, t1xp, t2xp;
+    bool changed1 = false;
+    bool changed2 = false;
+    int signx1, signx2, dx1, dy1, dx2, dy2;
+    int e1, e2;
+    // Sort vertices
+    if (y1 > y2) {
+      SWAP(y1, y2);
+      SWAP(x1, x2);
+    }
+    if (y1 > y3) {
+      SWAP(y1, y3);
+      SWAP(x1, x3);
+    }
+    if (y2 > y3) {
+      SWAP(y2, y3);
+      SWAP(x2, x3);
+    }
+
+    t1x = t2x = x1;
+    y = y1; // Starting points
+    dx1 = (int)(x2 - x1);
+    if (dx1 < 0) {
+      dx1 = -dx1;
+      signx1 = -1;
+    } else
+      signx1 = 1;
+    dy1 = (int)(y2 - y1);
+
+    dx2 = (int)(x3 - x1);
+    if (dx2 < 0) {
+      dx2 = -dx2;
+      signx2 = -1;
+    } else
+      signx2 = 1;
+    dy2 = (int)(y3 - y1);
+
+    if (dy1 > dx1) { // swap values
+      SWAP(dx1, dy1);
+      changed1 = true;
+    }
+    if (dy2 > dx2) { // swap values
+      SWAP(dy2, dx2);
+      changed2 = true;
+    }
+
+    e2 = (int)(dx2 >> 1);
+    // Flat top, just process the second half
+    if (y1 == y2)
+      goto next;
+    e1 = (int)(dx1 >> 1);
+
+    for (int i = 0; i < dx1;) {
+      t1xp = 0;
+      t2xp = 0;
+      if (t1x < t2x) {
+        minx = t1x;
+        maxx = t2x;
+      } else {
+        minx = t2x;
+        maxx = t1x;
+      }
+      // process first line until y value is about to change
+      while (i < dx1) {
+        i++;
+        e1 += dy1;
+        while (e1 >= dx1) {
+          e1 -= dx1;
+          if (changed1)
+            t1xp = signx1; // t1x += signx1;
+          else
+            goto next1;
+        }
+        if (changed1)
+          break;
+        else
+          t1x += signx1;
+      }
+      // Move line
+    next1:
+      // process second line until y value is about to change
+      while (1) {
+        e2 += dy2;
+        while (e2 >= dx2) {
+          e2 -= dx2;
+          if (changed2)
+            t2xp = signx2; // t2x += signx2;
+          else
+            goto next2;
+        }
+        if (changed2)
+          break;
+        else
+          t2x += signx2;
+      }
+    next2:
+      if (minx > t1x)
+        minx = t1x;
+      if (minx > t2x)
+        minx = t2x;
+      if (maxx < t1x)
+        maxx = t1x;
+      if (maxx < t2x)
+        maxx = t2x;
+      drawline(minx, maxx, y); // Draw line from min to max points found on the
+                               // y Now increase y
+      if (!changed1)
+        t1x += signx1;
+      t1x += t1xp;
+      if (!changed2)
+        t2x += signx2;
+      t2x += t2xp;
+      y += 1;
+      if (y == y2)
+        break;
+    }
+  next:
+    // Second half
+    dx1 = (int)(x3 - x2);
+    if (dx1 < 0) {
+      dx1 = -dx1;
+      signx1 = -1;
+    } else
+      signx1 = 1;
+    dy1 = (int)(y3 - y2);
+    t1x = x2;
+
+    if (dy1 > dx1) { // swap values
+      SWAP(dy1, dx1);
+      changed1 = true;
+    } else
+      changed1 = false;
+
+    e1 = (int)(dx1 >> 1);
+
+    for (int i = 0; i <= dx1; i++) {
+      t1xp = 0;
+      t2xp = 0;
+      if (t1x < t2x) {
+        minx = t1x;
+        maxx = t2x;
+      } else {
+        minx = t2x;
+        maxx = t1x;
+      }
+      // process first line until y value is about to change
+      while (i < dx1) {
+        e1 += dy1;
+        while (e1 >= dx1) {
+          e1 -= dx1;
+          if (changed1) {
+            t1xp = signx1;
+            break;
+          } // t1x += signx1;
+          else
+            goto next3;
+        }
+        if (changed1)
+          break;
+        else
+          t1x += signx1;
+        if (i < dx1)
+          i++;
+      }
+    next3:
+      // process second line until y value is about to change
+      while (t2x != x3) {
+        e2 += dy2;
+        while (e2 >= dx2) {
+          e2 -= dx2;
+          if (changed2)
+            t2xp = signx2;
+          else
+            goto next4;
+        }
+        if (changed2)
+          break;
+        else
+          t2x += signx2;
+      }
+    next4:
+
+      if (minx > t1x)
+        minx = t1x;
+      if (minx > t2x)
+        minx = t2x;
+      if (maxx < t1x)
+        maxx = t1x;
+      if (maxx < t2x)
+        maxx = t2x;
+      drawline(minx, maxx, y);
+      if (!changed1)
+        t1x += signx1;
+      t1x += t1xp;
+      if (!changed2)
+        t2x += signx2;
+      t2x += t2xp;
+      y += 1;
+      if (y > y3)
+        return;
+    }
+  }
+};
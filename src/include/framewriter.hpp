@@ -0,0 +1,214 @@
+#pragma once
+
+#include "image.hpp"
+#include "yuv.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Streams rendered frames to disk from a background thread, either as a
+// single Y4M video or as one binary PPM per frame.
+//
+// The writer owns a fixed pool of frame buffers. push() swaps the caller's
+// buffer with a free one from the pool instead of copying it, and only
+// blocks when every buffer is still queued for writing.
+class FrameWriter {
+public:
+  enum Format { Y4M, PPM_SEQUENCE };
+
+  // Time the render thread spent blocked in push() waiting for a buffer.
+  float stallMs = 0.0f;
+  int framesWritten = 0;
+  bool failed = false;
+
+private:
+  std::string path;
+  // The PPM pattern split around its conversion: the frame number goes
+  // between prefix and suffix, `digits` wide, padded with zeros or spaces.
+  std::string prefix, suffix;
+  int digits = 0;
+  bool zeroPad = false;
+  Format format;
+  int width;
+  int height;
+  FILE *video = NULL;
+
+  std::vector<std::vector<Uint32>> pool;
+  std::deque<std::vector<Uint32> *> freeBuffers;
+  std::deque<std::vector<Uint32> *> queued;
+  std::mutex lock;
+  std::condition_variable bufferFreed;
+  std::condition_variable frameQueued;
+  bool finished = false;
+  std::thread worker;
+
+  // Encoder scratch space, only touched by the writer thread.
+  std::vector<Uint8> encoded;
+
+public:
+  // `path` is the .y4m file, or for PPM sequences a pattern with exactly
+  // one integer conversion, %d with an optional 0 flag and width (e.g.
+  // "out/frame%04d.ppm"); %% stands for a literal %. Any other pattern
+  // leaves the writer failed.
+  FrameWriter(std::string path, Format format, int width, int height,
+              int fps = 30, int queueDepth = 4) {
+    this->path = path;
+    this->format = format;
+    this->width = width;
+    this->height = height;
+
+    if (format == PPM_SEQUENCE && !this->parsePattern()) {
+      this->failed = true;
+      return;
+    }
+    if (format == Y4M) {
+      this->video = fopen(path.c_str(), "wb");
+      if (this->video == NULL) {
+        this->failed = true;
+        return;
+      }
+      fprintf(this->video, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n",
+              width, height, fps);
+    }
+
+    this->pool.resize(queueDepth);
+    for (auto &buffer : this->pool) {
+      buffer.resize((size_t)width * height);
+      this->freeBuffers.push_back(&buffer);
+    }
+    this->worker = std::thread([this] { this->run(); });
+  }
+
+  ~FrameWriter() { this->finish(); }
+
+  // Hands a finished frame to the writer. On return `frame` holds a recycled
+  // buffer of the same size with undefined contents.
+  void push(std::vector<Uint32> &frame) {
+    if (frame.size() != (size_t)this->width * this->height)
+      return;
+
+    std::unique_lock<std::mutex> guard(this->lock);
+    if (this->failed)
+      return;
+    if (this->freeBuffers.empty()) {
+      auto start = std::chrono::steady_clock::now();
+      this->bufferFreed.wait(guard, [this] {
+        return !this->freeBuffers.empty() || this->failed;
+      });
+      this->stallMs += std::chrono::duration<float, std::milli>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+      if (this->failed)
+        return;
+    }
+    std::vector<Uint32> *buffer = this->freeBuffers.front();
+    this->freeBuffers.pop_front();
+    buffer->swap(frame);
+    this->queued.push_back(buffer);
+    this->frameQueued.notify_one();
+  }
+
+  // Drains the queue and closes the output. Safe to call more than once.
+  void finish() {
+    {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->finished = true;
+    }
+    this->frameQueued.notify_one();
+    if (this->worker.joinable())
+      this->worker.join();
+    if (this->video != NULL) {
+      if (fclose(this->video) != 0)
+        this->failed = true;
+      this->video = NULL;
+    }
+  }
+
+private:
+  void run() {
+    while (true) {
+      std::vector<Uint32> *buffer;
+      {
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->frameQueued.wait(guard, [this] {
+          return !this->queued.empty() || this->finished;
+        });
+        if (this->queued.empty())
+          return;
+        buffer = this->queued.front();
+        this->queued.pop_front();
+      }
+
+      bool ok = this->write(*buffer);
+
+      {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->freeBuffers.push_back(buffer);
+        if (ok)
+          this->framesWritten++;
+        else
+          this->failed = true;
+      }
+      this->bufferFreed.notify_one();
+    }
+  }
+
+  bool write(const std::vector<Uint32> &frame) {
+    size_t pixels = (size_t)this->width * this->height;
+
+    if (this->format == Y4M) {
+      this->encoded.resize(pixels + pixels / 2);
+      Uint8 *y = this->encoded.data();
+      Uint8 *u = y + pixels;
+      Uint8 *v = u + pixels / 4;
+      rgbaToYuv420(frame.data(), this->width, this->height, y, u, v);
+      return fputs("FRAME\n", this->video) >= 0 &&
+             fwrite(this->encoded.data(), 1, this->encoded.size(),
+                    this->video) == this->encoded.size();
+    }
+
+    char number[32];
+    snprintf(number, sizeof(number), this->zeroPad ? "%0*d" : "%*d",
+             this->digits, this->framesWritten);
+    std::string name = this->prefix + number + this->suffix;
+    return writePpm(name.c_str(), frame.data(), this->width, this->height,
+                    this->encoded);
+  }
+
+  bool parsePattern() {
+    bool found = false;
+    std::string *out = &this->prefix;
+    for (size_t i = 0; i < this->path.size(); i++) {
+      if (this->path[i] != '%') {
+        *out += this->path[i];
+        continue;
+      }
+      if (++i < this->path.size() && this->path[i] == '%') {
+        *out += '%';
+        continue;
+      }
+      if (found)
+        return false;
+      if (i < this->path.size() && this->path[i] == '0') {
+        this->zeroPad = true;
+        i++;
+      }
+      for (; i < this->path.size() && isdigit((unsigned char)this->path[i]);
+           i++)
+        this->digits = std::min(this->digits * 10 + (this->path[i] - '0'), 20);
+      if (i >= this->path.size() || this->path[i] != 'd')
+        return false;
+      found = true;
+      out = &this->suffix;
+    }
+    return found;
+  }
+};
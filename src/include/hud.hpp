@@ -0,0 +1,221 @@
+#pragma once
+
+#include "framebuffer.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <vector>
+
+// 5x7 glyphs for ' ' to '_', which covers digits, capitals and most
+// punctuation. One byte per row, top row first, bit 4 the leftmost pixel.
+inline const Uint8 HUD_FONT[64][7] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // space
+    {0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04}, // '!'
+    {0x0a, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00}, // '"'
+    {0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a}, // '#'
+    {0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04}, // '$'
+    {0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03}, // '%'
+    {0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d}, // '&'
+    {0x0c, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00}, // '''
+    {0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02}, // '('
+    {0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08}, // ')'
+    {0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00}, // '*'
+    {0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00}, // '+'
+    {0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08}, // ','
+    {0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00}, // '-'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c}, // '.'
+    {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00}, // '/'
+    {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e}, // '0'
+    {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e}, // '1'
+    {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f}, // '2'
+    {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e}, // '3'
+    {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02}, // '4'
+    {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e}, // '5'
+    {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e}, // '6'
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08}, // '7'
+    {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e}, // '8'
+    {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c}, // '9'
+    {0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00}, // ':'
+    {0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08}, // ';'
+    {0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02}, // '<'
+    {0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00}, // '='
+    {0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08}, // '>'
+    {0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04}, // '?'
+    {0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e}, // '@'
+    {0x0e, 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11}, // 'A'
+    {0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e}, // 'B'
+    {0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e}, // 'C'
+    {0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c}, // 'D'
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f}, // 'E'
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10}, // 'F'
+    {0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f}, // 'G'
+    {0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11}, // 'H'
+    {0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e}, // 'I'
+    {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c}, // 'J'
+    {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}, // 'K'
+    {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f}, // 'L'
+    {0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11}, // 'M'
+    {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11}, // 'N'
+    {0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, // 'O'
+    {0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10}, // 'P'
+    {0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d}, // 'Q'
+    {0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11}, // 'R'
+    {0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e}, // 'S'
+    {0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04}, // 'T'
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, // 'U'
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04}, // 'V'
+    {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a}, // 'W'
+    {0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11}, // 'X'
+    {0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04}, // 'Y'
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f}, // 'Z'
+    {0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e}, // '['
+    {0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00}, // backslash
+    {0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e}, // ']'
+    {0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00}, // '^'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f}, // '_'
+};
+
+// Immediate-mode performance overlay, drawn straight into the framebuffer
+// after the scene.
+//
+// Every call draws one opaque band of the panel at the top left and moves
+// down below it. The glyphs are expanded once into rows of finished pixels,
+// background included, so a character costs one memcpy per pixel row and
+// nothing is blended or drawn per pixel. Bands are flagged in the tile
+// bitmap like any other drawing, so they reach the window with dirty tiles
+// on.
+class Hud {
+public:
+  static constexpr int GLYPH_WIDTH = 6;
+  static constexpr int GLYPH_HEIGHT = 9;
+  static constexpr int COLUMNS = 30;
+  static constexpr int WIDTH = COLUMNS * GLYPH_WIDTH;
+  // One frame per column of the graph.
+  static constexpr int HISTORY = WIDTH;
+  static constexpr int GRAPH_HEIGHT = 40;
+
+  static constexpr Uint32 TEXT = 0xffffffff;
+  static constexpr Uint32 BACKGROUND = 0x202020ff;
+  static constexpr Uint32 UNDER_BUDGET = 0x40c040ff;
+  static constexpr Uint32 OVER_BUDGET = 0xe04040ff;
+  static constexpr Uint32 BUDGET_LINE = 0x808080ff;
+
+  Hud() {
+    this->glyphs.resize(64 * GLYPH_HEIGHT * GLYPH_WIDTH);
+    for (int g = 0; g < 64; g++) {
+      // A blank row above and below the glyph and a blank column after it.
+      for (int y = 0; y < GLYPH_HEIGHT; y++) {
+        Uint8 bits = y >= 1 && y <= 7 ? HUD_FONT[g][y - 1] : 0;
+        for (int x = 0; x < GLYPH_WIDTH; x++)
+          this->glyphs[(g * GLYPH_HEIGHT + y) * GLYPH_WIDTH + x] =
+              x < 5 && (bits >> (4 - x)) & 1 ? TEXT : BACKGROUND;
+      }
+    }
+    std::fill(this->history, this->history + HISTORY, 0.0f);
+  }
+
+  // Records how long a frame took, for the graph.
+  void addFrame(float ms) {
+    this->history[this->next] = ms;
+    this->next = (this->next + 1) % HISTORY;
+  }
+
+  // Mean of the last `frames` recorded frame times.
+  float recentMs(int frames) const {
+    float sum = 0.0f;
+    for (int i = 1; i <= frames; i++)
+      sum += this->history[(this->next - i + HISTORY) % HISTORY];
+    return sum / frames;
+  }
+
+  // Starts a new panel at the top left of `fb`.
+  void begin(Framebuffer &fb) {
+    this->fb = &fb;
+    this->y = 0;
+  }
+
+  // A line of printf-formatted text. Lower case is shown as upper case and
+  // anything the font lacks as '?'; the line is cut at COLUMNS characters.
+  void text(const char *format, ...) {
+    char line[COLUMNS + 1];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    length = std::clamp(length, 0, COLUMNS);
+
+    int y0 = this->y, y1 = std::min(y0 + GLYPH_HEIGHT, this->fb->height);
+    int width = std::min(WIDTH, this->fb->width);
+    int shown = std::min(length, width / GLYPH_WIDTH);
+    const Uint32 *spans[COLUMNS];
+    for (int i = 0; i < shown; i++) {
+      int c = (unsigned char)line[i];
+      if (c >= 'a' && c <= 'z')
+        c -= 'a' - 'A';
+      if (c < ' ' || c > '_')
+        c = '?';
+      spans[i] = &this->glyphs[(c - ' ') * GLYPH_HEIGHT * GLYPH_WIDTH];
+    }
+    for (int y = y0; y < y1; y++) {
+      Uint32 *row = &this->fb->color[(size_t)y * this->fb->width];
+      size_t glyphRow = (size_t)(y - y0) * GLYPH_WIDTH;
+      for (int i = 0; i < shown; i++)
+        memcpy(row + i * GLYPH_WIDTH, spans[i] + glyphRow,
+               GLYPH_WIDTH * sizeof(Uint32));
+      std::fill(row + shown * GLYPH_WIDTH, row + width, BACKGROUND);
+    }
+    this->finishBand(y0, y1, width);
+  }
+
+  // The recorded frame times as bars, oldest on the left, against a line
+  // at `budgetMs`, which sits halfway up.
+  void graph(float budgetMs) {
+    int y0 = this->y, y1 = std::min(y0 + GRAPH_HEIGHT, this->fb->height);
+    int width = std::min(WIDTH, this->fb->width);
+    // Bars first, so the rows below are plain selects.
+    int tops[HISTORY];
+    Uint32 colors[HISTORY];
+    float scale = GRAPH_HEIGHT / (2.0f * budgetMs);
+    for (int x = 0; x < width; x++) {
+      float ms = this->history[(this->next + x) % HISTORY];
+      int height = std::min((int)(ms * scale + 0.5f), GRAPH_HEIGHT);
+      tops[x] = GRAPH_HEIGHT - height;
+      colors[x] = ms > budgetMs ? OVER_BUDGET : UNDER_BUDGET;
+    }
+    for (int y = y0; y < y1; y++) {
+      Uint32 *row = &this->fb->color[(size_t)y * this->fb->width];
+      int gy = y - y0;
+      Uint32 empty = gy == GRAPH_HEIGHT / 2 ? BUDGET_LINE : BACKGROUND;
+      for (int x = 0; x < width; x++)
+        row[x] = gy >= tops[x] ? colors[x] : empty;
+    }
+    this->finishBand(y0, y1, width);
+  }
+
+  // Resident memory of this process in bytes, or 0 where /proc is missing.
+  static Uint64 residentBytes() {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+      return 0;
+    unsigned long long pages = 0, resident = 0;
+    int read = fscanf(statm, "%llu %llu", &pages, &resident);
+    fclose(statm);
+    return read == 2 ? resident * (Uint64)sysconf(_SC_PAGESIZE) : 0;
+  }
+
+private:
+  std::vector<Uint32> glyphs;
+  float history[HISTORY];
+  int next = 0;
+  Framebuffer *fb = nullptr;
+  int y = 0;
+
+  void finishBand(int y0, int y1, int width) {
+    if (y1 > y0 && width > 0)
+      this->fb->touch(0, y0, width - 1, y1 - 1);
+    this->y = y1;
+  }
+};
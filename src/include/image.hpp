@@ -0,0 +1,26 @@
+#pragma once
+
+#include <SDL2/SDL_stdinc.h>
+#include <cstdio>
+#include <vector>
+
+// Writes 0xRRGGBBAA pixels as a binary PPM. `scratch` holds the packed RGB
+// rows so repeated calls do not allocate.
+inline bool writePpm(const char *path, const Uint32 *pixels, int width,
+                     int height, std::vector<Uint8> &scratch) {
+  size_t count = (size_t)width * height;
+  scratch.resize(count * 3);
+  Uint8 *out = scratch.data();
+  for (size_t i = 0; i < count; i++) {
+    out[i * 3 + 0] = (Uint8)(pixels[i] >> 24);
+    out[i * 3 + 1] = (Uint8)(pixels[i] >> 16);
+    out[i * 3 + 2] = (Uint8)(pixels[i] >> 8);
+  }
+
+  FILE *f = fopen(path, "wb");
+  if (f == NULL)
+    return false;
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  bool ok = fwrite(out, 1, scratch.size(), f) == scratch.size();
+  return fclose(f) == 0 && ok;
+}
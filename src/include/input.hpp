@@ -1,3 +1,5 @@
+#pragma once
+
 #include <cstdlib>
 typedef struct {
   bool ARROW_UP;
@@ -8,6 +10,11 @@ typedef struct {
   bool A;
   bool S;
   bool D;
+  // Set on a left click at (MOUSE_X, MOUSE_Y) in window pixels; cleared by
+  // whoever handles it.
+  bool CLICKED;
+  int MOUSE_X;
+  int MOUSE_Y;
 } Keyboard;
 
 inline Keyboard *initKeyboard() {
@@ -21,6 +28,9 @@ inline Keyboard *initKeyboard() {
   keyboard->A = false;
   keyboard->S = false;
   keyboard->D = false;
+  keyboard->CLICKED = false;
+  keyboard->MOUSE_X = 0;
+  keyboard->MOUSE_Y = 0;
 
   return keyboard;
 }
\ No newline at end of file
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "vec3d.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+struct Light {
+  enum Type { DIRECTIONAL, POINT };
+  Type type = DIRECTIONAL;
+  // Unit vector pointing towards a directional light, or the world-space
+  // position of a point light.
+  vec3d v = {0.0f, 0.0f, -1.0f};
+  float intensity = 1.0f;
+  // Point lights fade as 1 / (1 + falloff * distance^2).
+  float falloff = 0.0f;
+};
+
+// Surfaces to light, one array per component: a unit normal and a
+// world-space position each. Positions only matter for point lights.
+struct LightingInputs {
+  std::vector<float> nx, ny, nz;
+  std::vector<float> px, py, pz;
+  // How much of the first light reaches each surface, from 0 in its shadow
+  // to 1; left empty when nothing is shadowed.
+  std::vector<float> shadow;
+
+  size_t size() const { return this->nx.size(); }
+
+  void clear() {
+    this->nx.clear();
+    this->ny.clear();
+    this->nz.clear();
+    this->px.clear();
+    this->py.clear();
+    this->pz.clear();
+    this->shadow.clear();
+  }
+
+  void add(const vec3d &n, const vec3d &p) {
+    this->nx.push_back(n.x);
+    this->ny.push_back(n.y);
+    this->nz.push_back(n.z);
+    this->px.push_back(p.x);
+    this->py.push_back(p.y);
+    this->pz.push_back(p.z);
+  }
+};
+
+// Diffuse lighting for batches of surfaces, separate from projection so
+// each normal is lit once however the result is then rasterized.
+//
+// A surface's intensity is the sum over the lights of
+// intensity * max(0, n . l) * attenuation, raised to at least `ambient`.
+// The first light's term is also scaled by the surface's shadow input.
+// With the default single light this is the engine's original
+// max(0.1, n . (0, 0, -1)).
+//
+// shade() works on eight surfaces at a time as two SSE2 registers, going
+// over every light for the batch before storing it. The scalar tail
+// repeats the same operations in the same order, so every surface gets the
+// same result wherever it falls in the batch.
+class LightingStage {
+public:
+  static const int BATCH = 8;
+
+  std::vector<Light> lights = {Light()};
+  float ambient = 0.1f;
+
+  // Writes the intensity of every surface in `in` to out[0, in.size()).
+  void shade(const LightingInputs &in, float *out) const {
+    size_t count = in.size();
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 ambient4 = _mm_set1_ps(this->ambient);
+    const bool shadowed = !in.shadow.empty();
+    for (; i + BATCH <= count; i += BATCH) {
+      __m128 nx[2], ny[2], nz[2], sum[2];
+      for (int h = 0; h < 2; h++) {
+        nx[h] = _mm_loadu_ps(&in.nx[i + h * 4]);
+        ny[h] = _mm_loadu_ps(&in.ny[i + h * 4]);
+        nz[h] = _mm_loadu_ps(&in.nz[i + h * 4]);
+        sum[h] = zero;
+      }
+      for (const Light &light : this->lights) {
+        bool first = &light == &this->lights[0];
+        const __m128 lx = _mm_set1_ps(light.v.x), ly = _mm_set1_ps(light.v.y);
+        const __m128 lz = _mm_set1_ps(light.v.z);
+        const __m128 intensity = _mm_set1_ps(light.intensity);
+        for (int h = 0; h < 2; h++) {
+          __m128 dot;
+          __m128 scale = intensity;
+          if (light.type == Light::DIRECTIONAL) {
+            dot = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(nx[h], lx), _mm_mul_ps(ny[h], ly)),
+                _mm_mul_ps(nz[h], lz));
+          } else {
+            __m128 dx = _mm_sub_ps(lx, _mm_loadu_ps(&in.px[i + h * 4]));
+            __m128 dy = _mm_sub_ps(ly, _mm_loadu_ps(&in.py[i + h * 4]));
+            __m128 dz = _mm_sub_ps(lz, _mm_loadu_ps(&in.pz[i + h * 4]));
+            __m128 d2 = _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+                _mm_mul_ps(dz, dz));
+            dot = _mm_div_ps(
+                _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(nx[h], dx), _mm_mul_ps(ny[h], dy)),
+                    _mm_mul_ps(nz[h], dz)),
+                _mm_sqrt_ps(d2));
+            scale = _mm_div_ps(
+                intensity,
+                _mm_add_ps(one, _mm_mul_ps(_mm_set1_ps(light.falloff), d2)));
+          }
+          if (first && shadowed)
+            scale = _mm_mul_ps(scale, _mm_loadu_ps(&in.shadow[i + h * 4]));
+          // max() returns its second operand for NaN, e.g. at distance 0.
+          sum[h] = _mm_add_ps(sum[h], _mm_mul_ps(_mm_max_ps(dot, zero), scale));
+        }
+      }
+      for (int h = 0; h < 2; h++)
+        _mm_storeu_ps(&out[i + h * 4], _mm_max_ps(sum[h], ambient4));
+    }
+#endif
+    for (; i < count; i++)
+      out[i] = this->shadeOne({in.nx[i], in.ny[i], in.nz[i]},
+                              {in.px[i], in.py[i], in.pz[i]},
+                              in.shadow.empty() ? 1.0f : in.shadow[i]);
+  }
+
+  // The intensity of one surface.
+  float shadeOne(const vec3d &n, const vec3d &p, float shadow = 1.0f) const {
+    float sum = 0.0f;
+    for (const Light &light : this->lights) {
+      float dot, scale = light.intensity;
+      if (light.type == Light::DIRECTIONAL) {
+        dot = n.x * light.v.x + n.y * light.v.y + n.z * light.v.z;
+      } else {
+        float dx = light.v.x - p.x, dy = light.v.y - p.y;
+        float dz = light.v.z - p.z;
+        float d2 = dx * dx + dy * dy + dz * dz;
+        dot = (n.x * dx + n.y * dy + n.z * dz) / sqrtf(d2);
+        scale = light.intensity / (1.0f + light.falloff * d2);
+      }
+      if (&light == &this->lights[0])
+        scale *= shadow;
+      sum += (dot > 0.0f ? dot : 0.0f) * scale;
+    }
+    return sum > this->ambient ? sum : this->ambient;
+  }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <iostream>
+
+class mat4x4 {
+public:
+  float m[4][4];
+
+  mat4x4() {
+    for (int i = 0; i < 4; i++) {
+      for (int j = 0; j < 4; j++) {
+        m[i][j] = 0;
+      }
+    }
+  }
+};
+
+inline void printMat4x4(mat4x4 m) {
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      std::cout << m.m[i][j] << " ";
+    }
+    std::cout << "\n";
+  }
+}
+
+// a followed by b, for row vectors: v * multiplyMat4x4(a, b) == (v * a) * b.
+inline mat4x4 multiplyMat4x4(const mat4x4 &a, const mat4x4 &b) {
+  mat4x4 out;
+  for (int r = 0; r < 4; r++) {
+    for (int c = 0; c < 4; c++) {
+      out.m[r][c] = a.m[r][0] * b.m[0][c] + a.m[r][1] * b.m[1][c] +
+                    a.m[r][2] * b.m[2][c] + a.m[r][3] * b.m[3][c];
+    }
+  }
+  return out;
+}
+
+// Inverse of an affine transform, one whose last column is (0, 0, 0, 1):
+// the upper 3x3 part is inverted through its cofactors and the translation
+// taken back through it. Singular matrices give non-finite values.
+inline mat4x4 invertAffineMat4x4(const mat4x4 &a) {
+  const float(&m)[4][4] = a.m;
+  float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+  float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+  float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+  float inv = 1.0f / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+  mat4x4 out;
+  out.m[0][0] = c00 * inv;
+  out.m[1][0] = c01 * inv;
+  out.m[2][0] = c02 * inv;
+  out.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv;
+  out.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv;
+  out.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv;
+  out.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv;
+  out.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv;
+  out.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv;
+  for (int c = 0; c < 3; c++)
+    out.m[3][c] = -(m[3][0] * out.m[0][c] + m[3][1] * out.m[1][c] +
+                    m[3][2] * out.m[2][c]);
+  out.m[3][3] = 1.0f;
+  return out;
+}
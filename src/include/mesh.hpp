@@ -0,0 +1,379 @@
+#pragma once
+
+#include "objparser.hpp"
+#include "vec3d.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct triangle {
+  vec3d p[3];
+
+  float illumination;
+};
+
+inline void printTriangle(triangle tri, bool pad = true) {
+  std::cout << "illumination: " << tri.illumination << std::endl;
+  for (int i = 0; i < 3; i++) {
+    printVec3d(tri.p[i]);
+  }
+  if (pad)
+    std::cout << "\n";
+}
+
+struct mesh {
+  std::vector<triangle> tris;
+
+  // Unit normal of each triangle, and for smooth shading a unit normal per
+  // vertex with three indices into it per triangle, averaged over the faces
+  // sharing the vertex and weighted by their area. Filled on load, or by
+  // ComputeNormals() for meshes built by hand.
+  std::vector<vec3d> faceNormals;
+  std::vector<vec3d> vertexNormals;
+  std::vector<Uint32> normalIndices;
+
+  // Axis-aligned bounds of tris, valid after ComputeBounds().
+  vec3d boundsMin;
+  vec3d boundsMax;
+
+  // A change made through UpdateTriangles(), AddTriangles() or
+  // RemoveTriangles(). TRIANGLES covers tris[first, end), whose positions
+  // and face normals changed along with the vertex normals of their
+  // corners. MOVED says that tris[first, end) now hold the triangles that
+  // were at `from` onwards, and VERTICES covers vertexNormals[first, end)
+  // alone. Triangles past the end of tris are gone.
+  struct Edit {
+    enum Kind { TRIANGLES, MOVED, VERTICES };
+    Kind kind;
+    Uint32 first, end;
+    Uint32 from;
+  };
+
+  // Counts the edits. Anything derived from the mesh, such as a Bvh or the
+  // engine's world-space normals, keeps the revision it was made from and
+  // catches up through EditsSince(). Changes made to tris directly are not
+  // tracked; ComputeNormals() after them starts everything over.
+  Uint64 revision = 0;
+
+  void ComputeBounds() {
+    blockDirty.assign((tris.size() + BOUNDS_BLOCK - 1) / BOUNDS_BLOCK, 1);
+    UpdateBounds();
+  }
+
+  // ComputeBounds() after edits, redoing only the blocks of BOUNDS_BLOCK
+  // triangles that they touched.
+  void UpdateBounds() {
+    size_t nBlocks = (tris.size() + BOUNDS_BLOCK - 1) / BOUNDS_BLOCK;
+    blockMin.resize(nBlocks);
+    blockMax.resize(nBlocks);
+    blockDirty.resize(nBlocks, 1);
+    if (tris.empty()) {
+      boundsMin = boundsMax = vec3d();
+      return;
+    }
+    for (size_t b = 0; b < nBlocks; b++) {
+      if (!blockDirty[b])
+        continue;
+      blockDirty[b] = 0;
+      size_t nEnd = std::min(tris.size(), (b + 1) * BOUNDS_BLOCK);
+      vec3d lo = tris[b * BOUNDS_BLOCK].p[0], hi = lo;
+      for (size_t i = b * BOUNDS_BLOCK; i < nEnd; i++)
+        for (auto &p : tris[i].p)
+          Grow(lo, hi, p);
+      blockMin[b] = lo;
+      blockMax[b] = hi;
+    }
+    boundsMin = blockMin[0];
+    boundsMax = blockMax[0];
+    for (size_t b = 1; b < nBlocks; b++) {
+      Grow(boundsMin, boundsMax, blockMin[b]);
+      Grow(boundsMin, boundsMax, blockMax[b]);
+    }
+  }
+
+  // Fills the normals for all of tris, treating corners at the same
+  // position as one vertex.
+  void ComputeNormals() {
+    std::unordered_map<Key, Uint32, KeyHash> welded;
+    faceNormals.clear();
+    vertexNormals.clear();
+    normalIndices.clear();
+    for (auto &tri : tris) {
+      for (auto &p : tri.p) {
+        auto inserted =
+            welded.insert({{p.x, p.y, p.z}, (Uint32)welded.size()});
+        normalIndices.push_back(inserted.first->second);
+      }
+    }
+    AccumulateNormals(0, welded.size());
+    StartOver();
+  }
+
+  // Moves the corners of tris[nFirst, nFirst + nCount) to those of
+  // pTris[0, nCount), e.g. to deform part of the mesh. Their face normals
+  // and the vertex normals of their corners are updated, at a cost in
+  // proportion to nCount. Corners keep their vertex normals, so corners
+  // that were welded stay welded even if they move apart.
+  void UpdateTriangles(size_t nFirst, const triangle *pTris, size_t nCount) {
+    PrepareEdits();
+    for (size_t i = nFirst; i < nFirst + nCount; i++) {
+      AddToVertexSums(i, -1.0f);
+      for (int k = 0; k < 3; k++)
+        tris[i].p[k] = pTris[i - nFirst].p[k];
+      AddToVertexSums(i, 1.0f);
+    }
+    FinishEdit(nFirst, nFirst + nCount);
+  }
+
+  // Appends pTris[0, nCount). Their corners are welded to each other but
+  // not to the rest of the mesh, so an added part is smooth in itself and
+  // has a hard edge where it meets the rest.
+  void AddTriangles(const triangle *pTris, size_t nCount) {
+    PrepareEdits();
+    size_t nFirst = tris.size();
+    size_t nFirstVertex = vertexNormals.size();
+    std::unordered_map<Key, Uint32, KeyHash> welded;
+    tris.insert(tris.end(), pTris, pTris + nCount);
+    for (size_t i = 0; i < nCount; i++) {
+      for (auto &p : pTris[i].p) {
+        auto inserted = welded.insert(
+            {{p.x, p.y, p.z}, (Uint32)(nFirstVertex + welded.size())});
+        normalIndices.push_back(inserted.first->second);
+      }
+    }
+    faceNormals.resize(tris.size());
+    vertexNormals.resize(nFirstVertex + welded.size());
+    vertexNormalSums.resize(vertexNormals.size(), vec3d(0, 0, 0));
+    for (size_t i = nFirst; i < tris.size(); i++)
+      AddToVertexSums(i, 1.0f);
+    FinishEdit(nFirst, tris.size());
+  }
+
+  // Removes tris[nFirst, nFirst + nCount). The last triangles of the mesh
+  // take their places, so this costs in proportion to nCount but changes
+  // the indices of up to nCount others. Vertex normals that no triangle
+  // uses any more are left in place.
+  void RemoveTriangles(size_t nFirst, size_t nCount) {
+    PrepareEdits();
+    std::vector<Uint32> vecCorners(normalIndices.begin() + nFirst * 3,
+                                   normalIndices.begin() +
+                                       (nFirst + nCount) * 3);
+    for (size_t i = nFirst; i < nFirst + nCount; i++)
+      AddToVertexSums(i, -1.0f);
+    size_t nSize = tris.size() - nCount;
+    size_t nFrom = std::max(nFirst + nCount, nSize);
+    size_t nMoved = tris.size() - nFrom;
+    for (size_t i = 0; i < nMoved; i++) {
+      tris[nFirst + i] = tris[nFrom + i];
+      faceNormals[nFirst + i] = faceNormals[nFrom + i];
+      for (int k = 0; k < 3; k++)
+        normalIndices[(nFirst + i) * 3 + k] =
+            normalIndices[(nFrom + i) * 3 + k];
+    }
+    tris.resize(nSize);
+    faceNormals.resize(nSize);
+    normalIndices.resize(nSize * 3);
+
+    std::sort(vecCorners.begin(), vecCorners.end());
+    vecCorners.erase(std::unique(vecCorners.begin(), vecCorners.end()),
+                     vecCorners.end());
+    size_t nRun = 0;
+    for (size_t i = 0; i < vecCorners.size(); i++) {
+      vertexNormals[vecCorners[i]] = Unit(vertexNormalSums[vecCorners[i]]);
+      bool bRunEnds = i + 1 == vecCorners.size() ||
+                      vecCorners[i + 1] != vecCorners[i] + 1;
+      if (bRunEnds) {
+        RecordEdit(Edit::VERTICES, vecCorners[nRun], vecCorners[i] + 1);
+        nRun = i + 1;
+      }
+    }
+    FinishEdit(nFirst, nFirst + nMoved, Edit::MOVED, nFrom);
+  }
+
+  // Calls fn(edit) for each edit made since `nRevision`, oldest first, and
+  // returns true; or returns false without calling it if they are no longer
+  // all kept, when the caller has to start over from the whole mesh.
+  template <typename Fn> bool EditsSince(Uint64 nRevision, Fn fn) const {
+    if (revision - nRevision > edits.size())
+      return false;
+    for (size_t i = edits.size() - (size_t)(revision - nRevision);
+         i < edits.size(); i++)
+      fn(edits[i]);
+    return true;
+  }
+
+  // Appends the triangles of an OBJ file, parsing it on up to nThreads
+  // threads (0 for one per core); see loadObjFile().
+  bool LoadFromObjectFile(std::string sFilename, int nThreads = 0) {
+    std::vector<vec3d> verts;
+    std::vector<Uint32> indices;
+    if (!loadObjFile(sFilename, verts, indices, nThreads))
+      return false;
+
+    size_t nFirst = tris.size();
+    size_t nFaces = indices.size() / 3;
+    tris.resize(nFirst + nFaces);
+    int nWorkers = nThreads > 0 ? nThreads
+                                : (int)std::thread::hardware_concurrency();
+    // Expanding is only worth threads for big meshes.
+    nWorkers = (int)std::clamp<size_t>(nFaces >> 16, 1, std::max(nWorkers, 1));
+    parallelFor(nFaces, nWorkers, [&](size_t nBegin, size_t nEnd) {
+      for (size_t i = nBegin; i < nEnd; i++)
+        tris[nFirst + i] = {verts[indices[i * 3]], verts[indices[i * 3 + 1]],
+                            verts[indices[i * 3 + 2]]};
+    });
+
+    // Triangles added by hand since the last ComputeNormals() have no
+    // normals to extend.
+    if (normalIndices.size() != nFirst * 3) {
+      ComputeNormals();
+      return true;
+    }
+    size_t nFirstVertex = vertexNormals.size();
+    for (Uint32 &index : indices)
+      index += (Uint32)nFirstVertex;
+    normalIndices.insert(normalIndices.end(), indices.begin(), indices.end());
+    AccumulateNormals(nFirst, verts.size());
+    StartOver();
+    return true;
+  }
+
+private:
+  // Triangles per block of bounds kept by UpdateBounds().
+  static constexpr size_t BOUNDS_BLOCK = 256;
+  // Edits kept for EditsSince() at least; more are kept for large meshes.
+  static constexpr size_t MIN_EDITS = 1024;
+
+  struct Key {
+    float x, y, z;
+    bool operator==(const Key &o) const {
+      return x == o.x && y == o.y && z == o.z;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key &k) const {
+      // Adding zero turns -0.0 into +0.0, which compare equal above and so
+      // must hash the same.
+      float f[3] = {k.x + 0.0f, k.y + 0.0f, k.z + 0.0f};
+      Uint32 b[3];
+      memcpy(b, f, sizeof(b));
+      return (size_t)b[0] * 73856093u ^ (size_t)b[1] * 19349663u ^
+             (size_t)b[2] * 83492791u;
+    }
+  };
+
+  std::vector<Edit> edits;
+  // Unnormalised vertex normals, so a face's share can be taken out again;
+  // filled by the first edit.
+  std::vector<vec3d> vertexNormalSums;
+  std::vector<vec3d> blockMin, blockMax;
+  std::vector<Uint8> blockDirty;
+
+  static vec3d Unit(vec3d v) {
+    float l = sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+    return l > 0.0f ? vec3d(v.x / l, v.y / l, v.z / l) : vec3d(0, 0, 0);
+  }
+
+  // Twice the area of the triangle, along its normal.
+  static vec3d FaceVector(const triangle &tri) {
+    const vec3d &a = tri.p[0], &b = tri.p[1], &c = tri.p[2];
+    return {(b.y - a.y) * (c.z - a.z) - (b.z - a.z) * (c.y - a.y),
+            (b.z - a.z) * (c.x - a.x) - (b.x - a.x) * (c.z - a.z),
+            (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x)};
+  }
+
+  static void Grow(vec3d &lo, vec3d &hi, const vec3d &p) {
+    lo.x = std::min(lo.x, p.x);
+    lo.y = std::min(lo.y, p.y);
+    lo.z = std::min(lo.z, p.z);
+    hi.x = std::max(hi.x, p.x);
+    hi.y = std::max(hi.y, p.y);
+    hi.z = std::max(hi.z, p.z);
+  }
+
+  // Forgets the edits, so that everything derived from the mesh is redone.
+  void StartOver() {
+    edits.clear();
+    vertexNormalSums.clear();
+    blockDirty.assign(blockDirty.size(), 1);
+    revision++;
+  }
+
+  void PrepareEdits() {
+    if (faceNormals.size() != tris.size() ||
+        normalIndices.size() != tris.size() * 3)
+      ComputeNormals();
+    if (vertexNormalSums.size() == vertexNormals.size())
+      return;
+    vertexNormalSums.assign(vertexNormals.size(), vec3d(0, 0, 0));
+    for (size_t i = 0; i < tris.size(); i++)
+      AddToVertexSums(i, 1.0f);
+  }
+
+  // Adds (fSign 1) or takes out (-1) triangle i's share of the vertex
+  // normals of its corners, refreshing its face normal on the way in.
+  void AddToVertexSums(size_t i, float fSign) {
+    vec3d face = FaceVector(tris[i]);
+    if (fSign > 0.0f)
+      faceNormals[i] = Unit(face);
+    for (int k = 0; k < 3; k++) {
+      vec3d &n = vertexNormalSums[normalIndices[i * 3 + k]];
+      n.x += fSign * face.x;
+      n.y += fSign * face.y;
+      n.z += fSign * face.z;
+    }
+  }
+
+  // Renormalises the vertex normals of tris[nFirst, nEnd) and records them
+  // as edited.
+  void FinishEdit(size_t nFirst, size_t nEnd,
+                  Edit::Kind kind = Edit::TRIANGLES, size_t nFrom = 0) {
+    for (size_t i = nFirst * 3; i < nEnd * 3; i++) {
+      Uint32 v = normalIndices[i];
+      vertexNormals[v] = Unit(vertexNormalSums[v]);
+    }
+    blockDirty.resize((tris.size() + BOUNDS_BLOCK - 1) / BOUNDS_BLOCK, 1);
+    for (size_t b = nFirst / BOUNDS_BLOCK;
+         b < blockDirty.size() && b * BOUNDS_BLOCK < nEnd; b++)
+      blockDirty[b] = 1;
+    // The last block may have lost triangles.
+    if (!blockDirty.empty())
+      blockDirty.back() = 1;
+    if (nEnd > nFirst)
+      RecordEdit(kind, nFirst, nEnd, nFrom);
+  }
+
+  void RecordEdit(Edit::Kind kind, size_t nFirst, size_t nEnd,
+                  size_t nFrom = 0) {
+    if (edits.size() >= std::max(MIN_EDITS, tris.size() / 16))
+      edits.erase(edits.begin(), edits.begin() + edits.size() / 2);
+    edits.push_back({kind, (Uint32)nFirst, (Uint32)nEnd, (Uint32)nFrom});
+    revision++;
+  }
+
+  // Computes the normals of tris[nFirst, end) and appends nNewVertices
+  // vertex normals, which normalIndices must already refer to.
+  void AccumulateNormals(size_t nFirst, size_t nNewVertices) {
+    size_t nFirstVertex = vertexNormals.size();
+    faceNormals.resize(tris.size());
+    vertexNormals.resize(nFirstVertex + nNewVertices, vec3d(0, 0, 0));
+    for (size_t i = nFirst; i < tris.size(); i++) {
+      // Unnormalised, so larger faces weigh more in the vertex normals.
+      vec3d face = FaceVector(tris[i]);
+      faceNormals[i] = Unit(face);
+      for (int k = 0; k < 3; k++) {
+        vec3d &n = vertexNormals[normalIndices[i * 3 + k]];
+        n.x += face.x;
+        n.y += face.y;
+        n.z += face.z;
+      }
+    }
+    for (size_t i = nFirstVertex; i < vertexNormals.size(); i++)
+      vertexNormals[i] = Unit(vertexNormals[i]);
+  }
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "mesh.hpp"
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Loads each OBJ file at most once, however many threads ask for it. The
+// first caller for a path parses it; concurrent callers for the same path
+// wait on that load instead of starting their own.
+class MeshCache {
+  std::mutex lock;
+  std::map<std::string, std::shared_future<std::shared_ptr<const mesh>>>
+      entries;
+
+public:
+  int loads = 0;
+  int hits = 0;
+
+  // Returns null if the file could not be loaded. Failures are cached too,
+  // so a broken file is only read once per batch.
+  std::shared_ptr<const mesh> get(const std::string &path) {
+    std::promise<std::shared_ptr<const mesh>> promise;
+    std::shared_future<std::shared_ptr<const mesh>> future;
+    bool owner = false;
+    {
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto it = this->entries.find(path);
+      if (it != this->entries.end()) {
+        this->hits++;
+        future = it->second;
+      } else {
+        this->loads++;
+        owner = true;
+        future = promise.get_future().share();
+        this->entries[path] = future;
+      }
+    }
+
+    if (owner) {
+      auto loaded = std::make_shared<mesh>();
+      if (loaded->LoadFromObjectFile(path))
+        promise.set_value(loaded);
+      else
+        promise.set_value(nullptr);
+    }
+    return future.get();
+  }
+};
@@ -0,0 +1,246 @@
+#pragma once
+
+#include "framebuffer.hpp"
+#include "vec3d.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// 4x multisample anti-aliasing that shades once per pixel.
+//
+// Vertices are snapped to 28.4 fixed point and every pixel gets a 4-bit
+// coverage mask from the edge functions at four rotated-grid sample
+// positions. Pixels that are fully covered by one triangle keep a single
+// colour (in the framebuffer) and a single depth; only pixels on an edge
+// are given a block of four colour and depth samples, which resolve()
+// averages back into the framebuffer.
+class MsaaBuffer {
+  static constexpr Uint32 NO_SAMPLES = 0xffffffff;
+
+  struct Samples {
+    Uint32 color[4];
+    float depth[4];
+    Uint32 pixel;
+  };
+
+  // Sample offsets inside a pixel, in 1/16 pixel units.
+  static constexpr int sampleX[4] = {6, 14, 2, 10};
+  static constexpr int sampleY[4] = {2, 6, 10, 14};
+
+  std::vector<float> depth;
+  std::vector<Uint32> sampleIndex;
+  std::vector<Samples> edgeSamples;
+
+public:
+  int width = 0;
+  int height = 0;
+  // Number of pixels that still carried separate samples at the last resolve.
+  size_t edgePixels = 0;
+
+  void resize(int width, int height) {
+    this->width = width;
+    this->height = height;
+    this->depth.resize((size_t)width * height);
+    this->sampleIndex.resize((size_t)width * height);
+  }
+
+  void clear() {
+    std::fill(this->depth.begin(), this->depth.end(), 1.0f);
+    std::fill(this->sampleIndex.begin(), this->sampleIndex.end(), NO_SAMPLES);
+    this->edgeSamples.clear();
+  }
+
+  // Rasterizes a screen-space triangle with depth in p.z. Uniform pixel
+  // colours are written straight into `fb`, which must match this buffer's
+  // size and be cleared by the caller.
+  void fillTriangle(Framebuffer &fb, vec3d p1, vec3d p2, vec3d p3,
+                    Uint32 color) {
+    vec3d v[3] = {p1, p2, p3};
+    int X[3], Y[3];
+    for (int i = 0; i < 3; i++) {
+      X[i] = (int)lroundf(v[i].x * 16.0f);
+      Y[i] = (int)lroundf(v[i].y * 16.0f);
+    }
+
+    long long area = (long long)(X[1] - X[0]) * (Y[2] - Y[0]) -
+                     (long long)(Y[1] - Y[0]) * (X[2] - X[0]);
+    if (area == 0)
+      return;
+    if (area < 0) {
+      std::swap(X[1], X[2]);
+      std::swap(Y[1], Y[2]);
+      std::swap(v[1], v[2]);
+    }
+
+    int minX = std::max(std::min({X[0], X[1], X[2]}) >> 4, 0);
+    int maxX = std::min(std::max({X[0], X[1], X[2]}) >> 4, this->width - 1);
+    int minY = std::max(std::min({Y[0], Y[1], Y[2]}) >> 4, 0);
+    int maxY = std::min(std::max({Y[0], Y[1], Y[2]}) >> 4, this->height - 1);
+    if (minX > maxX || minY > maxY)
+      return;
+    fb.touch(minX, minY, maxX, maxY);
+
+    // Depth plane through the snapped vertices, in pixel units.
+    float fx[3], fy[3];
+    for (int i = 0; i < 3; i++) {
+      fx[i] = X[i] / 16.0f;
+      fy[i] = Y[i] / 16.0f;
+    }
+    float det = (fx[1] - fx[0]) * (fy[2] - fy[0]) -
+                (fx[2] - fx[0]) * (fy[1] - fy[0]);
+    float dzdx = ((v[1].z - v[0].z) * (fy[2] - fy[0]) -
+                  (v[2].z - v[0].z) * (fy[1] - fy[0])) /
+                 det;
+    float dzdy = ((v[2].z - v[0].z) * (fx[1] - fx[0]) -
+                  (v[1].z - v[0].z) * (fx[2] - fx[0])) /
+                 det;
+
+    float sampleDz[4];
+    for (int s = 0; s < 4; s++)
+      sampleDz[s] =
+          dzdx * (sampleX[s] - 8) / 16.0f + dzdy * (sampleY[s] - 8) / 16.0f;
+
+    // Edge a->b: E(p) = (Xb - Xa)(py - Ya) - (Yb - Ya)(px - Xa), positive
+    // inside. Samples exactly on an edge belong to top and left edges only.
+    int edgeA[3], edgeB[3], rowE[3][4];
+    for (int e = 0; e < 3; e++) {
+      int a = e;
+      int b = (e + 1) % 3;
+      edgeA[e] = X[b] - X[a];
+      edgeB[e] = Y[b] - Y[a];
+      bool topLeft = edgeB[e] < 0 || (edgeB[e] == 0 && edgeA[e] > 0);
+      for (int s = 0; s < 4; s++) {
+        int px = minX * 16 + sampleX[s];
+        int py = minY * 16 + sampleY[s];
+        rowE[e][s] =
+            edgeA[e] * (py - Y[a]) - edgeB[e] * (px - X[a]) - (topLeft ? 0 : 1);
+      }
+    }
+
+    for (int y = minY; y <= maxY; y++) {
+      float z = v[0].z + dzdx * (minX + 0.5f - fx[0]) +
+                dzdy * (y + 0.5f - fy[0]);
+      size_t idx = (size_t)y * this->width + minX;
+#if defined(__SSE2__)
+      __m128i e0 = _mm_loadu_si128((const __m128i *)rowE[0]);
+      __m128i e1 = _mm_loadu_si128((const __m128i *)rowE[1]);
+      __m128i e2 = _mm_loadu_si128((const __m128i *)rowE[2]);
+      __m128i step0 = _mm_set1_epi32(-edgeB[0] * 16);
+      __m128i step1 = _mm_set1_epi32(-edgeB[1] * 16);
+      __m128i step2 = _mm_set1_epi32(-edgeB[2] * 16);
+#else
+      int e[3][4];
+      std::copy(&rowE[0][0], &rowE[0][0] + 12, &e[0][0]);
+#endif
+      for (int x = minX; x <= maxX; x++, idx++, z += dzdx) {
+#if defined(__SSE2__)
+        int outside = _mm_movemask_ps(
+            _mm_castsi128_ps(_mm_or_si128(e0, _mm_or_si128(e1, e2))));
+        e0 = _mm_add_epi32(e0, step0);
+        e1 = _mm_add_epi32(e1, step1);
+        e2 = _mm_add_epi32(e2, step2);
+        int mask = ~outside & 0xf;
+#else
+        int mask = 0;
+        for (int s = 0; s < 4; s++) {
+          if ((e[0][s] | e[1][s] | e[2][s]) >= 0)
+            mask |= 1 << s;
+          for (int k = 0; k < 3; k++)
+            e[k][s] -= edgeB[k] * 16;
+        }
+#endif
+        if (mask)
+          this->shade(fb, idx, mask, z, sampleDz, color);
+      }
+      for (int e = 0; e < 3; e++)
+        for (int s = 0; s < 4; s++)
+          rowE[e][s] += edgeA[e] * 16;
+    }
+  }
+
+  // Averages the samples of every edge pixel into the framebuffer.
+  void resolve(Framebuffer &fb) {
+    this->edgePixels = 0;
+    for (size_t i = 0; i < this->edgeSamples.size(); i++) {
+      Samples &s = this->edgeSamples[i];
+      // Blocks are abandoned, not freed, when a pixel becomes uniform again.
+      if (this->sampleIndex[s.pixel] != i)
+        continue;
+      this->edgePixels++;
+#if defined(__SSE2__)
+      __m128i zero = _mm_setzero_si128();
+      __m128i c = _mm_loadu_si128((const __m128i *)s.color);
+      __m128i sum = _mm_add_epi16(_mm_unpacklo_epi8(c, zero),
+                                  _mm_unpackhi_epi8(c, zero));
+      sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+      sum = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+      fb.color[s.pixel] = (Uint32)_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+#else
+      Uint32 r = 0;
+      for (int ch = 0; ch < 32; ch += 8) {
+        Uint32 total = 2;
+        for (int k = 0; k < 4; k++)
+          total += (s.color[k] >> ch) & 0xff;
+        r |= (total >> 2) << ch;
+      }
+      fb.color[s.pixel] = r;
+#endif
+    }
+  }
+
+private:
+  void shade(Framebuffer &fb, size_t idx, int mask, float z,
+             const float *sampleDz, Uint32 color) {
+    Uint32 block = this->sampleIndex[idx];
+
+    if (block == NO_SAMPLES) {
+      float current = this->depth[idx];
+      if (mask == 0xf) {
+        if (z < current) {
+          fb.color[idx] = color;
+          this->depth[idx] = z;
+        }
+        return;
+      }
+      int pass = 0;
+      for (int s = 0; s < 4; s++)
+        if ((mask >> s & 1) && z + sampleDz[s] < current)
+          pass |= 1 << s;
+      if (!pass)
+        return;
+
+      // First partial hit on a uniform pixel: expand it into samples.
+      Samples samples;
+      for (int s = 0; s < 4; s++) {
+        bool hit = pass >> s & 1;
+        samples.color[s] = hit ? color : fb.color[idx];
+        samples.depth[s] = hit ? z + sampleDz[s] : current;
+      }
+      samples.pixel = (Uint32)idx;
+      this->sampleIndex[idx] = (Uint32)this->edgeSamples.size();
+      this->edgeSamples.push_back(samples);
+      return;
+    }
+
+    Samples &samples = this->edgeSamples[block];
+    int pass = 0;
+    for (int s = 0; s < 4; s++) {
+      if ((mask >> s & 1) && z + sampleDz[s] < samples.depth[s]) {
+        samples.color[s] = color;
+        samples.depth[s] = z + sampleDz[s];
+        pass |= 1 << s;
+      }
+    }
+    // Fully covered and in front everywhere: collapse back to one sample.
+    if (pass == 0xf) {
+      fb.color[idx] = color;
+      this->depth[idx] = z;
+      this->sampleIndex[idx] = NO_SAMPLES;
+    }
+  }
+};
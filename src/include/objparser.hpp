@@ -0,0 +1,198 @@
+#pragma once
+
+#include "vec3d.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Parallel OBJ parsing.
+//
+// The file is mapped and cut into line-aligned chunks, which all cores
+// parse independently into per-chunk vertex and face lists. A prefix sum
+// over the chunks' vertex counts then gives every chunk its first global
+// vertex number, and a second parallel pass copies the vertices into place
+// and resolves the face indices. A face stores how many vertices its own
+// chunk had defined before it, so relative (negative) indices resolve
+// exactly as in a sequential read even when they reach into earlier
+// chunks.
+//
+// The rules are those the loader always had: "v x y z" and "f a b c"
+// lines, other lines ignored, only the first three face indices used, and
+// a face may only refer to vertices defined before it. Faces with
+// "a/b/c" references are rejected.
+
+// Runs fn(begin, end) over [0, count) split into `threads` contiguous
+// ranges, one per thread, the calling thread taking the first.
+template <typename Fn>
+void parallelFor(size_t count, int threads, Fn fn) {
+  threads = (int)std::clamp<size_t>(threads, 1, std::max<size_t>(count, 1));
+  std::vector<std::thread> workers;
+  for (int t = 1; t < threads; t++)
+    workers.emplace_back(
+        [&fn, count, threads, t] {
+          fn(count * t / threads, count * (t + 1) / threads);
+        });
+  fn(0, count / threads);
+  for (auto &worker : workers)
+    worker.join();
+}
+
+struct ObjFace {
+  int index[3];
+  // Vertices this face's chunk defined before it.
+  Uint32 vertsBefore;
+};
+
+struct ObjChunk {
+  std::vector<vec3d> verts;
+  std::vector<ObjFace> faces;
+  bool ok = true;
+};
+
+inline bool objSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+// Reads one number after optional blanks, which must end at a blank or the
+// end of the line. Returns nullptr if there is none.
+template <typename T>
+const char *objNumber(const char *p, const char *end, T &value) {
+  while (p < end && objSpace(*p))
+    p++;
+  if (p < end && *p == '+')
+    p++;
+  auto result = std::from_chars(p, end, value);
+  if (result.ec != std::errc() ||
+      (result.ptr < end && !objSpace(*result.ptr)))
+    return nullptr;
+  return result.ptr;
+}
+
+inline void parseObjChunk(const char *p, const char *end, ObjChunk &out) {
+  while (p < end) {
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if (!eol)
+      eol = end;
+    if (eol - p >= 2 && p[1] == ' ') {
+      if (p[0] == 'v') {
+        // Like the stream-based reader this replaced, missing or broken
+        // coordinates are left at zero.
+        vec3d v;
+        float *c[3] = {&v.x, &v.y, &v.z};
+        const char *q = p + 2;
+        for (int i = 0; i < 3 && q; i++)
+          q = objNumber(q, eol, *c[i]);
+        out.verts.push_back(v);
+      } else if (p[0] == 'f') {
+        ObjFace face;
+        face.vertsBefore = (Uint32)out.verts.size();
+        const char *q = p + 2;
+        for (int i = 0; i < 3 && q; i++)
+          q = objNumber(q, eol, face.index[i]);
+        if (!q) {
+          out.ok = false;
+          return;
+        }
+        out.faces.push_back(face);
+      }
+    }
+    p = eol + 1;
+  }
+}
+
+// Loads the vertex positions of `path` and three 0-based indices into them
+// per face, parsing with up to `threads` threads (0 for one per core).
+// Returns false if the file cannot be read or a face is invalid.
+inline bool loadObjFile(const std::string &path, std::vector<vec3d> &verts,
+                        std::vector<Uint32> &indices, int threads = 0) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return false;
+  }
+  size_t size = info.st_size;
+  verts.clear();
+  indices.clear();
+  if (size == 0) {
+    close(fd);
+    return true;
+  }
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return false;
+  madvise(mapped, size, MADV_SEQUENTIAL);
+  const char *data = (const char *)mapped;
+
+  // Below about a megabyte per thread, starting threads costs more than it
+  // saves, so small meshes are parsed on the calling thread.
+  if (threads <= 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = (int)std::clamp<size_t>(size >> 20, 1, threads);
+
+  // Several chunks per thread, handed out in order, so one slow chunk does
+  // not hold up the rest.
+  size_t chunkCount = threads == 1 ? 1 : (size_t)threads * 4;
+  std::vector<size_t> bounds(chunkCount + 1, size);
+  bounds[0] = 0;
+  for (size_t i = 1; i < chunkCount; i++) {
+    size_t at = std::max(size * i / chunkCount, bounds[i - 1]);
+    const char *eol = (const char *)memchr(data + at, '\n', size - at);
+    bounds[i] = eol ? eol - data + 1 : size;
+  }
+  std::vector<ObjChunk> chunks(chunkCount);
+  std::atomic<size_t> next(0);
+  parallelFor(threads, threads, [&](size_t, size_t) {
+    for (size_t i; (i = next++) < chunkCount;)
+      parseObjChunk(data + bounds[i], data + bounds[i + 1], chunks[i]);
+  });
+  munmap(mapped, size);
+
+  std::vector<size_t> firstVert(chunkCount + 1, 0);
+  std::vector<size_t> firstFace(chunkCount + 1, 0);
+  for (size_t i = 0; i < chunkCount; i++) {
+    if (!chunks[i].ok)
+      return false;
+    firstVert[i + 1] = firstVert[i] + chunks[i].verts.size();
+    firstFace[i + 1] = firstFace[i] + chunks[i].faces.size();
+  }
+  if (firstVert[chunkCount] > 0xffffffffu)
+    return false;
+
+  verts.resize(firstVert[chunkCount]);
+  indices.resize(firstFace[chunkCount] * 3);
+  std::atomic<bool> ok(true);
+  parallelFor(chunkCount, threads, [&](size_t begin, size_t end) {
+    for (size_t c = begin; c < end; c++) {
+      ObjChunk &chunk = chunks[c];
+      std::copy(chunk.verts.begin(), chunk.verts.end(),
+                verts.begin() + firstVert[c]);
+      Uint32 *out = &indices[firstFace[c] * 3];
+      for (ObjFace &face : chunk.faces) {
+        long long defined = (long long)firstVert[c] + face.vertsBefore;
+        for (int k = 0; k < 3; k++) {
+          long long i = face.index[k];
+          long long resolved = i > 0 ? i - 1 : defined + i;
+          if (i == 0 || resolved < 0 || resolved >= defined) {
+            ok = false;
+            return;
+          }
+          *out++ = (Uint32)resolved;
+        }
+      }
+      // Released as soon as it is merged, to keep the peak down.
+      chunk = ObjChunk();
+    }
+  });
+  return ok;
+}
@@ -0,0 +1,470 @@
+#pragma once
+
+#include "framebuffer.hpp"
+#include "matrix.hpp"
+#include "objparser.hpp"
+#include "threadpool.hpp"
+#include "vec3d.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Point cloud held as one array per component, for LiDAR scans and the
+// like with tens of millions of points.
+//
+// Render() transforms four points at a time with a single combined
+// model-view-projection matrix, rejects those outside the frustum, and
+// splats the rest as squares of pointSize pixels. With a thread pool the
+// points are split across workers, which resolve overlaps with an atomic
+// minimum on a per-pixel 64-bit word holding the depth's bits above the
+// colour. Depths in [0, 1] order the same as their bit patterns, so the
+// minimum keeps the nearest point, and the result does not depend on thread
+// timing. A single thread depth-tests straight into the framebuffer.
+class PointCloud {
+  std::unique_ptr<std::atomic<Uint64>[]> packed;
+  size_t packedSize = 0;
+
+public:
+  std::vector<float> x, y, z;
+  // 0xRRGGBBAA; white where the file has no colours.
+  std::vector<Uint32> color;
+  vec3d boundsMin;
+  vec3d boundsMax;
+
+  size_t size() const { return this->x.size(); }
+
+  void add(float px, float py, float pz, Uint32 rgba = 0xffffffff) {
+    this->x.push_back(px);
+    this->y.push_back(py);
+    this->z.push_back(pz);
+    this->color.push_back(rgba);
+  }
+
+  void ComputeBounds() {
+    if (this->x.empty()) {
+      this->boundsMin = this->boundsMax = vec3d();
+      return;
+    }
+    auto [x0, x1] = std::minmax_element(this->x.begin(), this->x.end());
+    auto [y0, y1] = std::minmax_element(this->y.begin(), this->y.end());
+    auto [z0, z1] = std::minmax_element(this->z.begin(), this->z.end());
+    this->boundsMin = {*x0, *y0, *z0};
+    this->boundsMax = {*x1, *y1, *z1};
+  }
+
+  // Loads a PLY (ASCII or binary little-endian; x, y, z and optional red,
+  // green, blue vertex properties) or an XYZ text file of "x y z [r g b]"
+  // lines, chosen by extension, and computes the bounds.
+  bool LoadFromFile(const std::string &path) {
+    bool ok = path.size() >= 4 && path.substr(path.size() - 4) == ".ply"
+                  ? this->loadPly(path)
+                  : this->loadXyz(path);
+    this->ComputeBounds();
+    return ok;
+  }
+
+  // Draws the points into `fb` with its depth test. `mvp` maps model space
+  // to clip space (row vectors, as Matrix_MultiplyVector), and points with
+  // clip w below fNear are dropped. Runs on `pool` when it has more than one
+  // worker.
+  void Render(Framebuffer &fb, const mat4x4 &mvp, float fNear, int pointSize,
+              ThreadPool *pool) {
+    if (!pool || pool->size() < 2) {
+      this->splat<false>(fb, mvp, fNear, pointSize, 0, this->size());
+      return;
+    }
+
+    size_t pixels = (size_t)fb.width * fb.height;
+    if (this->packedSize < pixels) {
+      this->packed = std::make_unique<std::atomic<Uint64>[]>(pixels);
+      this->packedSize = pixels;
+    }
+    auto rows = [&](auto fn) {
+      int bands = pool->size() * 4;
+      int step = (fb.height + bands - 1) / bands;
+      for (int y = 0; y < fb.height; y += step) {
+        int end = std::min(y + step, fb.height);
+        pool->submit([&fn, y, end](int) { fn(y, end); });
+      }
+      pool->wait();
+    };
+
+    rows([&](int y0, int y1) {
+      for (size_t i = (size_t)y0 * fb.width; i < (size_t)y1 * fb.width; i++)
+        this->packed[i].store(pack(fb.depth[i], fb.color[i]),
+                              std::memory_order_relaxed);
+    });
+
+    const size_t batch = 1 << 16;
+    for (size_t begin = 0; begin < this->size(); begin += batch) {
+      size_t end = std::min(begin + batch, this->size());
+      pool->submit([this, &fb, &mvp, fNear, pointSize, begin, end](int) {
+        this->splat<true>(fb, mvp, fNear, pointSize, begin, end);
+      });
+    }
+    pool->wait();
+
+    rows([&](int y0, int y1) {
+      for (int y = y0; y < y1; y++) {
+        for (int x = 0; x < fb.width; x++) {
+          size_t i = (size_t)y * fb.width + x;
+          Uint64 v = this->packed[i].load(std::memory_order_relaxed);
+          if (v == pack(fb.depth[i], fb.color[i]))
+            continue;
+          Uint32 bits = (Uint32)(v >> 32);
+          memcpy(&fb.depth[i], &bits, sizeof(bits));
+          fb.color[i] = (Uint32)v;
+          fb.tileTouched[(size_t)(y >> Framebuffer::TILE_SHIFT) * fb.tilesX +
+                         (x >> Framebuffer::TILE_SHIFT)] = 1;
+        }
+      }
+    });
+  }
+
+private:
+  static Uint64 pack(float depth, Uint32 rgba) {
+    Uint32 bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    return (Uint64)bits << 32 | rgba;
+  }
+
+  // Splats points [begin, end). Shared splats go to `packed`, for several
+  // threads at once; otherwise straight into `fb`, ordered the same way so
+  // both give the same picture.
+  //
+  // Points go in batches: transforming and rejecting a batch lists its
+  // survivors without a branch per point, then a short loop writes them.
+  // With no hard-to-predict branches in that loop, the CPU keeps many of
+  // its cache misses in flight at once.
+  template <bool Shared>
+  void splat(Framebuffer &fb, const mat4x4 &m, float fNear, int pointSize,
+             size_t begin, size_t end) {
+    const int BATCH = 256;
+    int outX[BATCH], outY[BATCH];
+    float outDepth[BATCH];
+    Uint32 outColor[BATCH];
+
+    const float halfW = 0.5f * fb.width, halfH = 0.5f * fb.height;
+    // Splats are centred on the point; keep any that still reach the screen.
+    const int lo = (pointSize - 1) / 2, hi = pointSize / 2;
+    const float minX = -(float)hi, maxX = (float)(fb.width + lo);
+    const float minY = -(float)hi, maxY = (float)(fb.height + lo);
+    // Survivors have x, y >= -hi, so truncating x + hi rounds down.
+    const float bias = (float)hi;
+#if defined(__SSE2__)
+    __m128 col[4][4];
+    for (int r = 0; r < 4; r++)
+      for (int c = 0; c < 4; c++)
+        col[r][c] = _mm_set1_ps(m.m[r][c]);
+    const __m128 near4 = _mm_set1_ps(fNear), one = _mm_set1_ps(1.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 hw = _mm_set1_ps(halfW), hh = _mm_set1_ps(halfH);
+    const __m128 minX4 = _mm_set1_ps(minX), maxX4 = _mm_set1_ps(maxX);
+    const __m128 minY4 = _mm_set1_ps(minY), maxY4 = _mm_set1_ps(maxY);
+    const __m128 bias4 = _mm_set1_ps(bias);
+    const __m128i hi4 = _mm_set1_epi32(hi);
+#endif
+
+    for (size_t start = begin; start < end; start += BATCH) {
+      size_t stop = std::min(start + BATCH, end);
+      int n = 0;
+      size_t i = start;
+#if defined(__SSE2__)
+      for (; i + 4 <= stop; i += 4) {
+        __m128 px = _mm_loadu_ps(&this->x[i]);
+        __m128 py = _mm_loadu_ps(&this->y[i]);
+        __m128 pz = _mm_loadu_ps(&this->z[i]);
+        __m128 clip[4];
+        for (int c = 0; c < 4; c++)
+          clip[c] = _mm_add_ps(
+              _mm_add_ps(_mm_mul_ps(px, col[0][c]), _mm_mul_ps(py, col[1][c])),
+              _mm_add_ps(_mm_mul_ps(pz, col[2][c]), col[3][c]));
+        // Rejected lanes may divide by zero; their results are dropped.
+        __m128 invW = _mm_div_ps(one, clip[3]);
+        __m128 sx = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(clip[0], invW), hw), hw);
+        __m128 sy = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(clip[1], invW), hh), hh);
+        // Adding zero turns -0 into +0, which packs below every other depth.
+        __m128 depth = _mm_add_ps(_mm_mul_ps(clip[2], invW), zero);
+        __m128 keep = _mm_cmpge_ps(clip[3], near4);
+        keep = _mm_and_ps(keep, _mm_and_ps(_mm_cmpge_ps(sx, minX4),
+                                           _mm_cmplt_ps(sx, maxX4)));
+        keep = _mm_and_ps(keep, _mm_and_ps(_mm_cmpge_ps(sy, minY4),
+                                           _mm_cmplt_ps(sy, maxY4)));
+        keep = _mm_and_ps(keep, _mm_and_ps(_mm_cmpge_ps(depth, zero),
+                                           _mm_cmplt_ps(depth, one)));
+        int mask = _mm_movemask_ps(keep);
+        if (!mask)
+          continue;
+        int ix[4], iy[4];
+        float fz[4];
+        _mm_storeu_si128(
+            (__m128i *)ix,
+            _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(sx, bias4)), hi4));
+        _mm_storeu_si128(
+            (__m128i *)iy,
+            _mm_sub_epi32(_mm_cvttps_epi32(_mm_add_ps(sy, bias4)), hi4));
+        _mm_storeu_ps(fz, depth);
+        for (int k = 0; k < 4; k++) {
+          outX[n] = ix[k];
+          outY[n] = iy[k];
+          outDepth[n] = fz[k];
+          outColor[n] = this->color[i + k];
+          n += mask >> k & 1;
+        }
+      }
+#endif
+      for (; i < stop; i++) {
+        float clip[4];
+        for (int c = 0; c < 4; c++)
+          clip[c] = this->x[i] * m.m[0][c] + this->y[i] * m.m[1][c] +
+                    this->z[i] * m.m[2][c] + m.m[3][c];
+        if (!(clip[3] >= fNear))
+          continue;
+        float sx = clip[0] / clip[3] * halfW + halfW;
+        float sy = clip[1] / clip[3] * halfH + halfH;
+        float depth = clip[2] / clip[3] + 0.0f;
+        if (!(sx >= minX && sx < maxX && sy >= minY && sy < maxY &&
+              depth >= 0.0f && depth < 1.0f))
+          continue;
+        outX[n] = (int)(sx + bias) - hi;
+        outY[n] = (int)(sy + bias) - hi;
+        outDepth[n] = depth;
+        outColor[n] = this->color[i];
+        n++;
+      }
+
+      // Tiles are flagged here for the direct path and when resolving for
+      // the shared one. Splats are at most a tile wide in practice, so the
+      // tiles of their corners cover them.
+      const int shift = Framebuffer::TILE_SHIFT;
+      if (pointSize == 1) {
+        for (int k = 0; k < n; k++) {
+          this->write<Shared>(fb, (size_t)outY[k] * fb.width + outX[k],
+                              outDepth[k], outColor[k]);
+          if constexpr (!Shared)
+            fb.tileTouched[(size_t)(outY[k] >> shift) * fb.tilesX +
+                           (outX[k] >> shift)] = 1;
+        }
+        continue;
+      }
+      for (int k = 0; k < n; k++) {
+        int x0 = std::max(outX[k] - lo, 0);
+        int x1 = std::min(outX[k] + hi, fb.width - 1);
+        int y0 = std::max(outY[k] - lo, 0);
+        int y1 = std::min(outY[k] + hi, fb.height - 1);
+        for (int y = y0; y <= y1; y++)
+          for (int x = x0; x <= x1; x++)
+            this->write<Shared>(fb, (size_t)y * fb.width + x, outDepth[k],
+                                outColor[k]);
+        if constexpr (!Shared) {
+          if (pointSize > Framebuffer::TILE_SIZE) {
+            fb.touch(x0, y0, x1, y1);
+            continue;
+          }
+          Uint8 *row0 = &fb.tileTouched[(size_t)(y0 >> shift) * fb.tilesX];
+          Uint8 *row1 = &fb.tileTouched[(size_t)(y1 >> shift) * fb.tilesX];
+          row0[x0 >> shift] = row0[x1 >> shift] = 1;
+          row1[x0 >> shift] = row1[x1 >> shift] = 1;
+        }
+      }
+    }
+  }
+
+  // Keeps the nearer of the pixel's current contents and the new point,
+  // breaking depth ties on the colour.
+  template <bool Shared>
+  void write(Framebuffer &fb, size_t i, float depth, Uint32 rgba) {
+    if constexpr (Shared) {
+      Uint64 value = pack(depth, rgba);
+      std::atomic<Uint64> &cell = this->packed[i];
+      Uint64 current = cell.load(std::memory_order_relaxed);
+      while (value < current &&
+             !cell.compare_exchange_weak(current, value,
+                                         std::memory_order_relaxed))
+        ;
+    } else if (depth < fb.depth[i] ||
+               (depth == fb.depth[i] && rgba < fb.color[i])) {
+      fb.depth[i] = depth;
+      fb.color[i] = rgba;
+    }
+  }
+
+  bool loadXyz(const std::string &path) {
+    std::ifstream f(path);
+    if (!f.is_open())
+      return false;
+    std::string line;
+    while (std::getline(f, line)) {
+      const char *p = line.data(), *end = p + line.size();
+      float v[3];
+      int rgb[3];
+      for (int i = 0; i < 3 && p; i++)
+        p = objNumber(p, end, v[i]);
+      // Blank and comment lines are skipped; anything else must parse.
+      if (!p) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+          continue;
+        return false;
+      }
+      const char *q = p;
+      for (int i = 0; i < 3 && q; i++)
+        q = objNumber(q, end, rgb[i]);
+      Uint32 rgba = 0xffffffff;
+      if (q)
+        rgba = (Uint32)std::clamp(rgb[0], 0, 255) << 24 |
+               (Uint32)std::clamp(rgb[1], 0, 255) << 16 |
+               (Uint32)std::clamp(rgb[2], 0, 255) << 8 | 0xff;
+      this->add(v[0], v[1], v[2], rgba);
+    }
+    return true;
+  }
+
+  bool loadPly(const std::string &path) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f.is_open())
+      return false;
+
+    struct Property {
+      std::string name;
+      int size;
+      char kind; // 'i' signed, 'u' unsigned, 'f' float
+    };
+    std::vector<Property> props;
+    auto find = [&props](const char *name) {
+      for (size_t i = 0; i < props.size(); i++)
+        if (props[i].name == name)
+          return (int)i;
+      return -1;
+    };
+    size_t count = 0;
+    bool binary = false, inVertex = false, seenVertex = false;
+    std::string line;
+    if (!std::getline(f, line) || line.rfind("ply", 0) != 0)
+      return false;
+    while (std::getline(f, line)) {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      std::istringstream s(line);
+      std::string word;
+      s >> word;
+      if (word == "format") {
+        s >> word;
+        if (word == "binary_little_endian")
+          binary = true;
+        else if (word != "ascii")
+          return false;
+      } else if (word == "element") {
+        std::string name;
+        size_t n = 0;
+        s >> name >> n;
+        // Only a leading vertex element is read; later ones are ignored.
+        if (!seenVertex && name != "vertex")
+          return false;
+        inVertex = !seenVertex;
+        if (inVertex)
+          count = n;
+        seenVertex = true;
+      } else if (word == "property" && inVertex) {
+        std::string type, name;
+        s >> type >> name;
+        if (type == "list")
+          return false;
+        Property p = {name, 0, 'i'};
+        if (type == "char" || type == "int8")
+          p.size = 1;
+        else if (type == "uchar" || type == "uint8")
+          p = {name, 1, 'u'};
+        else if (type == "short" || type == "int16")
+          p.size = 2;
+        else if (type == "ushort" || type == "uint16")
+          p = {name, 2, 'u'};
+        else if (type == "int" || type == "int32")
+          p.size = 4;
+        else if (type == "uint" || type == "uint32")
+          p = {name, 4, 'u'};
+        else if (type == "float" || type == "float32")
+          p = {name, 4, 'f'};
+        else if (type == "double" || type == "float64")
+          p = {name, 8, 'f'};
+        else
+          return false;
+        props.push_back(p);
+      } else if (word == "end_header") {
+        break;
+      }
+    }
+    int ix = find("x"), iy = find("y"), iz = find("z");
+    int ir = find("red"), ig = find("green"), ib = find("blue");
+    if (!seenVertex || ix < 0 || iy < 0 || iz < 0)
+      return false;
+    bool hasColor = ir >= 0 && ig >= 0 && ib >= 0;
+
+    this->x.reserve(count);
+    this->y.reserve(count);
+    this->z.reserve(count);
+    this->color.reserve(count);
+    size_t stride = 0;
+    for (auto &p : props)
+      stride += p.size;
+    std::vector<char> record(stride);
+    std::vector<double> values(props.size());
+    for (size_t n = 0; n < count; n++) {
+      if (binary) {
+        if (!f.read(record.data(), stride))
+          return false;
+        const char *at = record.data();
+        for (size_t k = 0; k < props.size(); k++) {
+          values[k] = decode(at, props[k].size, props[k].kind);
+          at += props[k].size;
+        }
+      } else {
+        for (size_t k = 0; k < props.size(); k++)
+          if (!(f >> values[k]))
+            return false;
+      }
+      Uint32 rgba = 0xffffffff;
+      if (hasColor) {
+        // Colours stored as floats are taken to be in [0, 1].
+        auto channel = [&](int k) {
+          double v = props[k].kind == 'f' ? values[k] * 255.0 : values[k];
+          return (Uint32)std::clamp(v, 0.0, 255.0);
+        };
+        rgba = channel(ir) << 24 | channel(ig) << 16 | channel(ib) << 8 | 0xff;
+      }
+      this->add((float)values[ix], (float)values[iy], (float)values[iz],
+                rgba);
+    }
+    return true;
+  }
+
+  static double decode(const char *p, int size, char kind) {
+    if (kind == 'f') {
+      if (size == 4) {
+        float v;
+        memcpy(&v, p, 4);
+        return v;
+      }
+      double v;
+      memcpy(&v, p, 8);
+      return v;
+    }
+    Uint64 bits = 0;
+    memcpy(&bits, p, size);
+    if (kind == 'u')
+      return (double)bits;
+    // Sign-extend from `size` bytes.
+    int shift = 64 - size * 8;
+    return (double)((Sint64)(bits << shift) >> shift);
+  }
+};
@@ -0,0 +1,300 @@
+#pragma once
+
+#include "framebuffer.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+// Screen-space vertex for the raster pipeline. `intensity` scales the base
+// colour; it is interpolated for Gouraud shading and taken from the first
+// vertex for flat shading.
+struct RasterVertex {
+  float x, y, z;
+  float intensity;
+};
+
+// Compile-time pipeline state for rasterTriangle(), which branches on it
+// with `if constexpr`, so each combination gets its own inner loop.
+template <bool DepthTest, bool Blend, bool Gouraud, bool Wireframe,
+          bool DepthEqual = false>
+struct RasterState {
+  static constexpr bool depthTest = DepthTest;
+  static constexpr bool blend = Blend;
+  static constexpr bool gouraud = Gouraud;
+  static constexpr bool wireframe = Wireframe;
+  static constexpr bool depthEqual = DepthEqual;
+};
+
+// The same state decided at runtime, for selectRaster() and for
+// rasterTriangleGeneric().
+struct RasterFlags {
+  bool depthTest = true;
+  bool blend = false;
+  bool gouraud = false;
+  bool wireframe = false;
+  // Draw only where the depth buffer already holds the triangle's own
+  // depth, without writing it. Needs depthTest, and is ignored with blend
+  // or wireframe.
+  bool depthEqual = false;
+};
+
+inline Uint32 shadeColor(Uint32 base, float intensity) {
+  int k = std::clamp((int)(intensity * 256.0f), 0, 256);
+  Uint32 r = (((base >> 24) & 0xff) * k) >> 8;
+  Uint32 g = (((base >> 16) & 0xff) * k) >> 8;
+  Uint32 b = (((base >> 8) & 0xff) * k) >> 8;
+  return r << 24 | g << 16 | b << 8 | (base & 0xff);
+}
+
+// Where a triangle lands on the pixel grid, shared by the specialised and
+// generic kernels: vertices snapped to 28.4 fixed point and wound
+// clockwise on screen, the bounding box clipped to the target, the edge
+// functions at its top-left pixel centre and the planes of depth and
+// intensity.
+struct RasterSetup {
+  int minX, maxX, minY, maxY;
+  // Edge a->b: E(p) = (Xb - Xa)(py - Ya) - (Yb - Ya)(px - Xa), positive
+  // inside; see MsaaBuffer for the derivation of the top-left bias.
+  int edgeA[3], edgeB[3], rowE[3];
+  // Converts E to a distance from the edge in pixels.
+  float edgeScale[3];
+  float rowZ, dzdx, dzdy;
+  float rowI, didx, didy;
+  float flatIntensity;
+
+  // False when the triangle covers no pixel left to draw. The intensity
+  // plane is only set up with `gouraud`.
+  bool init(const Framebuffer &fb, const RasterVertex &p1,
+            const RasterVertex &p2, const RasterVertex &p3, bool gouraud) {
+    RasterVertex v[3] = {p1, p2, p3};
+    int X[3], Y[3];
+    for (int i = 0; i < 3; i++) {
+      X[i] = (int)lroundf(v[i].x * 16.0f);
+      Y[i] = (int)lroundf(v[i].y * 16.0f);
+    }
+    long long area = (long long)(X[1] - X[0]) * (Y[2] - Y[0]) -
+                     (long long)(Y[1] - Y[0]) * (X[2] - X[0]);
+    if (area == 0)
+      return false;
+    if (area < 0) {
+      std::swap(X[1], X[2]);
+      std::swap(Y[1], Y[2]);
+      std::swap(v[1], v[2]);
+    }
+
+    minX = std::max(std::min({X[0], X[1], X[2]}) >> 4, 0);
+    maxX = std::min(std::max({X[0], X[1], X[2]}) >> 4, fb.width - 1);
+    minY = std::max(std::min({Y[0], Y[1], Y[2]}) >> 4, 0);
+    maxY = std::min(std::max({Y[0], Y[1], Y[2]}) >> 4, fb.height - 1);
+    if (minX > maxX || minY > maxY)
+      return false;
+
+    // Attribute planes through the snapped vertices, in pixel units.
+    float fx[3], fy[3];
+    for (int i = 0; i < 3; i++) {
+      fx[i] = X[i] / 16.0f;
+      fy[i] = Y[i] / 16.0f;
+    }
+    float det =
+        (fx[1] - fx[0]) * (fy[2] - fy[0]) - (fx[2] - fx[0]) * (fy[1] - fy[0]);
+    auto gradient = [&](float a0, float a1, float a2, float &ddx,
+                        float &ddy) {
+      ddx = ((a1 - a0) * (fy[2] - fy[0]) - (a2 - a0) * (fy[1] - fy[0])) / det;
+      ddy = ((a2 - a0) * (fx[1] - fx[0]) - (a1 - a0) * (fx[2] - fx[0])) / det;
+    };
+    didx = didy = 0.0f;
+    gradient(v[0].z, v[1].z, v[2].z, dzdx, dzdy);
+    if (gouraud)
+      gradient(v[0].intensity, v[1].intensity, v[2].intensity, didx, didy);
+
+    for (int e = 0; e < 3; e++) {
+      int a = e;
+      int b = (e + 1) % 3;
+      edgeA[e] = X[b] - X[a];
+      edgeB[e] = Y[b] - Y[a];
+      bool topLeft = edgeB[e] < 0 || (edgeB[e] == 0 && edgeA[e] > 0);
+      rowE[e] = edgeA[e] * (minY * 16 + 8 - Y[a]) -
+                edgeB[e] * (minX * 16 + 8 - X[a]) - (topLeft ? 0 : 1);
+      edgeScale[e] =
+          1.0f / (16.0f * sqrtf((float)edgeA[e] * edgeA[e] +
+                                (float)edgeB[e] * edgeB[e]));
+    }
+
+    flatIntensity = v[0].intensity;
+    rowZ = v[0].z + dzdx * (minX + 0.5f - fx[0]) +
+           dzdy * (minY + 0.5f - fy[0]);
+    rowI = v[0].intensity + didx * (minX + 0.5f - fx[0]) +
+           didy * (minY + 0.5f - fy[0]);
+    return true;
+  }
+};
+
+// Half-space rasterizer sampling pixel centres, with vertices snapped to
+// 28.4 fixed point and the top-left fill rule. Depth is tested against and
+// written to fb.depth; blended triangles test depth but do not write it.
+// With depthEqual, only pixels whose stored depth is exactly the
+// triangle's are drawn, for the colour pass after rasterDepth() has laid
+// down the nearest depths; that kernel repeats the depth arithmetic here
+// step for step, so keep the two in line.
+//
+// Every branch on the state is `if constexpr`, so each instantiation is its
+// own inner loop with only the work its state needs.
+template <typename State>
+void rasterTriangle(Framebuffer &fb, const RasterVertex &p1,
+                    const RasterVertex &p2, const RasterVertex &p3,
+                    Uint32 baseColor) {
+  static_assert(!State::depthEqual ||
+                    (State::depthTest && !State::blend && !State::wireframe),
+                "depthEqual is a depth-tested, opaque, filled pass");
+  RasterSetup t;
+  if (!t.init(fb, p1, p2, p3, State::gouraud))
+    return;
+  fb.touch(t.minX, t.minY, t.maxX, t.maxY);
+  Uint32 flatColor = shadeColor(baseColor, t.flatIntensity);
+  // shadeColor() keeps the base colour's alpha.
+  int alpha = Framebuffer::blendWeight(baseColor);
+  // Locals, as the stores below could otherwise alias the setup.
+  const int step0 = t.edgeB[0] * 16, step1 = t.edgeB[1] * 16,
+            step2 = t.edgeB[2] * 16;
+  const float dzdx = t.dzdx, didx = t.didx;
+  float rowZ = t.rowZ, rowI = t.rowI;
+
+  for (int y = t.minY; y <= t.maxY; y++) {
+    Uint32 *colorRow = &fb.color[(size_t)y * fb.width];
+    float *depthRow = &fb.depth[(size_t)y * fb.width];
+    int e0 = t.rowE[0], e1 = t.rowE[1], e2 = t.rowE[2];
+    float z = rowZ;
+    float intensity = rowI;
+
+    for (int x = t.minX; x <= t.maxX; x++, e0 -= step0, e1 -= step1,
+             e2 -= step2, z += dzdx, intensity += didx) {
+      if ((e0 | e1 | e2) < 0)
+        continue;
+      if constexpr (State::wireframe) {
+        float d = std::min({e0 * t.edgeScale[0], e1 * t.edgeScale[1],
+                            e2 * t.edgeScale[2]});
+        if (d >= 1.0f)
+          continue;
+      }
+      if constexpr (State::depthEqual) {
+        if (z != depthRow[x])
+          continue;
+      } else if constexpr (State::depthTest) {
+        if (!(z < depthRow[x]))
+          continue;
+        if constexpr (!State::blend)
+          depthRow[x] = z;
+      }
+      Uint32 col;
+      if constexpr (State::gouraud)
+        col = shadeColor(baseColor, intensity);
+      else
+        col = flatColor;
+      if constexpr (State::blend)
+        colorRow[x] = Framebuffer::blendPixel(colorRow[x], col, alpha);
+      else
+        colorRow[x] = col;
+    }
+
+    for (int e = 0; e < 3; e++)
+      t.rowE[e] += t.edgeA[e] * 16;
+    rowZ += t.dzdy;
+    rowI += t.didy;
+  }
+}
+
+// The same kernel deciding every flag per pixel at runtime: one loop for
+// every state, kept as a fallback and as the baseline for the benchmark.
+inline void rasterTriangleGeneric(Framebuffer &fb, const RasterVertex &p1,
+                                  const RasterVertex &p2,
+                                  const RasterVertex &p3, Uint32 baseColor,
+                                  const RasterFlags &flags) {
+  RasterSetup t;
+  if (!t.init(fb, p1, p2, p3, flags.gouraud))
+    return;
+  bool depthEqual = flags.depthEqual && !flags.blend && !flags.wireframe;
+  fb.touch(t.minX, t.minY, t.maxX, t.maxY);
+  Uint32 flatColor = shadeColor(baseColor, t.flatIntensity);
+  // shadeColor() keeps the base colour's alpha.
+  int alpha = Framebuffer::blendWeight(baseColor);
+  const int step0 = t.edgeB[0] * 16, step1 = t.edgeB[1] * 16,
+            step2 = t.edgeB[2] * 16;
+  const float dzdx = t.dzdx, didx = t.didx;
+  float rowZ = t.rowZ, rowI = t.rowI;
+
+  for (int y = t.minY; y <= t.maxY; y++) {
+    Uint32 *colorRow = &fb.color[(size_t)y * fb.width];
+    float *depthRow = &fb.depth[(size_t)y * fb.width];
+    int e0 = t.rowE[0], e1 = t.rowE[1], e2 = t.rowE[2];
+    float z = rowZ;
+    float intensity = rowI;
+
+    for (int x = t.minX; x <= t.maxX; x++, e0 -= step0, e1 -= step1,
+             e2 -= step2, z += dzdx, intensity += didx) {
+      if ((e0 | e1 | e2) < 0)
+        continue;
+      if (flags.wireframe) {
+        float d = std::min({e0 * t.edgeScale[0], e1 * t.edgeScale[1],
+                            e2 * t.edgeScale[2]});
+        if (d >= 1.0f)
+          continue;
+      }
+      if (flags.depthTest) {
+        if (depthEqual) {
+          if (z != depthRow[x])
+            continue;
+        } else {
+          if (!(z < depthRow[x]))
+            continue;
+          if (!flags.blend)
+            depthRow[x] = z;
+        }
+      }
+      Uint32 col = flags.gouraud ? shadeColor(baseColor, intensity)
+                                 : flatColor;
+      if (flags.blend)
+        colorRow[x] = Framebuffer::blendPixel(colorRow[x], col, alpha);
+      else
+        colorRow[x] = col;
+    }
+
+    for (int e = 0; e < 3; e++)
+      t.rowE[e] += t.edgeA[e] * 16;
+    rowZ += t.dzdy;
+    rowI += t.didy;
+  }
+}
+
+typedef void (*RasterFunction)(Framebuffer &fb, const RasterVertex &p1,
+                               const RasterVertex &p2, const RasterVertex &p3,
+                               Uint32 baseColor);
+
+template <int Bits>
+void rasterTriangleSpecialised(Framebuffer &fb, const RasterVertex &p1,
+                               const RasterVertex &p2, const RasterVertex &p3,
+                               Uint32 baseColor) {
+  rasterTriangle<RasterState<(Bits & 1) != 0, (Bits & 2) != 0,
+                             (Bits & 4) != 0, (Bits & 8) != 0,
+                             (Bits & 16) != 0>>(fb, p1, p2, p3, baseColor);
+}
+
+template <int... Bits>
+const RasterFunction *rasterTable(std::integer_sequence<int, Bits...>) {
+  static const RasterFunction table[] = {&rasterTriangleSpecialised<Bits>...};
+  return table;
+}
+
+// Picks the specialised kernel for a draw batch; call it once per batch and
+// reuse the returned function for every triangle in it. Only the states
+// the engine draws with are instantiated: every mix of the first four
+// flags, and depthEqual for depth-tested, opaque, filled triangles, flat or
+// Gouraud. Elsewhere depthEqual is ignored.
+inline RasterFunction selectRaster(const RasterFlags &flags) {
+  if (flags.depthEqual && flags.depthTest && !flags.blend && !flags.wireframe)
+    return flags.gouraud ? &rasterTriangleSpecialised<1 | 4 | 16>
+                         : &rasterTriangleSpecialised<1 | 16>;
+  int bits = (flags.depthTest ? 1 : 0) | (flags.blend ? 2 : 0) |
+             (flags.gouraud ? 4 : 0) | (flags.wireframe ? 8 : 0);
+  return rasterTable(std::make_integer_sequence<int, 16>())[bits];
+}
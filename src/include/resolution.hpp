@@ -0,0 +1,46 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+// Picks the internal render scale from measured raster time. Raster cost is
+// roughly proportional to the pixel count, i.e. to scale^2, so the scale that
+// would exactly hit the budget is scale * sqrt(target / measured).
+class ResolutionController {
+  float smoothedMs = 0.0f;
+
+public:
+  float targetMs;
+  float minScale;
+  float maxScale;
+  float scale;
+
+  ResolutionController(float targetMs, float minScale = 0.5f,
+                       float maxScale = 1.0f) {
+    this->targetMs = targetMs;
+    this->minScale = minScale;
+    this->maxScale = maxScale;
+    this->scale = maxScale;
+  }
+
+  float update(float rasterMs) {
+    if (this->smoothedMs == 0.0f)
+      this->smoothedMs = rasterMs;
+    this->smoothedMs = this->smoothedMs * 0.8f + rasterMs * 0.2f;
+    if (this->smoothedMs <= 0.0f)
+      return this->scale;
+
+    float ideal = this->scale * sqrtf(this->targetMs / this->smoothedMs);
+    ideal = std::clamp(ideal, this->minScale, this->maxScale);
+
+    // Dead band so a scene sitting right at the budget does not make the
+    // image shimmer between two sizes every frame.
+    if (fabsf(ideal - this->scale) < 0.02f)
+      return this->scale;
+
+    // Drop quickly when over budget, recover slowly when under it.
+    float rate = ideal < this->scale ? 0.5f : 0.1f;
+    this->scale += (ideal - this->scale) * rate;
+    return this->scale;
+  }
+};
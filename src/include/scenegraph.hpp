@@ -0,0 +1,129 @@
+#pragma once
+
+#include "matrix.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <vector>
+
+// A hierarchy of transforms, each node stored after its parent.
+//
+// Every node has a local transform relative to its parent; with row
+// vectors its world transform is the local one followed by its parent's
+// world transform. setLocal() only marks a node, and update() then redoes
+// the world transforms of the marked nodes and everything below them in
+// one pass in storage order, so a parent is always done before its
+// children. Nodes asked to keep an inverse have it redone in the same
+// pass, for cameras whose world transform has to be turned into a view.
+//
+// The pass only walks the index ranges the marked subtrees can cover: a
+// node's descendants all lie between it and the last of them. When nodes
+// are added depth first, as a scene is usually built, those ranges hold
+// nothing else and a frame costs what actually moved.
+class SceneGraph {
+public:
+  size_t size() const { return this->parent.size(); }
+
+  // Adds a node under `parent`, or a root for -1, with an identity local
+  // transform, and returns its index.
+  int add(int parent = -1, bool keepInverse = false) {
+    mat4x4 identity;
+    for (int i = 0; i < 4; i++)
+      identity.m[i][i] = 1.0f;
+    int node = (int)this->size();
+    this->parent.push_back(parent);
+    this->local.push_back(identity);
+    this->world.push_back(identity);
+    this->inverses.push_back(identity);
+    this->keepsInverse.push_back(keepInverse);
+    this->marked.push_back(0);
+    this->stamp.push_back(0);
+    this->last.push_back(node);
+    this->lastStale = true;
+    this->setLocal(node, identity);
+    return node;
+  }
+
+  int parentOf(int node) const { return this->parent[node]; }
+
+  const mat4x4 &localTransform(int node) const { return this->local[node]; }
+
+  void setLocal(int node, const mat4x4 &transform) {
+    this->local[node] = transform;
+    if (!this->marked[node]) {
+      this->marked[node] = 1;
+      this->pendingNodes.push_back(node);
+    }
+  }
+
+  // As of the last update().
+  const mat4x4 &worldTransform(int node) const { return this->world[node]; }
+
+  // The inverse of worldTransform(), kept for nodes added with keepInverse.
+  const mat4x4 &inverseWorld(int node) const { return this->inverses[node]; }
+
+  // Marks every node, so the next update() redoes them all.
+  void invalidate() {
+    for (size_t i = 0; i < this->size(); i++)
+      this->setLocal((int)i, this->local[i]);
+  }
+
+  // Brings the world transforms up to date with the local ones and returns
+  // how many were redone.
+  size_t update() {
+    if (this->pendingNodes.empty())
+      return 0;
+    if (this->lastStale) {
+      for (size_t i = 0; i < this->size(); i++)
+        this->last[i] = (int)i;
+      for (size_t i = this->size(); i-- > 0;)
+        if (this->parent[i] >= 0)
+          this->last[this->parent[i]] =
+              std::max(this->last[this->parent[i]], this->last[i]);
+      this->lastStale = false;
+    }
+    // Nodes redone in this pass carry its stamp, which is how their
+    // children know to follow.
+    if (++this->pass == 0) {
+      std::fill(this->stamp.begin(), this->stamp.end(), 0);
+      this->pass = 1;
+    }
+    std::vector<int> &nodes = this->pendingNodes;
+    std::sort(nodes.begin(), nodes.end());
+    size_t redone = 0, i = 0, end = 0;
+    for (size_t k = 0; k < nodes.size(); k++) {
+      if ((size_t)nodes[k] >= end)
+        i = nodes[k];
+      end = std::max(end, (size_t)this->last[nodes[k]] + 1);
+      // Up to the next marked node, which may widen the range.
+      size_t stop =
+          k + 1 < nodes.size() ? std::min(end, (size_t)nodes[k + 1]) : end;
+      for (; i < stop; i++) {
+        int p = this->parent[i];
+        if (!this->marked[i] && (p < 0 || this->stamp[p] != this->pass))
+          continue;
+        this->marked[i] = 0;
+        this->stamp[i] = this->pass;
+        this->world[i] = p < 0 ? this->local[i]
+                               : multiplyMat4x4(this->local[i], this->world[p]);
+        if (this->keepsInverse[i])
+          this->inverses[i] = invertAffineMat4x4(this->world[i]);
+        redone++;
+      }
+    }
+    nodes.clear();
+    return redone;
+  }
+
+private:
+  std::vector<int> parent;
+  std::vector<mat4x4> local, world, inverses;
+  std::vector<Uint8> keepsInverse;
+  // Nodes whose local transform changed since the last update().
+  std::vector<Uint8> marked;
+  std::vector<int> pendingNodes;
+  std::vector<Uint32> stamp;
+  Uint32 pass = 0;
+  // The highest index among each node's descendants, or its own.
+  std::vector<int> last;
+  bool lastStale = false;
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "depthraster.hpp"
+#include "mesh.hpp"
+#include "vec3d.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Depth of a scene as seen from a directional light, for telling which
+// surfaces the light reaches.
+//
+// The light looks along -Light::v through an orthographic box around a
+// bounding sphere of the scene, which aim() sets and which also empties
+// the map. add() draws world-space triangles into it with rasterDepth(),
+// and lit() compares a point's depth from the light with the nearest one
+// drawn there. The point is first moved off its surface along the normal
+// and then held against a small depth bias, so surfaces do not shadow
+// themselves.
+class ShadowMap {
+public:
+  // Texels along each side.
+  int size = 0;
+  std::vector<float> depth;
+  // In depth units, where [0, 1] spans the bounding sphere.
+  float bias = 0.002f;
+  // In texels, along the surface normal.
+  float normalOffset = 1.5f;
+
+  void resize(int size) {
+    this->size = size;
+    this->depth.resize((size_t)size * size);
+  }
+
+  void aim(const vec3d &towardsLight, const vec3d &centre, float radius) {
+    this->forward = {-towardsLight.x, -towardsLight.y, -towardsLight.z};
+    this->forward = normalise(this->forward);
+    // Any up that is not along the light will do.
+    vec3d up = fabsf(this->forward.y) < 0.9f ? vec3d(0, 1, 0) : vec3d(1, 0, 0);
+    this->right = normalise(cross(up, this->forward));
+    this->up = cross(this->forward, this->right);
+    this->centre = centre;
+    this->radius = std::max(radius, 1e-6f);
+    std::fill(this->depth.begin(), this->depth.end(), 1.0f);
+  }
+
+  // Where p lands in the map, in texels and depth.
+  RasterVertex project(const vec3d &p) const {
+    vec3d d = {p.x - this->centre.x, p.y - this->centre.y,
+               p.z - this->centre.z};
+    float scale = 0.5f / this->radius;
+    return {(dot(d, this->right) * scale + 0.5f) * this->size,
+            (0.5f - dot(d, this->up) * scale) * this->size,
+            dot(d, this->forward) * scale + 0.5f, 0.0f};
+  }
+
+  void add(const triangle &tri) {
+    rasterDepth(this->depth.data(), this->size, this->size,
+                this->project(tri.p[0]), this->project(tri.p[1]),
+                this->project(tri.p[2]));
+  }
+
+  // 1 where the light reaches the point p of a surface facing n, and 0
+  // where something nearer the light covers it. Points outside the map are
+  // lit.
+  float lit(const vec3d &p, const vec3d &n) const {
+    float offset = this->normalOffset * 2.0f * this->radius / this->size;
+    RasterVertex s = this->project(
+        {p.x + n.x * offset, p.y + n.y * offset, p.z + n.z * offset});
+    if (!(s.x >= 0.0f && s.y >= 0.0f && s.x < this->size && s.y < this->size))
+      return 1.0f;
+    float nearest = this->depth[(size_t)s.y * this->size + (size_t)s.x];
+    return s.z - this->bias <= nearest ? 1.0f : 0.0f;
+  }
+
+private:
+  vec3d centre;
+  float radius = 1.0f;
+  vec3d right, up, forward;
+
+  static float dot(const vec3d &a, const vec3d &b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+  }
+
+  static vec3d cross(const vec3d &a, const vec3d &b) {
+    return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+            a.x * b.y - a.y * b.x};
+  }
+
+  static vec3d normalise(const vec3d &v) {
+    float length = sqrtf(dot(v, v));
+    return {v.x / length, v.y / length, v.z / length};
+  }
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <new>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Frames shared with other local processes through a POSIX shared memory
+// ring ("/name" under /dev/shm).
+//
+// The object holds a header followed by `slots` frame buffers, each large
+// enough for the largest frame. Frame n (counting from 1) goes to slot
+// n % slots. Every slot has a sequence word used as a seqlock: it is odd
+// while the producer writes the slot and 2n once frame n is complete, so a
+// consumer reading the pixels in place can tell afterwards whether they
+// were overwritten under it. After each frame the producer bumps a futex
+// word in the header and wakes every waiter, so consumers sleep until a
+// frame is ready instead of polling.
+struct ShmRingHeader {
+  char magic[8];
+  Uint32 slots;
+  Uint32 maxWidth;
+  Uint32 maxHeight;
+  Uint32 reserved;
+  Uint64 slotBytes;
+  // Newest complete frame, 0 before the first.
+  std::atomic<Uint64> latest;
+  std::atomic<Uint32> futexWord;
+};
+
+// Precedes each slot's pixels, which are 0xRRGGBBAA, rows packed.
+struct ShmRingSlot {
+  std::atomic<Uint64> sequence;
+  Uint32 width;
+  Uint32 height;
+};
+
+static_assert(std::atomic<Uint64>::is_always_lock_free &&
+                  std::atomic<Uint32>::is_always_lock_free,
+              "shared memory atomics must be lock-free");
+
+static const char SHM_RING_MAGIC[8] = {'T', 'A', 'R', 'R', 'I', 'N', 'G', '1'};
+// Keeps every slot's pixels on their own cache lines.
+static const Uint64 SHM_RING_ALIGN = 64;
+
+inline Uint64 shmRingSlotBytes(Uint32 maxWidth, Uint32 maxHeight) {
+  Uint64 bytes =
+      sizeof(ShmRingSlot) + (Uint64)maxWidth * maxHeight * sizeof(Uint32);
+  return (bytes + SHM_RING_ALIGN - 1) / SHM_RING_ALIGN * SHM_RING_ALIGN;
+}
+
+inline Uint64 shmRingDataOffset() {
+  return (sizeof(ShmRingHeader) + SHM_RING_ALIGN - 1) / SHM_RING_ALIGN *
+         SHM_RING_ALIGN;
+}
+
+// The producing side. Creates (or replaces) the shared object and removes
+// it again when destroyed.
+class ShmRingWriter {
+  std::string name;
+  Uint8 *base = nullptr;
+  size_t mappedBytes = 0;
+  ShmRingHeader *header = nullptr;
+  Uint64 sequence = 0;
+
+  ShmRingSlot *slot(Uint64 n) {
+    return (ShmRingSlot *)(this->base + shmRingDataOffset() +
+                           (n % this->header->slots) *
+                               this->header->slotBytes);
+  }
+
+public:
+  bool failed = false;
+
+  ShmRingWriter(const std::string &name, int maxWidth, int maxHeight,
+                int slots = 3) {
+    this->name = name;
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0600);
+    if (fd < 0) {
+      this->failed = true;
+      return;
+    }
+    Uint64 slotBytes = shmRingSlotBytes(maxWidth, maxHeight);
+    this->mappedBytes = shmRingDataOffset() + slots * slotBytes;
+    if (slots < 2 || ftruncate(fd, (off_t)this->mappedBytes) != 0) {
+      close(fd);
+      shm_unlink(name.c_str());
+      this->failed = true;
+      return;
+    }
+    void *mapped = mmap(nullptr, this->mappedBytes, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      this->failed = true;
+      return;
+    }
+    this->base = (Uint8 *)mapped;
+
+    // ftruncate zero-fills, so every slot starts at sequence 0 (empty). The
+    // magic goes last so a consumer never sees a half-built header.
+    this->header = new (this->base) ShmRingHeader();
+    this->header->slots = slots;
+    this->header->maxWidth = maxWidth;
+    this->header->maxHeight = maxHeight;
+    this->header->slotBytes = slotBytes;
+    for (int i = 0; i < slots; i++)
+      new (this->slot(i)) ShmRingSlot();
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(this->header->magic, SHM_RING_MAGIC, sizeof(SHM_RING_MAGIC));
+  }
+
+  ~ShmRingWriter() {
+    if (this->base) {
+      munmap(this->base, this->mappedBytes);
+      shm_unlink(this->name.c_str());
+    }
+  }
+
+  ShmRingWriter(const ShmRingWriter &) = delete;
+  ShmRingWriter &operator=(const ShmRingWriter &) = delete;
+
+  // Copies a frame into the next slot and wakes the consumers. Frames
+  // larger than the ring was created for are cropped.
+  void publish(const Uint32 *pixels, int width, int height) {
+    if (this->failed)
+      return;
+    Uint64 n = ++this->sequence;
+    ShmRingSlot *s = this->slot(n);
+    int w = std::min(width, (int)this->header->maxWidth);
+    int h = std::min(height, (int)this->header->maxHeight);
+
+    s->sequence.store(2 * n - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s->width = w;
+    s->height = h;
+    Uint32 *out = (Uint32 *)(s + 1);
+    if (w == width) {
+      memcpy(out, pixels, (size_t)w * h * sizeof(Uint32));
+    } else {
+      for (int y = 0; y < h; y++)
+        memcpy(out + (size_t)y * w, pixels + (size_t)y * width,
+               w * sizeof(Uint32));
+    }
+    s->sequence.store(2 * n, std::memory_order_release);
+
+    this->header->latest.store(n, std::memory_order_release);
+    this->header->futexWord.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, &this->header->futexWord, FUTEX_WAKE, INT_MAX, nullptr,
+            nullptr, 0);
+  }
+
+  Uint64 framesPublished() { return this->sequence; }
+};
+
+// The consuming side; maps the ring read-only.
+class ShmRingReader {
+  Uint8 *base = nullptr;
+  size_t mappedBytes = 0;
+  const ShmRingHeader *header = nullptr;
+
+  const ShmRingSlot *slot(Uint64 n) const {
+    return (const ShmRingSlot *)(this->base + shmRingDataOffset() +
+                                 (n % this->header->slots) *
+                                     this->header->slotBytes);
+  }
+
+public:
+  struct Frame {
+    Uint64 sequence = 0;
+    int width = 0;
+    int height = 0;
+    // Points into the shared slot; only meaningful while valid() holds.
+    const Uint32 *pixels = nullptr;
+  };
+
+  ~ShmRingReader() {
+    if (this->base)
+      munmap(this->base, this->mappedBytes);
+  }
+
+  bool open(const std::string &name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+      return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 ||
+        (size_t)info.st_size < shmRingDataOffset()) {
+      close(fd);
+      return false;
+    }
+    void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+      return false;
+    this->base = (Uint8 *)mapped;
+    this->mappedBytes = info.st_size;
+    this->header = (const ShmRingHeader *)this->base;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return memcmp(this->header->magic, SHM_RING_MAGIC,
+                  sizeof(SHM_RING_MAGIC)) == 0 &&
+           this->header->slots >= 2 &&
+           shmRingDataOffset() +
+                   (Uint64)this->header->slots * this->header->slotBytes <=
+               this->mappedBytes;
+  }
+
+  int slots() const { return (int)this->header->slots; }
+
+  // Waits up to timeoutMs for a frame newer than `after` and points `frame`
+  // at the newest one, skipping any in between. Returns false on timeout.
+  bool wait(Uint64 after, int timeoutMs, Frame &frame) {
+    timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    while (true) {
+      Uint32 word = this->header->futexWord.load(std::memory_order_acquire);
+      Uint64 n = this->header->latest.load(std::memory_order_acquire);
+      if (n > after) {
+        const ShmRingSlot *s = this->slot(n);
+        if (s->sequence.load(std::memory_order_acquire) == 2 * n) {
+          frame.sequence = n;
+          frame.width = s->width;
+          frame.height = s->height;
+          frame.pixels = (const Uint32 *)(s + 1);
+          return true;
+        }
+        // Already being overwritten by a newer frame; wait for that one.
+      }
+      long r = syscall(SYS_futex, &this->header->futexWord, FUTEX_WAIT, word,
+                       &timeout, nullptr, 0);
+      if (r != 0 && errno == ETIMEDOUT)
+        return false;
+    }
+  }
+
+  // True while the producer has not started overwriting the frame's slot.
+  // Check it after reading the pixels to know the read was not torn.
+  bool valid(const Frame &frame) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return this->slot(frame.sequence)
+               ->sequence.load(std::memory_order_relaxed) ==
+           2 * frame.sequence;
+  }
+};
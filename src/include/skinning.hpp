@@ -0,0 +1,388 @@
+#pragma once
+
+#include "matrix.hpp"
+#include "threadpool.hpp"
+#include "vec3d.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Skeletal animation on the CPU.
+//
+// A SkinnedMesh stores its bind pose one array per component. Every frame
+// the morph targets are added to it with their weights, and each vertex is
+// then moved by the blend of up to four joint matrices from a palette the
+// Skeleton builds out of the pose. Four vertices go through at a time: the
+// blended matrix of each is built from whole matrix rows in SSE2 registers,
+// and the four results are transposed back into the component arrays. The
+// scalar tail repeats the same operations in the same order, so a vertex
+// comes out the same wherever it falls in a batch, and Deform() can split
+// the vertices over worker threads freely.
+
+// Joints of a skeleton, each stored after its parent.
+struct Skeleton {
+  // Index of each joint's parent, or -1 for a root.
+  std::vector<int> parent;
+  // Takes bind-pose model space into each joint's own space.
+  std::vector<mat4x4> inverseBind;
+
+  size_t size() const { return this->parent.size(); }
+
+  int add(int parent, const mat4x4 &inverseBind) {
+    this->parent.push_back(parent);
+    this->inverseBind.push_back(inverseBind);
+    return (int)this->parent.size() - 1;
+  }
+
+  // The skinning matrix of every joint for a pose given as each joint's
+  // transform relative to its parent. With row vectors a joint's global
+  // transform is its local one followed by its parent's; `root` follows the
+  // roots, so it can take the skinned vertices straight into world space.
+  // If `local` does not cover every joint, the bind pose is used.
+  void Pose(const std::vector<mat4x4> &local, const mat4x4 &root,
+            std::vector<mat4x4> &palette) const {
+    size_t count = this->size();
+    palette.resize(count);
+    if (local.size() < count) {
+      std::fill(palette.begin(), palette.end(), root);
+      return;
+    }
+    // Global transforms first, then each is turned into its skinning
+    // matrix in place; children only read their parent in the first pass.
+    for (size_t j = 0; j < count; j++) {
+      int p = this->parent[j];
+      palette[j] = multiplyMat4x4(local[j], p < 0 ? root : palette[p]);
+    }
+    for (size_t j = 0; j < count; j++)
+      palette[j] = multiplyMat4x4(this->inverseBind[j], palette[j]);
+  }
+};
+
+// Positions and normals, one array per component.
+struct VertexStreams {
+  std::vector<float> x, y, z;
+  std::vector<float> nx, ny, nz;
+
+  size_t size() const { return this->x.size(); }
+
+  void resize(size_t count) {
+    for (auto *stream : {&this->x, &this->y, &this->z, &this->nx, &this->ny,
+                         &this->nz})
+      stream->resize(count);
+  }
+};
+
+struct MorphTarget {
+  std::string name;
+  // Offset of every vertex from the bind pose, most of them zero.
+  VertexStreams delta;
+};
+
+class SkinnedMesh {
+public:
+  static constexpr int MAX_INFLUENCES = 4;
+  // Below this many vertices per thread, waking workers costs more than
+  // it saves.
+  static const size_t MIN_THREAD_VERTICES = 4096;
+
+  Skeleton skeleton;
+  VertexStreams bind;
+  // Joints moving each vertex and their weights, which add up to 1. Unused
+  // slots have joint 0 and weight 0.
+  std::vector<Uint16> joints[MAX_INFLUENCES];
+  std::vector<float> weights[MAX_INFLUENCES];
+  // Three vertex indices per triangle.
+  std::vector<Uint32> indices;
+  std::vector<MorphTarget> morphs;
+
+  size_t vertexCount() const { return this->bind.size(); }
+  size_t triangleCount() const { return this->indices.size() / 3; }
+
+  // Adds a vertex moved by `count` (at most four) joints. The weights are
+  // scaled to add up to 1.
+  Uint32 addVertex(const vec3d &p, const vec3d &n, int count,
+                   const int *joint, const float *weight) {
+    this->bind.x.push_back(p.x);
+    this->bind.y.push_back(p.y);
+    this->bind.z.push_back(p.z);
+    this->bind.nx.push_back(n.x);
+    this->bind.ny.push_back(n.y);
+    this->bind.nz.push_back(n.z);
+    count = std::clamp(count, 0, MAX_INFLUENCES);
+    float sum = 0.0f;
+    for (int k = 0; k < count; k++)
+      sum += weight[k];
+    for (int k = 0; k < MAX_INFLUENCES; k++) {
+      bool used = k < count && sum > 0.0f;
+      this->joints[k].push_back(used ? (Uint16)joint[k] : 0);
+      this->weights[k].push_back(used ? weight[k] / sum : 0.0f);
+    }
+    return (Uint32)this->vertexCount() - 1;
+  }
+
+  void addTriangle(Uint32 a, Uint32 b, Uint32 c) {
+    this->indices.insert(this->indices.end(), {a, b, c});
+  }
+
+  // Adds a morph target with every offset zero, to fill in through
+  // morphs[i].delta once all the vertices have been added.
+  int addMorphTarget(const std::string &name) {
+    this->morphs.push_back({name, {}});
+    this->morphs.back().delta.resize(this->vertexCount());
+    return (int)this->morphs.size() - 1;
+  }
+
+  // Poses every vertex into `out` with one skinning matrix per joint (see
+  // Skeleton::Pose) and the weight of each morph target, missing weights
+  // counting as zero. Normals come out unit length. The vertices are split
+  // over `pool` when given.
+  void Deform(const std::vector<mat4x4> &palette,
+              const std::vector<float> &morphWeights, VertexStreams &out,
+              ThreadPool *pool) const {
+    size_t count = this->vertexCount();
+    out.resize(count);
+    std::vector<std::pair<const MorphTarget *, float>> active;
+    for (size_t t = 0; t < this->morphs.size() && t < morphWeights.size(); t++)
+      if (morphWeights[t] != 0.0f)
+        active.push_back({&this->morphs[t], morphWeights[t]});
+
+    size_t chunks = pool ? std::min<size_t>(pool->size(),
+                                            count / MIN_THREAD_VERTICES)
+                         : 1;
+    if (chunks < 2) {
+      this->deformRange(palette.data(), active, out, 0, count);
+      return;
+    }
+    for (size_t c = 0; c < chunks; c++) {
+      // On 16-vertex boundaries, so no two threads store to the same cache
+      // line of `out`.
+      size_t begin = (count * c / chunks) & ~(size_t)15;
+      size_t end = c + 1 == chunks ? count : (count * (c + 1) / chunks) & ~15;
+      pool->submit([this, &palette, &active, &out, begin, end](int) {
+        this->deformRange(palette.data(), active, out, begin, end);
+      });
+    }
+    pool->wait();
+  }
+
+private:
+  void deformRange(const mat4x4 *palette,
+                   const std::vector<std::pair<const MorphTarget *, float>>
+                       &active,
+                   VertexStreams &out, size_t begin, size_t end) const {
+    const VertexStreams &bind = this->bind;
+    size_t i = begin;
+#if defined(__SSE2__)
+    for (; i + 4 <= end; i += 4) {
+      __m128 p[3] = {_mm_loadu_ps(&bind.x[i]), _mm_loadu_ps(&bind.y[i]),
+                     _mm_loadu_ps(&bind.z[i])};
+      __m128 n[3] = {_mm_loadu_ps(&bind.nx[i]), _mm_loadu_ps(&bind.ny[i]),
+                     _mm_loadu_ps(&bind.nz[i])};
+      for (const auto &[target, weight] : active) {
+        const VertexStreams &d = target->delta;
+        const __m128 w = _mm_set1_ps(weight);
+        p[0] = _mm_add_ps(p[0], _mm_mul_ps(_mm_loadu_ps(&d.x[i]), w));
+        p[1] = _mm_add_ps(p[1], _mm_mul_ps(_mm_loadu_ps(&d.y[i]), w));
+        p[2] = _mm_add_ps(p[2], _mm_mul_ps(_mm_loadu_ps(&d.z[i]), w));
+        n[0] = _mm_add_ps(n[0], _mm_mul_ps(_mm_loadu_ps(&d.nx[i]), w));
+        n[1] = _mm_add_ps(n[1], _mm_mul_ps(_mm_loadu_ps(&d.ny[i]), w));
+        n[2] = _mm_add_ps(n[2], _mm_mul_ps(_mm_loadu_ps(&d.nz[i]), w));
+      }
+      alignas(16) float pl[3][4], nl[3][4];
+      for (int c = 0; c < 3; c++) {
+        _mm_store_ps(pl[c], p[c]);
+        _mm_store_ps(nl[c], n[c]);
+      }
+
+      __m128 pos[4], nrm[4];
+      for (int l = 0; l < 4; l++) {
+        size_t v = i + l;
+        __m128 w = _mm_set1_ps(this->weights[0][v]);
+        const mat4x4 *m = &palette[this->joints[0][v]];
+        __m128 r0 = _mm_mul_ps(w, _mm_loadu_ps(m->m[0]));
+        __m128 r1 = _mm_mul_ps(w, _mm_loadu_ps(m->m[1]));
+        __m128 r2 = _mm_mul_ps(w, _mm_loadu_ps(m->m[2]));
+        __m128 r3 = _mm_mul_ps(w, _mm_loadu_ps(m->m[3]));
+        for (int k = 1; k < MAX_INFLUENCES; k++) {
+          w = _mm_set1_ps(this->weights[k][v]);
+          m = &palette[this->joints[k][v]];
+          r0 = _mm_add_ps(r0, _mm_mul_ps(w, _mm_loadu_ps(m->m[0])));
+          r1 = _mm_add_ps(r1, _mm_mul_ps(w, _mm_loadu_ps(m->m[1])));
+          r2 = _mm_add_ps(r2, _mm_mul_ps(w, _mm_loadu_ps(m->m[2])));
+          r3 = _mm_add_ps(r3, _mm_mul_ps(w, _mm_loadu_ps(m->m[3])));
+        }
+        pos[l] = _mm_add_ps(
+            _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(pl[0][l]), r0),
+                                  _mm_mul_ps(_mm_set1_ps(pl[1][l]), r1)),
+                       _mm_mul_ps(_mm_set1_ps(pl[2][l]), r2)),
+            r3);
+        nrm[l] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(nl[0][l]), r0),
+                                       _mm_mul_ps(_mm_set1_ps(nl[1][l]), r1)),
+                            _mm_mul_ps(_mm_set1_ps(nl[2][l]), r2));
+      }
+      // Rows of x, y, z (and an unused w) across the four vertices.
+      _MM_TRANSPOSE4_PS(pos[0], pos[1], pos[2], pos[3]);
+      _MM_TRANSPOSE4_PS(nrm[0], nrm[1], nrm[2], nrm[3]);
+      _mm_storeu_ps(&out.x[i], pos[0]);
+      _mm_storeu_ps(&out.y[i], pos[1]);
+      _mm_storeu_ps(&out.z[i], pos[2]);
+      // Blended matrices scale and shear, so normals are renormalised;
+      // zero stays zero.
+      __m128 length = _mm_sqrt_ps(
+          _mm_add_ps(_mm_add_ps(_mm_mul_ps(nrm[0], nrm[0]),
+                                _mm_mul_ps(nrm[1], nrm[1])),
+                     _mm_mul_ps(nrm[2], nrm[2])));
+      __m128 valid = _mm_cmpgt_ps(length, _mm_setzero_ps());
+      _mm_storeu_ps(&out.nx[i], _mm_and_ps(valid, _mm_div_ps(nrm[0], length)));
+      _mm_storeu_ps(&out.ny[i], _mm_and_ps(valid, _mm_div_ps(nrm[1], length)));
+      _mm_storeu_ps(&out.nz[i], _mm_and_ps(valid, _mm_div_ps(nrm[2], length)));
+    }
+#endif
+    for (; i < end; i++) {
+      float p[3] = {bind.x[i], bind.y[i], bind.z[i]};
+      float n[3] = {bind.nx[i], bind.ny[i], bind.nz[i]};
+      for (const auto &[target, weight] : active) {
+        const VertexStreams &d = target->delta;
+        p[0] = p[0] + d.x[i] * weight;
+        p[1] = p[1] + d.y[i] * weight;
+        p[2] = p[2] + d.z[i] * weight;
+        n[0] = n[0] + d.nx[i] * weight;
+        n[1] = n[1] + d.ny[i] * weight;
+        n[2] = n[2] + d.nz[i] * weight;
+      }
+      float r[4][4];
+      for (int k = 0; k < MAX_INFLUENCES; k++) {
+        float w = this->weights[k][i];
+        const mat4x4 &m = palette[this->joints[k][i]];
+        for (int row = 0; row < 4; row++)
+          for (int c = 0; c < 4; c++)
+            r[row][c] = k == 0 ? w * m.m[row][c] : r[row][c] + w * m.m[row][c];
+      }
+      float q[3], o[3];
+      for (int c = 0; c < 3; c++) {
+        q[c] = p[0] * r[0][c] + p[1] * r[1][c] + p[2] * r[2][c] + r[3][c];
+        o[c] = n[0] * r[0][c] + n[1] * r[1][c] + n[2] * r[2][c];
+      }
+      out.x[i] = q[0];
+      out.y[i] = q[1];
+      out.z[i] = q[2];
+      float length = sqrtf(o[0] * o[0] + o[1] * o[1] + o[2] * o[2]);
+      bool valid = length > 0.0f;
+      out.nx[i] = valid ? o[0] / length : 0.0f;
+      out.ny[i] = valid ? o[1] / length : 0.0f;
+      out.nz[i] = valid ? o[2] / length : 0.0f;
+    }
+  }
+};
+
+// A capped tube along y, from -length / 2 to length / 2, bound to a chain
+// of `jointCount` (at least 2) evenly spaced joints with a "bulge" morph
+// target that swells its middle. Something to animate without an asset
+// pipeline, for the demo and the benchmarks.
+inline void buildSkinnedTube(SkinnedMesh &mesh, int rings, int segments,
+                             int jointCount, float length, float radius) {
+  mesh = SkinnedMesh();
+  float spacing = length / (jointCount - 1);
+  for (int j = 0; j < jointCount; j++) {
+    mat4x4 inverseBind;
+    for (int d = 0; d < 4; d++)
+      inverseBind.m[d][d] = 1.0f;
+    inverseBind.m[3][1] = 0.5f * length - j * spacing;
+    mesh.skeleton.add(j - 1, inverseBind);
+  }
+  // Each vertex follows the joints within 1.5 spacings of it, weighted by
+  // closeness, so the bends are smooth.
+  auto add = [&](float x, float y, float z, const vec3d &n) {
+    float s = (y + 0.5f * length) / spacing;
+    int joint[SkinnedMesh::MAX_INFLUENCES];
+    float weight[SkinnedMesh::MAX_INFLUENCES];
+    int count = 0;
+    for (int j = std::max(0, (int)s - 1);
+         j < jointCount && count < SkinnedMesh::MAX_INFLUENCES; j++) {
+      float w = 1.0f - fabsf(s - j) / 1.5f;
+      if (w > 0.0f) {
+        joint[count] = j;
+        weight[count++] = w;
+      }
+    }
+    return mesh.addVertex({x, y, z}, n, count, joint, weight);
+  };
+
+  std::vector<float> cosines(segments), sines(segments);
+  for (int s = 0; s < segments; s++) {
+    cosines[s] = cosf(2.0f * (float)M_PI * s / segments);
+    sines[s] = sinf(2.0f * (float)M_PI * s / segments);
+  }
+  for (int r = 0; r <= rings; r++) {
+    float y = length * r / rings - 0.5f * length;
+    for (int s = 0; s < segments; s++)
+      add(radius * cosines[s], y, radius * sines[s],
+          {cosines[s], 0.0f, sines[s]});
+  }
+  for (int r = 0; r < rings; r++) {
+    for (int s = 0; s < segments; s++) {
+      Uint32 a = r * segments + s, b = r * segments + (s + 1) % segments;
+      Uint32 c = b + segments, d = a + segments;
+      mesh.addTriangle(a, c, b);
+      mesh.addTriangle(a, d, c);
+    }
+  }
+  for (int end = 0; end < 2; end++) {
+    float y = end ? 0.5f * length : -0.5f * length;
+    vec3d n = {0.0f, end ? 1.0f : -1.0f, 0.0f};
+    Uint32 centre = add(0.0f, y, 0.0f, n);
+    for (int s = 0; s < segments; s++)
+      add(radius * cosines[s], y, radius * sines[s], n);
+    for (int s = 0; s < segments; s++) {
+      Uint32 a = centre + 1 + s, b = centre + 1 + (s + 1) % segments;
+      if (end)
+        mesh.addTriangle(centre, b, a);
+      else
+        mesh.addTriangle(centre, a, b);
+    }
+  }
+
+  MorphTarget &bulge = mesh.morphs[mesh.addMorphTarget("bulge")];
+  for (int r = 0; r <= rings; r++) {
+    float swell = 0.6f * radius * sinf((float)M_PI * r / rings);
+    for (int s = 0; s < segments; s++) {
+      bulge.delta.x[r * segments + s] = swell * cosines[s];
+      bulge.delta.z[r * segments + s] = swell * sines[s];
+    }
+  }
+}
+
+// Sways a tube from buildSkinnedTube() with a wave running up the chain
+// and pulses its bulge, at time `t` in seconds.
+inline void poseSkinnedTube(const SkinnedMesh &mesh, float t,
+                            std::vector<mat4x4> &local,
+                            std::vector<float> &morphWeights) {
+  const Skeleton &skeleton = mesh.skeleton;
+  local.resize(skeleton.size());
+  for (size_t j = 0; j < skeleton.size(); j++) {
+    // Where the joint sits relative to its parent in the bind pose.
+    float y = -skeleton.inverseBind[j].m[3][1];
+    if (skeleton.parent[j] >= 0)
+      y += skeleton.inverseBind[skeleton.parent[j]].m[3][1];
+    float angle = j == 0 ? 0.0f : 0.35f * sinf(2.0f * t - 0.8f * j);
+    mat4x4 &m = local[j];
+    m = mat4x4();
+    m.m[0][0] = cosf(angle);
+    m.m[0][1] = sinf(angle);
+    m.m[1][0] = -sinf(angle);
+    m.m[1][1] = cosf(angle);
+    m.m[2][2] = 1.0f;
+    m.m[3][1] = y;
+    m.m[3][3] = 1.0f;
+  }
+  morphWeights.assign(mesh.morphs.size(), 0.0f);
+  if (!morphWeights.empty())
+    morphWeights[0] = 0.5f + 0.5f * sinf(3.0f * t);
+}
@@ -0,0 +1,565 @@
+#pragma once
+
+#include "matrix.hpp"
+#include "mesh.hpp"
+#include "threadpool.hpp"
+#include "vec3d.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Heights on a size x size grid of samples, one world unit apart, either
+// from a procedural fractal or from a raw heightmap file: size x size
+// little-endian 16-bit heights, row by row, as exported by most terrain
+// tools. Safe to read from several threads at once.
+class Heightmap {
+  const Uint16 *raw = nullptr;
+  size_t mappedBytes = 0;
+  Uint32 seed = 1;
+
+  // Value noise: a pseudo-random value in [0, 1) at each lattice point.
+  static float lattice(Uint32 x, Uint32 z, Uint32 seed) {
+    Uint32 h = x * 0x8da6b343u ^ z * 0xd8163841u ^ seed * 0xcb1ab31fu;
+    h ^= h >> 13;
+    h *= 0x85ebca6bu;
+    h ^= h >> 16;
+    return (float)(h >> 8) * (1.0f / 16777216.0f);
+  }
+
+  // Octaves of value noise from a 1024-sample wavelength down to 8, each at
+  // half the amplitude of the one before, smoothly interpolated. Squared so
+  // that valleys are wide and peaks sharp. In [0, 1).
+  float fractal(int x, int z) const {
+    float sum = 0.0f, amplitude = 0.5f;
+    for (int shift = 10; shift >= 3; shift--) {
+      Uint32 cx = (Uint32)x >> shift, cz = (Uint32)z >> shift;
+      float mask = (float)((1 << shift) - 1);
+      float fx = (float)(x & (int)mask) / (mask + 1.0f);
+      float fz = (float)(z & (int)mask) / (mask + 1.0f);
+      fx = fx * fx * (3.0f - 2.0f * fx);
+      fz = fz * fz * (3.0f - 2.0f * fz);
+      Uint32 octaveSeed = this->seed + shift;
+      float a = lattice(cx, cz, octaveSeed);
+      float b = lattice(cx + 1, cz, octaveSeed);
+      float c = lattice(cx, cz + 1, octaveSeed);
+      float d = lattice(cx + 1, cz + 1, octaveSeed);
+      float top = a + (b - a) * fx, bottom = c + (d - c) * fx;
+      sum += (top + (bottom - top) * fz) * amplitude;
+      amplitude *= 0.5f;
+    }
+    // The amplitudes add up to 1 - 2^-8.
+    sum *= 256.0f / 255.0f;
+    return sum * sum;
+  }
+
+public:
+  int size = 0;
+  // World height of the highest possible sample.
+  float heightScale = 400.0f;
+
+  Heightmap() {}
+  Heightmap(const Heightmap &) = delete;
+  Heightmap &operator=(const Heightmap &) = delete;
+  ~Heightmap() {
+    if (this->raw)
+      munmap((void *)this->raw, this->mappedBytes);
+  }
+
+  void generate(int size, Uint32 seed) {
+    this->size = size;
+    this->seed = seed;
+  }
+
+  // Maps a raw heightmap; its size follows from the file length. Returns
+  // false if the file cannot be mapped or is not square.
+  bool openRaw(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close(fd);
+      return false;
+    }
+    size_t samples = (size_t)info.st_size / 2;
+    size_t side = (size_t)sqrt((double)samples);
+    while (side * side > samples)
+      side--;
+    while ((side + 1) * (side + 1) <= samples)
+      side++;
+    if (side < 2 || side * side * 2 != (size_t)info.st_size ||
+        side > 0x7fffffff) {
+      close(fd);
+      return false;
+    }
+    void *mapped =
+        mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+      return false;
+    // Chunks are read a few rows at a time wherever the camera goes.
+    madvise(mapped, info.st_size, MADV_RANDOM);
+    this->raw = (const Uint16 *)mapped;
+    this->mappedBytes = info.st_size;
+    this->size = (int)side;
+    return true;
+  }
+
+  // The height of sample (x, z), which must lie on the grid.
+  float at(int x, int z) const {
+    if (this->raw)
+      return (float)this->raw[(size_t)z * this->size + x] *
+             (this->heightScale / 65535.0f);
+    return this->fractal(x, z) * this->heightScale;
+  }
+};
+
+// Draws a Heightmap as square chunks of CHUNK x CHUNK quads, with
+// geomipmapped levels of detail, streamed in around the camera.
+//
+// Level l of a chunk uses every 2^l-th sample, a quarter of the triangles
+// of level l - 1. A chunk gets level 0 within lodDistance of the camera and
+// one level more each time the distance doubles. When the chunks in view
+// would come to more than triangleBudget triangles, that distance is
+// shortened for the frame, a quarter of an octave at a time, so a view full
+// of near ground is drawn coarser rather than slower. Where a chunk meets a
+// coarser neighbour, its edge leaves out the vertices that the neighbour
+// lacks, which closes the cracks and leaves the neighbour as it is.
+//
+// The heights at chunk corners, all that the coarsest level needs, are read
+// when the terrain is opened. Chunks that need a finer level have their
+// full heights generated on the terrain's own threads, nearest first, into
+// a fixed set of slots; until then they are drawn at the coarsest level.
+// As in AssetManager, a worker fills a slot and then sets its state with a
+// release store, which update() picks up with an acquire load once per
+// frame, so drawing never waits. The least recently visible slot is reused
+// when none is free. Both ends are rationed per frame: a new chunk takes
+// the one core's worth of generation away from drawing, and a published one
+// adds up to a few thousand triangles, so a burst of either all at once
+// shows up as a slow frame.
+class Terrain {
+public:
+  static const int CHUNK = 64;
+  // Level LEVELS - 1 is a single quad per chunk.
+  static const int LEVELS = 7;
+
+private:
+  static const int SAMPLES = CHUNK + 1;
+
+  enum State { EMPTY, GENERATING, READY };
+
+  struct Slot {
+    std::vector<float> heights;
+    float low = 0.0f, high = 0.0f;
+    int chunk = -1;
+    std::atomic<int> state{EMPTY};
+    // Main thread only; set in the first update() after the worker is done.
+    bool published = false;
+    Uint64 lastUsed = 0;
+  };
+
+  Heightmap heights;
+  int chunksPerSide = 0;
+  std::vector<float> corners;
+  std::unique_ptr<Slot[]> slots;
+  int slotCount = 0;
+  std::vector<int> slotOf;
+  // Slots being generated, in the order they were requested.
+  std::vector<int> queued;
+  std::vector<std::pair<float, int>> candidates;
+  std::vector<float> grid;
+  vec3d camera;
+  // lodDistance for this frame, after the triangle budget.
+  float detailDistance = 0.0f;
+  Uint64 frame = 0;
+  // Declared last so it is destroyed first, finishing any work that still
+  // writes into the slots.
+  std::unique_ptr<ThreadPool> pool;
+
+  bool open() {
+    if (this->heights.size < CHUNK + 1)
+      return false;
+    this->chunksPerSide = (this->heights.size - 1) / CHUNK;
+    int side = this->chunksPerSide + 1;
+    this->corners.resize((size_t)side * side);
+    for (int z = 0; z < side; z++)
+      for (int x = 0; x < side; x++)
+        this->corners[(size_t)z * side + x] =
+            this->heights.at(x * CHUNK, z * CHUNK);
+    this->slotCount = (int)std::clamp<Uint64>(
+        this->budgetBytes / (SAMPLES * SAMPLES * sizeof(float)), 1,
+        (Uint64)this->chunksPerSide * this->chunksPerSide);
+    this->slots = std::make_unique<Slot[]>(this->slotCount);
+    for (int i = 0; i < this->slotCount; i++)
+      this->slots[i].heights.resize(SAMPLES * SAMPLES);
+    this->slotOf.assign((size_t)this->chunksPerSide * this->chunksPerSide, -1);
+    this->pool = std::make_unique<ThreadPool>(this->threads);
+    return true;
+  }
+
+  const Slot *resident(int chunk) const {
+    int s = this->slotOf[chunk];
+    return s >= 0 && this->slots[s].published ? &this->slots[s] : nullptr;
+  }
+
+  // Lowest and highest height of a chunk as far as it is known.
+  void bounds(int chunk, float &low, float &high) const {
+    if (const Slot *slot = this->resident(chunk)) {
+      low = slot->low;
+      high = slot->high;
+      return;
+    }
+    int side = this->chunksPerSide + 1;
+    int cx = chunk % this->chunksPerSide, cz = chunk / this->chunksPerSide;
+    const float *c = &this->corners[(size_t)cz * side + cx];
+    low = std::min({c[0], c[1], c[side], c[side + 1]});
+    high = std::max({c[0], c[1], c[side], c[side + 1]});
+  }
+
+  // Distance from the camera to a chunk's bounding box.
+  float distance(int chunk) const {
+    float low, high;
+    this->bounds(chunk, low, high);
+    float x0 = (float)(chunk % this->chunksPerSide * CHUNK);
+    float z0 = (float)(chunk / this->chunksPerSide * CHUNK);
+    // Heights point up, along -y.
+    float dx = std::max({x0 - this->camera.x, this->camera.x - x0 - CHUNK,
+                         0.0f});
+    float dy = std::max({-high - this->camera.y, this->camera.y + low, 0.0f});
+    float dz = std::max({z0 - this->camera.z, this->camera.z - z0 - CHUNK,
+                         0.0f});
+    return sqrtf(dx * dx + dy * dy + dz * dz);
+  }
+
+  int wantedLevel(float distance) const {
+    int level = 0;
+    for (float d = this->detailDistance; distance >= d && level < LEVELS - 1;
+         d *= 2.0f)
+      level++;
+    return level;
+  }
+
+  // The level a chunk is drawn at this frame.
+  int level(int chunk) const {
+    return this->resident(chunk) ? this->wantedLevel(this->distance(chunk))
+                                 : LEVELS - 1;
+  }
+
+  // Shortens detailDistance until the candidates, at the levels they would
+  // be drawn at, fit in triangleBudget.
+  void fitBudget() {
+    this->detailDistance = this->lodDistance;
+    if (this->triangleBudget <= 0)
+      return;
+    for (int step = 0; step < 16; step++) {
+      Uint64 total = 0;
+      for (auto &candidate : this->candidates) {
+        int n = CHUNK >> (this->resident(candidate.second)
+                              ? this->wantedLevel(candidate.first)
+                              : LEVELS - 1);
+        total += 2 * n * n;
+      }
+      if (total <= (Uint64)this->triangleBudget)
+        return;
+      this->detailDistance *= 0.84089642f; // 2^-1/4
+    }
+  }
+
+  void request(int chunk) {
+    // A free slot, or else the one unused the longest, unless that one is
+    // in use this frame or still being written.
+    int best = -1;
+    for (int i = 0; i < this->slotCount; i++) {
+      Slot &slot = this->slots[i];
+      if (slot.chunk < 0) {
+        best = i;
+        break;
+      }
+      if (slot.published && slot.lastUsed != this->frame &&
+          (best < 0 || slot.lastUsed < this->slots[best].lastUsed))
+        best = i;
+    }
+    if (best < 0)
+      return;
+    Slot &slot = this->slots[best];
+    if (slot.chunk >= 0) {
+      this->slotOf[slot.chunk] = -1;
+      this->evictions++;
+    }
+    slot.chunk = chunk;
+    slot.published = false;
+    slot.lastUsed = this->frame;
+    slot.state.store(GENERATING, std::memory_order_relaxed);
+    this->slotOf[chunk] = best;
+    this->queued.push_back(best);
+    this->pending++;
+    int x0 = chunk % this->chunksPerSide * CHUNK;
+    int z0 = chunk / this->chunksPerSide * CHUNK;
+    const Heightmap *source = &this->heights;
+    this->pool->submit([&slot, source, x0, z0](int) {
+      float low = source->at(x0, z0), high = low;
+      for (int z = 0; z < SAMPLES; z++) {
+        for (int x = 0; x < SAMPLES; x++) {
+          float h = source->at(x0 + x, z0 + z);
+          slot.heights[(size_t)z * SAMPLES + x] = h;
+          low = std::min(low, h);
+          high = std::max(high, h);
+        }
+      }
+      slot.low = low;
+      slot.high = high;
+      slot.state.store(READY, std::memory_order_release);
+    });
+  }
+
+  // Publishes at most `limit` finished chunks, the earliest requested
+  // first.
+  void publish(int limit) {
+    int published = 0;
+    auto ready = [&](int s) {
+      Slot &slot = this->slots[s];
+      if (published == limit ||
+          slot.state.load(std::memory_order_acquire) != READY)
+        return false;
+      slot.published = true;
+      published++;
+      this->pending--;
+      this->generated++;
+      return true;
+    };
+    this->queued.erase(
+        std::remove_if(this->queued.begin(), this->queued.end(), ready),
+        this->queued.end());
+  }
+
+public:
+  struct DrawChunk {
+    int chunk;
+    int level;
+  };
+
+  Uint64 budgetBytes;
+  // Worker threads generating chunks; 0 for one per core.
+  int threads = 0;
+  float lodDistance = 48.0f;
+  // Triangles the chunks in view may come to per frame, roughly; 0 for no
+  // limit. Keeps the frames where near ground fills the view in line.
+  int triangleBudget = 40000;
+  // Chunks farther than this are not drawn.
+  float viewDistance = 800.0f;
+  // Chunks queued for generation at most at once, so that the nearest
+  // chunks of the latest frame are always next.
+  int maxPending = 8;
+  // Chunks queued and chunks published at most per frame, unless blocking.
+  int maxRequestsPerFrame = 2;
+  int maxPublishesPerFrame = 2;
+
+  // Chunks to draw this frame, nearest first.
+  std::vector<DrawChunk> drawable;
+  int visibleChunks = 0;
+  int pending = 0;
+  Uint64 generated = 0;
+  Uint64 evictions = 0;
+
+  Terrain(Uint64 budgetBytes) { this->budgetBytes = budgetBytes; }
+
+  // A procedural terrain of size x size samples.
+  bool generate(int size, Uint32 seed = 1) {
+    this->heights.generate(size, seed);
+    return this->open();
+  }
+
+  // A terrain from a raw 16-bit heightmap (see Heightmap).
+  bool load(const std::string &path) {
+    return this->heights.openRaw(path) && this->open();
+  }
+
+  // Samples per side actually drawn, a multiple of CHUNK plus one.
+  int size() const { return this->chunksPerSide * CHUNK + 1; }
+  Uint64 residentBytes() const {
+    return (Uint64)(this->generated - this->evictions) * SAMPLES * SAMPLES *
+           sizeof(float);
+  }
+
+  // World height of the ground at (x, z), taken from the nearest sample.
+  float groundAt(float x, float z) const {
+    int limit = this->size() - 1;
+    return this->heights.at(std::clamp((int)lroundf(x), 0, limit),
+                            std::clamp((int)lroundf(z), 0, limit));
+  }
+
+  // Culls the chunks and picks their levels for one frame, and queues the
+  // generation of the ones that need more detail. `view` and `proj` are the
+  // engine's matrices. With `blocking`, the chunks in view are generated
+  // before returning, for offline rendering.
+  void update(const vec3d &camera, const mat4x4 &view, const mat4x4 &proj,
+              float fNear, bool blocking) {
+    this->frame++;
+    this->camera = camera;
+    this->drawable.clear();
+    this->candidates.clear();
+    this->publish(blocking ? INT_MAX : this->maxPublishesPerFrame);
+
+    // Chunks within viewDistance, culled by their bounding spheres as in
+    // BrickStreamer::update().
+    int reach = (int)ceilf(this->viewDistance / CHUNK) + 1;
+    int ccx = (int)floorf(camera.x / CHUNK);
+    int ccz = (int)floorf(camera.z / CHUNK);
+    int x0 = std::max(ccx - reach, 0);
+    int x1 = std::min(ccx + reach, this->chunksPerSide - 1);
+    int z0 = std::max(ccz - reach, 0);
+    int z1 = std::min(ccz + reach, this->chunksPerSide - 1);
+    const float px = proj.m[0][0], py = proj.m[1][1];
+    const float kx = sqrtf(px * px + 1.0f), ky = sqrtf(py * py + 1.0f);
+    const mat4x4 &m = view;
+    for (int cz = z0; cz <= z1; cz++) {
+      for (int cx = x0; cx <= x1; cx++) {
+        int chunk = cz * this->chunksPerSide + cx;
+        float d = this->distance(chunk);
+        if (d > this->viewDistance)
+          continue;
+        float low, high;
+        this->bounds(chunk, low, high);
+        float h = 0.5f * (high - low);
+        float r = sqrtf(2.0f * (0.5f * CHUNK) * (0.5f * CHUNK) + h * h);
+        vec3d c = {(cx + 0.5f) * CHUNK, -0.5f * (low + high),
+                   (cz + 0.5f) * CHUNK};
+        float x = c.x * m.m[0][0] + c.y * m.m[1][0] + c.z * m.m[2][0] +
+                  m.m[3][0];
+        float y = c.x * m.m[0][1] + c.y * m.m[1][1] + c.z * m.m[2][1] +
+                  m.m[3][1];
+        float z = c.x * m.m[0][2] + c.y * m.m[1][2] + c.z * m.m[2][2] +
+                  m.m[3][2];
+        if (z + r <= fNear || px * x - z > r * kx || -px * x - z > r * kx ||
+            py * y - z > r * ky || -py * y - z > r * ky)
+          continue;
+        this->candidates.push_back({d, chunk});
+      }
+    }
+    std::sort(this->candidates.begin(), this->candidates.end());
+    this->visibleChunks = (int)this->candidates.size();
+    this->fitBudget();
+
+    int requests = 0;
+    for (auto &candidate : this->candidates) {
+      int chunk = candidate.second;
+      if (this->wantedLevel(candidate.first) == LEVELS - 1)
+        continue;
+      int s = this->slotOf[chunk];
+      if (s >= 0) {
+        this->slots[s].lastUsed = this->frame;
+      } else if (blocking || (this->pending < this->maxPending &&
+                              requests < this->maxRequestsPerFrame)) {
+        this->request(chunk);
+        requests++;
+      }
+    }
+    if (blocking) {
+      this->pool->wait();
+      this->publish(INT_MAX);
+      // The budget counted the new chunks at the coarsest level.
+      this->fitBudget();
+    }
+
+    for (auto &candidate : this->candidates)
+      this->drawable.push_back(
+          {candidate.second, this->level(candidate.second)});
+  }
+
+  // Calls fn(tri) for each triangle of a chunk from `drawable`, in world
+  // space, with the ground facing up (-y).
+  template <typename Fn> void triangles(const DrawChunk &draw, Fn fn) {
+    int cx = draw.chunk % this->chunksPerSide;
+    int cz = draw.chunk / this->chunksPerSide;
+    int step = 1 << draw.level;
+    int n = CHUNK >> draw.level;
+    int side = n + 1;
+    this->grid.resize((size_t)side * side);
+    const Slot *slot = this->resident(draw.chunk);
+    for (int j = 0; j < side; j++) {
+      for (int i = 0; i < side; i++) {
+        float h;
+        if (slot) {
+          h = slot->heights[(size_t)j * step * SAMPLES + i * step];
+        } else {
+          int cs = this->chunksPerSide + 1;
+          h = this->corners[(size_t)(cz + j) * cs + cx + i];
+        }
+        this->grid[(size_t)j * side + i] = h;
+      }
+    }
+
+    float ox = (float)(cx * CHUNK), oz = (float)(cz * CHUNK);
+    auto vertex = [&](int i, int j) {
+      return vec3d(ox + i * step, -this->grid[(size_t)j * side + i],
+                   oz + j * step);
+    };
+    // Wound so that the normal points up.
+    auto emit = [&](int i0, int j0, int i1, int j1, int i2, int j2) {
+      if ((j1 - j0) * (i2 - i0) - (i1 - i0) * (j2 - j0) > 0) {
+        std::swap(i1, i2);
+        std::swap(j1, j2);
+      }
+      fn(triangle{{vertex(i0, j0), vertex(i1, j1), vertex(i2, j2)}});
+    };
+    if (n == 1) {
+      emit(0, 0, 1, 0, 1, 1);
+      emit(0, 0, 1, 1, 0, 1);
+      return;
+    }
+    for (int j = 1; j < n - 1; j++) {
+      for (int i = 1; i < n - 1; i++) {
+        emit(i, j, i + 1, j, i + 1, j + 1);
+        emit(i, j, i + 1, j + 1, i, j + 1);
+      }
+    }
+
+    // The outer ring of quads is triangulated one side at a time, between
+    // the edge and the row of vertices one step in. Along a coarser
+    // neighbour the edge keeps only the vertices that the neighbour has, so
+    // the two meet without cracks or T-junctions.
+    const int dx[4] = {-1, 1, 0, 0}, dz[4] = {0, 0, -1, 1};
+    for (int e = 0; e < 4; e++) {
+      int span = 1;
+      int nx = cx + dx[e], nz = cz + dz[e];
+      if (nx >= 0 && nz >= 0 && nx < this->chunksPerSide &&
+          nz < this->chunksPerSide) {
+        int neighbour = this->level(nz * this->chunksPerSide + nx);
+        if (neighbour > draw.level)
+          span = 1 << (neighbour - draw.level);
+      }
+      // Vertex k along the side, on the edge (depth 0) or one step in.
+      auto at = [&](int k, int depth, int &i, int &j) {
+        i = e == 0 ? depth : e == 1 ? n - depth : k;
+        j = e == 2 ? depth : e == 3 ? n - depth : k;
+      };
+      // Zips the edge (k = 0, span, ..., n) and the inner row
+      // (k = 1, ..., n - 1) together, taking the next segment whose middle
+      // comes first.
+      int outer = 0, inner = 1;
+      while (outer < n || inner < n - 1) {
+        int i0, j0, i1, j1, i2, j2;
+        at(outer, 0, i0, j0);
+        at(inner, 1, i1, j1);
+        if (inner == n - 1 || (outer < n && 2 * outer + span < 2 * inner + 1)) {
+          outer += span;
+          at(outer, 0, i2, j2);
+        } else {
+          inner++;
+          at(inner, 1, i2, j2);
+        }
+        emit(i0, j0, i1, j1, i2, j2);
+      }
+    }
+  }
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads pulling tasks from one queue. Tasks receive the
+// index of the worker running them, so callers can keep per-thread state
+// (framebuffers, scratch buffers) in a plain vector indexed by it.
+class ThreadPool {
+  std::vector<std::thread> workers;
+  std::deque<std::function<void(int)>> tasks;
+  std::mutex lock;
+  std::condition_variable taskReady;
+  std::condition_variable allDone;
+  int running = 0;
+  bool stopping = false;
+
+public:
+  // 0 threads means one per hardware thread.
+  ThreadPool(int threads = 0) {
+    if (threads <= 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < threads; i++)
+      this->workers.emplace_back([this, i] { this->run(i); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->stopping = true;
+    }
+    this->taskReady.notify_all();
+    for (auto &worker : this->workers)
+      worker.join();
+  }
+
+  int size() { return (int)this->workers.size(); }
+
+  void submit(std::function<void(int)> task) {
+    {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->tasks.push_back(std::move(task));
+    }
+    this->taskReady.notify_one();
+  }
+
+  // Blocks until the queue is empty and no task is running.
+  void wait() {
+    std::unique_lock<std::mutex> guard(this->lock);
+    this->allDone.wait(
+        guard, [this] { return this->tasks.empty() && this->running == 0; });
+  }
+
+private:
+  void run(int index) {
+    while (true) {
+      std::function<void(int)> task;
+      {
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->taskReady.wait(guard, [this] {
+          return !this->tasks.empty() || this->stopping;
+        });
+        if (this->tasks.empty())
+          return;
+        task = std::move(this->tasks.front());
+        this->tasks.pop_front();
+        this->running++;
+      }
+
+      task(index);
+
+      {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->running--;
+        if (this->tasks.empty() && this->running == 0)
+          this->allDone.notify_all();
+      }
+    }
+  }
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <chrono>
+
+class Timer {
+  std::chrono::steady_clock::time_point start;
+
+public:
+  Timer() { this->reset(); }
+
+  void reset() { this->start = std::chrono::steady_clock::now(); }
+
+  float elapsedMs() {
+    return std::chrono::duration<float, std::milli>(
+               std::chrono::steady_clock::now() - this->start)
+        .count();
+  }
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <SDL2/SDL_stdinc.h>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Scalers used to present the internal render resolution at window size.
+// Both take tightly packed 32-bit pixels; the channel layout does not matter.
+
+// Integer-ratio path: every source pixel becomes a factor x factor block.
+inline void upscaleInteger(const Uint32 *src, int sw, int sh, Uint32 *dst,
+                           int factor) {
+  int dw = sw * factor;
+  for (int y = 0; y < sh; y++) {
+    const Uint32 *s = src + (size_t)y * sw;
+    Uint32 *d = dst + (size_t)y * factor * dw;
+    int x = 0;
+#if defined(__SSE2__)
+    if (factor == 2) {
+      for (; x + 4 <= sw; x += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(s + x));
+        _mm_storeu_si128((__m128i *)(d + 2 * x), _mm_unpacklo_epi32(p, p));
+        _mm_storeu_si128((__m128i *)(d + 2 * x + 4),
+                         _mm_unpackhi_epi32(p, p));
+      }
+    } else if (factor >= 4) {
+      for (; x < sw; x++) {
+        __m128i p = _mm_set1_epi32((int)s[x]);
+        Uint32 *o = d + x * factor;
+        int i = 0;
+        for (; i + 4 <= factor; i += 4)
+          _mm_storeu_si128((__m128i *)(o + i), p);
+        for (; i < factor; i++)
+          o[i] = s[x];
+      }
+    }
+#endif
+    for (; x < sw; x++)
+      for (int i = 0; i < factor; i++)
+        d[x * factor + i] = s[x];
+    for (int r = 1; r < factor; r++)
+      memcpy(d + (size_t)r * dw, d, dw * sizeof(Uint32));
+  }
+}
+
+// Blends two rows channel-wise: out = a + (b - a) * w / 128, w in [0, 128].
+inline void blendRows(const Uint32 *a, const Uint32 *b, Uint32 *out, int n,
+                      int w) {
+  int x = 0;
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  __m128i weight = _mm_set1_epi16((short)w);
+  for (; x + 4 <= n; x += 4) {
+    __m128i pa = _mm_loadu_si128((const __m128i *)(a + x));
+    __m128i pb = _mm_loadu_si128((const __m128i *)(b + x));
+    __m128i alo = _mm_unpacklo_epi8(pa, zero);
+    __m128i ahi = _mm_unpackhi_epi8(pa, zero);
+    __m128i blo = _mm_unpacklo_epi8(pb, zero);
+    __m128i bhi = _mm_unpackhi_epi8(pb, zero);
+    // |b - a| <= 255 and w <= 128, so the product fits in a signed 16 bits.
+    __m128i lo = _mm_add_epi16(
+        alo, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(blo, alo), weight),
+                            7));
+    __m128i hi = _mm_add_epi16(
+        ahi, _mm_srai_epi16(_mm_mullo_epi16(_mm_sub_epi16(bhi, ahi), weight),
+                            7));
+    _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for (; x < n; x++) {
+    Uint32 r = 0;
+    for (int c = 0; c < 32; c += 8) {
+      int ca = (a[x] >> c) & 0xff;
+      int cb = (b[x] >> c) & 0xff;
+      r |= (Uint32)(ca + (((cb - ca) * w) >> 7)) << c;
+    }
+    out[x] = r;
+  }
+}
+
+// Arbitrary-ratio bilinear upscale in 16.16 fixed point. Vertical blending
+// is done a whole source row at a time into `row`, then each destination
+// pixel lerps two neighbours of that row.
+inline void upscaleBilinear(const Uint32 *src, int sw, int sh, Uint32 *dst,
+                            int dw, int dh, std::vector<Uint32> &row) {
+  row.resize(sw + 1);
+  Uint32 stepX = ((Uint32)sw << 16) / dw;
+  Uint32 stepY = ((Uint32)sh << 16) / dh;
+  // Sample at pixel centres so the image does not drift towards the origin.
+  int startX = (int)(stepX >> 1) - 0x8000;
+  int startY = (int)(stepY >> 1) - 0x8000;
+
+  for (int y = 0; y < dh; y++) {
+    int fy = startY + (int)(y * stepY);
+    if (fy < 0)
+      fy = 0;
+    int y0 = fy >> 16;
+    int y1 = y0 + 1 < sh ? y0 + 1 : sh - 1;
+    blendRows(src + (size_t)y0 * sw, src + (size_t)y1 * sw, row.data(), sw,
+              (fy & 0xffff) >> 9);
+    row[sw] = row[sw - 1];
+
+    Uint32 *d = dst + (size_t)y * dw;
+    for (int x = 0; x < dw; x++) {
+      int fx = startX + (int)(x * stepX);
+      if (fx < 0)
+        fx = 0;
+      int x0 = fx >> 16;
+      int w = (fx & 0xffff) >> 9;
+#if defined(__SSE2__)
+      __m128i p = _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i *)(row.data() + x0)),
+          _mm_setzero_si128());
+      __m128i diff = _mm_sub_epi16(_mm_srli_si128(p, 8), p);
+      __m128i r = _mm_add_epi16(
+          p, _mm_srai_epi16(_mm_mullo_epi16(diff, _mm_set1_epi16((short)w)),
+                            7));
+      d[x] = (Uint32)_mm_cvtsi128_si32(_mm_packus_epi16(r, r));
+#else
+      blendRows(row.data() + x0, row.data() + x0 + 1, d + x, 1, w);
+#endif
+    }
+  }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "depthsort.hpp"
+#include "framebuffer.hpp"
+#include "mesh.hpp"
+#include "vec3d.hpp"
+#include <SDL2/SDL_stdinc.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// One of several cameras drawing the same scene in a frame (see
+// olcEngine3D::vecViews).
+//
+// A view covers the rectangle (x, y, w, h) of the engine's framebuffer,
+// given as fractions of its size so it follows the render scale. It is
+// rasterized into its own `target` at that size, which keeps the views
+// independent enough to draw in parallel, and then copied into place.
+// Callers that want separate images can read `target` directly.
+struct Viewport {
+  vec3d camera;
+  // Turn about the Y axis; 0 looks down +z, as for the engine's camera.
+  float yaw = 0.0f;
+  float x = 0.0f, y = 0.0f, w = 1.0f, h = 1.0f;
+  Framebuffer target;
+
+  // Where the last frame's time went, in ms, and the triangles that were
+  // left to rasterize after culling and clipping.
+  float projectMs = 0.0f;
+  float sortMs = 0.0f;
+  float rasterMs = 0.0f;
+  size_t trianglesDrawn = 0;
+
+  // Per-view working space, kept between frames.
+  std::vector<triangle> triangles;
+  std::vector<float> light;
+  std::vector<Uint32> order;
+  DepthSorter sorter;
+
+  // The pixel rectangle the view covers in a width x height framebuffer.
+  // Neighbouring views share their edges, so a split leaves no gaps.
+  void area(int width, int height, int &left, int &top, int &right,
+            int &bottom) const {
+    left = std::clamp((int)lroundf(this->x * width), 0, width);
+    top = std::clamp((int)lroundf(this->y * height), 0, height);
+    right = std::clamp((int)lroundf((this->x + this->w) * width), left, width);
+    bottom =
+        std::clamp((int)lroundf((this->y + this->h) * height), top, height);
+  }
+
+  // Copies the target's colours into its rectangle of `fb`.
+  void present(Framebuffer &fb) const {
+    int left, top, right, bottom;
+    this->area(fb.width, fb.height, left, top, right, bottom);
+    int width = std::min(right - left, this->target.width);
+    int height = std::min(bottom - top, this->target.height);
+    if (width <= 0 || height <= 0)
+      return;
+    for (int row = 0; row < height; row++) {
+      const Uint32 *src = &this->target.color[(size_t)row * this->target.width];
+      std::copy(src, src + width,
+                &fb.color[(size_t)(top + row) * fb.width + left]);
+    }
+    fb.touch(left, top, left + width - 1, top + height - 1);
+  }
+};
+
+// Up to four views of `centre` from `distance` away, spread evenly around
+// it: one fills the framebuffer, two split it side by side and three or
+// four share a 2x2 grid.
+inline std::vector<Viewport> splitScreen(int count, vec3d centre,
+                                         float distance) {
+  count = std::clamp(count, 1, 4);
+  std::vector<Viewport> views(count);
+  int columns = count == 1 ? 1 : 2;
+  int rows = count <= 2 ? 1 : 2;
+  for (int i = 0; i < count; i++) {
+    Viewport &view = views[i];
+    view.w = 1.0f / columns;
+    view.h = 1.0f / rows;
+    view.x = (i % columns) * view.w;
+    view.y = (i / columns) * view.h;
+    // Looking along (-sin(yaw), 0, cos(yaw)) from the opposite side.
+    view.yaw = 2.0f * (float)M_PI * i / count;
+    view.camera = {centre.x + distance * sinf(view.yaw), centre.y,
+                   centre.z - distance * cosf(view.yaw)};
+  }
+  return views;
+}
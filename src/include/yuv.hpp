@@ -0,0 +1,134 @@
+#pragma once
+
+#include <SDL2/SDL_stdinc.h>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// BT.601 limited-range RGB -> YUV 4:2:0 for 0xRRGGBBAA pixels. Width and
+// height must be even; each chroma sample is the average of a 2x2 block.
+//
+//   Y = ((66R + 129G + 25B + 128) >> 8) + 16
+//   U = ((-38R - 74G + 112B + 128) >> 8) + 128
+//   V = ((112R - 94G - 18B + 128) >> 8) + 128
+
+inline void rgbaToYuv420Scalar(const Uint32 *rgba, int width, int y0, int y1,
+                               int x0, Uint8 *yPlane, Uint8 *uPlane,
+                               Uint8 *vPlane) {
+  for (int y = y0; y < y1; y++) {
+    for (int x = x0; x < width; x++) {
+      Uint32 p = rgba[(size_t)y * width + x];
+      int r = p >> 24, g = (p >> 16) & 0xff, b = (p >> 8) & 0xff;
+      yPlane[(size_t)y * width + x] =
+          (Uint8)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    }
+  }
+  for (int y = y0; y < y1; y += 2) {
+    for (int x = x0; x < width; x += 2) {
+      int r = 0, g = 0, b = 0;
+      for (int k = 0; k < 4; k++) {
+        Uint32 p = rgba[(size_t)(y + k / 2) * width + x + k % 2];
+        r += p >> 24;
+        g += (p >> 16) & 0xff;
+        b += (p >> 8) & 0xff;
+      }
+      r = (r + 2) >> 2;
+      g = (g + 2) >> 2;
+      b = (b + 2) >> 2;
+      size_t c = (size_t)(y / 2) * (width / 2) + x / 2;
+      uPlane[c] = (Uint8)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+      vPlane[c] = (Uint8)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+  }
+}
+
+inline void rgbaToYuv420(const Uint32 *rgba, int width, int height,
+                         Uint8 *yPlane, Uint8 *uPlane, Uint8 *vPlane) {
+#if defined(__SSE2__)
+  const __m128i mask = _mm_set1_epi32(0xff);
+  // 32-bit lanes of 0xRRGGBBAA -> R, G, B in 32-bit lanes.
+  auto split = [&](__m128i p, __m128i &r, __m128i &g, __m128i &b) {
+    r = _mm_srli_epi32(p, 24);
+    g = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+    b = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+  };
+  // Lanes a0..a3, b0..b3 -> a0+a1, a2+a3, b0+b1, b2+b3.
+  auto pairSum = [](__m128i a, __m128i b) {
+    __m128 fa = _mm_castsi128_ps(a);
+    __m128 fb = _mm_castsi128_ps(b);
+    return _mm_add_epi32(
+        _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0))),
+        _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1))));
+  };
+
+  int simdWidth = width & ~7;
+  for (int y = 0; y < height; y += 2) {
+    for (int x = 0; x < simdWidth; x += 8) {
+      __m128i r2[2], g2[2], b2[2];
+      for (int row = 0; row < 2; row++) {
+        const Uint32 *src = rgba + (size_t)(y + row) * width + x;
+        __m128i ra, ga, ba, rb, gb, bb;
+        split(_mm_loadu_si128((const __m128i *)src), ra, ga, ba);
+        split(_mm_loadu_si128((const __m128i *)(src + 4)), rb, gb, bb);
+
+        // Luma in unsigned 16 bits: the weighted sum never exceeds 56228.
+        __m128i r = _mm_packs_epi32(ra, rb);
+        __m128i g = _mm_packs_epi32(ga, gb);
+        __m128i b = _mm_packs_epi32(ba, bb);
+        __m128i luma = _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)),
+                          _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+            _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)),
+                          _mm_set1_epi16(128)));
+        luma = _mm_add_epi16(_mm_srli_epi16(luma, 8), _mm_set1_epi16(16));
+        _mm_storel_epi64(
+            (__m128i *)(yPlane + (size_t)(y + row) * width + x),
+            _mm_packus_epi16(luma, luma));
+
+        // Horizontal pair sums for the 2x2 chroma average.
+        r2[row] = pairSum(ra, rb);
+        g2[row] = pairSum(ga, gb);
+        b2[row] = pairSum(ba, bb);
+      }
+
+      __m128i two = _mm_set1_epi32(2);
+      __m128i r = _mm_srli_epi32(
+          _mm_add_epi32(_mm_add_epi32(r2[0], r2[1]), two), 2);
+      __m128i g = _mm_srli_epi32(
+          _mm_add_epi32(_mm_add_epi32(g2[0], g2[1]), two), 2);
+      __m128i b = _mm_srli_epi32(
+          _mm_add_epi32(_mm_add_epi32(b2[0], b2[1]), two), 2);
+      r = _mm_packs_epi32(r, r);
+      g = _mm_packs_epi32(g, g);
+      b = _mm_packs_epi32(b, b);
+
+      // Chroma in signed 16 bits: every partial sum stays within +-28688.
+      __m128i u = _mm_add_epi16(
+          _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(-38)),
+                        _mm_mullo_epi16(g, _mm_set1_epi16(-74))),
+          _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(112)),
+                        _mm_set1_epi16(128)));
+      __m128i v = _mm_add_epi16(
+          _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(112)),
+                        _mm_mullo_epi16(g, _mm_set1_epi16(-94))),
+          _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(-18)),
+                        _mm_set1_epi16(128)));
+      u = _mm_add_epi16(_mm_srai_epi16(u, 8), _mm_set1_epi16(128));
+      v = _mm_add_epi16(_mm_srai_epi16(v, 8), _mm_set1_epi16(128));
+
+      size_t c = (size_t)(y / 2) * (width / 2) + x / 2;
+      int packedU = _mm_cvtsi128_si32(_mm_packus_epi16(u, u));
+      int packedV = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+      memcpy(uPlane + c, &packedU, 4);
+      memcpy(vPlane + c, &packedV, 4);
+    }
+  }
+  if (simdWidth < width)
+    rgbaToYuv420Scalar(rgba, width, 0, height, simdWidth, yPlane, uPlane,
+                       vPlane);
+#else
+  rgbaToYuv420Scalar(rgba, width, 0, height, 0, yPlane, uPlane, vPlane);
+#endif
+}
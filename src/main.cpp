@@ -1,745 +1,504 @@
-#include "display.hpp"
+#include "batch.hpp"
+#include "engine.hpp"
 #include "failure.hpp"
-#include "matrix.hpp"
-#include "vec3d.hpp"
-#include <algorithm>
+#include "framewriter.hpp"
+#include "hud.hpp"
+#include "resolution.hpp"
+#include "shmring.hpp"
+#include "timer.hpp"
 #include <cmath>
-#include <fstream>
-#include <list>
-#include <sstream>
-#include <vector>
-
-struct triangle {
-  vec3d p[3];
-
-  float illumination;
-};
-
-void printTriangle(triangle tri, bool pad = true) {
-  std::cout << "illumination: " << tri.illumination << std::endl;
-  for (int i = 0; i < 3; i++) {
-    printVec3d(tri.p[i]);
-  }
-  if (pad)
-    std::cout << "\n";
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#define USAGE                                                                  \
+  "Usage: main [--target-ms ms] [--min-scale s] [--max-scale s] [--msaa]\n"    \
+  "            [--mesh file.obj] [--size WxH] [--alpha a] [--wireframe]\n"     \
+  "            [--no-depth] [--compact] [--gouraud]\n"                         \
+  "            [--views n] [--prepass] [--shadows]\n"                          \
+  "            [--light x,y,z[,i]]...\n"                                       \
+  "            [--point-light x,y,z[,i[,falloff]]]...\n"                       \
+  "            [--no-dirty-tiles] [--dirty-stats] [--hud]\n"                   \
+  "            [--bricks file.tarb [--resident-mb n]]\n"                       \
+  "            [--terrain size|file.r16 [--resident-mb n]]\n"                  \
+  "            [--points file.ply|file.xyz [--point-size n]]\n"                \
+  "            [--skinned-demo]\n"                                             \
+  "            [--export out.y4m|frame%04d.ppm [--frames n] [--fps n]]\n"      \
+  "            [--shm /name [--shm-slots n]]\n"                                \
+  "            [--batch manifest.txt [--threads n]]\n"                         \
+  "       main --build-bricks in.obj out.tarb [--brick-tris n]"
+
+// Moves the demo's skinned tube to where it is `seconds` into its
+// animation.
+static void animateSkinned(olcEngine3D &engine, float seconds) {
+  if (engine.pSkinned)
+    poseSkinnedTube(*engine.pSkinned, seconds, engine.vecJointPose,
+                    engine.vecMorphWeights);
 }
 
-struct mesh {
-  std::vector<triangle> tris;
-
-  bool LoadFromObjectFile(std::string sFilename) {
-    std::ifstream f(sFilename);
-    if (!f.is_open()) {
-      return false;
-    }
-
-    std::vector<vec3d> verts;
-
-    while (!f.eof()) {
-      char line[128];
-      f.getline(line, 128);
-
-      std::stringstream s;
-      s << line;
-
-      char junk;
-
-      if (line[0] == 'v') {
-        vec3d v;
-        s >> junk >> v.x >> v.y >> v.z;
-        verts.push_back(v);
-      }
-      if (line[0] == 'f') {
-        int f[3];
-        s >> junk >> f[0] >> f[1] >> f[2];
-        tris.push_back({verts[f[0] - 1], verts[f[1] - 1], verts[f[2] - 1]});
-      }
-    }
-
-    return true;
+// Opens the terrain for --terrain, a procedural one if `source` is a
+// number, and puts the camera over its centre. Without --light the sun is
+// high up behind the camera.
+static void openTerrain(olcEngine3D &engine, const std::string &source,
+                        int residentMb, bool defaultLights) {
+  Uint64 budget = (Uint64)residentMb << 20;
+  bool procedural = source.find_first_not_of("0123456789") == std::string::npos;
+  if (procedural ? !engine.GenerateTerrain(atoi(source.c_str()), budget)
+                 : !engine.LoadTerrain(source, budget)) {
+    fail("Could not open the terrain; it needs at least 65x65 heights");
   }
-};
-
-class mat4x4 {
-public:
-  float m[4][4];
-
-  mat4x4() {
-    for (int i = 0; i < 4; i++) {
-      for (int j = 0; j < 4; j++) {
-        m[i][j] = 0;
-      }
-    }
-  }
-};
-
-void printMat4x4(mat4x4 m) {
-  for (int i = 0; i < 4; i++) {
-    for (int j = 0; j < 4; j++) {
-      std::cout << m.m[i][j] << " ";
-    }
-    std::cout << "\n";
+  float centre = engine.pTerrain->size() * 0.5f;
+  engine.SetCamera(
+      {centre, -engine.pTerrain->groundAt(centre, centre) - 40.0f, centre},
+      0.0f);
+  if (defaultLights) {
+    Light sun;
+    float length = sqrtf(0.3f * 0.3f + 0.8f * 0.8f + 0.5f * 0.5f);
+    sun.v = {0.3f / length, -0.8f / length, -0.5f / length};
+    engine.lighting.lights = {sun};
   }
 }
 
-class olcEngine3D : public Display {
-public:
-  olcEngine3D() {}
-
-private:
-  mesh meshCube;
-  mat4x4 matProj;
-
-  vec3d vCamera;
-  vec3d vLookDir;
-
-  float fTheta = 0;
-  float fYaw = 0;
-
-  vec3d Matrix_MultiplyVector(mat4x4 &m, vec3d &i) {
-    vec3d v;
-    v.x = i.x * m.m[0][0] + i.y * m.m[1][0] + i.z * m.m[2][0] + i.w * m.m[3][0];
-    v.y = i.x * m.m[0][1] + i.y * m.m[1][1] + i.z * m.m[2][1] + i.w * m.m[3][1];
-    v.z = i.x * m.m[0][2] + i.y * m.m[1][2] + i.z * m.m[2][2] + i.w * m.m[3][2];
-    v.w = i.x * m.m[0][3] + i.y * m.m[1][3] + i.z * m.m[2][3] + i.w * m.m[3][3];
-    return v;
-  }
-
-  mat4x4 Matrix_PointAt(vec3d &pos, vec3d &target, vec3d &up) {
-    vec3d newForward = Vector_Sub(target, pos);
-    newForward = Vector_Normalise(newForward);
-
-    vec3d a = Vector_Mul(newForward, Vector_DotProduct(up, newForward));
-    vec3d newUp = Vector_Sub(up, a);
-    newUp = Vector_Normalise(newUp);
-
-    vec3d newRight = Vector_CrossProduct(newUp, newForward);
-
-    mat4x4 matrix;
-    matrix.m[0][0] = newRight.x;
-    matrix.m[0][1] = newRight.y;
-    matrix.m[0][2] = newRight.z;
-    matrix.m[0][3] = 0.0f;
-    matrix.m[1][0] = newUp.x;
-    matrix.m[1][1] = newUp.y;
-    matrix.m[1][2] = newUp.z;
-    matrix.m[1][3] = 0.0f;
-    matrix.m[2][0] = newForward.x;
-    matrix.m[2][1] = newForward.y;
-    matrix.m[2][2] = newForward.z;
-    matrix.m[2][3] = 0.0f;
-    matrix.m[3][0] = pos.x;
-    matrix.m[3][1] = pos.y;
-    matrix.m[3][2] = pos.z;
-    matrix.m[3][3] = 1.0f;
-    return matrix;
-  }
-
-  mat4x4 Matrix_MakeIdentity() {
-    mat4x4 matrix;
-    matrix.m[0][0] = 1.0f;
-    matrix.m[1][1] = 1.0f;
-    matrix.m[2][2] = 1.0f;
-    matrix.m[3][3] = 1.0f;
-    return matrix;
-  }
+static void printSkinningRate(olcEngine3D &engine) {
+  std::cout << "  skinned: " << engine.nSkinnedVertices / engine.fSkinningMs
+            << " vertices/ms on " << engine.pSkinned->vertexCount()
+            << " vertices" << std::endl;
+}
 
-  mat4x4 Matrix_MakeRotationX(float fAngleRad) {
-    mat4x4 matrix;
-    matrix.m[0][0] = 1.0f;
-    matrix.m[1][1] = cosf(fAngleRad);
-    matrix.m[1][2] = sinf(fAngleRad);
-    matrix.m[2][1] = -sinf(fAngleRad);
-    matrix.m[2][2] = cosf(fAngleRad);
-    matrix.m[3][3] = 1.0f;
-    return matrix;
+// Draws the performance overlay over the frame just rendered. sceneMs is
+// how long the engine took over it, hudMs what the overlay itself took
+// last time. The memory use is refreshed every 30 frames so it can be
+// read.
+static void drawHud(Hud &hud, olcEngine3D &demo, int frameCount,
+                    float sceneMs, float hudMs) {
+  static Uint64 residentBytes = 0;
+  if (frameCount % 30 == 0)
+    residentBytes = Hud::residentBytes();
+  float frameMs = hud.recentMs(30);
+  hud.begin(demo);
+  hud.text("FRAME %.2f MS %.0f FPS", frameMs, 1000.0f / frameMs);
+  hud.text("SCENE %.2f MS AT %d%%", sceneMs, (int)(100 * demo.renderScale));
+  hud.text("PROJECT %.2f SORT %.2f", demo.fProjectMs, demo.fSortMs);
+  hud.text("RASTER %.2f", demo.fRasterMs);
+  hud.text("TRIS %zu / %zu", demo.nTrianglesDrawn, demo.nTrianglesSubmitted);
+  if (!demo.vecViews.empty()) {
+    float viewMs = 0.0f;
+    for (Viewport &view : demo.vecViews)
+      viewMs += view.projectMs + view.sortMs + view.rasterMs;
+    hud.text("VIEWS %zu AT %.2f MS EACH", demo.vecViews.size(),
+             viewMs / demo.vecViews.size());
   }
+  hud.text("MEM %llu MB HUD %.3f MS",
+           (unsigned long long)(residentBytes >> 20), hudMs);
+  hud.graph(1000.0f / 60.0f);
+}
 
-  mat4x4 Matrix_MakeRotationY(float fAngleRad) {
-    mat4x4 matrix;
-    matrix.m[0][0] = cosf(fAngleRad);
-    matrix.m[0][2] = sinf(fAngleRad);
-    matrix.m[2][0] = -sinf(fAngleRad);
-    matrix.m[1][1] = 1.0f;
-    matrix.m[2][2] = cosf(fAngleRad);
-    matrix.m[3][3] = 1.0f;
-    return matrix;
+// Renders a full turntable of the mesh headlessly and streams it to `path`,
+// and to `shm` as well when given.
+static int exportTurntable(olcEngine3D &engine, std::string path, int frames,
+                           int fps, ShmRingWriter *shm) {
+  bool y4m = path.size() >= 4 && path.substr(path.size() - 4) == ".y4m";
+  FrameWriter writer(path,
+                     y4m ? FrameWriter::Y4M : FrameWriter::PPM_SEQUENCE,
+                     engine.width, engine.height, fps);
+  if (writer.failed) {
+    fail(y4m ? "Could not open the export file"
+             : "The --export pattern needs exactly one %d conversion, "
+               "such as frame%04d.ppm");
   }
 
-  mat4x4 Matrix_MakeRotationZ(float fAngleRad) {
-    mat4x4 matrix;
-    matrix.m[0][0] = cosf(fAngleRad);
-    matrix.m[0][1] = sinf(fAngleRad);
-    matrix.m[1][0] = -sinf(fAngleRad);
-    matrix.m[1][1] = cosf(fAngleRad);
-    matrix.m[2][2] = 1.0f;
-    matrix.m[3][3] = 1.0f;
-    return matrix;
+  Keyboard *keyboard = initKeyboard();
+  Timer total;
+  float renderMs = 0.0f;
+  for (int i = 0; i < frames && !writer.failed; i++) {
+    Timer render;
+    engine.fSpin = 2.0f * (float)M_PI * i / frames;
+    animateSkinned(engine, (float)i / fps);
+    engine.OnUserUpdate(1.0f / fps, keyboard);
+    renderMs += render.elapsedMs();
+    // Before push(), which takes the buffer.
+    if (shm)
+      shm->publish(engine.color.data(), engine.width, engine.height);
+    writer.push(engine.color);
   }
-
-  mat4x4 Matrix_MakeTranslation(float x, float y, float z) {
-    mat4x4 matrix;
-    matrix.m[0][0] = 1.0f;
-    matrix.m[1][1] = 1.0f;
-    matrix.m[2][2] = 1.0f;
-    matrix.m[3][3] = 1.0f;
-    matrix.m[3][0] = x;
-    matrix.m[3][1] = y;
-    matrix.m[3][2] = z;
-    return matrix;
+  writer.finish();
+  float totalMs = total.elapsedMs();
+  free(keyboard);
+
+  std::cout << "exported " << writer.framesWritten << "/" << frames
+            << " frames to " << path << "\n  render: " << renderMs / frames
+            << " ms/frame, stalled on writer: " << writer.stallMs
+            << " ms total, " << writer.framesWritten * 1000.0f / totalMs
+            << " frames/s end to end" << std::endl;
+  if (engine.pBricks) {
+    std::cout << "  bricks: peak " << (engine.pBricks->peakResidentBytes >> 20)
+              << "/" << (engine.pBricks->budgetBytes >> 20)
+              << " MB resident, " << engine.pBricks->pageIns << " paged in, "
+              << engine.pBricks->evictions << " evicted" << std::endl;
   }
-
-  mat4x4 Matrix_MakeProjection(float fFovDegrees, float fAspectRatio,
-                               float fNear, float fFar) {
-    float fFovRad = 1.0f / tanf(fFovDegrees * 0.5f / 180.0f * 3.14159f);
-    mat4x4 matrix;
-    matrix.m[0][0] = fAspectRatio * fFovRad;
-    matrix.m[1][1] = fFovRad;
-    matrix.m[2][2] = fFar / (fFar - fNear);
-    matrix.m[3][2] = (-fFar * fNear) / (fFar - fNear);
-    matrix.m[2][3] = 1.0f;
-    matrix.m[3][3] = 0.0f;
-    return matrix;
+  if (engine.pPoints) {
+    std::cout << "  points: " << engine.pPoints->size() << ", "
+              << engine.pPoints->size() * frames / (renderMs * 1000.0f)
+              << " M points/s" << std::endl;
   }
-
-  mat4x4 Matrix_MultiplyMatrix(mat4x4 &m1, mat4x4 &m2) {
-    mat4x4 matrix;
-    for (int c = 0; c < 4; c++)
-      for (int r = 0; r < 4; r++)
-        matrix.m[r][c] = m1.m[r][0] * m2.m[0][c] + m1.m[r][1] * m2.m[1][c] +
-                         m1.m[r][2] * m2.m[2][c] + m1.m[r][3] * m2.m[3][c];
-    return matrix;
+  if (engine.pSkinned)
+    printSkinningRate(engine);
+  if (writer.failed) {
+    std::cerr << "Writing frames failed" << std::endl;
+    return 1;
   }
+  return 0;
+}
 
-  mat4x4
-  Matrix_QuickInverse(mat4x4 &m) // Only for Rotation/Translation Matrices
-  {
-    mat4x4 matrix;
-    matrix.m[0][0] = m.m[0][0];
-    matrix.m[0][1] = m.m[1][0];
-    matrix.m[0][2] = m.m[2][0];
-    matrix.m[0][3] = 0.0f;
-    matrix.m[1][0] = m.m[0][1];
-    matrix.m[1][1] = m.m[1][1];
-    matrix.m[1][2] = m.m[2][1];
-    matrix.m[1][3] = 0.0f;
-    matrix.m[2][0] = m.m[0][2];
-    matrix.m[2][1] = m.m[1][2];
-    matrix.m[2][2] = m.m[2][2];
-    matrix.m[2][3] = 0.0f;
-    matrix.m[3][0] = -(m.m[3][0] * matrix.m[0][0] + m.m[3][1] * matrix.m[1][0] +
-                       m.m[3][2] * matrix.m[2][0]);
-    matrix.m[3][1] = -(m.m[3][0] * matrix.m[0][1] + m.m[3][1] * matrix.m[1][1] +
-                       m.m[3][2] * matrix.m[2][1]);
-    matrix.m[3][2] = -(m.m[3][0] * matrix.m[0][2] + m.m[3][1] * matrix.m[1][2] +
-                       m.m[3][2] * matrix.m[2][2]);
-    matrix.m[3][3] = 1.0f;
-    return matrix;
+int main(int argc, char **argv) {
+  // Raster budget per frame; the rest of the 60Hz frame is left for
+  // presenting and the OS.
+  float targetMs = 10.0f;
+  float minScale = 0.5f;
+  float maxScale = 1.0f;
+  bool msaa = false;
+  float alpha = 1.0f;
+  bool wireframe = false;
+  bool depthTest = true;
+  bool compact = false;
+  bool gouraud = false;
+  bool prepass = false;
+  bool shadows = false;
+  // Split-screen cameras; 0 when --views is not given.
+  int views = 0;
+  // Replace the default light when any are given.
+  std::vector<Light> lights;
+  bool dirtyTiles = true;
+  bool dirtyStats = false;
+  bool showHud = false;
+  std::string meshFile = "res/axis.obj";
+  int width = 1280;
+  int height = 720;
+  std::string exportPath;
+  int frames = 120;
+  int fps = 30;
+  std::string batchManifest;
+  int threads = 0;
+  std::string brickFile;
+  std::string brickSource;
+  std::string terrain;
+  int residentMb = 256;
+  int brickTris = 4096;
+  std::string pointFile;
+  int pointSize = 1;
+  bool skinnedDemo = false;
+  std::string shmName;
+  int shmSlots = 3;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--target-ms") == 0 && i + 1 < argc) {
+      targetMs = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--min-scale") == 0 && i + 1 < argc) {
+      minScale = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--max-scale") == 0 && i + 1 < argc) {
+      maxScale = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--msaa") == 0) {
+      msaa = true;
+    } else if (strcmp(argv[i], "--alpha") == 0 && i + 1 < argc) {
+      alpha = std::clamp((float)atof(argv[++i]), 0.0f, 1.0f);
+    } else if (strcmp(argv[i], "--wireframe") == 0) {
+      wireframe = true;
+    } else if (strcmp(argv[i], "--no-depth") == 0) {
+      depthTest = false;
+    } else if (strcmp(argv[i], "--compact") == 0) {
+      compact = true;
+    } else if (strcmp(argv[i], "--gouraud") == 0) {
+      gouraud = true;
+    } else if (strcmp(argv[i], "--prepass") == 0) {
+      prepass = true;
+    } else if (strcmp(argv[i], "--shadows") == 0) {
+      shadows = true;
+    } else if (strcmp(argv[i], "--views") == 0 && i + 1 < argc) {
+      views = atoi(argv[++i]);
+      // Checked here, since 0 also means that it was not given.
+      if (views < 1 || views > 4) {
+        fail("--views must be between 1 and 4");
+      }
+    } else if ((strcmp(argv[i], "--light") == 0 ||
+                strcmp(argv[i], "--point-light") == 0) &&
+               i + 1 < argc) {
+      Light light;
+      bool point = strcmp(argv[i], "--point-light") == 0;
+      int n = sscanf(argv[++i], "%f,%f,%f,%f,%f", &light.v.x, &light.v.y,
+                     &light.v.z, &light.intensity, &light.falloff);
+      if (n < 3 || (!point && n > 4)) {
+        fail(USAGE);
+      }
+      if (point) {
+        light.type = Light::POINT;
+      } else {
+        float length = sqrtf(light.v.x * light.v.x + light.v.y * light.v.y +
+                             light.v.z * light.v.z);
+        if (length == 0.0f) {
+          fail("A directional light needs a non-zero direction");
+        }
+        light.v = {light.v.x / length, light.v.y / length,
+                   light.v.z / length};
+      }
+      lights.push_back(light);
+    } else if (strcmp(argv[i], "--no-dirty-tiles") == 0) {
+      dirtyTiles = false;
+    } else if (strcmp(argv[i], "--dirty-stats") == 0) {
+      dirtyStats = true;
+    } else if (strcmp(argv[i], "--hud") == 0) {
+      showHud = true;
+    } else if (strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+      meshFile = argv[++i];
+    } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &width, &height) != 2) {
+        fail(USAGE);
+      }
+    } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+      exportPath = argv[++i];
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+      fps = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+      shmName = argv[++i];
+    } else if (strcmp(argv[i], "--shm-slots") == 0 && i + 1 < argc) {
+      shmSlots = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batchManifest = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--bricks") == 0 && i + 1 < argc) {
+      brickFile = argv[++i];
+    } else if (strcmp(argv[i], "--terrain") == 0 && i + 1 < argc) {
+      terrain = argv[++i];
+    } else if (strcmp(argv[i], "--resident-mb") == 0 && i + 1 < argc) {
+      residentMb = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--build-bricks") == 0 && i + 2 < argc) {
+      brickSource = argv[++i];
+      brickFile = argv[++i];
+    } else if (strcmp(argv[i], "--brick-tris") == 0 && i + 1 < argc) {
+      brickTris = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--points") == 0 && i + 1 < argc) {
+      pointFile = argv[++i];
+    } else if (strcmp(argv[i], "--point-size") == 0 && i + 1 < argc) {
+      pointSize = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--skinned-demo") == 0) {
+      skinnedDemo = true;
+    } else {
+      std::cerr << "Unknown argument: " << argv[i] << std::endl;
+      fail(USAGE);
+    }
   }
-
-  vec3d Vector_Add(vec3d &v1, vec3d &v2) {
-    return {v1.x + v2.x, v1.y + v2.y, v1.z + v2.z};
+  if (minScale <= 0.0f || minScale > maxScale || maxScale > 1.0f) {
+    fail("Scales must satisfy 0 < min-scale <= max-scale <= 1");
   }
-
-  vec3d Vector_Sub(vec3d &v1, vec3d &v2) {
-    return {v1.x - v2.x, v1.y - v2.y, v1.z - v2.z};
+  if (width < 16 || height < 16 || width % 2 || height % 2) {
+    fail("The size must be even and at least 16x16");
   }
 
-  vec3d Vector_Mul(vec3d &v1, float k) {
-    return {v1.x * k, v1.y * k, v1.z * k};
+  if (residentMb <= 0 || brickTris <= 0) {
+    fail("--resident-mb and --brick-tris must be positive");
   }
-
-  vec3d Vector_Div(vec3d &v1, float k) {
-    return {v1.x / k, v1.y / k, v1.z / k};
+  if (pointSize < 1 || pointSize > 64) {
+    fail("--point-size must be between 1 and 64");
   }
 
-  float Vector_DotProduct(vec3d &v1, vec3d &v2) {
-    return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
+  // About 4700 vertices on eight joints, near a game character's budget.
+  std::shared_ptr<SkinnedMesh> skinned;
+  if (skinnedDemo) {
+    skinned = std::make_shared<SkinnedMesh>();
+    buildSkinnedTube(*skinned, 96, 48, 8, 4.0f, 0.5f);
   }
 
-  float Vector_Length(vec3d &v) { return sqrtf(Vector_DotProduct(v, v)); }
-
-  vec3d Vector_Normalise(vec3d &v) {
-    float l = Vector_Length(v);
-    return {v.x / l, v.y / l, v.z / l};
+  if (shmSlots < 2) {
+    fail("--shm-slots must be at least 2");
   }
-
-  vec3d Vector_CrossProduct(vec3d &v1, vec3d &v2) {
-    vec3d v;
-    v.x = v1.y * v2.z - v1.z * v2.y;
-    v.y = v1.z * v2.x - v1.x * v2.z;
-    v.z = v1.x * v2.y - v1.y * v2.x;
-    return v;
+  // Sized for the full window; frames rendered at a lower scale use part of
+  // each slot. Static so the exit() on window close still unlinks it.
+  static std::unique_ptr<ShmRingWriter> shm;
+  if (!shmName.empty()) {
+    shm = std::make_unique<ShmRingWriter>(shmName, width, height, shmSlots);
+    if (shm->failed) {
+      fail("Could not create the shared memory output");
+    }
   }
 
-  vec3d Vector_IntersectPlane(vec3d &plane_p, vec3d &plane_n, vec3d &lineStart,
-                              vec3d &lineEnd) {
-    plane_n = Vector_Normalise(plane_n);
-    float plane_d = -Vector_DotProduct(plane_n, plane_p);
-    float ad = Vector_DotProduct(lineStart, plane_n);
-    float bd = Vector_DotProduct(lineEnd, plane_n);
-    float t = (-plane_d - ad) / (bd - ad);
-    vec3d lineStartToEnd = Vector_Sub(lineEnd, lineStart);
-    vec3d lineToIntersect = Vector_Mul(lineStartToEnd, t);
-    return Vector_Add(lineStart, lineToIntersect);
+  if (!brickSource.empty()) {
+    Timer build;
+    if (!buildBrickFile(brickSource, brickFile, brickTris)) {
+      fail("Could not build the brick file");
+    }
+    std::cout << "built " << brickFile << " in " << build.elapsedMs()
+              << " ms" << std::endl;
+    return 0;
   }
 
-  int Triangle_ClipAgainstPlane(vec3d plane_p, vec3d plane_n, triangle &in_tri,
-                                triangle &out_tri1, triangle &out_tri2) {
-    plane_n = Vector_Normalise(plane_n);
-
-    auto dist = [&](vec3d &p) {
-      vec3d n = Vector_Normalise(p);
-      (void)n;
-      return (plane_n.x * p.x + plane_n.y * p.y + plane_n.z * p.z -
-              Vector_DotProduct(plane_n, plane_p));
-    };
-
-    vec3d *inside_points[3];
-    int nInsidePointCount = 0;
-    vec3d *outside_points[3];
-    int nOutsidePointCount = 0;
-
-    float d0 = dist(in_tri.p[0]);
-    float d1 = dist(in_tri.p[1]);
-    float d2 = dist(in_tri.p[2]);
-
-    if (d0 >= 0) {
-      inside_points[nInsidePointCount++] = &in_tri.p[0];
-    } else {
-      outside_points[nOutsidePointCount++] = &in_tri.p[0];
-    }
-    if (d1 >= 0) {
-      inside_points[nInsidePointCount++] = &in_tri.p[1];
-    } else {
-      outside_points[nOutsidePointCount++] = &in_tri.p[1];
-    }
-    if (d2 >= 0) {
-      inside_points[nInsidePointCount++] = &in_tri.p[2];
-    } else {
-      outside_points[nOutsidePointCount++] = &in_tri.p[2];
+  if (!batchManifest.empty()) {
+    std::vector<BatchJob> jobs;
+    if (!parseBatchManifest(batchManifest, jobs)) {
+      fail("Could not open the batch manifest");
     }
+    return runBatch(jobs, threads, msaa) == 0 ? 0 : 1;
+  }
 
-    if (nInsidePointCount == 0) {
-      return 0;
+  if (!exportPath.empty()) {
+    if (frames <= 0 || fps <= 0) {
+      fail("--frames and --fps must be positive");
     }
-    if (nInsidePointCount == 3) {
-      out_tri1 = in_tri;
-      return 1;
+    olcEngine3D engine(width, height, true);
+    engine.bMsaa = msaa;
+    engine.fAlpha = alpha;
+    engine.bWireframe = wireframe;
+    engine.bDepthTest = depthTest;
+    engine.bCompact = compact;
+    engine.bGouraud = gouraud;
+    engine.bDepthPrepass = prepass;
+    engine.bShadows = shadows;
+    if (views > 0)
+      engine.vecViews = splitScreen(views, {0.0f, 0.0f, 5.0f}, 5.0f);
+    if (!lights.empty())
+      engine.lighting.lights = lights;
+    engine.sMeshFile = meshFile;
+    if (!brickFile.empty() &&
+        !engine.LoadBricks(brickFile, (Uint64)residentMb << 20)) {
+      fail("Could not open the brick file");
     }
-    if (nInsidePointCount == 1 && nOutsidePointCount == 2) {
-      out_tri1.illumination = in_tri.illumination;
-
-      out_tri1.p[0] = *inside_points[0];
-
-      out_tri1.p[1] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0],
-                                            *outside_points[0]);
-      out_tri1.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0],
-                                            *outside_points[1]);
+    if (!terrain.empty())
+      openTerrain(engine, terrain, residentMb, lights.empty());
+    engine.nPointSize = pointSize;
+    if (!pointFile.empty() && !engine.LoadPoints(pointFile)) {
+      fail("Could not load the point cloud");
     }
-
-    return 1;
-    if (nInsidePointCount == 2 && nOutsidePointCount == 1) {
-      out_tri1.illumination = in_tri.illumination;
-      out_tri2.illumination = in_tri.illumination;
-
-      out_tri1.p[0] = *inside_points[0];
-      out_tri1.p[1] = *inside_points[1];
-      out_tri1.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[0],
-                                            *outside_points[0]);
-
-      out_tri2.p[0] = *inside_points[1];
-      out_tri2.p[1] = out_tri1.p[2];
-      out_tri2.p[2] = Vector_IntersectPlane(plane_p, plane_n, *inside_points[1],
-                                            *outside_points[0]);
-
-      return 2;
+    engine.pSkinned = skinned;
+    engine.OnUserCreate();
+    if (!engine.WaitForAssets()) {
+      fail("Could not load the mesh");
     }
+    return exportTurntable(engine, exportPath, frames, fps, shm.get());
   }
 
-public:
-  bool OnUserCreate() {
-    meshCube.tris = {
-
-        // SOUTH
-        {
-            0.0f,
-            0.0f,
-            0.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-        },
-        {
-            0.0f,
-            0.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            0.0f,
-            1.0f,
-        },
-
-        // EAST
-        {
-            1.0f,
-            0.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-        },
-        {
-            1.0f,
-            0.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-        },
-
-        // NORTH
-        {
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-        },
-        {
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-        },
-
-        // WEST
-        {
-            0.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-        },
-        {
-            0.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            0.0f,
-            0.0f,
-            0.0f,
-            1.0f,
-        },
-
-        // TOP
-        {
-            0.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-        },
-        {
-            0.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            1.0f,
-        },
-
-        // BOTTOM
-        {
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            0.0f,
-            0.0f,
-            1.0f,
-        },
-        {
-            1.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            0.0f,
-            0.0f,
-            1.0f,
-            1.0f,
-            0.0f,
-            0.0f,
-            1.0f,
-        },
-
-    };
-
-    if (!meshCube.LoadFromObjectFile("res/axis.obj")) {
-      fail("Could not find file");
-    }
-
-    matProj = Matrix_MakeProjection(
-        90.0f, (float)this->height / (float)this->width, 0.1f, 1000.0f);
-
-    return true;
+  olcEngine3D demo(width, height, false);
+  demo.bMsaa = msaa;
+  demo.fAlpha = alpha;
+  demo.bWireframe = wireframe;
+  demo.bDepthTest = depthTest;
+  demo.bCompact = compact;
+  demo.bGouraud = gouraud;
+  demo.bDepthPrepass = prepass;
+  demo.bShadows = shadows;
+  if (views > 0)
+    demo.vecViews = splitScreen(views, {0.0f, 0.0f, 5.0f}, 5.0f);
+  if (!lights.empty())
+    demo.lighting.lights = lights;
+  demo.dirtyTiles = dirtyTiles;
+  demo.showHud = showHud;
+  demo.sMeshFile = meshFile;
+  if (!brickFile.empty() &&
+      !demo.LoadBricks(brickFile, (Uint64)residentMb << 20)) {
+    fail("Could not open the brick file");
   }
-
-  bool OnUserUpdate(float fElapsedTime, Keyboard *keyboard) {
-    if (keyboard->ARROW_UP)
-      vCamera.y -= 8.0f * fElapsedTime;
-    if (keyboard->ARROW_DOWN)
-      vCamera.y += 8.0f * fElapsedTime;
-    if (keyboard->ARROW_LEFT)
-      vCamera.x -= 8.0f * fElapsedTime;
-    if (keyboard->ARROW_RIGHT)
-      vCamera.x += 8.0f * fElapsedTime;
-
-    vec3d vForward = Vector_Mul(vLookDir, 8.0f * fElapsedTime);
-
-    if (keyboard->W)
-      vCamera = Vector_Add(vCamera, vForward);
-    if (keyboard->S)
-      vCamera = Vector_Sub(vCamera, vForward);
-    if (keyboard->A)
-      fYaw -= 2.0f * fElapsedTime;
-    if (keyboard->D)
-      fYaw += 2.0f * fElapsedTime;
-
-    this->clear();
-
-    mat4x4 matRotZ, matRotX;
-    // fTheta += 1.0f * fElapsedTime;
-
-    matRotZ = Matrix_MakeRotationZ(fTheta * 0.5f);
-    matRotX = Matrix_MakeRotationX(fTheta);
-
-    mat4x4 matTrans;
-    matTrans = Matrix_MakeTranslation(0.0f, 0.0f, 5.0f);
-
-    mat4x4 matWorld;
-    matWorld = Matrix_MakeIdentity();
-    matWorld = Matrix_MultiplyMatrix(matRotZ, matRotX);
-    matWorld = Matrix_MultiplyMatrix(matWorld, matTrans);
-
-    vec3d vUp = {0, 1, 0};
-    vec3d vTarget = {0, 0, 1};
-    mat4x4 matCameraRot = Matrix_MakeRotationY(fYaw);
-    vLookDir = Matrix_MultiplyVector(matCameraRot, vTarget);
-    vTarget = Vector_Add(vCamera, vLookDir);
-    mat4x4 matCamera = Matrix_PointAt(vCamera, vTarget, vUp);
-
-    mat4x4 matView = Matrix_QuickInverse(matCamera);
-
-    std::vector<triangle> vecTrianglesToRaster;
-
-    for (auto tri : meshCube.tris) {
-      triangle triProjected, triTransformed, triViewed;
-
-      triTransformed.p[0] = Matrix_MultiplyVector(matWorld, tri.p[0]);
-      triTransformed.p[1] = Matrix_MultiplyVector(matWorld, tri.p[1]);
-      triTransformed.p[2] = Matrix_MultiplyVector(matWorld, tri.p[2]);
-
-      vec3d normal, line1, line2;
-
-      line1 = Vector_Sub(triTransformed.p[1], triTransformed.p[0]);
-      line2 = Vector_Sub(triTransformed.p[2], triTransformed.p[0]);
-
-      normal = Vector_CrossProduct(line1, line2);
-
-      normal = Vector_Normalise(normal);
-
-      vec3d vCameraRay = Vector_Sub(triTransformed.p[0], vCamera);
-
-      if (Vector_DotProduct(normal, vCameraRay) < 0.0f) {
-
-        vec3d light_direction = {0.0f, 0.0f, -1.0f};
-        light_direction = Vector_Normalise(light_direction);
-
-        float dp = std::max(0.1f, Vector_DotProduct(light_direction, normal));
-
-        triViewed.p[0] = Matrix_MultiplyVector(matView, triTransformed.p[0]);
-        triViewed.p[1] = Matrix_MultiplyVector(matView, triTransformed.p[1]);
-        triViewed.p[2] = Matrix_MultiplyVector(matView, triTransformed.p[2]);
-
-        int nClippedTriangles = 0;
-        triangle clipped[2];
-        nClippedTriangles =
-            Triangle_ClipAgainstPlane({0.0f, 0.0f, 0.1f}, {0.0f, 0.0f, 1.0f},
-                                      triViewed, clipped[0], clipped[1]);
-
-        for (int n = 0; n < nClippedTriangles; n++) {
-          triProjected.p[0] = Matrix_MultiplyVector(matProj, triViewed.p[0]);
-          triProjected.p[1] = Matrix_MultiplyVector(matProj, triViewed.p[1]);
-          triProjected.p[2] = Matrix_MultiplyVector(matProj, triViewed.p[2]);
-
-          triProjected.p[0] =
-              Vector_Div(triProjected.p[0], triProjected.p[0].w);
-          triProjected.p[1] =
-              Vector_Div(triProjected.p[1], triProjected.p[1].w);
-          triProjected.p[2] =
-              Vector_Div(triProjected.p[2], triProjected.p[2].w);
-
-          vec3d vOffsetView = {1, 1, 0};
-          triProjected.p[0] = Vector_Add(triProjected.p[0], vOffsetView);
-          triProjected.p[1] = Vector_Add(triProjected.p[1], vOffsetView);
-          triProjected.p[2] = Vector_Add(triProjected.p[2], vOffsetView);
-          triProjected.p[0].x *= 0.5f * (float)this->width;
-          triProjected.p[0].y *= 0.5f * (float)this->height;
-          triProjected.p[1].x *= 0.5f * (float)this->width;
-          triProjected.p[1].y *= 0.5f * (float)this->height;
-          triProjected.p[2].x *= 0.5f * (float)this->width;
-          triProjected.p[2].y *= 0.5f * (float)this->height;
-
-          triProjected.illumination = dp;
-          vecTrianglesToRaster.push_back(triProjected);
-        }
-      }
-    }
-
-    std::sort(vecTrianglesToRaster.begin(), vecTrianglesToRaster.end(),
-              [](triangle &t1, triangle &t2) {
-                float z1 = (t1.p[0].z + t1.p[1].z + t1.p[2].z) / 3.0f;
-                float z2 = (t2.p[0].z + t2.p[1].z + t2.p[2].z) / 3.0f;
-                return z1 > z2;
-              });
-
-    for (auto &triToRaster : vecTrianglesToRaster) {
-      triangle clipped[2];
-      std::list<triangle> listTriangles;
-      listTriangles.push_back(triToRaster);
-      int nNewTriangles = 1;
-
-      for (int p = 0; p < 4; p++) {
-        int nTrisToAdd = 0;
-        while (nNewTriangles > 0) {
-          triangle test = listTriangles.front();
-          listTriangles.pop_front();
-          nNewTriangles--;
-
-          switch (p) {
-          case 0:
-            nTrisToAdd = Triangle_ClipAgainstPlane({0.0f, 0.0f, 0.0f},
-                                                   {0.0f, 1.0f, 0.0f}, test,
-                                                   clipped[0], clipped[1]);
-            break;
-          case 1:
-            nTrisToAdd = Triangle_ClipAgainstPlane(
-                {0.0f, (float)this->height - 1, 0.0f}, {0.0f, -1.0f, 0.0f},
-                test, clipped[0], clipped[1]);
-            break;
-          case 2:
-            nTrisToAdd = Triangle_ClipAgainstPlane({0.0f, 0.0f, 0.0f},
-                                                   {1.0f, 0.0f, 0.0f}, test,
-                                                   clipped[0], clipped[1]);
-            break;
-          case 3:
-            nTrisToAdd = Triangle_ClipAgainstPlane(
-                {(float)this->width - 1, 0.0f, 0.0f}, {-1.0f, 0.0f, 0.0f}, test,
-                clipped[0], clipped[1]);
-            break;
-          }
-
-          for (int w = 0; w < nTrisToAdd; w++) {
-            listTriangles.push_back(clipped[w]);
-          }
-        }
-        nNewTriangles = listTriangles.size();
-      }
-
-      for (auto &t : listTriangles) {
-        this->fillTriangle(
-            t.p[0], t.p[1], t.p[2],
-            (static_cast<Uint32>(0xff * t.illumination) << 24) |
-                (static_cast<Uint32>(0xff * t.illumination) << 16) |
-                (static_cast<Uint32>(0xff * t.illumination) << 8) | 0xff);
-      }
-    }
-
-    return true;
+  if (!terrain.empty())
+    openTerrain(demo, terrain, residentMb, lights.empty());
+  demo.nPointSize = pointSize;
+  if (!pointFile.empty() && !demo.LoadPoints(pointFile)) {
+    fail("Could not load the point cloud");
   }
-};
-
-int main() {
-  olcEngine3D demo = olcEngine3D();
+  demo.pSkinned = skinned;
+  ResolutionController resolution(targetMs, minScale, maxScale);
+  demo.setRenderScale(resolution.scale);
 
   Keyboard *keyboard = initKeyboard();
 
+  Timer startup;
+  bool firstFrame = true;
+  bool loaded = false;
+  int frameCount = 0;
+  Uint64 uploadedPixels = 0;
+  float pointsMs = 0.0f;
+  Hud hud;
+  float hudMs = 0.0f;
   demo.OnUserCreate();
   while (true) {
+    Timer frame;
     demo.poll(keyboard);
+
+    Timer raster;
+    animateSkinned(demo, frameCount / 60.0f);
     demo.OnUserUpdate(1.0f / 60.0f, keyboard);
-    demo.draw();
+    float rasterMs = raster.elapsedMs();
+    pointsMs += rasterMs;
+    if (shm)
+      shm->publish(demo.color.data(), demo.width, demo.height);
+    if (demo.showHud) {
+      Timer overlay;
+      drawHud(hud, demo, frameCount, rasterMs, hudMs);
+      hudMs = overlay.elapsedMs();
+    }
 
-    SDL_Delay(1000.0f / 60.0f);
+    demo.draw();
+    if (firstFrame) {
+      std::cout << "first frame after " << startup.elapsedMs() << " ms"
+                << std::endl;
+      firstFrame = false;
+    }
+    if (!loaded && demo.AssetsSettled()) {
+      std::cout << "assets loaded after " << startup.elapsedMs() << " ms"
+                << std::endl;
+      loaded = true;
+    }
+    if (keyboard->CLICKED) {
+      BvhHit hit;
+      if (demo.Pick(keyboard->MOUSE_X + 0.5f, keyboard->MOUSE_Y + 0.5f, hit)) {
+        std::cout << "picked triangle " << hit.triangle << " at distance "
+                  << hit.t << std::endl;
+      }
+      keyboard->CLICKED = false;
+    }
+    frameCount++;
+    if (dirtyStats && frameCount % 120 == 0) {
+      Uint64 window = (Uint64)demo.windowWidth * demo.windowHeight;
+      std::cout << "uploaded "
+                << 100.0 * (demo.uploadedPixels - uploadedPixels) /
+                       (window * 120)
+                << "% of the window per frame" << std::endl;
+      uploadedPixels = demo.uploadedPixels;
+    }
+    if (demo.pBricks && frameCount % 120 == 0) {
+      BrickStreamer &bricks = *demo.pBricks;
+      std::cout << "bricks: " << bricks.drawable.size() << "/"
+                << bricks.visibleBricks << " visible drawn, "
+                << (bricks.residentBytes >> 20) << "/"
+                << (bricks.budgetBytes >> 20) << " MB resident, "
+                << bricks.pageIns << " paged in, " << bricks.evictions
+                << " evicted" << std::endl;
+    }
+    if (demo.pTerrain && frameCount % 120 == 0) {
+      Terrain &ground = *demo.pTerrain;
+      std::cout << "terrain: " << ground.drawable.size() << " chunks drawn, "
+                << demo.nTrianglesSubmitted << " triangles, "
+                << (ground.residentBytes() >> 20) << "/"
+                << (ground.budgetBytes >> 20) << " MB resident, "
+                << ground.generated << " generated, " << ground.pending
+                << " pending, " << ground.evictions << " evicted"
+                << std::endl;
+    }
+    if (demo.pPoints && frameCount % 120 == 0) {
+      std::cout << "points: " << demo.pPoints->size() * 120 / (pointsMs * 1000)
+                << " M points/s" << std::endl;
+      pointsMs = 0.0f;
+    }
+    if (demo.pSkinned && frameCount % 120 == 0) {
+      printSkinningRate(demo);
+      demo.nSkinnedVertices = 0;
+      demo.fSkinningMs = 0.0f;
+    }
+    // Resized only after presenting, so the next frame renders at the new
+    // size from the start.
+    demo.setRenderScale(resolution.update(rasterMs));
+
+    float remaining = 1000.0f / 60.0f - frame.elapsedMs();
+    if (remaining > 0.0f)
+      SDL_Delay(remaining);
+    hud.addFrame(frame.elapsedMs());
   }
 
   return 0;